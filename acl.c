@@ -0,0 +1,450 @@
+/*
+  **
+  ** acl.c
+  **
+  ** Decides which clients are served, from the prefixes of acl_allow
+  ** and acl_deny. Both are lists of prefixes, such as 10.0.0.0/8 or
+  ** 2001:db8::/32, or files of them, one or more per line. The longest
+  ** prefix matching the client address decides; a prefix in both lists
+  ** is denied. A client no prefix matches is refused if there are
+  ** allowed prefixes, served otherwise.
+  **
+  ** The prefixes are compiled into a binary trie where a node skips all
+  ** the bits no other prefix branches on, so a lookup costs one node per
+  ** prefix nested around the address, however many there are. The nodes
+  ** are then laid out in one array, each one followed by its first
+  ** child. IPv4 addresses go in the trie as IPv4-mapped IPv6 ones, and
+  ** a table indexed by their first byte holds where the walk is after
+  ** those bits, so a lookup skips the top of the trie.
+  **
+*/
+
+#include <stdint.h>
+#include "dproxy.h"
+#include "acl.h"
+
+static inline unsigned int _bit(uint32_t *key, unsigned int bit) {
+
+	return (key[bit >> 5] >> (31 - (bit & 31))) & 1;
+
+}
+
+/**
+ * Returns 1 if the bits from to len of key and addr are the same. The
+ * ones before were matched with the parent node already.
+ */
+static inline int _match(uint32_t *addr, uint32_t *key, unsigned int from, unsigned int len) {
+
+	unsigned int idx;
+
+	for (idx = from >> 5; idx < (len >> 5); idx++)
+		if (addr[idx] != key[idx])
+			return 0;
+
+	return ((len & 31) == 0 || ((addr[idx] ^ key[idx]) >> (32 - (len & 31))) == 0);
+
+}
+
+/**
+ * Walks the trie for key from at, through the nodes of less than depth
+ * bits, whose children are picked by the first depth bits of key. at is
+ * left on the next node to look at, 0 if none, with the action of the
+ * longest prefix matched.
+ */
+static inline void _walk(struct acl *acl, uint32_t *key, struct acl_jump *at, unsigned int depth) {
+
+	struct acl_node *node;
+
+	while (at->node != 0) {
+
+		node = &acl->nodes[at->node];
+		if (node->len >= depth)
+			return;
+
+		if (!_match(key, node->key, at->from, node->len)) {
+			at->node = 0;
+			return;
+		}
+
+		if (node->action != ACL_NONE)
+			at->action = node->action;
+
+		if (node->len == ACL_KEY_BITS) {
+			at->node = 0;
+			return;
+		}
+
+		at->from = node->len;
+		at->node = node->child[_bit(key, at->from)];
+
+	}
+
+}
+
+/**
+ * Returns how many of the first max bits of a and b are the same
+ */
+static unsigned int _common(uint32_t *a, uint32_t *b, unsigned int max) {
+
+	unsigned int idx;
+	unsigned int len = 0;
+	uint32_t diff;
+
+	for (idx = 0; idx < ACL_KEY_WORDS && len < max; idx++) {
+		diff = a[idx] ^ b[idx];
+		if (diff != 0) {
+			len += __builtin_clz(diff);
+			break;
+		}
+		len += 32;
+	}
+
+	return (len < max) ? len : max;
+
+}
+
+/**
+ * Makes room for count more nodes
+ * Returns 1 if out of memory
+ */
+static int _reserve(struct acl *acl, unsigned int count) {
+
+	struct acl_node *nodes;
+	unsigned int size;
+
+	if (acl->nodes_count + count <= acl->nodes_size)
+		return 0;
+
+	size = (acl->nodes_size > 0) ? acl->nodes_size * 2 : 64;
+	nodes = realloc(acl->nodes, size * sizeof(struct acl_node));
+	if (nodes == NULL)
+		return 1;
+
+	acl->nodes = nodes;
+	acl->nodes_size = size;
+
+	return 0;
+
+}
+
+/**
+ * Takes a reserved node for the len first bits of key
+ * Returns its index
+ */
+static uint32_t _node(struct acl *acl, uint32_t *key, unsigned int len, unsigned char action) {
+
+	struct acl_node *node = &acl->nodes[acl->nodes_count];
+	unsigned int idx;
+	unsigned int bits;
+
+	memset(node, 0, sizeof(struct acl_node));
+
+	for (idx = 0, bits = len; idx < ACL_KEY_WORDS && bits > 0; idx++) {
+		node->key[idx] = (bits >= 32) ? key[idx] : key[idx] & ~(0xffffffffu >> bits);
+		bits = (bits >= 32) ? bits - 32 : 0;
+	}
+
+	node->len = len;
+	node->action = action;
+
+	return acl->nodes_count++;
+
+}
+
+/**
+ * Adds a prefix to the trie being built, rooted at nodes[0].child[0]
+ * Returns 1 if out of memory
+ */
+static int _insert(struct acl *acl, uint32_t *key, unsigned int len, unsigned char action) {
+
+	struct acl_node *node;
+	uint32_t *link;
+	uint32_t idx;
+	unsigned int common;
+
+	/* A split takes two nodes, no realloc while walking */
+	if (_reserve(acl, 2))
+		return 1;
+
+	link = &acl->nodes[0].child[0];
+
+	while (*link != 0) {
+
+		node = &acl->nodes[*link];
+		common = _common(key, node->key, (len < node->len) ? len : node->len);
+
+		if (common == node->len) {
+			if (node->len == len) {
+				if (node->action != ACL_DENY)
+					node->action = action;
+				return 0;
+			}
+			link = &node->child[_bit(key, node->len)];
+			continue;
+		}
+
+		/* The node goes below a new one, holding the bits in common */
+		idx = _node(acl, key, common, ACL_NONE);
+		acl->nodes[idx].child[_bit(node->key, common)] = *link;
+		if (common < len)
+			acl->nodes[idx].child[_bit(key, common)] = _node(acl, key, len, action);
+		else
+			acl->nodes[idx].action = action;
+		*link = idx;
+
+		return 0;
+
+	}
+
+	*link = _node(acl, key, len, action);
+
+	return 0;
+
+}
+
+/**
+ * Reads an address with an optional "/length"
+ * Returns 1 if it is not valid
+ */
+static int _parse_prefix(char *text, uint32_t *key, unsigned int *len) {
+
+	char address[INET6_ADDRSTRLEN];
+	unsigned char bytes[16];
+	char *slash;
+	char *end;
+	unsigned int idx;
+	unsigned int max;
+	long bits;
+
+	slash = strchr(text, '/');
+	idx = (slash != NULL) ? slash - text : strlen(text);
+	if (idx >= sizeof(address))
+		return 1;
+
+	memcpy(address, text, idx);
+	address[idx] = 0;
+
+	memset(key, 0, ACL_KEY_WORDS * sizeof(uint32_t));
+
+	if (inet_pton(AF_INET, address, bytes) == 1) {
+		key[2] = 0xffff;
+		key[3] = ((uint32_t)bytes[0] << 24) | (bytes[1] << 16) | (bytes[2] << 8) | bytes[3];
+		max = 32;
+	} else if (inet_pton(AF_INET6, address, bytes) == 1) {
+		for (idx = 0; idx < ACL_KEY_WORDS; idx++)
+			key[idx] = ((uint32_t)bytes[idx * 4] << 24) | (bytes[idx * 4 + 1] << 16) | (bytes[idx * 4 + 2] << 8) | bytes[idx * 4 + 3];
+		max = ACL_KEY_BITS;
+	} else {
+		return 1;
+	}
+
+	bits = max;
+	if (slash != NULL) {
+		bits = strtol(slash + 1, &end, 10);
+		if (slash[1] == 0 || *end != 0 || bits < 0 || bits > max)
+			return 1;
+	}
+
+	*len = ACL_KEY_BITS - max + bits;
+
+	return 0;
+
+}
+
+static int _add_prefix(struct acl *acl, char *text, unsigned char action) {
+
+	uint32_t key[ACL_KEY_WORDS];
+	unsigned int len;
+
+	if (_parse_prefix(text, key, &len))
+		return 1;
+
+	if (_insert(acl, key, len, action))
+		return 1;
+
+	if (action == ACL_ALLOW)
+		acl->allowed++;
+	else
+		acl->denied++;
+
+	return 0;
+
+}
+
+/**
+ * Adds the prefixes of a file, '#' starting a comment
+ * Returns 1 if the file can't be read or holds an invalid prefix
+ */
+static int _add_file(struct acl *acl, char *path, unsigned char action) {
+
+	FILE *fp;
+	char *line = NULL;
+	char *token;
+	char *saveptr;
+	size_t line_size = 0;
+	unsigned int line_no = 0;
+	int failed = 0;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		log_error("Could not open the client list %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	while (!failed && getline(&line, &line_size, fp) != -1) {
+
+		line_no++;
+
+		if ((token = strchr(line, '#')) != NULL)
+			*token = 0;
+
+		for (token = strtok_r(line, " \t\r\n", &saveptr); token != NULL && !failed; token = strtok_r(NULL, " \t\r\n", &saveptr)) {
+			failed = _add_prefix(acl, token, action);
+			if (failed)
+				log_error("Invalid client prefix \"%s\" at %s:%u\n", token, path, line_no);
+		}
+
+	}
+
+	free(line);
+	fclose(fp);
+
+	return failed;
+
+}
+
+/**
+ * Adds the items of a comma separated list, prefixes or files
+ * Returns 1 if one is not valid
+ */
+static int _add_list(struct acl *acl, char *list, unsigned char action) {
+
+	char *copy;
+	char *item;
+	char *saveptr;
+	int failed = 0;
+
+	copy = strdup(list);
+	if (copy == NULL)
+		return 1;
+
+	for (item = strtok_r(copy, ", \t", &saveptr); item != NULL && !failed; item = strtok_r(NULL, ", \t", &saveptr)) {
+		if (item[0] == '/') {
+			failed = _add_file(acl, item, action);
+		} else {
+			failed = _add_prefix(acl, item, action);
+			if (failed)
+				log_error("Invalid client prefix \"%s\"\n", item);
+		}
+	}
+
+	free(copy);
+
+	return failed;
+
+}
+
+/**
+ * Copies the subtrie at idx of from to to, in depth first order
+ * Returns its new index
+ */
+static uint32_t _compile(struct acl_node *from, uint32_t idx, struct acl_node *to, unsigned int *count) {
+
+	uint32_t at;
+
+	if (idx == 0)
+		return 0;
+
+	at = (*count)++;
+	to[at] = from[idx];
+	to[at].child[0] = _compile(from, from[idx].child[0], to, count);
+	to[at].child[1] = _compile(from, from[idx].child[1], to, count);
+
+	return at;
+
+}
+
+/**
+ * Compiles the allowed and denied lists
+ * Returns NULL if a prefix or file is not valid, or out of memory
+ */
+struct acl *acl_new(char *allow, char *deny) {
+
+	struct acl *acl;
+	struct acl_node *nodes;
+	struct acl_jump *at;
+	uint32_t key[ACL_KEY_WORDS] = { 0, 0, 0xffff, 0 };
+	unsigned int count = 1;
+	unsigned int idx;
+
+	acl = malloc(sizeof(struct acl));
+	if (acl == NULL)
+		return NULL;
+
+	memset(acl, 0, sizeof(struct acl));
+
+	/* Node 0 stands for no child, its first child is the root */
+	if (_reserve(acl, 1)) {
+		free(acl);
+		return NULL;
+	}
+	memset(&acl->nodes[0], 0, sizeof(struct acl_node));
+	acl->nodes_count = 1;
+
+	if (_add_list(acl, allow, ACL_ALLOW) || _add_list(acl, deny, ACL_DENY)) {
+		acl_destroy(acl);
+		return NULL;
+	}
+
+	acl->fallback = (acl->allowed > 0) ? ACL_DENY : ACL_ALLOW;
+
+	nodes = malloc(acl->nodes_count * sizeof(struct acl_node));
+	if (nodes == NULL) {
+		acl_destroy(acl);
+		return NULL;
+	}
+
+	memset(&nodes[0], 0, sizeof(struct acl_node));
+	nodes[0].child[0] = _compile(acl->nodes, acl->nodes[0].child[0], nodes, &count);
+
+	free(acl->nodes);
+	acl->nodes = nodes;
+	acl->nodes_count = count;
+	acl->nodes_size = count;
+
+	for (idx = 0; idx < ACL_JUMP_SIZE; idx++) {
+		key[3] = idx << 24;
+		at = &acl->jump[idx];
+		at->node = nodes[0].child[0];
+		at->from = 0;
+		at->action = acl->fallback;
+		_walk(acl, key, at, ACL_JUMP_BITS);
+	}
+
+	return acl;
+
+}
+
+void acl_destroy(struct acl *acl) {
+
+	if (acl == NULL)
+		return;
+
+	free(acl->nodes);
+	free(acl);
+
+}
+
+/**
+ * Returns 1 if the client at addr is served
+ */
+int acl_check(struct acl *acl, struct in_addr addr) {
+
+	uint32_t key[ACL_KEY_WORDS] = { 0, 0, 0xffff, ntohl(addr.s_addr) };
+	struct acl_jump at = acl->jump[key[3] >> 24];
+
+	_walk(acl, key, &at, ACL_KEY_BITS + 1);
+
+	return (at.action == ACL_ALLOW);
+
+}
@@ -0,0 +1,65 @@
+#include <stdint.h>
+#include <netinet/in.h>
+
+#ifndef ACL_H
+#define ACL_H
+
+#define ACL_NONE 0
+#define ACL_ALLOW 1
+#define ACL_DENY 2
+
+/*
+ * Addresses are kept as IPv6 ones, 4 words from the most significant,
+ * IPv4 ones mapped in ::ffff:0:0/96
+ */
+#define ACL_KEY_WORDS 4
+#define ACL_KEY_BITS 128
+
+/*
+ * The first byte of an IPv4 address picks where in the trie a lookup
+ * starts, in place of the top levels
+ */
+#define ACL_JUMP_SIZE 256
+#define ACL_JUMP_BITS (ACL_KEY_BITS - 32 + 8)
+
+/*
+ * Node of the trie. It holds the len first bits of key, the ones its
+ * parent doesn't test are skipped in a single step. Children are
+ * indexes in the node array, 0 being none.
+ */
+struct acl_node {
+	uint32_t key[ACL_KEY_WORDS];
+	uint32_t child[2];
+	unsigned char len;
+	unsigned char action;
+};
+
+/*
+ * A point of a lookup: the node to look at next, the bits matched
+ * already and the action of the longest prefix among them
+ */
+struct acl_jump {
+	uint32_t node;
+	unsigned char from;
+	unsigned char action;
+};
+
+struct acl {
+	struct acl_jump jump[ACL_JUMP_SIZE];
+	struct acl_node *nodes;
+	unsigned int nodes_count;
+	unsigned int nodes_size;
+	unsigned int allowed;
+	unsigned int denied;
+	/*
+	 * For the addresses no prefix matches: refused when there are
+	 * allowed prefixes, allowed otherwise
+	 */
+	unsigned char fallback;
+};
+
+struct acl *acl_new(char *, char *);
+void acl_destroy(struct acl *);
+int acl_check(struct acl *, struct in_addr);
+
+#endif
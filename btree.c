@@ -28,7 +28,56 @@ int inline _compare(struct node *node, char *host, unsigned short int type) {
 	
 }
 
-void btinsert(struct node **tree, char *host, unsigned short int type, unsigned int expires, void *buffer, unsigned short int buf_len) {
+/*
+ * Explicit stack of the walks of the tree. Recursing once per level
+ * would run out of stack on a degenerate tree, as the tree is not kept
+ * balanced between two tidy ups.
+ */
+struct _frame {
+	struct node **link;
+	unsigned int depth;
+	int expanded;
+};
+
+struct _stack {
+	struct _frame *frames;
+	unsigned int len;
+	unsigned int size;
+};
+
+/**
+ * Pushes the subtree hanging from link, if any
+ * Returns 1 if out of memory
+ */
+static int _push(struct _stack *stack, struct node **link, unsigned int depth) {
+
+	struct _frame *frames;
+
+	if (*link == NULL)
+		return 0;
+
+	if (stack->len == stack->size) {
+		frames = (struct _frame *)realloc(stack->frames, sizeof(struct _frame) * (stack->size ? stack->size * 2 : 64));
+		if (frames == NULL)
+			return 1;
+		stack->frames = frames;
+		stack->size = stack->size ? stack->size * 2 : 64;
+	}
+
+	stack->frames[stack->len].link = link;
+	stack->frames[stack->len].depth = depth;
+	stack->frames[stack->len].expanded = 0;
+	stack->len++;
+
+	return 0;
+
+}
+
+/**
+ * Adds a node, or updates the one with the same host and type
+ * Returns 1 if a node was added
+ */
+int btinsert(struct node **tree, char *host, unsigned short int type, unsigned int expires, void *buffer, unsigned short int buf_len) {
 
 	int compare;
 	
@@ -44,7 +93,7 @@ void btinsert(struct node **tree, char *host, unsigned short int type, unsigned
 			memcpy (&(*tree)->payload.buffer, buffer, buf_len);
 			(*tree)->payload.buf_len = buf_len;
 			(*tree)->payload.expires = expires;
-            return;
+            return 0;
         }
 
     }
@@ -57,7 +106,7 @@ void btinsert(struct node **tree, char *host, unsigned short int type, unsigned
 	(*tree)->payload.expires = expires;
     (*tree)->left = NULL;
     (*tree)->right = NULL;
-    return;
+    return 1;
 
 }
 
@@ -83,14 +132,28 @@ struct node *btsearch(struct node *tree, char *host, unsigned int type) {
 
 }
 
+/**
+ * Frees all the nodes. Left children are rotated up until the root has
+ * none, so the tree is freed in order without a stack.
+ */
 void btdestroy(struct node *tree) {
 
-    if (tree == NULL)
-        return;
+	struct node *node;
 
-    btdestroy (tree->left);
-    btdestroy (tree->right);
-    free (tree);
+	while (tree != NULL) {
+
+		if (tree->left != NULL) {
+			node = tree->left;
+			tree->left = node->right;
+			node->right = tree;
+			tree = node;
+		} else {
+			node = tree->right;
+			free (tree);
+			tree = node;
+		}
+
+	}
 
 }
 
@@ -156,7 +219,11 @@ void _remove_node (struct node **parent, struct node *node) {
 
 }
 
-void btdelete(struct node **tree, char *host, unsigned short int type) {
+/**
+ * Removes the node of host and type
+ * Returns 1 if there was one
+ */
+int btdelete(struct node **tree, char *host, unsigned short int type) {
 
     struct node **parent = tree;
     struct node *node = (*tree);
@@ -180,66 +247,212 @@ void btdelete(struct node **tree, char *host, unsigned short int type) {
         } else if (compare == 0) {
 
             _remove_node (parent, node);
-            return;
+            return 1;
 
         }
 
     }
 
+    return 0;
+
+}
+
+/**
+ * Finds the node following host and type in the order of the tree, or
+ * the first node if host is NULL. As only keys are compared, a walk can
+ * go on from the last key seen even if the tree changed meanwhile.
+ */
+struct node *btnext(struct node *tree, char *host, unsigned short int type) {
+
+	struct node *next = NULL;
+
+	while (tree != NULL) {
+
+		if (host == NULL || _compare(tree, host, type) < 0) {
+			next = tree;
+			tree = tree->left;
+		} else {
+			tree = tree->right;
+		}
+
+	}
+
+	return next;
+
+}
+
+/**
+ * Calls visit on the nodes in order
+ */
+static void _inorder (struct node *tree, void (*visit)(struct node *, void *), void *arg) {
+
+	struct _stack stack = { NULL, 0, 0 };
+	struct _frame *frame;
+	struct node *node;
+
+	if (_push(&stack, &tree, 0))
+		return;
+
+	while (stack.len > 0) {
+
+		frame = &stack.frames[stack.len - 1];
+		node = *frame->link;
+
+		/*
+		 * The left subtree goes first, then the node and its right
+		 * subtree, which takes its place on the stack
+		 */
+		if (!frame->expanded) {
+			frame->expanded = 1;
+			if (_push(&stack, &node->left, 0))
+				break;
+			continue;
+		}
+
+		stack.len--;
+		visit(node, arg);
+		if (_push(&stack, &node->right, 0))
+			break;
+
+	}
+
+	free (stack.frames);
+
+}
+
+static void _print_node (struct node *node, void *arg) {
+
+	printf ("Domain %s with expiration time: %d\n", node->payload.host, node->payload.expires);
+
 }
 
 void btprint (struct node *tree) {
 
-    if (tree == NULL)
-        return;
+	_inorder(tree, _print_node, NULL);
+
+}
+
+struct _sorted {
+	struct node **nodes;
+	int count;
+	int size;
+};
+
+static void _sort_node (struct node *node, void *arg) {
 
-    btprint (tree->left);
-    printf ("Domain %s with expiration time: %d\n", tree->payload.host, tree->payload.expires);
-    btprint (tree->right);
+	struct _sorted *sorted = (struct _sorted *)arg;
 
+	if (sorted->count < sorted->size)
+		sorted->nodes[sorted->count++] = node;
 
 }
 
-void _copy_balanced_tree (struct node *origin_tree, struct node **balanced) {
+/**
+ * Links a copy of the nodes from first to last, sorted, into a balanced
+ * tree. Recursion goes as deep as the copy, log2 of the nodes.
+ * Returns NULL if out of memory, freeing what was copied
+ */
+static struct node *_copy_balanced_tree (struct node **sorted, int first, int last, int *failed) {
+
+	struct node *node;
+	int middle;
+
+	if (first > last || *failed)
+		return NULL;
 
-    if (origin_tree == NULL)
-        return;
+	middle = first + (last - first) / 2;
+
+	node = (struct node *)malloc(sizeof(struct node));
+	if (node == NULL) {
+		*failed = 1;
+		return NULL;
+	}
 
-    btinsert(balanced, origin_tree->payload.host, origin_tree->payload.type, origin_tree->payload.expires, (void *)&origin_tree->payload.buffer, origin_tree->payload.buf_len);
-    _copy_balanced_tree(origin_tree->left, balanced);
-    _copy_balanced_tree(origin_tree->right, balanced);
+	memcpy (&node->payload, &sorted[middle]->payload, sizeof(struct payload));
+	node->left = _copy_balanced_tree(sorted, first, middle - 1, failed);
+	node->right = _copy_balanced_tree(sorted, middle + 1, last, failed);
+
+	if (*failed) {
+		btdestroy(node);
+		return NULL;
+	}
+
+	return node;
 
 }
 
 /**
  * Creates a balanced *copy* of a binary tree recreating all the nodes
+ * Returns NULL if the tree is empty or out of memory
  */
 struct node *btbalance (struct node *origin_tree) {
 
-    struct node *balanced = NULL;
+	struct _sorted sorted;
+	struct node *balanced;
+	int failed = 0;
+
+	sorted.size = btcount(origin_tree);
+	sorted.count = 0;
+	if (sorted.size == 0)
+		return NULL;
+
+	sorted.nodes = (struct node **)malloc(sizeof(struct node *) * sorted.size);
+	if (sorted.nodes == NULL)
+		return NULL;
+
+	_inorder(origin_tree, _sort_node, &sorted);
+
+	balanced = _copy_balanced_tree(sorted.nodes, 0, sorted.count - 1, &failed);
 
-    _copy_balanced_tree(origin_tree, &balanced);
+	free (sorted.nodes);
 
-    return balanced;
+	return balanced;
 
 }
 
 /**
  * Removes all the nodes that have the expires field below given timestamp
+ * Returns the number of nodes removed
  */
-void btprune (struct node **tree, unsigned int timestamp) {
-	
-	if ((*tree) == NULL)
-		return;
-		
-	btprune (&(*tree)->left, timestamp);
-	btprune (&(*tree)->right, timestamp);
-	
-	if (timestamp > (*tree)->payload.expires) {
-		_remove_node(tree, (*tree));
-		return;
+int btprune (struct node **tree, unsigned int timestamp) {
+
+	struct _stack stack = { NULL, 0, 0 };
+	struct _frame *frame;
+	struct node **link;
+	int removed = 0;
+
+	if (_push(&stack, tree, 0))
+		return 0;
+
+	/*
+	 * A node is checked once both its subtrees are pruned, so
+	 * _remove_node only ever moves up nodes that are staying
+	 */
+	while (stack.len > 0) {
+
+		frame = &stack.frames[stack.len - 1];
+		link = frame->link;
+
+		if (!frame->expanded) {
+			frame->expanded = 1;
+			if (_push(&stack, &(*link)->right, 0) || _push(&stack, &(*link)->left, 0))
+				break;
+			continue;
+		}
+
+		stack.len--;
+
+		if (timestamp > (*link)->payload.expires) {
+			_remove_node(link, (*link));
+			removed++;
+		}
+
 	}
-	
+
+	free (stack.frames);
+
+	return removed;
+
 }
 
 /**
@@ -247,10 +460,26 @@ void btprune (struct node **tree, unsigned int timestamp) {
  */
 int btcount (struct node *tree) {
 
-    if (tree == NULL)
-        return 0;
+	struct _stack stack = { NULL, 0, 0 };
+	struct node *node;
+	int count = 0;
+
+	if (_push(&stack, &tree, 0))
+		return 0;
+
+	while (stack.len > 0) {
 
-    return btcount(tree->left) + btcount(tree->right) + 1;
+		node = *stack.frames[--stack.len].link;
+		count++;
+
+		if (_push(&stack, &node->left, 0) || _push(&stack, &node->right, 0))
+			break;
+
+	}
+
+	free (stack.frames);
+
+	return count;
 
 }
 
@@ -259,19 +488,31 @@ int btcount (struct node *tree) {
  * Calculates the maximum depth of the binary tree structure
  */
 int btdepth (struct node *tree) {
-	
-	int left_depth;
-	int right_depth;
-	
-	if (tree == NULL)
+
+	struct _stack stack = { NULL, 0, 0 };
+	struct node *node;
+	unsigned int depth;
+	unsigned int max_depth = 0;
+
+	if (_push(&stack, &tree, 1))
 		return 0;
-		
-	left_depth = btdepth(tree->left);
-	right_depth = btdepth(tree->right);
-	
-	if (left_depth > right_depth)
-		return left_depth + 1;
-	else
-		return right_depth + 1;
-	
+
+	while (stack.len > 0) {
+
+		stack.len--;
+		node = *stack.frames[stack.len].link;
+		depth = stack.frames[stack.len].depth;
+
+		if (depth > max_depth)
+			max_depth = depth;
+
+		if (_push(&stack, &node->left, depth + 1) || _push(&stack, &node->right, depth + 1))
+			break;
+
+	}
+
+	free (stack.frames);
+
+	return max_depth;
+
 }
@@ -20,14 +20,15 @@ struct node {
     struct node *right;
 };
 
-void btinsert(struct node **, char *, unsigned short int, unsigned int, void *, unsigned short int);
+int btinsert(struct node **, char *, unsigned short int, unsigned int, void *, unsigned short int);
 struct node *btsearch(struct node *, char *, unsigned int);
 void btdestroy(struct node *);
-void btdelete(struct node **, char *, unsigned short int);
+int btdelete(struct node **, char *, unsigned short int);
+struct node *btnext(struct node *, char *, unsigned short int);
 int btcount (struct node *);
 void btprint (struct node *);
 struct node *btbalance (struct node *);
-void btprune (struct node **, unsigned int);
+int btprune (struct node **, unsigned int);
 int btdepth (struct node *);
 
 #endif
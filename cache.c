@@ -1,37 +1,115 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include "dproxy.h"
 #include "btree.h"
 #include "cache.h"
+#include "cache_shm.h"
+#include "numa.h"
 
-struct cache *cache_new () {
+/**
+ * Returns the index of the shard of the node the calling thread runs on
+ */
+static inline unsigned int _local_index (struct cache *cache) {
+
+	unsigned int node = numa_local_node();
+
+	if (node >= cache->shards_count)
+		node = 0;
+
+	return node;
+
+}
+
+static inline struct cache_shard *_local_shard (struct cache *cache) {
+
+	return &cache->shards[_local_index(cache)];
+
+}
+
+struct cache *cache_new (unsigned int shards_count) {
 	
 	struct cache *cache;
+	unsigned int idx;
+	
+	if (shards_count == 0)
+		shards_count = 1;
 	
 	cache = (struct cache *)malloc(sizeof(struct cache));
 	
-	cache->tree = NULL;
-	pthread_mutex_init (&cache->mutex, NULL);
+	if (posix_memalign((void **)&cache->shards, 64, sizeof(struct cache_shard) * shards_count) != 0) {
+		free (cache);
+		return NULL;
+	}
+	
+	cache->shards_count = shards_count;
+	cache->shm = NULL;
+	
+	for (idx = 0; idx < shards_count; idx++) {
+		cache->shards[idx].tree = NULL;
+		cache->shards[idx].count = 0;
+		pthread_mutex_init (&cache->shards[idx].mutex, NULL);
+	}
 	
 	return cache;
 	
 }
 
+/**
+ * Instantiates a cache kept in the file of path and shared with the
+ * other processes mapping it, see cache_shm.c
+ * Returns NULL if the file can't be used
+ */
+struct cache *cache_new_shared (char *path, unsigned int size_mb, unsigned int shards_count) {
+
+	struct cache *cache;
+
+	cache = (struct cache *)malloc(sizeof(struct cache));
+	if (cache == NULL)
+		return NULL;
+
+	cache->shm = cache_shm_open(path, size_mb, shards_count);
+	if (cache->shm == NULL) {
+		free (cache);
+		return NULL;
+	}
+
+	cache->shards = NULL;
+	cache->shards_count = cache->shm->header->shards_count;
+
+	return cache;
+
+}
+
 void cache_destroy (struct cache *cache) {
 
-	if (cache == NULL);
+	unsigned int idx;
+
+	if (cache == NULL)
+		return;
+
+	if (cache->shm != NULL) {
+		cache_shm_close(cache->shm);
+		free (cache);
 		return;
+	}
 		
-	pthread_mutex_lock(&cache->mutex);
-	
-	btdestroy (cache->tree);
-	cache->tree = NULL;
-	
-	pthread_mutex_unlock(&cache->mutex);
-	
-	pthread_mutex_destroy(&cache->mutex);
+	for (idx = 0; idx < cache->shards_count; idx++) {
+		
+		pthread_mutex_lock(&cache->shards[idx].mutex);
+		
+		btdestroy (cache->shards[idx].tree);
+		cache->shards[idx].tree = NULL;
+		cache->shards[idx].count = 0;
+		
+		pthread_mutex_unlock(&cache->shards[idx].mutex);
+		
+		pthread_mutex_destroy(&cache->shards[idx].mutex);
+		
+	}
 	
+	free (cache->shards);
 	free (cache);
 	
 }
@@ -39,22 +117,35 @@ void cache_destroy (struct cache *cache) {
 
 int cache_search (struct cache *cache, char *host, unsigned short int type, unsigned int expires, void *buffer, unsigned short int *buf_len) {
 	
+	struct cache_shard *shard;
 	struct node *node;
+	unsigned int idx;
+	int res;
+
+	if (cache->shm != NULL) {
+		idx = _local_index(cache);
+		cache_shm_lock(cache->shm, idx);
+		res = cache_shm_search(cache->shm, idx, host, type, expires, buffer, buf_len);
+		cache_shm_unlock(cache->shm, idx);
+		return res;
+	}
+
+	shard = _local_shard(cache);
 	/*
 	 * -- Entering cache critical section
 	 */
-	pthread_mutex_lock (&cache->mutex);
+	pthread_mutex_lock (&shard->mutex);
 	
-	node = btsearch(cache->tree, host, type);
+	node = btsearch(shard->tree, host, type);
 
 	if (node == NULL) {
-		pthread_mutex_unlock (&cache->mutex);
+		pthread_mutex_unlock (&shard->mutex);
 		return 0;
 	} 
 	
 	if (expires > node->payload.expires) {
 		debug ("Item expired %d, now %d\n", node->payload.expires, expires);
-		pthread_mutex_unlock (&cache->mutex);
+		pthread_mutex_unlock (&shard->mutex);
 		return 0;
 	}
 	
@@ -64,7 +155,7 @@ int cache_search (struct cache *cache, char *host, unsigned short int type, unsi
 	/*
 	 * Exiting critical section
 	 */
-	pthread_mutex_unlock (&cache->mutex);
+	pthread_mutex_unlock (&shard->mutex);
 	
 	return 1;
 		
@@ -73,56 +164,376 @@ int cache_search (struct cache *cache, char *host, unsigned short int type, unsi
 
 void cache_insert (struct cache *cache, char *host, unsigned short int type, unsigned int expires, void *buffer, unsigned short int buf_len) {
 	
+	struct cache_shard *shard;
+	unsigned int idx;
+
+	if (cache->shm != NULL) {
+		idx = _local_index(cache);
+		cache_shm_lock(cache->shm, idx);
+		cache_shm_insert(cache->shm, idx, host, type, expires, buffer, buf_len);
+		cache_shm_unlock(cache->shm, idx);
+		return;
+	}
+
+	shard = _local_shard(cache);
+	
 	/*
 	 * Entering a critical section to add the results of the query
 	 */
-	pthread_mutex_lock(&cache->mutex);
-	btinsert (&cache->tree, host, type, expires, buffer, buf_len);
-	pthread_mutex_unlock(&cache->mutex);
+	pthread_mutex_lock(&shard->mutex);
+	shard->count += btinsert (&shard->tree, host, type, expires, buffer, buf_len);
+	pthread_mutex_unlock(&shard->mutex);
 	
 }
 
 void cache_prune (struct cache *cache, unsigned int timestamp) {
 	
-	pthread_mutex_lock(&cache->mutex);
-	btprune (&cache->tree, timestamp);
-	pthread_mutex_unlock(&cache->mutex);
+	unsigned int idx;
+
+	if (cache->shm != NULL) {
+		cache_tidyup(cache, timestamp);
+		return;
+	}
+	
+	for (idx = 0; idx < cache->shards_count; idx++) {
+		pthread_mutex_lock(&cache->shards[idx].mutex);
+		cache->shards[idx].count -= btprune (&cache->shards[idx].tree, timestamp);
+		pthread_mutex_unlock(&cache->shards[idx].mutex);
+	}
 	
 }
 
 void cache_tidyup (struct cache *cache, unsigned int timestamp) {
 	
-	struct node *orig_tree;
-	
-	pthread_mutex_lock(&cache->mutex);
-	
-	btprune (&cache->tree, timestamp);
-	orig_tree = cache->tree;
-	cache->tree = btbalance(cache->tree);
-	btdestroy(orig_tree);
+	struct node *balanced;
+	struct cache_shard *shard;
+	unsigned int idx;
+
+	/* Pruning a shared tree balances it too */
+	if (cache->shm != NULL) {
+		for (idx = 0; idx < cache->shards_count; idx++) {
+			cache_shm_lock(cache->shm, idx);
+			cache_shm_prune(cache->shm, idx, timestamp);
+			cache_shm_unlock(cache->shm, idx);
+		}
+		return;
+	}
 	
-	pthread_mutex_unlock(&cache->mutex);
+	for (idx = 0; idx < cache->shards_count; idx++) {
+		
+		shard = &cache->shards[idx];
+		
+		pthread_mutex_lock(&shard->mutex);
+		
+		shard->count -= btprune (&shard->tree, timestamp);
+		/*
+		 * Out of memory, the tree stays as it is
+		 */
+		balanced = btbalance(shard->tree);
+		if (balanced != NULL) {
+			btdestroy(shard->tree);
+			shard->tree = balanced;
+		}
+		
+		pthread_mutex_unlock(&shard->mutex);
+		
+	}
 	
 }
 
+/**
+ * Balances the trees of at most max nodes, taking the lock of one shard
+ * at a time. The larger ones are left as they are: balancing them would
+ * stop the lookups for too long, and the names come in no particular
+ * order, so their depth stays logarithmic on average.
+ */
+void cache_balance (struct cache *cache, unsigned int max) {
+
+	struct node *balanced;
+	struct cache_shard *shard;
+	unsigned int idx;
+
+	for (idx = 0; idx < cache->shards_count; idx++) {
+
+		if (cache->shm != NULL) {
+			cache_shm_lock(cache->shm, idx);
+			if (cache->shm->header->shards[idx].count <= max)
+				cache_shm_balance(cache->shm, idx);
+			cache_shm_unlock(cache->shm, idx);
+			continue;
+		}
+
+		shard = &cache->shards[idx];
+
+		pthread_mutex_lock(&shard->mutex);
+
+		if (shard->count <= max) {
+			/*
+			 * Out of memory, the tree stays as it is
+			 */
+			balanced = btbalance(shard->tree);
+			if (balanced != NULL) {
+				btdestroy(shard->tree);
+				shard->tree = balanced;
+			}
+		}
+
+		pthread_mutex_unlock(&shard->mutex);
+
+	}
+
+}
+
+/**
+ * Prints all the cached entries, a batch at a time
+ */
 void cache_print (struct cache *cache) {
 	
-	pthread_mutex_lock(&cache->mutex);
-	btprint(cache->tree);
-	printf ("Cached domains count: %d\n", btcount(cache->tree));
-	printf ("Binary tree maximum depth: %d\n", btdepth(cache->tree));
-	pthread_mutex_unlock(&cache->mutex);
+	struct cache_cursor cursor;
+	struct payload *payload;
+	unsigned int count = 0;
+	
+	if (cache_cursor_open(&cursor, cache))
+		return;
+	
+	while ((payload = cache_cursor_next(&cursor)) != NULL) {
+		printf ("Domain %s with expiration time: %d\n", payload->host, payload->expires);
+		count++;
+	}
+	
+	cache_cursor_close(&cursor);
+	
+	printf ("Cached domains count: %d\n", count);
 	
 }
 
+/**
+ * Returns the number of cached entries. The counters of the shards are
+ * read without taking their locks, so the number may be a moment old.
+ */
 unsigned int cache_count (struct cache *cache) {
 	
-	unsigned int count;
+	unsigned int count = 0;
+	unsigned int idx;
+
+	if (cache->shm != NULL) {
+		for (idx = 0; idx < cache->shards_count; idx++)
+			count += *(volatile unsigned int *)&cache->shm->header->shards[idx].count;
+		return count;
+	}
 	
-	pthread_mutex_lock(&cache->mutex);
-	count = btcount(cache->tree);
-	pthread_mutex_unlock(&cache->mutex);
+	for (idx = 0; idx < cache->shards_count; idx++)
+		count += *(volatile unsigned int *)&cache->shards[idx].count;
 	
 	return count;
 	
 }
+
+/**
+ * Returns the memory taken by the cached entries, in bytes
+ */
+unsigned long cache_memory (struct cache *cache) {
+
+	if (cache->shm != NULL)
+		return (unsigned long)cache_count(cache) * sizeof(struct cache_shm_node);
+
+	return (unsigned long)cache_count(cache) * sizeof(struct node);
+
+}
+
+/**
+ * Prepares a cursor to read the whole cache
+ * Returns 1 if out of memory
+ */
+int cache_cursor_open (struct cache_cursor *cursor, struct cache *cache) {
+
+	memset(cursor, 0, sizeof(struct cache_cursor));
+	cursor->cache = cache;
+
+	cursor->batch = (struct payload *)malloc(sizeof(struct payload) * CACHE_WALK_BATCH);
+
+	return cursor->batch == NULL;
+
+}
+
+/**
+ * Copies the next batch of entries, holding the lock of the shard only
+ * while copying. Shards are read one after the other.
+ */
+static void _cursor_fill (struct cache_cursor *cursor) {
+
+	struct cache_shard *shard;
+	struct cache_shm *shm;
+	struct node *node;
+
+	cursor->count = 0;
+	cursor->pos = 0;
+
+	while (cursor->count == 0 && cursor->shard < cursor->cache->shards_count) {
+
+		if (cursor->shard_done) {
+			cursor->shard++;
+			cursor->shard_done = 0;
+			cursor->host[0] = 0;
+			continue;
+		}
+
+		if (cursor->cache->shm != NULL) {
+
+			shm = cursor->cache->shm;
+
+			cache_shm_lock(shm, cursor->shard);
+			cursor->count = cache_shm_copy(shm, cursor->shard, cursor->host[0] ? cursor->host : NULL, cursor->type, cursor->batch, CACHE_WALK_BATCH, &cursor->shard_done);
+			cache_shm_unlock(shm, cursor->shard);
+
+		} else {
+
+			shard = &cursor->cache->shards[cursor->shard];
+
+			pthread_mutex_lock(&shard->mutex);
+
+			node = btnext(shard->tree, cursor->host[0] ? cursor->host : NULL, cursor->type);
+			while (node != NULL && cursor->count < CACHE_WALK_BATCH) {
+				memcpy(&cursor->batch[cursor->count++], &node->payload, sizeof(struct payload));
+				node = btnext(shard->tree, node->payload.host, node->payload.type);
+			}
+
+			pthread_mutex_unlock(&shard->mutex);
+
+			cursor->shard_done = (node == NULL);
+
+		}
+
+		if (cursor->count > 0) {
+			strcpy(cursor->host, cursor->batch[cursor->count - 1].host);
+			cursor->type = cursor->batch[cursor->count - 1].type;
+		}
+
+	}
+
+}
+
+/**
+ * Returns the next entry, valid until the following call, or NULL at
+ * the end of the cache
+ */
+struct payload *cache_cursor_next (struct cache_cursor *cursor) {
+
+	if (cursor->pos == cursor->count)
+		_cursor_fill(cursor);
+
+	if (cursor->pos == cursor->count)
+		return NULL;
+
+	return &cursor->batch[cursor->pos++];
+
+}
+
+void cache_cursor_close (struct cache_cursor *cursor) {
+
+	free(cursor->batch);
+	cursor->batch = NULL;
+
+}
+
+/**
+ * Calls visit on the payload of every cached entry, stopping when it
+ * returns nonzero. No lock is held while visiting, so visit may change
+ * the cache.
+ * Returns the number of entries visited
+ */
+unsigned int cache_walk (struct cache *cache, int (*visit)(struct payload *, void *), void *arg) {
+
+	struct cache_cursor cursor;
+	struct payload *payload;
+	unsigned int visited = 0;
+
+	if (cache_cursor_open(&cursor, cache))
+		return 0;
+
+	while ((payload = cache_cursor_next(&cursor)) != NULL) {
+		visited++;
+		if (visit(payload, arg))
+			break;
+	}
+
+	cache_cursor_close(&cursor);
+
+	return visited;
+
+}
+
+/**
+ * Calls visit on the entry of host and type of each shard, found by a
+ * search of its tree, stopping when it returns nonzero. No lock is held
+ * while visiting.
+ * Returns the number of entries found
+ */
+unsigned int cache_lookup (struct cache *cache, char *host, unsigned short int type, int (*visit)(struct payload *, void *), void *arg) {
+
+	struct payload *payload;
+	struct node *node;
+	unsigned int found = 0;
+	unsigned int idx;
+	int res;
+
+	payload = (struct payload *)malloc(sizeof(struct payload));
+	if (payload == NULL)
+		return 0;
+
+	for (idx = 0; idx < cache->shards_count; idx++) {
+
+		if (cache->shm != NULL) {
+			cache_shm_lock(cache->shm, idx);
+			res = cache_shm_get(cache->shm, idx, host, type, payload);
+			cache_shm_unlock(cache->shm, idx);
+		} else {
+			pthread_mutex_lock(&cache->shards[idx].mutex);
+			node = btsearch(cache->shards[idx].tree, host, type);
+			res = (node != NULL);
+			if (res)
+				memcpy(payload, &node->payload, sizeof(struct payload));
+			pthread_mutex_unlock(&cache->shards[idx].mutex);
+		}
+
+		if (res) {
+			found++;
+			if (visit(payload, arg))
+				break;
+		}
+
+	}
+
+	free(payload);
+
+	return found;
+
+}
+
+/**
+ * Removes the entry of host and type from all the shards
+ * Returns the number of entries removed
+ */
+unsigned int cache_delete (struct cache *cache, char *host, unsigned short int type) {
+
+	unsigned int removed = 0;
+	unsigned int idx;
+	int res;
+
+	for (idx = 0; idx < cache->shards_count; idx++) {
+		if (cache->shm != NULL) {
+			cache_shm_lock(cache->shm, idx);
+			res = cache_shm_delete(cache->shm, idx, host, type);
+			cache_shm_unlock(cache->shm, idx);
+		} else {
+			pthread_mutex_lock(&cache->shards[idx].mutex);
+			res = btdelete(&cache->shards[idx].tree, host, type);
+			cache->shards[idx].count -= res;
+			pthread_mutex_unlock(&cache->shards[idx].mutex);
+		}
+		removed += res;
+	}
+
+	return removed;
+
+}
@@ -1,16 +1,80 @@
 #include <pthread.h>
 #include "btree.h"
 
-struct cache {
+/*
+ * The cache is split in shards, one per NUMA node. Each thread looks up
+ * and fills only the shard of its own node, so tree nodes and locks are
+ * allocated and touched from local memory. Shards are cache line
+ * aligned so the locks of different nodes never share a line.
+ */
+struct cache_shard {
 	struct node *tree;
 	pthread_mutex_t mutex;
+	/*
+	 * Nodes in the tree, kept up to date on insert and prune so
+	 * nobody needs to walk the tree to know
+	 */
+	unsigned int count;
+} __attribute__((aligned(64)));
+
+/*
+ * Entries copied out of a shard for each time its lock is taken by a
+ * cursor
+ */
+#define CACHE_WALK_BATCH 64
+
+/*
+ * Largest tree balanced by cache_balance(), so its lock is held for a
+ * bounded time
+ */
+#define CACHE_BALANCE_MAX 8192
+
+struct cache_shm;
+
+/*
+ * A shared cache keeps its shards in the segment of shm, see
+ * cache_shm.c, and has no shards of its own
+ */
+struct cache {
+	struct cache_shard *shards;
+	unsigned int shards_count;
+	struct cache_shm *shm;
+};
+
+/*
+ * Reads the cache a batch at a time, in the order of the trees. Between
+ * two batches the shards are unlocked and may change: the cursor goes on
+ * from the last key it returned, so entries added meanwhile may or may
+ * not be seen, but none is seen twice and the others are all seen.
+ */
+struct cache_cursor {
+	struct cache *cache;
+	unsigned int shard;
+	/*
+	 * Last key copied from the shard, host[0] is 0 before the first
+	 */
+	char host[DNS_NAME_SIZE];
+	unsigned short int type;
+	int shard_done;
+	struct payload *batch;
+	unsigned int count;
+	unsigned int pos;
 };
 
-struct cache *cache_new ();
+struct cache *cache_new (unsigned int);
+struct cache *cache_new_shared (char *, unsigned int, unsigned int);
 void cache_destroy (struct cache *cache);
 int cache_search (struct cache *, char *, unsigned short int, unsigned int, void *, unsigned short int *);
 void cache_insert (struct cache *, char *, unsigned short int , unsigned int , void *, unsigned short int);
 void cache_print (struct cache *);
 unsigned int cache_count (struct cache *) ;
+unsigned long cache_memory (struct cache *);
 void cache_prune (struct cache *, unsigned int);
 void cache_tidyup (struct cache *, unsigned int);
+void cache_balance (struct cache *, unsigned int);
+int cache_cursor_open (struct cache_cursor *, struct cache *);
+struct payload *cache_cursor_next (struct cache_cursor *);
+void cache_cursor_close (struct cache_cursor *);
+unsigned int cache_walk (struct cache *, int (*)(struct payload *, void *), void *);
+unsigned int cache_lookup (struct cache *, char *, unsigned short int, int (*)(struct payload *, void *), void *);
+unsigned int cache_delete (struct cache *, char *, unsigned short int);
@@ -0,0 +1,553 @@
+/*
+  **
+  ** cache_bench.c
+  **
+  ** cache-bench: microbenchmarks of the cache, run by "make bench". For
+  ** each cache size and number of threads it times the insertion of the
+  ** entries, lookups of cached and of missing names drawn with uniform
+  ** and Zipfian distributions, the expiry of half the entries and the
+  ** tidy up that follows. Every result is a line of key=value pairs:
+  **
+  **   bench=search_hit entries=100000 dist=zipf threads=2 ops=400000
+  **   hits=400000 ops_per_sec=1919267 p50_ns=408 p90_ns=1270 p99_ns=2368
+  **   p999_ns=3619
+  **
+  ** One operation in BENCH_SAMPLE is timed on its own for the latency
+  ** percentiles, the rate comes from the wall clock of all of them.
+  **
+  ** With -f the shared cache is measured instead, in a file created
+  ** afresh for each run and removed after it.
+  **
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <malloc.h>
+#include <pthread.h>
+#include "dproxy.h"
+#include "cache.h"
+#include "cache_shm.h"
+#include "numa.h"
+
+#define BENCH_NAME_LEN 40
+#define BENCH_SAMPLE 8
+#define BENCH_LIST_MAX 16
+
+/*
+ * Entries expire at either time, so that the expiry benchmark removes
+ * half of them. Lookups are done at BENCH_NOW.
+ */
+#define BENCH_NOW 1
+#define BENCH_EXPIRES_EARLY 100
+#define BENCH_EXPIRES_LATE 1000
+
+enum bench_dist {
+	BENCH_UNIFORM = 0,
+	BENCH_ZIPF
+};
+
+static char *bench_dist_names[] = { "uniform", "zipf" };
+
+/*
+ * Zipfian ranks as generated by Gray et al., "Quickly generating
+ * billion-record synthetic databases", with constants computed once for
+ * each size
+ */
+struct bench_zipf {
+	unsigned long n;
+	double theta;
+	double alpha;
+	double zetan;
+	double eta;
+	double half_pow_theta;
+};
+
+struct bench_thread {
+	pthread_t tid;
+	unsigned int idx;
+	unsigned int shards;
+	struct cache *cache;
+	pthread_barrier_t *barrier;
+	/*
+	 * Operation to run on each name, and the names
+	 */
+	int (*op)(struct cache *, char *, unsigned long);
+	char (*names)[BENCH_NAME_LEN];
+	unsigned long count;
+	unsigned long hits;
+	unsigned int *samples;
+	unsigned long samples_count;
+	unsigned long long start;
+	unsigned long long end;
+};
+
+static struct dns_data bench_answer;
+
+/*
+ * File of the shared cache, NULL for a private one
+ */
+static char *bench_file = NULL;
+
+static unsigned long long bench_now_nsec(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+}
+
+/**
+ * xorshift64*, one state per generator
+ */
+static unsigned long long bench_random(unsigned long long *state) {
+
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+
+	return *state * 2685821657736338717ULL;
+
+}
+
+static double bench_random_double(unsigned long long *state) {
+
+	return (bench_random(state) >> 11) * (1.0 / 9007199254740992.0);
+
+}
+
+static void bench_zipf_init(struct bench_zipf *zipf, unsigned long n, double theta) {
+
+	unsigned long idx;
+	double zeta2;
+
+	zipf->n = n;
+	zipf->theta = theta;
+	zipf->zetan = 0;
+	for (idx = 1; idx <= n; idx++)
+		zipf->zetan += 1.0 / pow(idx, theta);
+
+	zeta2 = 1.0 + 1.0 / pow(2, theta);
+	zipf->alpha = 1.0 / (1.0 - theta);
+	zipf->eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / zipf->zetan);
+	zipf->half_pow_theta = 1.0 + pow(0.5, theta);
+
+}
+
+static unsigned long bench_zipf_next(struct bench_zipf *zipf, unsigned long long *state) {
+
+	double u = bench_random_double(state);
+	double uz = u * zipf->zetan;
+	unsigned long rank;
+
+	if (uz < 1.0)
+		return 0;
+	if (uz < zipf->half_pow_theta)
+		return 1;
+
+	rank = (unsigned long)(zipf->n * pow(zipf->eta * u - zipf->eta + 1.0, zipf->alpha));
+
+	return (rank < zipf->n) ? rank : zipf->n - 1;
+
+}
+
+/**
+ * Writes the name of entry idx. Popular ranks are scattered over the
+ * entries, or the hot names would all be neighbours in the trees.
+ */
+static void bench_name(char *name, unsigned long idx) {
+
+	snprintf(name, BENCH_NAME_LEN, "h%lx.bench%lu.example", idx, idx % 97);
+
+}
+
+static unsigned long bench_scatter(unsigned long rank, unsigned long n) {
+
+	return (rank * 2654435761UL + 12345) % n;
+
+}
+
+static int bench_op_insert(struct cache *cache, char *name, unsigned long idx) {
+
+	cache_insert(cache, name, DNS_TYPE_A, (idx & 1) ? BENCH_EXPIRES_EARLY : BENCH_EXPIRES_LATE, &bench_answer, 64);
+
+	return 1;
+
+}
+
+static int bench_op_search(struct cache *cache, char *name, unsigned long idx) {
+
+	struct dns_data buffer;
+	unsigned short int len;
+
+	return cache_search(cache, name, DNS_TYPE_A, BENCH_NOW, &buffer, &len);
+
+}
+
+static void *bench_thread_run(void *args) {
+
+	struct bench_thread *thread = (struct bench_thread *)args;
+	unsigned long long start;
+	unsigned long idx;
+
+	/* Each thread works on a shard, as the resolvers of a node do */
+	numa_set_local_node(thread->idx % thread->shards);
+
+	pthread_barrier_wait(thread->barrier);
+
+	thread->start = bench_now_nsec();
+
+	for (idx = 0; idx < thread->count; idx++) {
+
+		if (idx % BENCH_SAMPLE == 0) {
+			start = bench_now_nsec();
+			thread->hits += thread->op(thread->cache, thread->names[idx], idx);
+			thread->samples[thread->samples_count++] = bench_now_nsec() - start;
+		} else {
+			thread->hits += thread->op(thread->cache, thread->names[idx], idx);
+		}
+
+	}
+
+	thread->end = bench_now_nsec();
+
+	return NULL;
+
+}
+
+static int bench_compare_samples(const void *a, const void *b) {
+
+	unsigned int sa = *(const unsigned int *)a;
+	unsigned int sb = *(const unsigned int *)b;
+
+	return (sa > sb) - (sa < sb);
+
+}
+
+/**
+ * Runs op on the names of each thread, all the threads starting at once,
+ * and prints the result line
+ */
+static void bench_run(char *bench, char *dist, struct bench_thread *threads, unsigned int threads_count, char *extra) {
+
+	pthread_barrier_t barrier;
+	unsigned long long start = ~0ULL;
+	unsigned long long end = 0;
+	unsigned int *samples;
+	unsigned long samples_count = 0;
+	unsigned long ops = 0;
+	unsigned long hits = 0;
+	unsigned int idx;
+	double seconds;
+
+	pthread_barrier_init(&barrier, NULL, threads_count);
+
+	for (idx = 0; idx < threads_count; idx++) {
+		threads[idx].barrier = &barrier;
+		threads[idx].hits = 0;
+		threads[idx].samples_count = 0;
+		threads[idx].samples = malloc(sizeof(unsigned int) * (threads[idx].count / BENCH_SAMPLE + 1));
+		if (threads[idx].samples == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		pthread_create(&threads[idx].tid, NULL, bench_thread_run, &threads[idx]);
+	}
+
+	for (idx = 0; idx < threads_count; idx++) {
+		pthread_join(threads[idx].tid, NULL);
+		if (threads[idx].start < start)
+			start = threads[idx].start;
+		if (threads[idx].end > end)
+			end = threads[idx].end;
+		ops += threads[idx].count;
+		hits += threads[idx].hits;
+		samples_count += threads[idx].samples_count;
+	}
+
+	pthread_barrier_destroy(&barrier);
+
+	samples = malloc(sizeof(unsigned int) * (samples_count + 1));
+	if (samples == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	samples_count = 0;
+	for (idx = 0; idx < threads_count; idx++) {
+		memcpy(samples + samples_count, threads[idx].samples, sizeof(unsigned int) * threads[idx].samples_count);
+		samples_count += threads[idx].samples_count;
+		free(threads[idx].samples);
+	}
+
+	qsort(samples, samples_count, sizeof(unsigned int), bench_compare_samples);
+
+	seconds = (end - start) / 1e9;
+
+	printf("bench=%s entries=%u dist=%s threads=%u ops=%lu hits=%lu ops_per_sec=%.0f p50_ns=%u p90_ns=%u p99_ns=%u p999_ns=%u%s\n",
+		bench, cache_count(threads[0].cache), dist, threads_count, ops, hits, ops / seconds,
+		samples[samples_count * 50 / 100], samples[samples_count * 90 / 100],
+		samples[samples_count * 99 / 100], samples[samples_count * 999 / 1000], extra);
+	fflush(stdout);
+
+	free(samples);
+
+}
+
+/**
+ * Times a call on the whole cache, from the main thread
+ */
+static void bench_run_once(char *bench, struct cache *cache, void (*call)(struct cache *, unsigned int), unsigned int timestamp) {
+
+	unsigned long long start;
+	unsigned long long nsec;
+	unsigned int entries;
+
+	entries = cache_count(cache);
+
+	start = bench_now_nsec();
+	call(cache, timestamp);
+	nsec = bench_now_nsec() - start;
+
+	printf("bench=%s entries=%u dist=none threads=1 ops=%u remaining=%u ops_per_sec=%.0f duration_ns=%llu\n",
+		bench, entries, entries, cache_count(cache), entries / (nsec / 1e9), nsec);
+	fflush(stdout);
+
+}
+
+/**
+ * Memory taken by an entry, malloc overhead included
+ */
+static unsigned long bench_entry_bytes(void) {
+
+	void *probe;
+	unsigned long bytes;
+
+	if (bench_file != NULL)
+		return sizeof(struct cache_shm_node);
+
+	probe = malloc(sizeof(struct node));
+	if (probe == NULL)
+		return 0;
+
+	bytes = malloc_usable_size(probe) + sizeof(size_t);
+	free(probe);
+
+	return bytes;
+
+}
+
+/**
+ * Draws the names looked up by each thread
+ */
+static void bench_draw(struct bench_thread *threads, unsigned int threads_count, enum bench_dist dist, struct bench_zipf *zipf, unsigned long entries, unsigned long offset) {
+
+	unsigned long long state;
+	unsigned long rank;
+	unsigned long idx;
+	unsigned int thread;
+
+	for (thread = 0; thread < threads_count; thread++) {
+
+		state = 0x9e3779b97f4a7c15ULL * (thread + 1);
+
+		for (idx = 0; idx < threads[thread].count; idx++) {
+			if (dist == BENCH_ZIPF)
+				rank = bench_scatter(bench_zipf_next(zipf, &state), entries);
+			else
+				rank = bench_random(&state) % entries;
+			bench_name(threads[thread].names[idx], rank + offset);
+		}
+
+	}
+
+}
+
+/**
+ * Runs all the benchmarks on a cache of the given size
+ */
+static void bench_size(unsigned long entries, unsigned int threads_count, unsigned int shards, unsigned long ops, double theta) {
+
+	struct bench_thread *threads;
+	struct bench_zipf zipf;
+	struct cache *cache;
+	unsigned long count;
+	unsigned long idx;
+	unsigned int thread;
+	char extra[64];
+	int dist;
+
+	if (bench_file != NULL) {
+		unlink(bench_file);
+		cache = cache_new_shared(bench_file, entries * sizeof(struct cache_shm_node) / (1024 * 1024) + 2, shards);
+	} else {
+		cache = cache_new(shards);
+	}
+
+	threads = calloc(threads_count, sizeof(struct bench_thread));
+	count = (entries > ops) ? entries : ops;
+
+	if (cache == NULL || threads == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	for (thread = 0; thread < threads_count; thread++) {
+		threads[thread].idx = thread;
+		threads[thread].shards = shards;
+		threads[thread].cache = cache;
+		threads[thread].names = malloc(BENCH_NAME_LEN * (count / threads_count + 1));
+		if (threads[thread].names == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+	}
+
+	/*
+	 * Insert the entries in a random order, each thread its share
+	 */
+	for (thread = 0; thread < threads_count; thread++) {
+		threads[thread].count = 0;
+		threads[thread].op = bench_op_insert;
+	}
+
+	for (idx = 0; idx < entries; idx++) {
+		thread = idx % threads_count;
+		bench_name(threads[thread].names[threads[thread].count++], bench_scatter(idx, entries));
+	}
+
+	snprintf(extra, sizeof(extra), " bytes_per_entry=%lu", bench_entry_bytes());
+	bench_run("insert", "uniform", threads, threads_count, extra);
+
+	bench_zipf_init(&zipf, entries, theta);
+
+	for (dist = BENCH_UNIFORM; dist <= BENCH_ZIPF; dist++) {
+
+		for (thread = 0; thread < threads_count; thread++) {
+			threads[thread].count = ops / threads_count;
+			threads[thread].op = bench_op_search;
+		}
+
+		bench_draw(threads, threads_count, dist, &zipf, entries, 0);
+		bench_run("search_hit", bench_dist_names[dist], threads, threads_count, "");
+
+		/* Names past the last entry are never cached */
+		bench_draw(threads, threads_count, dist, &zipf, entries, entries);
+		bench_run("search_miss", bench_dist_names[dist], threads, threads_count, "");
+
+	}
+
+	bench_run_once("expiry", cache, cache_prune, (BENCH_EXPIRES_EARLY + BENCH_EXPIRES_LATE) / 2);
+	bench_run_once("tidyup", cache, cache_tidyup, BENCH_NOW);
+
+	for (thread = 0; thread < threads_count; thread++)
+		free(threads[thread].names);
+
+	free(threads);
+	cache_destroy(cache);
+
+	if (bench_file != NULL)
+		unlink(bench_file);
+
+}
+
+/**
+ * Parses a comma separated list of numbers
+ * Returns the number of items, 0 if the list is not valid
+ */
+static unsigned int bench_parse_list(char *list, unsigned long *items) {
+
+	unsigned int count = 0;
+	char *end;
+
+	while (*list && count < BENCH_LIST_MAX) {
+		items[count] = strtoul(list, &end, 10);
+		if (end == list || items[count] == 0)
+			return 0;
+		count++;
+		list = (*end == ',') ? end + 1 : end;
+		if (*end != ',' && *end != 0)
+			return 0;
+	}
+
+	return count;
+
+}
+
+static void bench_usage(char *program) {
+
+	fprintf(stderr, "usage: %s [-n entries,...] [-t threads,...] [-o ops] [-s shards] [-z theta] [-f file]\n", program);
+	fprintf(stderr, "\t-n\tcache sizes, default 10000,100000,1000000\n");
+	fprintf(stderr, "\t-t\tthread counts, default 1 and the number of CPUs\n");
+	fprintf(stderr, "\t-o\tlookups of each search benchmark, default 400000\n");
+	fprintf(stderr, "\t-s\tcache shards, default 1\n");
+	fprintf(stderr, "\t-z\texponent of the Zipfian distribution, default 0.99\n");
+	fprintf(stderr, "\t-f\tmeasure the shared cache, kept in this file\n");
+
+}
+
+int main(int argc, char *argv[]) {
+
+	unsigned long sizes[BENCH_LIST_MAX] = { 10000, 100000, 1000000 };
+	unsigned long threads[BENCH_LIST_MAX] = { 1 };
+	unsigned int sizes_count = 3;
+	unsigned int threads_count = 1;
+	unsigned long ops = 400000;
+	unsigned int shards = 1;
+	double theta = 0.99;
+	unsigned int size;
+	unsigned int thread;
+	long cpus;
+	int opt;
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus > 1)
+		threads[threads_count++] = cpus;
+
+	while ((opt = getopt(argc, argv, "n:t:o:s:z:f:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			sizes_count = bench_parse_list(optarg, sizes);
+			break;
+		case 't':
+			threads_count = bench_parse_list(optarg, threads);
+			break;
+		case 'o':
+			ops = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			shards = atoi(optarg);
+			break;
+		case 'z':
+			theta = atof(optarg);
+			break;
+		case 'f':
+			bench_file = optarg;
+			break;
+		default:
+			bench_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (sizes_count == 0 || threads_count == 0 || ops == 0 || shards == 0 || theta <= 0 || theta == 1.0) {
+		bench_usage(argv[0]);
+		return 1;
+	}
+
+	/* A typical answer, only its length matters */
+	memset(&bench_answer, 0x5a, sizeof(bench_answer));
+
+	for (size = 0; size < sizes_count; size++)
+		for (thread = 0; thread < threads_count; thread++)
+			bench_size(sizes[size], threads[thread], shards, ops, theta);
+
+	return 0;
+
+}
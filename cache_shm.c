@@ -0,0 +1,628 @@
+/*
+  **
+  ** cache_shm.c
+  **
+  ** The cache trees kept in a file mapped by every dproxy process using
+  ** it, so they share one cache which also outlives them. The trees are
+  ** those of btree.c, with nodes linking each other by offset instead of
+  ** pointer. Nodes are all the same size: freed ones go to a list of the
+  ** shard, the others are carved from the end of the segment.
+  **
+  ** Who is using the file is known by record locks: while opening it a
+  ** process holds byte 0 exclusively, then byte 1 shared until it leaves.
+  ** Whoever gets byte 1 exclusively is alone and may format the file.
+  **
+  ** The caller holds the lock of the shard around every call but
+  ** cache_shm_open() and cache_shm_close().
+  **
+*/
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "dproxy.h"
+#include "cache_shm.h"
+
+#define NODE(shm, off) ((struct cache_shm_node *)((shm)->base + (off)))
+
+/*
+ * Nodes start on the first cache line after the header
+ */
+#define CACHE_SHM_NODES ((sizeof(struct cache_shm_header) + 63) & ~(uint64_t)63)
+
+static int _compare(struct payload *payload, char *host, unsigned short int type) {
+
+	int case_compare;
+
+	case_compare = strncmp(host, payload->host, DNS_NAME_SIZE);
+
+	if (case_compare > 0)
+		return 1;
+	else if (case_compare < 0)
+		return -1;
+
+	if (type > payload->type)
+		return 1;
+	else if (type < payload->type)
+		return -1;
+
+	return 0;
+
+}
+
+static int _range_lock(int fd, int cmd, short type, off_t start) {
+
+	struct flock fl;
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = start;
+	fl.l_len = 1;
+
+	return fcntl(fd, cmd, &fl);
+
+}
+
+static void _init_mutex(pthread_mutex_t *mutex) {
+
+	pthread_mutexattr_t attr;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+}
+
+static int _valid(struct cache_shm_header *header, uint64_t size) {
+
+	return size >= CACHE_SHM_NODES &&
+		memcmp(header->magic, CACHE_SHM_MAGIC, sizeof(header->magic)) == 0 &&
+		header->version == CACHE_SHM_VERSION &&
+		header->header_size == sizeof(struct cache_shm_header) &&
+		header->node_size == sizeof(struct cache_shm_node) &&
+		header->size == size &&
+		header->shards_count > 0 && header->shards_count <= CACHE_SHM_MAX_SHARDS;
+
+}
+
+static void _format(struct cache_shm_header *header, uint64_t size, unsigned int shards_count) {
+
+	unsigned int idx;
+
+	memset(header, 0, CACHE_SHM_NODES);
+	header->version = CACHE_SHM_VERSION;
+	header->header_size = sizeof(struct cache_shm_header);
+	header->node_size = sizeof(struct cache_shm_node);
+	header->shards_count = shards_count;
+	header->size = size;
+	header->created = time(NULL);
+	header->used = CACHE_SHM_NODES;
+
+	for (idx = 0; idx < CACHE_SHM_MAX_SHARDS; idx++)
+		_init_mutex(&header->shards[idx].mutex);
+
+	memcpy(header->magic, CACHE_SHM_MAGIC, sizeof(header->magic));
+
+}
+
+/**
+ * Maps the cache of path, size_mb megabytes large, creating it if
+ * needed. A cache in use by other processes is taken as it is, with
+ * its size and shards. One left by processes gone is kept as well,
+ * grown if asked for more space.
+ * Returns NULL on failure
+ */
+struct cache_shm *cache_shm_open(char *path, unsigned int size_mb, unsigned int shards_count) {
+
+	struct cache_shm *shm;
+	struct cache_shm_header header;
+	struct stat st;
+	uint64_t size;
+	unsigned int idx;
+	int alone;
+	int format = 0;
+
+	if (size_mb == 0)
+		size_mb = 1;
+	if (shards_count == 0)
+		shards_count = 1;
+	if (shards_count > CACHE_SHM_MAX_SHARDS)
+		shards_count = CACHE_SHM_MAX_SHARDS;
+
+	size = (uint64_t)size_mb * 1024 * 1024;
+
+	shm = malloc(sizeof(struct cache_shm));
+	if (shm == NULL)
+		return NULL;
+
+	shm->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (shm->fd < 0) {
+		debug_perror("Could not open the shared cache");
+		free(shm);
+		return NULL;
+	}
+
+	if (_range_lock(shm->fd, F_SETLKW, F_WRLCK, 0) < 0 || fstat(shm->fd, &st) < 0) {
+		debug_perror("Could not lock the shared cache");
+		goto failed;
+	}
+
+	alone = (_range_lock(shm->fd, F_SETLK, F_WRLCK, 1) == 0);
+
+	memset(&header, 0, sizeof(header));
+	if (pread(shm->fd, &header, sizeof(header), 0) != sizeof(header) || !_valid(&header, st.st_size)) {
+		if (!alone) {
+			log_error("The shared cache %s is in use with another layout\n", path);
+			goto failed;
+		}
+		format = 1;
+	} else if (!alone || header.size >= size) {
+		size = st.st_size;
+	}
+
+	if (st.st_size != size && ftruncate(shm->fd, size) < 0) {
+		debug_perror("Could not size the shared cache");
+		goto failed;
+	}
+
+	shm->size = size;
+	shm->base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, shm->fd, 0);
+	if (shm->base == MAP_FAILED) {
+		debug_perror("Could not map the shared cache");
+		goto failed;
+	}
+
+	shm->header = (struct cache_shm_header *)shm->base;
+
+	if (format) {
+		_format(shm->header, size, shards_count);
+	} else if (alone) {
+		/*
+		 * Nobody can hold the locks, but a process killed with the
+		 * machine may have left them taken
+		 */
+		for (idx = 0; idx < CACHE_SHM_MAX_SHARDS; idx++)
+			_init_mutex(&shm->header->shards[idx].mutex);
+		shm->header->size = size;
+	}
+
+	/* Byte 1 tells the others this process uses the cache */
+	_range_lock(shm->fd, F_SETLK, F_RDLCK, 1);
+	_range_lock(shm->fd, F_SETLK, F_UNLCK, 0);
+
+	log_info("Shared cache %s of %lu MB, %u shards, %s\n", path, (unsigned long)(size >> 20), shm->header->shards_count,
+		format ? "created" : (alone ? "left by a previous run" : "in use by other processes"));
+
+	return shm;
+
+failed:
+	close(shm->fd);
+	free(shm);
+	return NULL;
+
+}
+
+/**
+ * Unmaps the cache, which stays in its file for the others
+ */
+void cache_shm_close(struct cache_shm *shm) {
+
+	if (shm == NULL)
+		return;
+
+	munmap(shm->base, shm->size);
+	/* Closing the file drops the record locks */
+	close(shm->fd);
+	free(shm);
+
+}
+
+/**
+ * Takes the lock of a shard. If its last owner died meanwhile the tree
+ * may be half changed: it is dropped, and the nodes are lost until the
+ * file is formatted again.
+ */
+void cache_shm_lock(struct cache_shm *shm, unsigned int idx) {
+
+	struct cache_shm_shard *shard = &shm->header->shards[idx];
+
+	if (pthread_mutex_lock(&shard->mutex) == EOWNERDEAD) {
+		log_error("A process died changing the shared cache, dropping %u entries\n", shard->count);
+		shard->lost += shard->count;
+		shard->root = 0;
+		shard->free = 0;
+		shard->count = 0;
+		pthread_mutex_consistent(&shard->mutex);
+	}
+
+}
+
+void cache_shm_unlock(struct cache_shm *shm, unsigned int idx) {
+
+	pthread_mutex_unlock(&shm->header->shards[idx].mutex);
+
+}
+
+/**
+ * Takes a node from the free list of the shard, or a new one
+ * Returns 0 if the segment is full
+ */
+static uint64_t _alloc(struct cache_shm *shm, struct cache_shm_shard *shard) {
+
+	uint64_t off = shard->free;
+
+	if (off != 0) {
+		shard->free = NODE(shm, off)->right;
+		return off;
+	}
+
+	/* Don't go on moving the end once past it */
+	if (shm->header->used + sizeof(struct cache_shm_node) > shm->size)
+		return 0;
+
+	off = __sync_fetch_and_add(&shm->header->used, sizeof(struct cache_shm_node));
+	if (off + sizeof(struct cache_shm_node) > shm->size)
+		return 0;
+
+	return off;
+
+}
+
+static void _free(struct cache_shm *shm, struct cache_shm_shard *shard, uint64_t off) {
+
+	NODE(shm, off)->right = shard->free;
+	shard->free = off;
+
+}
+
+static uint64_t _search(struct cache_shm *shm, uint64_t off, char *host, unsigned short int type) {
+
+	int compare;
+
+	while (off != 0) {
+
+		compare = _compare(&NODE(shm, off)->payload, host, type);
+
+		if (compare == 0)
+			return off;
+
+		off = (compare > 0) ? NODE(shm, off)->right : NODE(shm, off)->left;
+
+	}
+
+	return 0;
+
+}
+
+/**
+ * Copies the answer of host and type, if it doesn't expire before
+ * expires
+ * Returns 1 if found
+ */
+int cache_shm_search(struct cache_shm *shm, unsigned int idx, char *host, unsigned short int type, unsigned int expires, void *buffer, unsigned short int *buf_len) {
+
+	struct cache_shm_node *node;
+	uint64_t off;
+
+	off = _search(shm, shm->header->shards[idx].root, host, type);
+	if (off == 0)
+		return 0;
+
+	node = NODE(shm, off);
+	if (expires > node->payload.expires)
+		return 0;
+
+	memcpy(buffer, &node->payload.buffer, node->payload.buf_len);
+	*buf_len = node->payload.buf_len;
+
+	return 1;
+
+}
+
+/**
+ * Copies the entry of host and type, expired or not
+ * Returns 1 if found
+ */
+int cache_shm_get(struct cache_shm *shm, unsigned int idx, char *host, unsigned short int type, struct payload *payload) {
+
+	uint64_t off;
+
+	off = _search(shm, shm->header->shards[idx].root, host, type);
+	if (off == 0)
+		return 0;
+
+	memcpy(payload, &NODE(shm, off)->payload, sizeof(struct payload));
+
+	return 1;
+
+}
+
+/**
+ * Adds an entry, or updates the one with the same host and type. When
+ * the segment is full the expired entries of the shard make room.
+ * Returns 1 if an entry was added
+ */
+int cache_shm_insert(struct cache_shm *shm, unsigned int idx, char *host, unsigned short int type, unsigned int expires, void *buffer, unsigned short int buf_len) {
+
+	struct cache_shm_shard *shard = &shm->header->shards[idx];
+	struct cache_shm_node *node;
+	uint64_t *link;
+	uint64_t off;
+	int compare;
+
+	link = &shard->root;
+
+	while (*link != 0) {
+
+		node = NODE(shm, *link);
+		compare = _compare(&node->payload, host, type);
+
+		if (compare > 0) {
+			link = &node->right;
+		} else if (compare < 0) {
+			link = &node->left;
+		} else {
+			memcpy(&node->payload.buffer, buffer, buf_len);
+			node->payload.buf_len = buf_len;
+			node->payload.expires = expires;
+			return 0;
+		}
+
+	}
+
+	off = _alloc(shm, shard);
+	if (off == 0 && shard->full != time(NULL)) {
+		shard->full = time(NULL);
+		if (cache_shm_prune(shm, idx, shard->full) > 0)
+			return cache_shm_insert(shm, idx, host, type, expires, buffer, buf_len);
+	}
+
+	if (off == 0) {
+		debug("The shared cache is full, %s not cached\n", host);
+		return 0;
+	}
+
+	/* Filled before being linked, the others can't see it half done */
+	node = NODE(shm, off);
+	strncpy(node->payload.host, host, DNS_NAME_SIZE - 1);
+	node->payload.host[DNS_NAME_SIZE - 1] = 0;
+	node->payload.type = type;
+	memcpy(&node->payload.buffer, buffer, buf_len);
+	node->payload.buf_len = buf_len;
+	node->payload.expires = expires;
+	node->left = 0;
+	node->right = 0;
+
+	*link = off;
+	shard->count++;
+
+	return 1;
+
+}
+
+/**
+ * Removes the entry of host and type
+ * Returns 1 if there was one
+ */
+int cache_shm_delete(struct cache_shm *shm, unsigned int idx, char *host, unsigned short int type) {
+
+	struct cache_shm_shard *shard = &shm->header->shards[idx];
+	struct cache_shm_node *node;
+	uint64_t *link = &shard->root;
+	uint64_t *minimum;
+	uint64_t off;
+	int compare;
+
+	while (*link != 0) {
+
+		node = NODE(shm, *link);
+		compare = _compare(&node->payload, host, type);
+
+		if (compare > 0) {
+			link = &node->right;
+			continue;
+		} else if (compare < 0) {
+			link = &node->left;
+			continue;
+		}
+
+		off = *link;
+
+		if (node->left == 0) {
+			*link = node->right;
+		} else if (node->right == 0) {
+			*link = node->left;
+		} else {
+			/*
+			 * Two children: the smallest node on the right takes
+			 * the place of this one
+			 */
+			minimum = &node->right;
+			while (NODE(shm, *minimum)->left != 0)
+				minimum = &NODE(shm, *minimum)->left;
+			off = *minimum;
+			memcpy(&node->payload, &NODE(shm, off)->payload, sizeof(struct payload));
+			*minimum = NODE(shm, off)->right;
+		}
+
+		_free(shm, shard, off);
+		shard->count--;
+
+		return 1;
+
+	}
+
+	return 0;
+
+}
+
+/**
+ * Turns the tree in a list sorted by the right links, by rotations
+ * Returns the number of nodes
+ */
+static unsigned int _tree_to_vine(struct cache_shm *shm, uint64_t *root) {
+
+	struct cache_shm_node *node;
+	uint64_t *link = root;
+	uint64_t left;
+	unsigned int count = 0;
+
+	while (*link != 0) {
+
+		node = NODE(shm, *link);
+
+		if (node->left == 0) {
+			count++;
+			link = &node->right;
+			continue;
+		}
+
+		left = node->left;
+		node->left = NODE(shm, left)->right;
+		NODE(shm, left)->right = *link;
+		*link = left;
+
+	}
+
+	return count;
+
+}
+
+/**
+ * Rotates left every other node of the list, count times
+ */
+static void _compress(struct cache_shm *shm, uint64_t *root, unsigned int count) {
+
+	struct cache_shm_node *child;
+	uint64_t *link = root;
+	uint64_t off;
+	uint64_t next;
+
+	while (count-- > 0) {
+		off = *link;
+		child = NODE(shm, off);
+		next = child->right;
+		*link = next;
+		child->right = NODE(shm, next)->left;
+		NODE(shm, next)->left = off;
+		link = &NODE(shm, next)->right;
+	}
+
+}
+
+/**
+ * Balances a list of size nodes into a complete tree, in place, as the
+ * segment has no room for a copy (Day, Stout and Warren)
+ */
+static void _vine_to_tree(struct cache_shm *shm, uint64_t *root, unsigned int size) {
+
+	unsigned int full = 1;
+
+	while (full * 2 <= size + 1)
+		full *= 2;
+
+	_compress(shm, root, size + 1 - full);
+	size = full - 1;
+
+	while (size > 1) {
+		size /= 2;
+		_compress(shm, root, size);
+	}
+
+}
+
+/**
+ * Balances the tree of a shard, in place
+ */
+void cache_shm_balance(struct cache_shm *shm, unsigned int idx) {
+
+	struct cache_shm_shard *shard = &shm->header->shards[idx];
+
+	_vine_to_tree(shm, &shard->root, _tree_to_vine(shm, &shard->root));
+
+}
+
+/**
+ * Removes the entries expired before timestamp, and balances the tree
+ * Returns the number of entries removed
+ */
+unsigned int cache_shm_prune(struct cache_shm *shm, unsigned int idx, unsigned int timestamp) {
+
+	struct cache_shm_shard *shard = &shm->header->shards[idx];
+	struct cache_shm_node *node;
+	uint64_t *link;
+	uint64_t off;
+	unsigned int removed = 0;
+	unsigned int kept = 0;
+
+	_tree_to_vine(shm, &shard->root);
+
+	for (link = &shard->root; *link != 0; ) {
+		off = *link;
+		node = NODE(shm, off);
+		if (timestamp > node->payload.expires) {
+			*link = node->right;
+			_free(shm, shard, off);
+			removed++;
+		} else {
+			link = &node->right;
+			kept++;
+		}
+	}
+
+	_vine_to_tree(shm, &shard->root, kept);
+	shard->count = kept;
+
+	return removed;
+
+}
+
+/**
+ * Finds the node following host and type, or the first if host is NULL
+ */
+static uint64_t _next(struct cache_shm *shm, uint64_t off, char *host, unsigned short int type) {
+
+	uint64_t next = 0;
+
+	while (off != 0) {
+
+		if (host == NULL || _compare(&NODE(shm, off)->payload, host, type) < 0) {
+			next = off;
+			off = NODE(shm, off)->left;
+		} else {
+			off = NODE(shm, off)->right;
+		}
+
+	}
+
+	return next;
+
+}
+
+/**
+ * Copies up to max entries following host and type, see btnext()
+ * Returns the number of entries copied, done is set if no other follows
+ */
+unsigned int cache_shm_copy(struct cache_shm *shm, unsigned int idx, char *host, unsigned short int type, struct payload *batch, unsigned int max, int *done) {
+
+	struct cache_shm_node *node;
+	uint64_t off;
+	unsigned int count = 0;
+
+	off = _next(shm, shm->header->shards[idx].root, host, type);
+
+	while (off != 0 && count < max) {
+		node = NODE(shm, off);
+		memcpy(&batch[count++], &node->payload, sizeof(struct payload));
+		off = _next(shm, shm->header->shards[idx].root, node->payload.host, node->payload.type);
+	}
+
+	*done = (off == 0);
+
+	return count;
+
+}
@@ -0,0 +1,88 @@
+#include <stdint.h>
+#include <pthread.h>
+#include "btree.h"
+
+#ifndef CACHE_SHM_H
+#define CACHE_SHM_H
+
+#define CACHE_SHM_MAGIC "DPXCACHE"
+#define CACHE_SHM_VERSION 1
+
+/*
+ * Shards a segment holds at most, one per NUMA node
+ */
+#define CACHE_SHM_MAX_SHARDS 64
+
+/*
+ * Nodes link each other by their offset from the start of the segment,
+ * which holds in every process whatever the address the segment is
+ * mapped at. Offset 0 is the header, so it stands for no node.
+ */
+struct cache_shm_node {
+	struct payload payload;
+	uint64_t left;
+	uint64_t right;
+};
+
+struct cache_shm_shard {
+	/*
+	 * Shared between the processes, and robust: a process dying while
+	 * holding it doesn't leave the others waiting
+	 */
+	pthread_mutex_t mutex;
+	uint64_t root;
+	/*
+	 * Nodes freed by the shard, linked by their right offset
+	 */
+	uint64_t free;
+	unsigned int count;
+	/*
+	 * Last time the segment was found full, pruning the tree to make
+	 * room is not tried again within the same second
+	 */
+	unsigned int full;
+	/*
+	 * Entries dropped because a process died changing the tree
+	 */
+	unsigned int lost;
+} __attribute__((aligned(64)));
+
+struct cache_shm_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;
+	uint32_t node_size;
+	uint32_t shards_count;
+	uint64_t size;
+	uint64_t created;
+	/*
+	 * Nodes never used yet are carved from here to the end of the
+	 * segment, without locks
+	 */
+	volatile uint64_t used;
+	struct cache_shm_shard shards[CACHE_SHM_MAX_SHARDS];
+};
+
+/*
+ * A segment as mapped by this process
+ */
+struct cache_shm {
+	int fd;
+	char *base;
+	struct cache_shm_header *header;
+	uint64_t size;
+};
+
+struct cache_shm *cache_shm_open(char *, unsigned int, unsigned int);
+void cache_shm_close(struct cache_shm *);
+void cache_shm_lock(struct cache_shm *, unsigned int);
+void cache_shm_unlock(struct cache_shm *, unsigned int);
+int cache_shm_search(struct cache_shm *, unsigned int, char *, unsigned short int, unsigned int, void *, unsigned short int *);
+int cache_shm_get(struct cache_shm *, unsigned int, char *, unsigned short int, struct payload *);
+int cache_shm_insert(struct cache_shm *, unsigned int, char *, unsigned short int, unsigned int, void *, unsigned short int);
+int cache_shm_delete(struct cache_shm *, unsigned int, char *, unsigned short int);
+void cache_shm_balance(struct cache_shm *, unsigned int);
+unsigned int cache_shm_prune(struct cache_shm *, unsigned int, unsigned int);
+unsigned int cache_shm_copy(struct cache_shm *, unsigned int, char *, unsigned short int, struct payload *, unsigned int, int *);
+
+#endif
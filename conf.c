@@ -52,7 +52,39 @@ struct config config_defaults = {
   PPP_DEV_DEFAULT, 
   DHCP_LEASES_DEFAULT, 
   DEBUG_FILE_DEFAULT, 
-  WORKER_THREADS_COUNT_DEFAULT
+  WORKER_THREADS_COUNT_DEFAULT,
+  WORKER_THREADS_MIN_DEFAULT,
+  WORKER_THREADS_MAX_DEFAULT,
+  WORKER_POOL_LATENCY_DEFAULT,
+  WORKER_CPUS_DEFAULT,
+  RECEIVER_CPUS_DEFAULT,
+  NUMA_AFFINITY_DEFAULT,
+  PACKET_POOL_SIZE_DEFAULT,
+  TCP_LISTEN_DEFAULT,
+  TCP_THREADS_COUNT_DEFAULT,
+  TCP_MAX_CONNECTIONS_DEFAULT,
+  TCP_IDLE_TIMEOUT_DEFAULT,
+  UPSTREAM_SOCKETS_DEFAULT,
+  UPSTREAM_TIMEOUT_DEFAULT,
+  DENY_NXDOMAIN_DEFAULT,
+  DHCP_DOMAIN_DEFAULT,
+  LOCAL_ZONES_DEFAULT,
+  FORWARD_DEFAULT,
+  METRICS_LISTEN_DEFAULT,
+  LOG_LEVEL_DEFAULT,
+  QUERY_LOG_DEFAULT,
+  QUERY_LOG_SIZE_DEFAULT,
+  CONTROL_SOCKET_DEFAULT,
+  LISTEN_PORT_DEFAULT,
+  CACHE_SHARED_DEFAULT,
+  CACHE_SIZE_DEFAULT,
+  RRL_CLIENTS_DEFAULT,
+  RRL_RESPONSES_DEFAULT,
+  RRL_PREFIX_DEFAULT,
+  RRL_SLIP_DEFAULT,
+  RRL_TABLE_SIZE_DEFAULT,
+  ACL_ALLOW_DEFAULT,
+  ACL_DENY_DEFAULT
 };
 
 static void copy_bool(char *, void *);
@@ -61,7 +93,11 @@ static void init_int(char *, void *);
 static void copy_int(char *, void *);
 static void print_int(FILE * fd , void * value ) ;
 static void copy_string(char *, void *);
+static void copy_list(char *, void *);
+static void init_list(char *, void *);
 static void print_string(FILE * fd , void * value ) ;
+static void *conf_field(struct config *, int);
+static void conf_cmdparse_into(struct config *, char *, char *);
 
 config_param config_params[] = {
    { 
@@ -95,7 +131,7 @@ config_param config_params[] = {
   } ,
   { 
      "cache_file" ,
-     "# Location of the cache file\n",
+     "# Location of the cache file, see cache_shared\n",
      &config.cache_file,
      &config_defaults.cache_file,
      copy_string ,
@@ -151,6 +187,340 @@ config_param config_params[] = {
      copy_int ,
      print_int
   } ,
+  { 
+     "worker_threads_min" ,
+     "# The pool of worker threads grows and shrinks with the load,\n"
+     "# starting from worker_threads_count threads. This is the\n"
+     "# minimum number of threads kept running.\n",
+     &config.worker_threads_min ,
+     &config_defaults.worker_threads_min ,
+     init_int,
+     copy_int ,
+     print_int
+  } ,
+  { 
+     "worker_threads_max" ,
+     "# Maximum number of worker threads. Set it equal to\n"
+     "# worker_threads_min for a pool of fixed size.\n",
+     &config.worker_threads_max ,
+     &config_defaults.worker_threads_max ,
+     init_int,
+     copy_int ,
+     print_int
+  } ,
+  { 
+     "worker_pool_latency" ,
+     "# Average time (in microseconds) a query may wait for an idle\n"
+     "# worker thread before the pool is grown\n",
+     &config.worker_pool_latency ,
+     &config_defaults.worker_pool_latency ,
+     init_int,
+     copy_int ,
+     print_int
+  } ,
+  { 
+     "worker_cpus" ,
+     "# Pin the worker threads to these CPUs (e.g. 0-3,8-11).\n"
+     "# Leave empty to let the scheduler move them around.\n",
+     &config.worker_cpus,
+     &config_defaults.worker_cpus,
+     copy_string ,
+     copy_string ,
+     print_string
+  } ,
+  { 
+     "receiver_cpus" ,
+     "# Pin the threads reading the UDP socket to these CPUs.\n"
+     "# Leave empty to let the scheduler move them around.\n",
+     &config.receiver_cpus,
+     &config_defaults.receiver_cpus,
+     copy_string ,
+     copy_string ,
+     print_string
+  } ,
+  { 
+     "numa_affinity" ,
+     "# Run a receiver thread, a worker pool and a cache shard on each\n"
+     "# NUMA node, with threads bound to the CPUs of their node. Queries\n"
+     "# are steered to the node of the CPU that received them.\n"
+     "# Worker pool sizes apply to each node.\n",
+     &config.numa_affinity ,
+     &config_defaults.numa_affinity ,
+     init_int,
+     copy_bool ,
+     print_bool 
+  } ,
+  { 
+     "packet_pool_size" ,
+     "# Number of packet buffers (per NUMA node). Received queries wait\n"
+     "# in these buffers for a worker thread, so this is how far the\n"
+     "# receiver may read ahead of the workers.\n",
+     &config.packet_pool_size ,
+     &config_defaults.packet_pool_size ,
+     init_int,
+     copy_int ,
+     print_int
+  } ,
+  { 
+     "tcp_listen" ,
+     "# Accept DNS queries over TCP on the same port too?\n"
+     "# Queries on a connection may be pipelined, answers are sent\n"
+     "# back as soon as they are ready.\n",
+     &config.tcp_listen ,
+     &config_defaults.tcp_listen ,
+     init_int,
+     copy_bool ,
+     print_bool 
+  } ,
+  { 
+     "tcp_threads_count" ,
+     "# Number of threads resolving the queries received over TCP\n",
+     &config.tcp_threads_count ,
+     &config_defaults.tcp_threads_count ,
+     init_int,
+     copy_int ,
+     print_int
+  } ,
+  { 
+     "tcp_max_connections" ,
+     "# Maximum number of TCP client connections open at the same time.\n"
+     "# Further connections are closed as soon as they are accepted.\n",
+     &config.tcp_max_connections ,
+     &config_defaults.tcp_max_connections ,
+     init_int,
+     copy_int ,
+     print_int
+  } ,
+  { 
+     "tcp_idle_timeout" ,
+     "# Seconds of inactivity after which a TCP client connection\n"
+     "# is closed\n",
+     &config.tcp_idle_timeout ,
+     &config_defaults.tcp_idle_timeout ,
+     init_int,
+     copy_int ,
+     print_int
+  } ,
+  {
+     "upstream_sockets" ,
+     "# Number of sockets, each bound to a random port, shared by all\n"
+     "# the threads to send the queries to the upstream server\n",
+     &config.upstream_sockets ,
+     &config_defaults.upstream_sockets ,
+     init_int,
+     copy_int ,
+     print_int
+  } ,
+  {
+     "upstream_timeout" ,
+     "# Milliseconds to wait for an answer from the upstream server\n",
+     &config.upstream_timeout ,
+     &config_defaults.upstream_timeout ,
+     init_int,
+     copy_int ,
+     print_int
+  } ,
+  {
+     "deny_nxdomain" ,
+     "# Answer the names of the deny file with NXDOMAIN. If off they\n"
+     "# are answered with the unspecified address 0.0.0.0 or ::\n",
+     &config.deny_nxdomain ,
+     &config_defaults.deny_nxdomain ,
+     init_int,
+     copy_bool ,
+     print_bool
+  } ,
+  {
+     "dhcp_domain" ,
+     "# Domain of the hosts in the dhcp leases. Their names are\n"
+     "# answered both bare and in this domain\n",
+     &config.dhcp_domain,
+     &config_defaults.dhcp_domain,
+     copy_string ,
+     copy_string ,
+     print_string
+  } ,
+  {
+     "local_zones" ,
+     "# Answer the reverse lookups of private and special-use\n"
+     "# addresses locally (RFC 6303) instead of forwarding them.\n"
+     "# Names with a forward route of their own are forwarded anyway\n",
+     &config.local_zones ,
+     &config_defaults.local_zones ,
+     init_int,
+     copy_bool ,
+     print_bool
+  } ,
+  {
+     "forward" ,
+     "# Send the queries for a domain to other servers, as\n"
+     "# domain/server[:port]/server[:port]... Repeat the option, or\n"
+     "# separate the routes with commas, to add more domains. The\n"
+     "# domain \".\" replaces the server of /etc/resolv.conf for the rest.\n"
+     "# A route for a reverse zone, such as 168.192.in-addr.arpa, takes\n"
+     "# its names out of local_zones\n",
+     &config.forward,
+     &config_defaults.forward,
+     init_list ,
+     copy_list ,
+     print_string
+  } ,
+  {
+     "metrics_listen" ,
+     "# Serve the statistics in the Prometheus text format on this\n"
+     "# local TCP port, or unix socket if it is a path. Empty to disable\n",
+     &config.metrics_listen,
+     &config_defaults.metrics_listen,
+     copy_string ,
+     copy_string ,
+     print_string
+  } ,
+  {
+     "log_level" ,
+     "# Verbosity of the log: 0 errors only, 1 warnings, 2 informational\n"
+     "# messages, 3 debug, a few lines for every query\n",
+     &config.log_level ,
+     &config_defaults.log_level ,
+     init_int,
+     copy_int ,
+     print_int
+  } ,
+  {
+     "query_log" ,
+     "# Record every query in this file, read it with dproxy-querylog.\n"
+     "# Empty to disable\n",
+     &config.query_log,
+     &config_defaults.query_log,
+     copy_string ,
+     copy_string ,
+     print_string
+  } ,
+  {
+     "query_log_size" ,
+     "# Size of the query log in megabytes. When full, the oldest\n"
+     "# queries are overwritten\n",
+     &config.query_log_size ,
+     &config_defaults.query_log_size ,
+     init_int,
+     copy_int ,
+     print_int
+  } ,
+  {
+     "control_socket" ,
+     "# Accept commands to inspect and flush the cache, to change the\n"
+     "# number of workers or to reload this file, on this unix socket.\n"
+     "# Empty to disable. SIGHUP reloads this file as well\n",
+     &config.control_socket,
+     &config_defaults.control_socket,
+     copy_string ,
+     copy_string ,
+     print_string
+  } ,
+  {
+     "listen_port" ,
+     "# Port to answer the queries on, over UDP and TCP\n",
+     &config.listen_port ,
+     &config_defaults.listen_port ,
+     init_int,
+     copy_int ,
+     print_int
+  } ,
+  {
+     "cache_shared" ,
+     "# Keep the cache in cache_file, mapped in memory, instead of the\n"
+     "# process memory. The dproxy processes using the same file share\n"
+     "# one cache, which also outlives them. Put the file in /dev/shm\n"
+     "# unless it has to survive a reboot\n",
+     &config.cache_shared ,
+     &config_defaults.cache_shared ,
+     init_int,
+     copy_bool ,
+     print_bool
+  } ,
+  {
+     "cache_size" ,
+     "# Size of the shared cache in megabytes. When full, expired\n"
+     "# entries are dropped to make room, and new ones are not cached\n"
+     "# if none is\n",
+     &config.cache_size ,
+     &config_defaults.cache_size ,
+     init_int,
+     copy_int ,
+     print_int
+  } ,
+  {
+     "rrl_clients" ,
+     "# Responses per second over UDP to the clients of a same network,\n"
+     "# see rrl_prefix. 0 is no limit\n",
+     &config.rrl_clients ,
+     &config_defaults.rrl_clients ,
+     init_int,
+     copy_int ,
+     print_int
+  } ,
+  {
+     "rrl_responses" ,
+     "# Responses per second over UDP to a same question from the\n"
+     "# clients of a same network. 0 is no limit\n",
+     &config.rrl_responses ,
+     &config_defaults.rrl_responses ,
+     init_int,
+     copy_int ,
+     print_int
+  } ,
+  {
+     "rrl_prefix" ,
+     "# Length of the prefix grouping the client addresses in networks\n"
+     "# for rate limiting\n",
+     &config.rrl_prefix ,
+     &config_defaults.rrl_prefix ,
+     init_int,
+     copy_int ,
+     print_int
+  } ,
+  {
+     "rrl_slip" ,
+     "# Over the limit, one query in rrl_slip gets an empty truncated\n"
+     "# answer, so a real client asks again over TCP, and the others\n"
+     "# none. 1 truncates all of them, 0 drops all of them\n",
+     &config.rrl_slip ,
+     &config_defaults.rrl_slip ,
+     init_int,
+     copy_int ,
+     print_int
+  } ,
+  {
+     "rrl_table_size" ,
+     "# Networks and questions rate limiting keeps track of at most.\n"
+     "# 0 leaves rate limiting out\n",
+     &config.rrl_table_size ,
+     &config_defaults.rrl_table_size ,
+     init_int,
+     copy_int ,
+     print_int
+  } ,
+  {
+     "acl_allow" ,
+     "# Serve only the clients in these networks, as address/length.\n"
+     "# A path reads the networks from a file, one or more per line.\n"
+     "# Repeat the option, or separate the items with commas, to add\n"
+     "# more. Empty serves everybody but the clients of acl_deny\n",
+     &config.acl_allow,
+     &config_defaults.acl_allow,
+     init_list ,
+     copy_list ,
+     print_string
+  } ,
+  {
+     "acl_deny" ,
+     "# Refuse the clients in these networks, written as in acl_allow.\n"
+     "# The longest network matching a client decides\n",
+     &config.acl_deny,
+     &config_defaults.acl_deny,
+     init_list ,
+     copy_list ,
+     print_string
+  } ,
   /*
    * end-of-array indicator, must be present and everything below
    * this line will be ignored.
@@ -189,8 +559,58 @@ int conf_load (char *conf_file)
   fclose(fp);
   return 0;
 }
+/**************************************************************************
+    Reads conf_file into dst rather than into the running configuration,
+    starting from the defaults, so it can be checked before it is used.
+    Returns 1 if the file can't be read
+*/
+int conf_parse (char *conf_file, struct config *dst)
+{
+  FILE *fp;
+  char line[256], *cmd = NULL, *arg1 = NULL;
+  int i = 0;
+
+  fp = fopen (conf_file, "r");
+  if (!fp)
+	 return 1;
+
+  while( config_params[i].param_name != NULL ) {
+	config_params[i].init( config_params[i].def_value,
+			       conf_field(dst, i) );
+	i++;
+  }
+
+  dst->daemon_mode = config.daemon_mode;
+  dst->dhcp_lease_file[0] = 0;
+  dst->debug_file[0] = 0;
+  strncpy(dst->config_file, conf_file, CONF_PATH_LEN - 1);
+  dst->config_file[CONF_PATH_LEN - 1] = 0;
+
+  while (fgets(line, 256, fp)) {
+	 if (!(line[0]=='#')) {	/* skip lines with comment */
+		line[strcspn(line, "\n")] = 0; /* kill '\n' */
+		cmd = strtok( line, " =" );
+		arg1 = strtok( NULL, " =");
+		conf_cmdparse_into(dst, cmd, arg1);
+	 }
+  }
+  fclose(fp);
+  return 0;
+}
+/**************************************************************************
+    Field of the i-th parameter in another struct config
+*/
+static void *conf_field (struct config *dst, int i)
+{
+  return (char *)dst + ((char *)config_params[i].conf_value - (char *)&config);
+}
 /*****************************************************************************/
 void conf_cmdparse(char *cmd, char *arg1)
+{
+  conf_cmdparse_into(&config, cmd, arg1);
+}
+/*****************************************************************************/
+static void conf_cmdparse_into(struct config *dst, char *cmd, char *arg1)
 {
   int i = 0;
 
@@ -201,7 +621,7 @@ void conf_cmdparse(char *cmd, char *arg1)
 	if(!strncasecmp(cmd, config_params[i].param_name , 
 			CONF_PATH_LEN + 50)) 
 	{
-	    config_params[i].copy( arg1, config_params[i].conf_value );
+	    config_params[i].copy( arg1, conf_field(dst, i) );
 	    return;
 	}
 	i++;
@@ -218,6 +638,8 @@ void conf_cmdparse(char *cmd, char *arg1)
  *   copy_bool   - convert a bool representation to int
  *   copy_int    - convert a string to int
  *   copy_string - just a string copy
+ *   copy_list   - append to a comma separated list, for options which
+ *                 may be repeated
  *   
  * @param str -   A char *, pointing to a string representation of the
  *                value.
@@ -230,6 +652,7 @@ static void copy_bool (char *str, void * val)
 	     !strcasecmp(str,"on")) 
 	{
 		*((int *)val) = 1;
+		return;
 	}
 	*((int *)val) = 0;
 }
@@ -239,9 +662,21 @@ static void copy_int(char *str, void * val) {
 static void copy_string(char *str, void * val) {
 	strncpy((char *)val, str , CONF_PATH_LEN );
 }
+static void copy_list(char *str, void * val) {
+	char *list = (char *)val;
+	unsigned int len = strlen(list);
+	if (len > 0 && len + 1 < CONF_LIST_LEN)
+		list[len++] = ',';
+	strncpy(list + len, str, CONF_LIST_LEN - len - 1);
+	list[CONF_LIST_LEN - 1] = 0;
+}
 static void init_int(char *str, void * val) {
 	*((int *)val) = *((int *)str);
 }
+static void init_list(char *str, void * val) {
+	strncpy((char *)val, str, CONF_LIST_LEN - 1);
+	((char *)val)[CONF_LIST_LEN - 1] = 0;
+}
 /************************************************************************
  * print functions  -
  *
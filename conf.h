@@ -15,6 +15,7 @@
 #include "dproxy.h"
 
 #define CONF_PATH_LEN 256
+#define CONF_LIST_LEN 1024
 /*
     more parameters may be added later.
  */
@@ -30,6 +31,38 @@ struct config {
 	char dhcp_lease_file[CONF_PATH_LEN];
 	char debug_file[CONF_PATH_LEN];
 	int worker_threads_count;
+	int worker_threads_min;
+	int worker_threads_max;
+	int worker_pool_latency;
+	char worker_cpus[CONF_PATH_LEN];
+	char receiver_cpus[CONF_PATH_LEN];
+	int numa_affinity;
+	int packet_pool_size;
+	int tcp_listen;
+	int tcp_threads_count;
+	int tcp_max_connections;
+	int tcp_idle_timeout;
+	int upstream_sockets;
+	int upstream_timeout;
+	int deny_nxdomain;
+	char dhcp_domain[CONF_PATH_LEN];
+	int local_zones;
+	char forward[CONF_LIST_LEN];
+	char metrics_listen[CONF_PATH_LEN];
+	int log_level;
+	char query_log[CONF_PATH_LEN];
+	int query_log_size;
+	char control_socket[CONF_PATH_LEN];
+	int listen_port;
+	int cache_shared;
+	int cache_size;
+	int rrl_clients;
+	int rrl_responses;
+	int rrl_prefix;
+	int rrl_slip;
+	int rrl_table_size;
+	char acl_allow[CONF_LIST_LEN];
+	char acl_deny[CONF_LIST_LEN];
 };
 
 /**
@@ -54,6 +87,7 @@ typedef struct {
 
 extern struct config config;
 int conf_load (char *conf_file);
+int conf_parse (char *conf_file, struct config *dst);
 void conf_defaults (void);
 void conf_cmdparse(char *cmd, char *arg1);
 int conf_bool (char *val);
@@ -0,0 +1,710 @@
+/*
+  **
+  ** control.c
+  **
+  ** Runtime control of a running dproxy through a unix socket. Commands
+  ** are lines of text, each one answered by some lines and a last one
+  ** reading "OK" or "ERROR: reason", so it can be driven by hand with
+  ** socat or by scripts. The cache is walked a batch of entries at a
+  ** time, so flushing, dumping or tidying up a large cache doesn't stop
+  ** the resolvers; a name with a type is searched for directly.
+  **
+  ** The thread also serves SIGUSR1, SIGUSR2 and SIGHUP, whose handlers
+  ** only raise a flag: printing or tidying up the cache, or reloading the
+  ** configuration, from a signal handler could deadlock on the locks the
+  ** interrupted thread holds. Every purge_time seconds it tidies up the
+  ** cache too, so no receiver stops reading its socket for that.
+  **
+*/
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <poll.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include "dproxy.h"
+#include "cache.h"
+#include "conf.h"
+#include "stats.h"
+#include "topk.h"
+#include "control.h"
+#include "reload.h"
+
+volatile sig_atomic_t control_dump_requested = 0;
+volatile sig_atomic_t control_tidy_requested = 0;
+volatile sig_atomic_t control_reload_requested = 0;
+
+static void *control_loop(void *);
+
+/*
+ * Names accepted for the query types, the others by number
+ */
+static struct {
+	unsigned short int type;
+	char *name;
+} control_qtypes[] = {
+	{ 1, "A" }, { 2, "NS" }, { 5, "CNAME" }, { 6, "SOA" }, { 12, "PTR" },
+	{ 15, "MX" }, { 16, "TXT" }, { 28, "AAAA" }, { 33, "SRV" }, { 35, "NAPTR" },
+	{ 43, "DS" }, { 48, "DNSKEY" }, { 64, "SVCB" }, { 65, "HTTPS" }, { 255, "ANY" },
+	{ 0, NULL }
+};
+
+/*
+ * What a walk of the cache looks for, and what it found
+ */
+struct control_walk {
+	FILE *fp;
+	char *name;
+	unsigned int name_len;
+	int suffix;
+	int type;
+	unsigned int now;
+	unsigned int count;
+};
+
+/**
+ * Parses a query type, by name or number
+ * Returns -1 if it is not valid
+ */
+static int control_parse_type(char *arg) {
+
+	char *end;
+	long type;
+	unsigned int idx;
+
+	for (idx = 0; control_qtypes[idx].name != NULL; idx++)
+		if (strcasecmp(control_qtypes[idx].name, arg) == 0)
+			return control_qtypes[idx].type;
+
+	type = strtol(arg, &end, 10);
+	if (*end != 0 || end == arg || type < 0 || type > 65535)
+		return -1;
+
+	return type;
+
+}
+
+static void control_print_type(FILE *fp, unsigned short int type) {
+
+	unsigned int idx;
+
+	for (idx = 0; control_qtypes[idx].name != NULL; idx++)
+		if (control_qtypes[idx].type == type) {
+			fputs(control_qtypes[idx].name, fp);
+			return;
+		}
+
+	fprintf(fp, "%u", type);
+
+}
+
+/**
+ * Checks whether a cached entry is the one a walk looks for: the same
+ * name, or one of its subdomains if walk->suffix is set, ignoring the
+ * case. A NULL name matches everything.
+ */
+static int control_match(struct control_walk *walk, struct payload *payload) {
+
+	unsigned int len;
+
+	if (walk->type >= 0 && payload->type != walk->type)
+		return 0;
+
+	if (walk->name == NULL)
+		return 1;
+
+	len = strlen(payload->host);
+
+	if (len == walk->name_len)
+		return strcasecmp(payload->host, walk->name) == 0;
+
+	return walk->suffix && len > walk->name_len && payload->host[len - walk->name_len - 1] == '.' && strcasecmp(payload->host + len - walk->name_len, walk->name) == 0;
+
+}
+
+static void control_print_entry(FILE *fp, struct payload *payload, unsigned int now) {
+
+	fprintf(fp, "%s ", payload->host);
+	control_print_type(fp, payload->type);
+	fprintf(fp, " %d %u\n", (payload->expires > now) ? (int)(payload->expires - now) : 0, payload->buf_len);
+
+}
+
+static int control_visit_print(struct payload *payload, void *arg) {
+
+	struct control_walk *walk = (struct control_walk *)arg;
+
+	if (control_match(walk, payload)) {
+		control_print_entry(walk->fp, payload, walk->now);
+		walk->count++;
+	}
+
+	return ferror(walk->fp);
+
+}
+
+/*
+ * The walk goes on from the key deleted, so entries can be removed as
+ * they are visited
+ */
+static int control_visit_flush(struct payload *payload, void *arg) {
+
+	struct control_walk *walk = (struct control_walk *)arg;
+
+	if (control_match(walk, payload))
+		walk->count += cache_delete(cache, payload->host, payload->type);
+
+	return 0;
+
+}
+
+/*
+ * Expired entries are deleted as the cursor finds them, so a lock is
+ * never held for more than a batch copy or a single deletion
+ */
+static int control_visit_expired(struct payload *payload, void *arg) {
+
+	struct control_walk *walk = (struct control_walk *)arg;
+
+	if (walk->now > payload->expires)
+		walk->count += cache_delete(cache, payload->host, payload->type);
+
+	return 0;
+
+}
+
+static void control_walk_init(struct control_walk *walk, FILE *fp, char *name, int suffix, int type) {
+
+	memset(walk, 0, sizeof(struct control_walk));
+	walk->fp = fp;
+	walk->name = name;
+	walk->name_len = (name != NULL) ? strlen(name) : 0;
+	walk->suffix = suffix;
+	walk->type = type;
+	walk->now = time(NULL);
+
+	/* A trailing dot makes no difference */
+	if (walk->name_len > 1 && name[walk->name_len - 1] == '.')
+		name[--walk->name_len] = 0;
+
+}
+
+/**
+ * Removes the expired entries, a batch at a time, then balances the
+ * trees small enough to be balanced at once
+ * Returns the number of entries removed
+ */
+static unsigned int control_tidy(void) {
+
+	struct control_walk walk;
+
+	control_walk_init(&walk, NULL, NULL, 0, -1);
+	cache_walk(cache, control_visit_expired, &walk);
+
+	cache_balance(cache, CACHE_BALANCE_MAX);
+
+	return walk.count;
+
+}
+
+/**
+ * Prints the whole cache on fp
+ * Returns the number of entries
+ */
+static unsigned int control_dump(FILE *fp) {
+
+	struct control_walk walk;
+
+	control_walk_init(&walk, fp, NULL, 0, -1);
+	cache_walk(cache, control_visit_print, &walk);
+
+	return walk.count;
+
+}
+
+static void control_stats(FILE *fp, struct control *control) {
+
+	struct stats_thread *total;
+	unsigned int idx;
+
+	total = malloc(sizeof(struct stats_thread));
+	if (total == NULL) {
+		fprintf(fp, "ERROR: out of memory\n");
+		return;
+	}
+
+	stats_read(total);
+
+	fprintf(fp, "queries %lu\n", total->counters[STATS_QUERIES]);
+	fprintf(fp, "queries_udp %lu\n", total->counters[STATS_UDP_QUERIES]);
+	fprintf(fp, "queries_tcp %lu\n", total->counters[STATS_TCP_QUERIES]);
+	fprintf(fp, "cache_hits %lu\n", total->counters[STATS_CACHE_HITS]);
+	fprintf(fp, "cache_misses %lu\n", total->counters[STATS_CACHE_MISSES]);
+	fprintf(fp, "local_answers %lu\n", total->counters[STATS_LOCAL_ANSWERS]);
+	fprintf(fp, "blocked %lu\n", total->counters[STATS_BLOCKED]);
+	fprintf(fp, "dropped %lu\n", total->counters[STATS_DROPPED]);
+	fprintf(fp, "rrl_dropped %lu\n", total->counters[STATS_RRL_DROPPED]);
+	fprintf(fp, "rrl_slipped %lu\n", total->counters[STATS_RRL_SLIPPED]);
+	fprintf(fp, "acl_refused %lu\n", total->counters[STATS_ACL_REFUSED]);
+	fprintf(fp, "upstream_queries %lu\n", total->counters[STATS_UPSTREAM_QUERIES]);
+	fprintf(fp, "upstream_answers %lu\n", total->counters[STATS_UPSTREAM_ANSWERS]);
+	fprintf(fp, "upstream_timeouts %lu\n", total->counters[STATS_UPSTREAM_TIMEOUTS]);
+	fprintf(fp, "upstream_waiting %d\n", upstream_waiting);
+	fprintf(fp, "cache_entries %u\n", cache_count(cache));
+	fprintf(fp, "cache_memory %lu\n", cache_memory(cache));
+	fprintf(fp, "reloads %lu\n", reload_count);
+	fprintf(fp, "reload_failures %lu\n", reload_failures);
+
+	for (idx = 0; idx < control->pools_count; idx++)
+		fprintf(fp, "workers_node%u %u\n", idx, control->pools[idx]->count);
+
+	fprintf(fp, "OK\n");
+
+	free(total);
+
+}
+
+static void control_top(FILE *fp, char *arg) {
+
+	struct topk_entry *items;
+	enum topk_list list = TOPK_NAMES;
+	char address[INET_ADDRSTRLEN];
+	unsigned int count;
+	unsigned int idx;
+
+	if (arg == NULL || strcmp(arg, "names") == 0)
+		list = TOPK_NAMES;
+	else if (strcmp(arg, "clients") == 0)
+		list = TOPK_CLIENTS;
+	else if (strcmp(arg, "nxdomain") == 0)
+		list = TOPK_NXDOMAIN;
+	else {
+		fprintf(fp, "ERROR: top names|clients|nxdomain\n");
+		return;
+	}
+
+	items = malloc(sizeof(struct topk_entry) * TOPK_SIZE);
+	if (items == NULL) {
+		fprintf(fp, "ERROR: out of memory\n");
+		return;
+	}
+
+	count = topk_read(list, items, TOPK_SIZE, stats_now_usec());
+
+	for (idx = 0; idx < count; idx++) {
+		if (list == TOPK_CLIENTS && items[idx].key_len == sizeof(struct in_addr)) {
+			inet_ntop(AF_INET, items[idx].key, address, sizeof(address));
+			fprintf(fp, "%s %lu\n", address, items[idx].count);
+		} else {
+			fprintf(fp, "%.*s %lu\n", (int)items[idx].key_len, items[idx].key, items[idx].count);
+		}
+	}
+
+	fprintf(fp, "OK\n");
+
+	free(items);
+
+}
+
+/**
+ * Changes the number of workers of every node. Pools with min and max
+ * apart keep being resized by their manager afterwards.
+ */
+static void control_threads(FILE *fp, struct control *control, char *arg) {
+
+	unsigned int idx;
+	char *end;
+	long count;
+
+	if (arg != NULL) {
+		count = strtol(arg, &end, 10);
+		if (*end != 0 || end == arg || count <= 0) {
+			fprintf(fp, "ERROR: invalid thread count\n");
+			return;
+		}
+		for (idx = 0; idx < control->pools_count; idx++)
+			worker_pool_resize(control->pools[idx], count);
+	}
+
+	for (idx = 0; idx < control->pools_count; idx++)
+		fprintf(fp, "node%u %u (min %u, max %u)\n", idx, control->pools[idx]->count, control->pools[idx]->min, control->pools[idx]->max);
+
+	fprintf(fp, "OK\n");
+
+}
+
+/**
+ * Runs a command, writing the answer on fp
+ * Returns 1 if the client asked to leave
+ */
+static int control_command(FILE *fp, struct control *control, char *line) {
+
+	struct control_walk walk;
+	char *saveptr;
+	char *cmd;
+	char *arg;
+	char *arg2;
+	FILE *out;
+	unsigned int count;
+	int type = -1;
+	int lookup;
+	int suffix;
+
+	cmd = strtok_r(line, " \t\r\n", &saveptr);
+	if (cmd == NULL)
+		return 0;
+
+	arg = strtok_r(NULL, " \t\r\n", &saveptr);
+	arg2 = (arg != NULL) ? strtok_r(NULL, " \t\r\n", &saveptr) : NULL;
+
+	if (strcmp(cmd, "quit") == 0) {
+
+		return 1;
+
+	} else if (strcmp(cmd, "help") == 0) {
+
+		fprintf(fp, "stats\n"
+			"lookup NAME [TYPE]\n"
+			"flush [NAME [TYPE]]\n"
+			"flush-suffix DOMAIN\n"
+			"dump FILE\n"
+			"tidy\n"
+			"threads [COUNT]\n"
+			"top [names|clients|nxdomain]\n"
+			"reload\n"
+			"upgrade [BINARY]\n"
+			"quit\n"
+			"OK\n");
+
+	} else if (strcmp(cmd, "stats") == 0) {
+
+		control_stats(fp, control);
+
+	} else if (strcmp(cmd, "lookup") == 0 || strcmp(cmd, "flush") == 0 || strcmp(cmd, "flush-suffix") == 0) {
+
+		lookup = (strcmp(cmd, "lookup") == 0);
+		suffix = (strcmp(cmd, "flush-suffix") == 0);
+
+		if (arg == NULL && (lookup || suffix)) {
+			fprintf(fp, "ERROR: %s %s\n", cmd, lookup ? "NAME [TYPE]" : "DOMAIN");
+			return 0;
+		}
+
+		if (arg2 != NULL && (type = control_parse_type(arg2)) < 0) {
+			fprintf(fp, "ERROR: invalid type %s\n", arg2);
+			return 0;
+		}
+
+		control_walk_init(&walk, fp, arg, suffix, type);
+
+		/* With a type the key is known, no need to walk */
+		if (lookup && type >= 0) {
+			cache_lookup(cache, arg, type, control_visit_print, &walk);
+		} else if (lookup) {
+			cache_walk(cache, control_visit_print, &walk);
+		} else if (arg != NULL && !suffix && type >= 0) {
+			walk.count = cache_delete(cache, arg, type);
+			log_info("Flushed %u cache entries of %s\n", walk.count, arg);
+		} else {
+			cache_walk(cache, control_visit_flush, &walk);
+			log_info("Flushed %u cache entries of %s\n", walk.count, (arg != NULL) ? arg : "all the names");
+		}
+
+		fprintf(fp, "OK %u\n", walk.count);
+
+	} else if (strcmp(cmd, "dump") == 0) {
+
+		if (arg == NULL) {
+			fprintf(fp, "ERROR: dump FILE\n");
+			return 0;
+		}
+
+		out = fopen(arg, "w");
+		if (out == NULL) {
+			fprintf(fp, "ERROR: %s: %s\n", arg, strerror(errno));
+			return 0;
+		}
+
+		fprintf(fp, "OK %u\n", control_dump(out));
+		fclose(out);
+
+	} else if (strcmp(cmd, "tidy") == 0) {
+
+		count = control_tidy();
+		log_info("Pruned %u expired cache entries\n", count);
+		fprintf(fp, "OK %u\n", cache_count(cache));
+
+	} else if (strcmp(cmd, "threads") == 0) {
+
+		control_threads(fp, control, arg);
+
+	} else if (strcmp(cmd, "top") == 0) {
+
+		control_top(fp, arg);
+
+	} else if (strcmp(cmd, "reload") == 0) {
+
+		if (reload_config(config.config_file, control->pools, control->pools_count, fp))
+			fprintf(fp, "ERROR: %s not applied\n", config.config_file);
+		else
+			fprintf(fp, "OK\n");
+
+	} else if (strcmp(cmd, "upgrade") == 0) {
+
+		if (dproxy_upgrade(arg, fp)) {
+			fprintf(fp, "ERROR: still running the old binary\n");
+			return 0;
+		}
+
+		/* The socket on the path is the new process's now */
+		free(control->path);
+		control->path = NULL;
+
+		fprintf(fp, "OK\n");
+
+	} else {
+
+		fprintf(fp, "ERROR: unknown command %s, try help\n", cmd);
+
+	}
+
+	return 0;
+
+}
+
+/**
+ * Serves what the signal handlers asked for, and the periodic tidy up
+ * of the cache
+ */
+static void control_signals(struct control *control) {
+
+	unsigned int count;
+	time_t now;
+
+	if (control_dump_requested) {
+		control_dump_requested = 0;
+		printf("Cached domain list:\n");
+		count = control_dump(stdout);
+		printf("Cached domains count: %u\n", count);
+		fflush(stdout);
+	}
+
+	if (control_tidy_requested) {
+		control_tidy_requested = 0;
+		log_info("Beginning cache tree pruning (%u nodes)\n", cache_count(cache));
+		count = control_tidy();
+		log_info("Pruning complete, %u expired, remaining %u nodes\n", count, cache_count(cache));
+	}
+
+	if (control_reload_requested) {
+		control_reload_requested = 0;
+		reload_config(config.config_file, control->pools, control->pools_count, NULL);
+	}
+
+	now = time(NULL);
+	if (now > control->last_purge + config.purge_time) {
+		log_info("Beginning cache tree tidying up (%u nodes)\n", cache_count(cache));
+		count = control_tidy();
+		log_info("Tidying up complete, %u expired, remaining %u nodes\n", count, cache_count(cache));
+		control->last_purge = now;
+	}
+
+}
+
+/**
+ * Sends what a command wrote in the buffer
+ * Returns 1 if the client is gone
+ */
+static int control_send(int fd, char *buf, size_t len) {
+
+	ssize_t res;
+
+	while (len > 0) {
+		res = send(fd, buf, len, MSG_NOSIGNAL);
+		if (res <= 0)
+			return 1;
+		buf += res;
+		len -= res;
+	}
+
+	return 0;
+
+}
+
+/**
+ * Serves the commands of a client until it leaves, stays silent for
+ * CONTROL_CLIENT_TIMEOUT seconds or dproxy stops
+ */
+static void control_client(struct control *control, int fd) {
+
+	struct pollfd pfd;
+	char line[CONTROL_LINE_LEN];
+	unsigned int len = 0;
+	unsigned int idle = 0;
+	char *eol;
+	char *buf;
+	size_t buf_len;
+	FILE *fp;
+	ssize_t res;
+	int done = 0;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+
+	while (control->run && !done) {
+
+		eol = memchr(line, '\n', len);
+
+		if (eol == NULL) {
+
+			if (len == sizeof(line)) {
+				control_send(fd, "ERROR: line too long\n", 21);
+				return;
+			}
+
+			res = poll(&pfd, 1, CONTROL_POLL_MSEC);
+			control_signals(control);
+
+			if (res == 0 && ++idle * CONTROL_POLL_MSEC >= CONTROL_CLIENT_TIMEOUT * 1000)
+				return;
+			if (res <= 0)
+				continue;
+
+			res = recv(fd, line + len, sizeof(line) - len, 0);
+			if (res <= 0)
+				return;
+
+			len += res;
+			idle = 0;
+			continue;
+
+		}
+
+		*eol = 0;
+
+		fp = open_memstream(&buf, &buf_len);
+		if (fp == NULL)
+			return;
+
+		done = control_command(fp, control, line);
+		fclose(fp);
+
+		if (control_send(fd, buf, buf_len))
+			done = 1;
+
+		free(buf);
+
+		len -= eol + 1 - line;
+		memmove(line, eol + 1, len);
+
+	}
+
+}
+
+static void *control_loop(void *args) {
+
+	struct control *control = (struct control *)args;
+	struct pollfd pfd;
+	int client;
+
+	pfd.fd = control->fd;
+	pfd.events = POLLIN;
+
+	while (control->run) {
+
+		if (control->fd < 0)
+			usleep(CONTROL_POLL_MSEC * 1000);
+		else if (poll(&pfd, 1, CONTROL_POLL_MSEC) > 0 && (client = accept4(control->fd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+			control_client(control, client);
+			close(client);
+		}
+
+		control_signals(control);
+
+	}
+
+	return NULL;
+
+}
+
+/**
+ * Starts the control thread, listening for commands on the unix socket
+ * path unless it is empty. The worker pools are those the thread count
+ * commands apply to.
+ * Returns NULL on failure
+ */
+struct control *control_new(char *path, struct worker_pool **pools, unsigned int pools_count) {
+
+	struct control *control;
+	struct sockaddr_un su;
+
+	control = malloc(sizeof(struct control));
+	if (control == NULL)
+		return NULL;
+
+	memset(control, 0, sizeof(struct control));
+
+	control->fd = -1;
+	control->pools = pools;
+	control->pools_count = pools_count;
+	control->last_purge = time(NULL);
+	control->run = 1;
+
+	if (path[0]) {
+
+		memset(&su, 0, sizeof(su));
+		su.sun_family = AF_UNIX;
+		strncpy(su.sun_path, path, sizeof(su.sun_path) - 1);
+
+		control->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (control->fd >= 0) {
+			/* Left behind by a previous run */
+			unlink(path);
+			if (strlen(path) >= sizeof(su.sun_path) || bind(control->fd, (struct sockaddr *)&su, sizeof(su)) < 0 || listen(control->fd, 4) < 0) {
+				close(control->fd);
+				control->fd = -1;
+			}
+		}
+
+		/* The thread still serves the signals and the tidy up */
+		if (control->fd < 0) {
+			fprintf(stderr, "Could not open the control socket %s: %s\n", path, strerror(errno));
+		} else {
+			/* Commands may empty the cache, keep them to the owner */
+			chmod(path, 0600);
+			control->path = strdup(path);
+		}
+
+	}
+
+	if (pthread_create(&control->tid, NULL, control_loop, control) != 0) {
+		if (control->fd >= 0) {
+			close(control->fd);
+			unlink(path);
+		}
+		free(control->path);
+		free(control);
+		return NULL;
+	}
+
+	return control;
+
+}
+
+void control_destroy(struct control *control) {
+
+	if (control == NULL)
+		return;
+
+	control->run = 0;
+	pthread_join(control->tid, NULL);
+
+	if (control->fd >= 0)
+		close(control->fd);
+	if (control->path != NULL)
+		unlink(control->path);
+
+	free(control->path);
+	free(control);
+
+}
@@ -0,0 +1,45 @@
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include "worker_pool.h"
+
+#ifndef CONTROL_H
+#define CONTROL_H
+
+/*
+ * Seconds a client may stay silent before it is disconnected
+ */
+#define CONTROL_CLIENT_TIMEOUT 30
+
+/*
+ * Milliseconds between two checks of the requests made by signals
+ */
+#define CONTROL_POLL_MSEC 500
+
+#define CONTROL_LINE_LEN 512
+
+struct control {
+	int fd;
+	char *path;
+	struct worker_pool **pools;
+	unsigned int pools_count;
+	/*
+	 * The cache is tidied up every purge_time seconds
+	 */
+	time_t last_purge;
+	pthread_t tid;
+	int run;
+};
+
+/*
+ * Set by the SIGUSR1, SIGUSR2 and SIGHUP handlers, served by the control
+ * thread
+ */
+extern volatile sig_atomic_t control_dump_requested;
+extern volatile sig_atomic_t control_tidy_requested;
+extern volatile sig_atomic_t control_reload_requested;
+
+struct control *control_new(char *, struct worker_pool **, unsigned int);
+void control_destroy(struct control *);
+
+#endif
@@ -0,0 +1,397 @@
+/*
+  **
+  ** deny.c
+  **
+  ** Blocks the names listed in the deny file, together with all their
+  ** subdomains. The list is compiled into an open addressing hash table
+  ** of names, and a query is matched by looking up each of its suffixes,
+  ** one per label, so the cost does not depend on the size of the list.
+  ** Blocked names are answered locally, never forwarded.
+  **
+  ** Each line of the file holds a name, "*.name" to block the subdomains
+  ** only, or an address followed by names as in a hosts file, which is
+  ** the format many published blocklists use.
+  **
+*/
+
+#include <pthread.h>
+#include "dproxy.h"
+#include "deny.h"
+#include "stats.h"
+
+/*
+ * Names found in the hosts file format lists which must not be blocked
+ */
+static char *deny_ignored[] = {
+	"localhost",
+	"localhost.localdomain",
+	"local",
+	"broadcasthost",
+	"ip6-localhost",
+	"ip6-loopback",
+	NULL
+};
+
+static void _table_free(struct deny_table *table) {
+
+	if (table == NULL)
+		return;
+
+	free(table->slots);
+	free(table->pool);
+	free(table);
+
+}
+
+static struct deny_table *_table_new(void) {
+
+	struct deny_table *table;
+
+	table = malloc(sizeof(struct deny_table));
+	if (table == NULL)
+		return NULL;
+
+	memset(table, 0, sizeof(struct deny_table));
+
+	table->mask = 1023;
+	table->slots = calloc(table->mask + 1, sizeof(struct deny_slot));
+	table->pool_size = 4096;
+	table->pool = malloc(table->pool_size);
+
+	if (table->slots == NULL || table->pool == NULL) {
+		_table_free(table);
+		return NULL;
+	}
+
+	/* Offset 0 marks the empty slots */
+	table->pool[0] = 0;
+	table->pool_len = 1;
+
+	return table;
+
+}
+
+static struct deny_slot *_lookup(struct deny_table *table, unsigned int hash, char *name) {
+
+	unsigned int idx;
+	struct deny_slot *slot;
+
+	for (idx = hash & table->mask; ; idx = (idx + 1) & table->mask) {
+		slot = &table->slots[idx];
+		if (slot->name == 0)
+			return slot;
+		if (slot->hash == hash && strcmp(table->pool + slot->name, name) == 0)
+			return slot;
+	}
+
+}
+
+/**
+ * Doubles the number of slots. Returns 1 if out of memory
+ */
+static int _grow(struct deny_table *table) {
+
+	struct deny_slot *slots;
+	struct deny_slot *old;
+	unsigned int old_mask;
+	unsigned int idx;
+	unsigned int pos;
+
+	slots = calloc((table->mask + 1) * 2, sizeof(struct deny_slot));
+	if (slots == NULL)
+		return 1;
+
+	old = table->slots;
+	old_mask = table->mask;
+	table->slots = slots;
+	table->mask = (table->mask + 1) * 2 - 1;
+
+	for (idx = 0; idx <= old_mask; idx++) {
+		if (old[idx].name == 0)
+			continue;
+		for (pos = old[idx].hash & table->mask; slots[pos].name != 0; pos = (pos + 1) & table->mask)
+			;
+		slots[pos] = old[idx];
+	}
+
+	free(old);
+
+	return 0;
+
+}
+
+/**
+ * Adds a name to the table. A name listed both alone and as "*.name"
+ * blocks the name and its subdomains. Returns 1 if out of memory
+ */
+static int _table_add(struct deny_table *table, char *name, int subdomains_only) {
+
+	struct deny_slot *slot;
+	unsigned int hash;
+	unsigned int len;
+	char *pool;
+
+	hash = dns_name_hash(name);
+	slot = _lookup(table, hash, name);
+
+	if (slot->name != 0) {
+		slot->subdomains_only &= subdomains_only;
+		return 0;
+	}
+
+	len = strlen(name) + 1;
+	if (table->pool_len + len > table->pool_size) {
+		pool = realloc(table->pool, table->pool_size * 2);
+		if (pool == NULL)
+			return 1;
+		table->pool = pool;
+		table->pool_size *= 2;
+	}
+
+	memcpy(table->pool + table->pool_len, name, len);
+	slot->hash = hash;
+	slot->name = table->pool_len;
+	slot->subdomains_only = subdomains_only;
+	table->pool_len += len;
+	table->count++;
+
+	/* Keep the table at most half full */
+	if (table->count * 2 > table->mask + 1)
+		return _grow(table);
+
+	return 0;
+
+}
+
+static int _ignored(char *name) {
+
+	char **ptr;
+
+	for (ptr = deny_ignored; *ptr != NULL; ptr++)
+		if (strcmp(*ptr, name) == 0)
+			return 1;
+
+	return 0;
+
+}
+
+/**
+ * Adds the names of a line of the deny file
+ * Returns 1 if out of memory
+ */
+static int _parse_line(struct deny_table *table, char *line) {
+
+	char *token;
+	char *saveptr;
+	char name[DNS_NAME_SIZE];
+	unsigned char addr[16];
+	int subdomains_only;
+
+	if ((token = strchr(line, '#')) != NULL)
+		*token = 0;
+
+	token = strtok_r(line, " \t\r\n", &saveptr);
+
+	/*
+	 * Hosts file format: skip the address
+	 */
+	if (token != NULL && (inet_pton(AF_INET, token, addr) == 1 || inet_pton(AF_INET6, token, addr) == 1))
+		token = strtok_r(NULL, " \t\r\n", &saveptr);
+
+	for (; token != NULL; token = strtok_r(NULL, " \t\r\n", &saveptr)) {
+
+		subdomains_only = (strncmp(token, "*.", 2) == 0);
+		dns_name_lower(name, subdomains_only ? token + 2 : token, sizeof(name));
+
+		if (!dns_name_valid(name) || _ignored(name))
+			continue;
+
+		if (_table_add(table, name, subdomains_only))
+			return 1;
+
+	}
+
+	return 0;
+
+}
+
+/**
+ * Compiles a deny file into a table. A missing file gives an empty one.
+ * Returns NULL if out of memory
+ */
+static struct deny_table *deny_table_load(char *path) {
+
+	struct deny_table *table;
+	FILE *fp;
+	char *line = NULL;
+	size_t line_size = 0;
+	int failed = 0;
+
+	table = _table_new();
+	if (table == NULL)
+		return NULL;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		debug_perror("Could not open the deny file");
+		return table;
+	}
+
+	while (!failed && getline(&line, &line_size, fp) != -1)
+		failed = _parse_line(table, line);
+
+	free(line);
+	fclose(fp);
+
+	if (failed) {
+		_table_free(table);
+		return NULL;
+	}
+
+	return table;
+
+}
+
+static void _changed(void *arg) {
+
+	deny_reload((struct deny *)arg);
+
+}
+
+/**
+ * Loads the deny file and starts watching it for changes. Blocked names
+ * get NXDOMAIN if nxdomain is set, the unspecified address otherwise.
+ */
+struct deny *deny_new(char *path, int nxdomain) {
+
+	struct deny *deny;
+
+	deny = malloc(sizeof(struct deny));
+	if (deny == NULL)
+		return NULL;
+
+	memset(deny, 0, sizeof(struct deny));
+
+	deny->path = strdup(path);
+	deny->nxdomain = nxdomain;
+	pthread_rwlock_init(&deny->lock, NULL);
+
+	if (deny->path == NULL || deny_reload(deny)) {
+		deny_destroy(deny);
+		return NULL;
+	}
+
+	deny->watch = file_watch_new(path, _changed, deny);
+
+	return deny;
+
+}
+
+void deny_destroy(struct deny *deny) {
+
+	if (deny == NULL)
+		return;
+
+	file_watch_destroy(deny->watch);
+	_table_free(deny->table);
+	pthread_rwlock_destroy(&deny->lock);
+	free(deny->path);
+	free(deny);
+
+}
+
+/**
+ * Builds a new table from the file and swaps it with the current one.
+ * Returns 1 on failure, the current table is kept then.
+ */
+int deny_reload(struct deny *deny) {
+
+	struct deny_table *table;
+	struct deny_table *old;
+
+	table = deny_table_load(deny->path);
+	if (table == NULL) {
+		fprintf(stderr, "Could not load the deny file %s\n", deny->path);
+		return 1;
+	}
+
+	pthread_rwlock_wrlock(&deny->lock);
+	old = deny->table;
+	deny->table = table;
+	pthread_rwlock_unlock(&deny->lock);
+
+	_table_free(old);
+
+	log_info("Loaded %d names from %s\n", table->count, deny->path);
+
+	return 0;
+
+}
+
+/**
+ * Checks whether a name, or one of the domains it belongs to, is blocked
+ * Returns 1 if it is
+ */
+int deny_match(struct deny *deny, char *name) {
+
+	struct deny_table *table;
+	struct deny_slot *slot;
+	char lname[DNS_NAME_SIZE];
+	char *suffix;
+	int blocked = 0;
+
+	dns_name_lower(lname, name, sizeof(lname));
+
+	pthread_rwlock_rdlock(&deny->lock);
+
+	table = deny->table;
+
+	if (table->count > 0) {
+		for (suffix = lname; suffix != NULL; suffix = strchr(suffix, '.')) {
+			if (*suffix == '.')
+				suffix++;
+			slot = _lookup(table, dns_name_hash(suffix), suffix);
+			if (slot->name != 0 && (suffix != lname || !slot->subdomains_only)) {
+				blocked = 1;
+				break;
+			}
+		}
+	}
+
+	pthread_rwlock_unlock(&deny->lock);
+
+	return blocked;
+
+}
+
+/**
+ * Answers a query for name, type class IN, if the name is blocked. data
+ * holds the query, data_len bytes long, and receives the answer.
+ * Returns the length of the answer, or 0 if the name is not blocked
+ */
+int deny_answer(struct deny *deny, char *name, unsigned short int type, struct dns_data *data, unsigned int data_len) {
+
+	unsigned int question_len;
+	unsigned int len;
+	unsigned char addr[16];
+
+	question_len = dns_question_len(data, data_len);
+	if (question_len == 0 || !deny_match(deny, name))
+		return 0;
+
+	stats_count(STATS_BLOCKED);
+
+	if (deny->nxdomain)
+		return dns_reply_init(data, question_len, 3);
+
+	len = dns_reply_init(data, question_len, 0);
+
+	memset(addr, 0, sizeof(addr));
+	if (type == DNS_TYPE_A)
+		len = dns_reply_add_rr(data, len, type, DENY_TTL, addr, 4);
+	else if (type == DNS_TYPE_AAAA)
+		len = dns_reply_add_rr(data, len, type, DENY_TTL, addr, 16);
+
+	return len;
+
+}
@@ -0,0 +1,47 @@
+#include <pthread.h>
+#include "dns.h"
+#include "watch.h"
+
+#ifndef DENY_H
+#define DENY_H
+
+/*
+ * TTL of the 0.0.0.0 answers given to blocked names
+ */
+#define DENY_TTL 300
+
+/*
+ * A slot of the open addressing table. The full hash is kept in the slot
+ * so most probes are settled without looking at the name. Offset 0 of
+ * the pool is never a name, it marks the empty slots.
+ */
+struct deny_slot {
+	unsigned int hash;
+	unsigned int name : 31;
+	unsigned int subdomains_only : 1;
+};
+
+struct deny_table {
+	struct deny_slot *slots;
+	unsigned int mask;
+	unsigned int count;
+	char *pool;
+	unsigned int pool_len;
+	unsigned int pool_size;
+};
+
+struct deny {
+	char *path;
+	struct deny_table *table;
+	pthread_rwlock_t lock;
+	struct file_watch *watch;
+	int nxdomain;
+};
+
+struct deny *deny_new(char *, int);
+void deny_destroy(struct deny *);
+int deny_reload(struct deny *);
+int deny_match(struct deny *, char *);
+int deny_answer(struct deny *, char *, unsigned short int, struct dns_data *, unsigned int);
+
+#endif
@@ -0,0 +1,501 @@
+/*
+  **
+  ** dhcp.c
+  **
+  ** Answers the names handed out by the DHCP server, and their PTRs, from
+  ** the ISC dhcpd leases file. dhcpd appends a lease block to the file
+  ** every time a lease changes, so the file is tailed: only the bytes
+  ** appended since the last read are parsed, and a later block for an
+  ** address replaces the earlier one. When dhcpd rewrites the file from
+  ** scratch it is read again from the start, and the leases it no longer
+  ** lists are dropped afterwards, so the names never go missing while it
+  ** is parsed.
+  **
+*/
+
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "dproxy.h"
+#include "dhcp.h"
+
+static inline unsigned int _ip_bucket(struct in_addr ip) {
+
+	return ntohl(ip.s_addr) % DHCP_BUCKETS;
+
+}
+
+/**
+ * Removes the lease of an address, if any. Must be called holding the
+ * write lock
+ */
+static void _lease_remove(struct dhcp_leases *leases, struct in_addr ip) {
+
+	struct dhcp_lease **ptr;
+	struct dhcp_lease *lease = NULL;
+
+	for (ptr = &leases->by_ip[_ip_bucket(ip)]; *ptr != NULL; ptr = &(*ptr)->ip_next) {
+		if ((*ptr)->ip.s_addr == ip.s_addr) {
+			lease = *ptr;
+			*ptr = lease->ip_next;
+			break;
+		}
+	}
+
+	if (lease == NULL)
+		return;
+
+	for (ptr = &leases->by_name[dns_name_hash(lease->name) % DHCP_BUCKETS]; *ptr != NULL; ptr = &(*ptr)->name_next) {
+		if (*ptr == lease) {
+			*ptr = lease->name_next;
+			break;
+		}
+	}
+
+	free(lease);
+	leases->count--;
+
+}
+
+/**
+ * Records the last known state of the lease of an address
+ */
+static void _lease_set(struct dhcp_leases *leases, struct in_addr ip, time_t ends, int active, char *name) {
+
+	struct dhcp_lease *lease = NULL;
+	unsigned int bucket;
+
+	if (active && name[0]) {
+		lease = malloc(sizeof(struct dhcp_lease));
+		if (lease != NULL) {
+			lease->ip = ip;
+			lease->ends = ends;
+			lease->generation = leases->generation;
+			strcpy(lease->name, name);
+		}
+	}
+
+	pthread_rwlock_wrlock(&leases->lock);
+
+	_lease_remove(leases, ip);
+
+	if (lease != NULL) {
+		bucket = _ip_bucket(ip);
+		lease->ip_next = leases->by_ip[bucket];
+		leases->by_ip[bucket] = lease;
+		bucket = dns_name_hash(name) % DHCP_BUCKETS;
+		lease->name_next = leases->by_name[bucket];
+		leases->by_name[bucket] = lease;
+		leases->count++;
+	}
+
+	pthread_rwlock_unlock(&leases->lock);
+
+}
+
+/**
+ * Drops the leases not seen since the file was last rewritten
+ */
+static void _sweep(struct dhcp_leases *leases) {
+
+	struct dhcp_lease *lease;
+	unsigned int idx;
+
+	pthread_rwlock_wrlock(&leases->lock);
+
+	for (idx = 0; idx < DHCP_BUCKETS; idx++) {
+		lease = leases->by_ip[idx];
+		while (lease != NULL) {
+			if (lease->generation != leases->generation) {
+				_lease_remove(leases, lease->ip);
+				lease = leases->by_ip[idx];
+			} else {
+				lease = lease->ip_next;
+			}
+		}
+	}
+
+	pthread_rwlock_unlock(&leases->lock);
+
+}
+
+/**
+ * Parses the time of an "ends" statement: "4 2026/10/15 22:00:00" in
+ * UTC, "epoch 1760565600" or "never"
+ * Returns the time, 0 if it never ends, -1 if it can't be parsed
+ */
+static time_t _parse_time(char *value) {
+
+	struct tm tm;
+	long epoch;
+
+	if (strncmp(value, "never", 5) == 0)
+		return 0;
+
+	if (sscanf(value, "epoch %ld", &epoch) == 1)
+		return epoch;
+
+	memset(&tm, 0, sizeof(tm));
+	if (sscanf(value, "%*d %d/%d/%d %d:%d:%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6)
+		return -1;
+
+	tm.tm_year -= 1900;
+	tm.tm_mon -= 1;
+
+	return timegm(&tm);
+
+}
+
+/**
+ * Parses a block of the file. header is the line opening the block, body
+ * the statements between the braces. Blocks other than leases are
+ * ignored.
+ */
+static void _parse_block(struct dhcp_leases *leases, char *header, char *body) {
+
+	char address[16];
+	char name[DNS_NAME_SIZE];
+	char *statement;
+	char *saveptr;
+	char *ptr;
+	struct in_addr ip;
+	time_t ends = 0;
+	int active = 1;
+
+	if (sscanf(header, " lease %15s", address) != 1 || inet_aton(address, &ip) == 0)
+		return;
+
+	name[0] = 0;
+
+	for (statement = strtok_r(body, ";", &saveptr); statement != NULL; statement = strtok_r(NULL, ";", &saveptr)) {
+
+		while (isspace((unsigned char)*statement))
+			statement++;
+
+		if (strncmp(statement, "ends ", 5) == 0) {
+			ends = _parse_time(statement + 5);
+			if (ends < 0)
+				return;
+		} else if (strncmp(statement, "binding state ", 14) == 0) {
+			active = (strncmp(statement + 14, "active", 6) == 0);
+		} else if (strncmp(statement, "client-hostname \"", 17) == 0) {
+			dns_name_lower(name, statement + 17, sizeof(name));
+			if ((ptr = strchr(name, '"')) != NULL)
+				*ptr = 0;
+		}
+
+	}
+
+	/*
+	 * Only single label names can be answered
+	 */
+	if (name[0] && (strlen(name) >= sizeof(((struct dhcp_lease *)0)->name) || strchr(name, '.') != NULL || !dns_name_valid(name)))
+		name[0] = 0;
+
+	_lease_set(leases, ip, ends, active, name);
+
+}
+
+/**
+ * Parses the complete blocks of buf, len bytes long
+ * Returns the number of bytes consumed
+ */
+static unsigned int _parse_chunk(struct dhcp_leases *leases, char *buf, unsigned int len) {
+
+	unsigned int pos = 0;
+	char *open;
+	char *close;
+	char *header;
+
+	while (pos < len) {
+
+		open = memchr(buf + pos, '{', len - pos);
+		if (open == NULL)
+			break;
+
+		close = memchr(open, '}', len - (open - buf));
+		if (close == NULL)
+			break;
+
+		*open = 0;
+		*close = 0;
+
+		/* The block is opened by the last line before the brace */
+		header = strrchr(buf + pos, '\n');
+		header = (header != NULL) ? header + 1 : buf + pos;
+
+		_parse_block(leases, header, open + 1);
+
+		pos = close - buf + 1;
+
+	}
+
+	return pos;
+
+}
+
+/**
+ * Reads what has been appended to the file since the last call, starting
+ * over if dhcpd has rewritten it
+ * Returns 1 if the file can't be read
+ */
+int dhcp_leases_update(struct dhcp_leases *leases) {
+
+	struct stat st;
+	char buf[4096];
+	char *partial;
+	unsigned int consumed;
+	int rewritten = 0;
+	int numread;
+	int fd;
+
+	fd = open(leases->path, O_RDONLY);
+	if (fd < 0) {
+		debug_perror("Could not open the dhcp leases file");
+		return 1;
+	}
+
+	fstat(fd, &st);
+
+	if (st.st_ino != leases->inode || st.st_size < leases->offset) {
+		leases->inode = st.st_ino;
+		leases->offset = 0;
+		leases->partial_len = 0;
+		leases->generation++;
+		rewritten = 1;
+	}
+
+	lseek(fd, leases->offset, SEEK_SET);
+
+	while ((numread = read(fd, buf, sizeof(buf))) > 0) {
+
+		leases->offset += numread;
+
+		/* One more byte, blocks are parsed as strings */
+		partial = realloc(leases->partial, leases->partial_len + numread + 1);
+		if (partial == NULL)
+			break;
+		leases->partial = partial;
+
+		memcpy(leases->partial + leases->partial_len, buf, numread);
+		leases->partial_len += numread;
+		leases->partial[leases->partial_len] = 0;
+
+		consumed = _parse_chunk(leases, leases->partial, leases->partial_len);
+		memmove(leases->partial, leases->partial + consumed, leases->partial_len - consumed);
+		leases->partial_len -= consumed;
+
+		/* Not a leases file, or a broken one */
+		if (leases->partial_len > DHCP_MAX_PARTIAL)
+			leases->partial_len = 0;
+
+	}
+
+	close(fd);
+
+	if (rewritten)
+		_sweep(leases);
+
+	log_info("%d leases in %s\n", leases->count, leases->path);
+
+	return 0;
+
+}
+
+static void _changed(void *arg) {
+
+	dhcp_leases_update((struct dhcp_leases *)arg);
+
+}
+
+/**
+ * Loads the leases file and starts following it. Names in domain, if not
+ * empty, are answered as well as the bare host names.
+ */
+struct dhcp_leases *dhcp_leases_new(char *path, char *domain) {
+
+	struct dhcp_leases *leases;
+
+	leases = malloc(sizeof(struct dhcp_leases));
+	if (leases == NULL)
+		return NULL;
+
+	memset(leases, 0, sizeof(struct dhcp_leases));
+
+	leases->path = strdup(path);
+	leases->domain = strdup(domain);
+	pthread_rwlock_init(&leases->lock, NULL);
+
+	if (leases->path == NULL || leases->domain == NULL) {
+		dhcp_leases_destroy(leases);
+		return NULL;
+	}
+
+	dns_name_lower(leases->domain, domain, strlen(domain) + 1);
+
+	dhcp_leases_update(leases);
+
+	leases->watch = file_watch_new(path, _changed, leases);
+
+	return leases;
+
+}
+
+void dhcp_leases_destroy(struct dhcp_leases *leases) {
+
+	struct dhcp_lease *lease;
+	struct dhcp_lease *next;
+	unsigned int idx;
+
+	if (leases == NULL)
+		return;
+
+	file_watch_destroy(leases->watch);
+
+	for (idx = 0; idx < DHCP_BUCKETS; idx++) {
+		for (lease = leases->by_ip[idx]; lease != NULL; lease = next) {
+			next = lease->ip_next;
+			free(lease);
+		}
+	}
+
+	pthread_rwlock_destroy(&leases->lock);
+	free(leases->partial);
+	free(leases->domain);
+	free(leases->path);
+	free(leases);
+
+}
+
+static unsigned int _ttl(struct dhcp_lease *lease, time_t now) {
+
+	if (lease->ends == 0 || lease->ends - now > DHCP_MAX_TTL)
+		return DHCP_MAX_TTL;
+
+	return lease->ends - now;
+
+}
+
+/**
+ * Gets the address of a reverse lookup name, d.c.b.a.in-addr.arpa
+ * Returns 1 if name is not one
+ */
+static int _reverse_address(char *name, struct in_addr *ip) {
+
+	char address[BUF_SIZE];
+	unsigned int len;
+	unsigned int dots = 0;
+	unsigned int idx;
+
+	len = strlen(name);
+	if (len <= 13 || len - 13 >= sizeof(address) || strcmp(name + len - 13, ".in-addr.arpa") != 0)
+		return 1;
+
+	memcpy(address, name, len - 13);
+	address[len - 13] = 0;
+
+	for (idx = 0; address[idx]; idx++)
+		if (address[idx] == '.')
+			dots++;
+
+	if (dots != 3 || reverse_domain_name(address) || inet_aton(address, ip) == 0)
+		return 1;
+
+	return 0;
+
+}
+
+/**
+ * Answers a query for name, type class IN, from the active leases. data
+ * holds the query, data_len bytes long, and receives the answer. The
+ * TTL is the time left on the lease, up to DHCP_MAX_TTL.
+ * Returns the length of the answer, or 0 if no lease matches
+ */
+int dhcp_leases_answer(struct dhcp_leases *leases, char *name, unsigned short int type, struct dns_data *data, unsigned int data_len) {
+
+	struct dhcp_lease *lease;
+	struct in_addr ip;
+	char lname[DNS_NAME_SIZE];
+	char encoded[DNS_NAME_SIZE];
+	unsigned int question_len;
+	unsigned int domain_len;
+	unsigned int name_len;
+	unsigned int len = 0;
+	unsigned int res;
+	time_t now;
+
+	if (type != DNS_TYPE_A && type != DNS_TYPE_AAAA && type != DNS_TYPE_PTR)
+		return 0;
+
+	question_len = dns_question_len(data, data_len);
+	if (question_len == 0)
+		return 0;
+
+	dns_name_lower(lname, name, sizeof(lname));
+	now = time(NULL);
+
+	if (type == DNS_TYPE_PTR) {
+
+		if (_reverse_address(lname, &ip))
+			return 0;
+
+		pthread_rwlock_rdlock(&leases->lock);
+
+		for (lease = leases->by_ip[_ip_bucket(ip)]; lease != NULL; lease = lease->ip_next) {
+			if (lease->ip.s_addr != ip.s_addr || (lease->ends != 0 && lease->ends <= now))
+				continue;
+			if (leases->domain[0])
+				snprintf(encoded, sizeof(encoded), "%s.%s", lease->name, leases->domain);
+			else
+				strcpy(encoded, lease->name);
+			name_len = strlen(encoded);
+			encode_domain_name(encoded);
+			len = dns_reply_init(data, question_len, 0);
+			res = dns_reply_add_rr(data, len, type, _ttl(lease, now), encoded, name_len + 2);
+			if (res > 0)
+				len = res;
+			break;
+		}
+
+		pthread_rwlock_unlock(&leases->lock);
+
+		return len;
+
+	}
+
+	/*
+	 * Names in the local domain are looked up by host name
+	 */
+	domain_len = strlen(leases->domain);
+	name_len = strlen(lname);
+	if (domain_len > 0 && name_len > domain_len + 1 && lname[name_len - domain_len - 1] == '.' && strcmp(lname + name_len - domain_len, leases->domain) == 0)
+		lname[name_len - domain_len - 1] = 0;
+
+	if (strchr(lname, '.') != NULL)
+		return 0;
+
+	pthread_rwlock_rdlock(&leases->lock);
+
+	for (lease = leases->by_name[dns_name_hash(lname) % DHCP_BUCKETS]; lease != NULL; lease = lease->name_next) {
+
+		if (strcmp(lease->name, lname) != 0 || (lease->ends != 0 && lease->ends <= now))
+			continue;
+
+		if (len == 0)
+			len = dns_reply_init(data, question_len, 0);
+
+		if (type != DNS_TYPE_A)
+			continue;
+
+		res = dns_reply_add_rr(data, len, type, _ttl(lease, now), &lease->ip, 4);
+		if (res == 0)
+			break;
+		len = res;
+
+	}
+
+	pthread_rwlock_unlock(&leases->lock);
+
+	return len;
+
+}
@@ -0,0 +1,56 @@
+#include <pthread.h>
+#include <sys/types.h>
+#include "dns.h"
+#include "watch.h"
+
+#ifndef DHCP_H
+#define DHCP_H
+
+#define DHCP_BUCKETS 256
+/*
+ * Longest TTL of the answers, given to leases which never end too
+ */
+#define DHCP_MAX_TTL 3600
+/*
+ * Longest incomplete lease block kept between two reads of the file
+ */
+#define DHCP_MAX_PARTIAL 65536
+
+struct dhcp_lease {
+	struct in_addr ip;
+	time_t ends; /* 0 if the lease never ends */
+	char name[64];
+	unsigned int generation;
+	struct dhcp_lease *ip_next;
+	struct dhcp_lease *name_next;
+};
+
+struct dhcp_leases {
+	char *path;
+	char *domain;
+	/*
+	 * Active leases with a host name, by address and by name
+	 */
+	struct dhcp_lease *by_ip[DHCP_BUCKETS];
+	struct dhcp_lease *by_name[DHCP_BUCKETS];
+	unsigned int count;
+	pthread_rwlock_t lock;
+	/*
+	 * Where the last read of the file stopped, the bytes of a lease
+	 * block not completely written yet, and the number of times the
+	 * file has been read from the start
+	 */
+	ino_t inode;
+	off_t offset;
+	unsigned int generation;
+	char *partial;
+	unsigned int partial_len;
+	struct file_watch *watch;
+};
+
+struct dhcp_leases *dhcp_leases_new(char *, char *);
+void dhcp_leases_destroy(struct dhcp_leases *);
+int dhcp_leases_update(struct dhcp_leases *);
+int dhcp_leases_answer(struct dhcp_leases *, char *, unsigned short int, struct dns_data *, unsigned int);
+
+#endif
@@ -130,20 +130,247 @@ int reverse_domain_name(char *name) {
 	
 	res = sscanf(name, "%d.%d.%d.%d", &octet[3], &octet[2], &octet[1], &octet[0]);
 	
+	if (res != 4)
+		return 1;
+	
 	for (idx = 0; idx < 4; idx++) {
 		if (octet[idx] < 0 || octet[idx] > 255)
 			return 1;
 	}
 	
-	if (res == 4) {
-		sprintf(name, "%d.%d.%d.%d", octet[0], octet[1], octet[2], octet[3]);
-		return 0;
-	}
+	sprintf(name, "%d.%d.%d.%d", octet[0], octet[1], octet[2], octet[3]);
 	
-	return 1;
+	return 0;
 		
 }
 
+/**
+ * Splits the flags of a raw DNS header into the fields of the cooked header
+ */
+void dns_cook_header(struct dns_header *hdr, struct dns_cooked_header *chdr) {
+
+	unsigned short flags;
+
+	flags = ntohs(hdr->dns_flags);
+	
+	chdr->message_id = ntohs(hdr->dns_id);
+	chdr->query_bit = flags & 0x01;
+	chdr->opcode = (flags & 0x1e) >> 1;
+	chdr->auth_answer = (flags & 0x20) >> 5;
+	chdr->truncated = (flags & 0x40) >> 6;
+	chdr->recurse_desired = (flags & 0x80) >> 7;
+	chdr->recurse_avail = (flags & 0x100) >> 8;
+	chdr->z_field = (flags & 0xe00) >> 9;
+	chdr->rcode = (flags & 0xf000) >> 12;
+
+}
+
+/**
+ * Computes the length of the question section of a message with a single
+ * question: the encoded name plus type and class.
+ * Returns 0 if there is not exactly one question or it is malformed
+ */
+unsigned int dns_question_len(struct dns_data *data, unsigned int data_len) {
+
+	unsigned int pos = 0;
+	unsigned int max;
+
+	if (ntohs(data->dns_hdr.dns_no_questions) != 1 || data_len <= sizeof(struct dns_header))
+		return 0;
+
+	max = data_len - sizeof(struct dns_header);
+
+	while (pos < max && data->buf[pos] != 0) {
+		/* No compression pointers in a question */
+		if (data->buf[pos] & 0xc0)
+			return 0;
+		pos += (unsigned char)data->buf[pos] + 1;
+	}
+
+	if (pos + 5 > max)
+		return 0;
+
+	return pos + 5;
+
+}
+
+/**
+ * Turns the query in data into an answer with the given response code,
+ * keeping the question and dropping everything after it. The answer is
+ * marked authoritative, since it comes from local data.
+ * Returns the length of the answer so far
+ */
+unsigned int dns_reply_init(struct dns_data *data, unsigned int question_len, unsigned short int rcode) {
+
+	unsigned short int flags;
+
+	flags = ntohs(data->dns_hdr.dns_flags);
+
+	/* Response, same opcode and recursion desired, authoritative, recursion available */
+	flags = 0x8000 | (flags & 0x7900) | 0x0400 | 0x0080 | (rcode & 0x0f);
+
+	data->dns_hdr.dns_flags = htons(flags);
+	data->dns_hdr.dns_no_answers = 0;
+	data->dns_hdr.dns_no_authority = 0;
+	data->dns_hdr.dns_no_additional = 0;
+
+	return sizeof(struct dns_header) + question_len;
+
+}
+
+/**
+ * Writes the fixed part of a resource record, class IN, at offset len of
+ * a message. name is the offset of the owner name within the message.
+ * Returns where the record data goes, or NULL if the record does not fit
+ */
+static unsigned char *_reply_put_rr(struct dns_data *data, unsigned int len, unsigned int name, unsigned short int type, unsigned int ttl, unsigned short int rdata_len) {
+
+	unsigned char *ptr;
+
+	if (len + 12 + rdata_len > sizeof(struct dns_data))
+		return NULL;
+
+	ptr = (unsigned char *)data + len;
+
+	ptr[0] = 0xc0 | (name >> 8);
+	ptr[1] = name & 0xff;
+	ptr[2] = type >> 8;
+	ptr[3] = type & 0xff;
+	ptr[4] = 0;
+	ptr[5] = 1;
+	ptr[6] = ttl >> 24;
+	ptr[7] = (ttl >> 16) & 0xff;
+	ptr[8] = (ttl >> 8) & 0xff;
+	ptr[9] = ttl & 0xff;
+	ptr[10] = rdata_len >> 8;
+	ptr[11] = rdata_len & 0xff;
+
+	return ptr + 12;
+
+}
+
+/**
+ * Appends a resource record for the name of the question to the answer
+ * section of a message of length len. ttl is in seconds, rdata is in
+ * wire format.
+ * Returns the new length, or 0 if the record does not fit
+ */
+unsigned int dns_reply_add_rr(struct dns_data *data, unsigned int len, unsigned short int type, unsigned int ttl, void *rdata, unsigned short int rdata_len) {
+
+	unsigned char *ptr;
+
+	/* The name of the question is right after the header */
+	ptr = _reply_put_rr(data, len, sizeof(struct dns_header), type, ttl, rdata_len);
+	if (ptr == NULL)
+		return 0;
+
+	memcpy(ptr, rdata, rdata_len);
+
+	data->dns_hdr.dns_no_answers = htons(ntohs(data->dns_hdr.dns_no_answers) + 1);
+
+	return len + 12 + rdata_len;
+
+}
+
+/**
+ * Appends the SOA record of a zone served locally, to the answer section
+ * or, for negative answers, to the authority one. zone is the offset of
+ * the zone name within the message. ttl is both the TTL of the record
+ * and the time negative answers may be cached.
+ * Returns the new length, or 0 if the record does not fit
+ */
+unsigned int dns_reply_add_soa(struct dns_data *data, unsigned int len, int authority, unsigned int zone, unsigned int ttl) {
+
+	/* nobody.invalid, the mailbox of the zones nobody owns */
+	static const unsigned char rname[] = "\006nobody\007invalid";
+	/* serial, refresh, retry, expire, minimum */
+	unsigned int timers[5] = { 1, 3600, 1200, 604800, ttl };
+	unsigned char *ptr;
+	unsigned int idx;
+
+	ptr = _reply_put_rr(data, len, zone, DNS_TYPE_SOA, ttl, 2 + sizeof(rname) + 20);
+	if (ptr == NULL)
+		return 0;
+
+	/* The primary server is named after the zone */
+	*ptr++ = 0xc0 | (zone >> 8);
+	*ptr++ = zone & 0xff;
+	memcpy(ptr, rname, sizeof(rname));
+	ptr += sizeof(rname);
+
+	for (idx = 0; idx < 5; idx++) {
+		*ptr++ = timers[idx] >> 24;
+		*ptr++ = (timers[idx] >> 16) & 0xff;
+		*ptr++ = (timers[idx] >> 8) & 0xff;
+		*ptr++ = timers[idx] & 0xff;
+	}
+
+	if (authority)
+		data->dns_hdr.dns_no_authority = htons(ntohs(data->dns_hdr.dns_no_authority) + 1);
+	else
+		data->dns_hdr.dns_no_answers = htons(ntohs(data->dns_hdr.dns_no_answers) + 1);
+
+	return len + 12 + 2 + sizeof(rname) + 20;
+
+}
+
+/**
+ * FNV-1a hash of a name
+ */
+unsigned int dns_name_hash(char *name) {
+
+	unsigned int hash = 2166136261u;
+
+	while (*name) {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619;
+	}
+
+	return hash;
+
+}
+
+/**
+ * Copies a dotted name in lowercase, dropping the trailing dot of a
+ * fully qualified one
+ */
+void dns_name_lower(char *dst, char *src, unsigned int size) {
+
+	unsigned int idx;
+
+	for (idx = 0; idx + 1 < size && src[idx]; idx++)
+		dst[idx] = tolower((unsigned char)src[idx]);
+
+	if (idx > 1 && dst[idx - 1] == '.')
+		idx--;
+
+	dst[idx] = 0;
+
+}
+
+/**
+ * Checks that a dotted name can be encoded: labels 1 to 63 characters
+ * long and at most 253 characters overall
+ */
+int dns_name_valid(char *name) {
+
+	unsigned int len = 0;
+	unsigned int label = 0;
+
+	for (; *name; name++, len++) {
+		if (*name == '.') {
+			if (label == 0)
+				return 0;
+			label = 0;
+		} else if (++label > 63) {
+			return 0;
+		}
+	}
+
+	return len > 0 && len <= 253 && label > 0;
+
+}
+
 int extract_request(char *buffer, char *host_name, unsigned short int *type, unsigned short int *class) {
 	
 	int res;
@@ -19,6 +19,16 @@
 #define BUF_SIZE 536
 #define DNS_NAME_SIZE 256
 
+/*
+ * Longest message over TCP, whose length prefix is two bytes
+ */
+#define DNS_TCP_SIZE 65535
+
+#define DNS_TYPE_A 1
+#define DNS_TYPE_SOA 6
+#define DNS_TYPE_PTR 12
+#define DNS_TYPE_AAAA 28
+
 struct dns_header {
 	short int dns_id;
 	short int dns_flags;
@@ -89,6 +99,14 @@ int reverse_domain_name(char name[BUF_SIZE]);
 void print_query (void *ptr);
 void print_resource (void *ptr);
 int extract_request(char *, char *, unsigned short int *, unsigned short int *);
+void dns_cook_header(struct dns_header *, struct dns_cooked_header *);
+unsigned int dns_question_len(struct dns_data *, unsigned int);
+unsigned int dns_reply_init(struct dns_data *, unsigned int, unsigned short int);
+unsigned int dns_reply_add_rr(struct dns_data *, unsigned int, unsigned short int, unsigned int, void *, unsigned short int);
+unsigned int dns_reply_add_soa(struct dns_data *, unsigned int, int, unsigned int, unsigned int);
+unsigned int dns_name_hash(char *);
+void dns_name_lower(char *, char *, unsigned int);
+int dns_name_valid(char *);
 
 #endif
 /* EOF */
@@ -19,8 +19,10 @@ struct dns_server *dns_server_new(char *address, unsigned short int port) {
 	if (srv == NULL)
 		return NULL;
 	
-	if (inet_pton(AF_INET, address, (void *)&srv->inet_address.sin_addr) == 0)
+	if (inet_pton(AF_INET, address, (void *)&srv->inet_address.sin_addr) != 1) {
+		free(srv);
 		return NULL;
+	}
 		
 	srv->inet_address.sin_port = htons(port);
 	srv->inet_address.sin_family = AF_INET;
@@ -37,24 +39,3 @@ void dns_server_destroy(struct dns_server *srv) {
 	free(srv);
 	
 }
-
-int dns_server_resolve(struct dns_server *srv, int socket, struct dns_data *data, unsigned int data_len) {
-	
-	int res;
-	unsigned int salen = sizeof(srv->inet_address);
-	
-	res = sendto(socket, data, data_len, 0, (struct sockaddr *)&srv->inet_address, salen);
-	if (res == 0) {
-		fprintf(stderr, "Could not send data\n");
-		return 0;
-	}
-			
-	res = recvfrom(socket, data, sizeof(struct dns_data), 0, (struct sockaddr *)&srv->inet_address, &salen);
-	if (res == -1) {
-		fprintf(stderr, "Could not receive data back. Timeout?\n");
-		return 0;
-	}
-	
-	return res;
-	
-}
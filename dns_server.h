@@ -14,6 +14,5 @@ struct dns_server {
 
 struct dns_server *dns_server_new(char *, unsigned short int);
 void dns_server_destroy(struct dns_server *);
-int dns_server_resolve(struct dns_server *, int, struct dns_data *, unsigned int);
 
 #endif
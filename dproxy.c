@@ -18,57 +18,210 @@
   **
 */
 
+#define _GNU_SOURCE
 #include <time.h>
 #include <pthread.h>
+#include <limits.h>
 #include "dproxy.h"
 #include "cache.h"
 #include "conf.h"
 #include "dns.h"
-
-#define MIN_SLEEP_TIMEOUT 10000;
-#define MAX_SLEEP_TIMEOUT 1000000
+#include "tcp_server.h"
+#include "worker_pool.h"
+#include "numa.h"
+#include "upstream.h"
+#include "hosts.h"
+#include "deny.h"
+#include "dhcp.h"
+#include "local_zones.h"
+#include "forward.h"
+#include "stats.h"
+#include "metrics.h"
+#include "querylog.h"
+#include "topk.h"
+#include "control.h"
+#include "reload.h"
+#include "upgrade.h"
+#include "rrl.h"
+#include "acl.h"
 
 /*****************************************************************************/
 /* Global variables */
 /*****************************************************************************/
+/*
+ * A receiver reads the UDP socket of a NUMA node into the buffers of the
+ * node packet pool and queues them to the workers of the same node.
+ * Without NUMA affinity there is a single receiver, run by the main
+ * thread.
+ */
+struct receiver {
+	pthread_t tid;
+	int node;
+	int sockfd;
+	cpu_set_t cpus;
+	/*
+	 * Set when the loop is left, under receivers_mutex
+	 */
+	int stopped;
+	struct worker_pool *pool;
+	struct packet_pool *packets;
+	struct packet_cache cache;
+};
+
+/*
+ * What _resolve_packet() found out about a query, for the query log
+ */
+struct resolve_info {
+	char host[DNS_NAME_SIZE];
+	unsigned short int type;
+	int source;
+	struct dns_server *server;
+};
+
 /* function protos */
 void usage(char * program , char * message );
-int udp_sock_open(struct in_addr ip, int port);
+int udp_sock_open(struct in_addr ip, int port, int reuseport);
 int udp_packet_read(int sockfd, struct udp_packet *udp_pkt);
 void *thread_resolve(void *args);
-struct thread_info **create_worker_threads(unsigned int);
-void stop_worker_threads(struct thread_info **, unsigned int);
+void *receiver_loop(void *args);
 struct dns_server *get_system_dns(void);
+static int _resolve_packet(struct udp_packet *pkt, struct resolve_info *info);
+static int _resolve_tcp(struct udp_packet *pkt, char *query_host, struct resolve_info *info);
 
 void sig_hup (int signo);
 void sig_int (int);
+void sig_alrm (int);
 void sig_usr1 (int);
 void sig_usr2 (int);
 int get_options( int argc, char ** argv );
 
 int sockfd;
 int run_process;
+struct receiver *receivers;
+unsigned int receivers_count;
+pthread_mutex_t receivers_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Kept for an upgrade, which starts the new binary the same way
+ */
+static char **dproxy_argv;
+static char dproxy_binary[PATH_MAX];
+static struct tcp_server *tcp_server = NULL;
+static struct metrics *metrics = NULL;
+static struct rrl *rrl = NULL;
+
+/*
+ * Set once the sockets belong to a new process, which must not see them
+ * shut down
+ */
+static volatile int handed_over = 0;
+
+/*
+ * Waiting counter of the pool of a UDP worker, NULL for the other
+ * threads resolving
+ */
+static __thread volatile int *pool_waiting = NULL;
+
+/**
+ * Computes the CPUs a thread of the given node may run on: the CPUs of
+ * the node, restricted to the configured list if any. Without NUMA
+ * affinity only the configured list counts. An empty set means that
+ * the thread is not pinned at all.
+ */
+static void node_cpu_set(int node, char *list, cpu_set_t *set) {
+
+	cpu_set_t node_set;
+	cpu_set_t list_set;
+
+	CPU_ZERO(set);
+	CPU_ZERO(&list_set);
+
+	if (list[0] && numa_parse_cpulist(list, &list_set) != 0) {
+		fprintf (stderr, "Invalid CPU list \"%s\", threads will not be pinned\n", list);
+		CPU_ZERO(&list_set);
+	}
+
+	if (!config.numa_affinity) {
+		memcpy(set, &list_set, sizeof(cpu_set_t));
+		return;
+	}
+
+	if (numa_node_cpus(node, &node_set) != 0)
+		return;
+
+	if (CPU_COUNT(&list_set) > 0)
+		CPU_AND(set, &node_set, &list_set);
+
+	/*
+	 * The list doesn't cover this node, stay on the node anyway
+	 */
+	if (CPU_COUNT(set) == 0)
+		memcpy(set, &node_set, sizeof(cpu_set_t));
+
+}
 
 /*****************************************************************************/
 int main(int argc, char **argv) {
 
 	struct in_addr ip;
-	int numread;
-	struct thread_info **t_info;
-	struct thread_info *target_thread;
-	unsigned int t_cursor = 0;
-	unsigned int t_idx;
-	unsigned int sleep_timeout = MIN_SLEEP_TIMEOUT;
-	
-	unsigned int last_cache_purge = time(NULL);
+	struct control *control = NULL;
+	struct upgrade *up;
+	struct sigaction sa;
+	struct worker_pool **pools;
+	struct receiver *receiver;
+	pthread_attr_t attr;
+	cpu_set_t worker_cpus;
+	cpu_set_t main_cpus;
+	unsigned int idx;
+	unsigned int loaded;
+	time_t drain_end;
+	int busy;
+	ssize_t len;
 	
 	/* get commandline options, load config if needed. */
 	if(get_options( argc, argv ) < 0 ) {
 		exit(1);
 	}
 
+	dproxy_argv = argv;
+	len = readlink("/proc/self/exe", dproxy_binary, sizeof(dproxy_binary) - 1);
+	dproxy_binary[(len > 0) ? len : 0] = 0;
+
+	/*
+	 * Started by an upgrade, the sockets come from the old process
+	 */
+	up = upgrade_receive();
+
+	/*
+	 * With NUMA affinity each node gets its own socket. They all share
+	 * the port and the kernel steers each packet to the socket of the
+	 * node that received it.
+	 */
+	receivers_count = 1;
+	if (config.numa_affinity)
+		receivers_count = numa_nodes_count();
+
+	receivers = (struct receiver *)calloc(receivers_count, sizeof(struct receiver));
+
+	if (up != NULL && up->udp_count != receivers_count) {
+		fprintf (stderr, "The old process has %u UDP sockets, not %u\n", up->udp_count, receivers_count);
+		exit(1);
+	}
+
 	ip.s_addr = INADDR_ANY;
-	sockfd = udp_sock_open( ip, PORT );
+	for (idx = 0; idx < receivers_count; idx++) {
+		receivers[idx].node = idx;
+		if (up != NULL)
+			receivers[idx].sockfd = up->udp_fds[idx];
+		else
+			receivers[idx].sockfd = udp_sock_open( ip, config.listen_port, receivers_count > 1 );
+	}
+
+	/* Inherited sockets are steered already */
+	if (receivers_count > 1 && up == NULL)
+		numa_steer_sockets(receivers[0].sockfd, receivers_count);
+
+	sockfd = receivers[0].sockfd;
 
 	if (config.daemon_mode) {
 		/* Standard fork and background code */
@@ -86,29 +239,128 @@ int main(int argc, char **argv) {
 		}
 	}
 
-	//signal(SIGHUP, sig_hup);
+	/*
+	 * The log writer thread must be started by the process that stays
+	 */
+	log_start(config.log_level);
+
+	signal(SIGHUP, sig_hup);
 	signal(SIGINT, sig_int);
 	signal(SIGTERM, sig_int);
 	signal(SIGUSR1, sig_usr1);
 	signal(SIGUSR2, sig_usr2);
 
-	t_info = create_worker_threads(config.worker_threads_count);
-	
 	/*
-	 * Instantiate a cache
+	 * Wakes up a receiver blocked reading its socket, without
+	 * restarting the read
 	 */
-	cache = cache_new();
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sig_alrm;
+	sigaction(SIGALRM, &sa, NULL);
+
+	/*
+	 * Instantiate a cache, with a shard for each node, in the file
+	 * shared with the other processes if asked
+	 */
+	if (config.cache_shared) {
+		cache = cache_new_shared(config.cache_file, config.cache_size, receivers_count);
+		if (cache == NULL)
+			fprintf (stderr, "Could not use the shared cache %s, using a private one\n", config.cache_file);
+	}
+
+	if (cache == NULL)
+		cache = cache_new(receivers_count);
+
+	if (up != NULL) {
+		loaded = upgrade_load_cache(up, cache);
+		log_info("Loaded %u of %u cache entries of the old process\n", loaded, up->entries);
+	}
 	
 	/*
 	 * Instantiate a DNS remote server
 	 */
 	server = get_system_dns();
 	
-	if (server == NULL) {
+	/*
+	 * Route the queries by domain, the rest to the server of
+	 * /etc/resolv.conf unless the configuration has a default route
+	 */
+	forward = forward_new(config.forward, server);
+
+	if (forward == NULL) {
 		fprintf (stderr, "No DNS resolver available. Check /etc/resolv.conf for a valid DNS server\n");
 		return 1;
 	}
 
+	/*
+	 * Names of the hosts file are answered locally
+	 */
+	if (config.hosts_file[0]) {
+		hosts = hosts_new(config.hosts_file);
+		if (hosts == NULL)
+			fprintf (stderr, "Could not load the hosts file, ignoring it\n");
+	}
+
+	/*
+	 * Names of the deny file are blocked
+	 */
+	if (config.deny_file[0]) {
+		deny = deny_new(config.deny_file, config.deny_nxdomain);
+		if (deny == NULL)
+			fprintf (stderr, "Could not load the deny file, ignoring it\n");
+	}
+
+	/*
+	 * Names handed out by the DHCP server are answered locally
+	 */
+	if (config.dhcp_lease_file[0]) {
+		leases = dhcp_leases_new(config.dhcp_lease_file, config.dhcp_domain);
+		if (leases == NULL)
+			fprintf (stderr, "Could not follow the dhcp leases, ignoring them\n");
+	}
+
+	/*
+	 * All the threads send their queries through the same few sockets
+	 */
+	upstream = upstream_new(config.upstream_sockets, config.upstream_timeout);
+
+	if (upstream == NULL) {
+		fprintf (stderr, "Could not open the upstream sockets\n");
+		return 1;
+	}
+
+	/*
+	 * Every query is recorded in the query log, if any
+	 */
+	if (config.query_log[0]) {
+		querylog = querylog_open(config.query_log, config.query_log_size);
+		if (querylog == NULL)
+			fprintf (stderr, "Could not open the query log, ignoring it\n");
+	}
+
+	/*
+	 * Clients outside the allowed networks are not served. A broken
+	 * list must not leave the server open, nor closed to everybody.
+	 */
+	if (config.acl_allow[0] || config.acl_deny[0]) {
+		acl = acl_new(config.acl_allow, config.acl_deny);
+		if (acl == NULL) {
+			fprintf (stderr, "Could not compile the client ACL\n");
+			return 1;
+		}
+		log_info("Client ACL of %u allowed and %u denied networks\n", acl->allowed, acl->denied);
+	}
+
+	/*
+	 * The receivers limit the rate of the answers to each network. The
+	 * table is there even with no limit, so a reload can set one.
+	 */
+	if (config.rrl_table_size > 0) {
+		rrl = rrl_new(config.rrl_table_size);
+		if (rrl == NULL)
+			fprintf (stderr, "Could not allocate the rate limiting table, ignoring it\n");
+	}
+
 	/*
 	 * Populate af_inet_hints global struct. We don't need to generate
 	 * this each time a dns query is forwarded. We create the right
@@ -120,169 +372,331 @@ int main(int argc, char **argv) {
 	af_inet_hints.ai_flags = 0;
 	af_inet_hints.ai_protocol = 0;
 
-	run_process = 1;
+	sched_getaffinity(0, sizeof(cpu_set_t), &main_cpus);
 
-	while(run_process) {
+	for (idx = 0; idx < receivers_count; idx++) {
+
+		receiver = &receivers[idx];
+
+		node_cpu_set(receiver->node, config.worker_cpus, &worker_cpus);
+		node_cpu_set(receiver->node, config.receiver_cpus, &receiver->cpus);
 
 		/*
-		 * Find the next non-busy thread in the list
+		 * Move to the node while allocating its packet buffers, so
+		 * they are backed by local memory
 		 */
-		target_thread = NULL;
+		numa_pin_self(&worker_cpus);
+		receiver->packets = packet_pool_new(config.packet_pool_size);
+		sched_setaffinity(0, sizeof(cpu_set_t), &main_cpus);
 
-		while (run_process) {
+		if (receiver->packets == NULL) {
+			fprintf (stderr, "Could not allocate the packet buffers\n");
+			return 1;
+		}
 
-			t_cursor = (t_cursor + 1) % config.worker_threads_count;
+		receiver->pool = worker_pool_new(config.worker_threads_count, config.worker_threads_min, config.worker_threads_max, config.worker_pool_latency, thread_resolve, receiver->node, &worker_cpus, receiver->sockfd, receiver->packets);
+		if (receiver->pool == NULL) {
+			fprintf (stderr, "Could not create the worker threads\n");
+			return 1;
+		}
 
-			for (t_idx = 0; t_idx < config.worker_threads_count; t_idx++) {
-				if (t_info[t_cursor]->busy == 0) {
-					target_thread = t_info[t_cursor];
-					debug ("Entering thread %x...\n", target_thread->tid);
-					pthread_mutex_lock (&target_thread->mutex);
-					target_thread->busy = 1;
-					debug("Entered thread %x and set to busy\n", target_thread->tid);
-					break;
-				}
-			}
+	}
 
-			/*
-			 * No threads are available, wait for some time and retry
-			 */
-			if (target_thread == NULL) {
-				debug ("All threads are busy, waiting for %d microseconds...\n", sleep_timeout);
-				usleep (sleep_timeout);
-				sleep_timeout<<=1;
-				if (sleep_timeout > MAX_SLEEP_TIMEOUT)
-					sleep_timeout = MAX_SLEEP_TIMEOUT;
-			} else {
-				sleep_timeout=MIN_SLEEP_TIMEOUT;
-				break;
-			}
+	/*
+	 * Start accepting queries over TCP too. The TCP listener has its
+	 * own resolver threads but shares cache and server with the UDP ones
+	 */
+	if (config.tcp_listen) {
+		tcp_server = tcp_server_new(ip, config.listen_port, (up != NULL) ? up->tcp_fd : -1, config.tcp_threads_count, config.tcp_max_connections, config.tcp_idle_timeout);
+		if (tcp_server == NULL)
+			fprintf (stderr, "Could not start the TCP listener, serving UDP only\n");
+	}
+
+	/*
+	 * Serve the statistics to the scrapers
+	 */
+	pools = (struct worker_pool **)calloc(receivers_count, sizeof(struct worker_pool *));
+	for (idx = 0; idx < receivers_count; idx++)
+		pools[idx] = receivers[idx].pool;
+
+	if (config.metrics_listen[0]) {
+		metrics = metrics_new(config.metrics_listen, (up != NULL) ? up->metrics_fd : -1, pools, receivers_count, tcp_server);
+		if (metrics == NULL)
+			fprintf (stderr, "Could not start the metrics listener, ignoring it\n");
+	}
+
+	/*
+	 * Take the commands of the control socket, and those of the signals
+	 */
+	control = control_new(config.control_socket, pools, receivers_count);
+	if (control == NULL)
+		fprintf (stderr, "Could not start the control thread, ignoring it\n");
+
+	run_process = 1;
 
+	/*
+	 * The old process stops reading as soon as it knows, this one must
+	 * not start serving if it already gave up
+	 */
+	if (up != NULL && upgrade_ready(up) != 0) {
+		fprintf (stderr, "The old process gave up the upgrade\n");
+		exit(1);
+	}
+
+	/*
+	 * Receivers of the other nodes run in their own threads, the first
+	 * one in the main thread
+	 */
+	for (idx = 1; idx < receivers_count; idx++) {
+		pthread_attr_init(&attr);
+		numa_pin_attr(&attr, &receivers[idx].cpus);
+		pthread_create(&receivers[idx].tid, &attr, receiver_loop, &receivers[idx]);
+		pthread_attr_destroy(&attr);
+	}
+
+	receivers[0].tid = pthread_self();
+	numa_pin_self(&receivers[0].cpus);
+	receiver_loop(&receivers[0]);
+
+	for (idx = 1; idx < receivers_count; idx++)
+		pthread_join(receivers[idx].tid, NULL);
+
+	/*
+	 * After an upgrade answer the queries already taken, up to the
+	 * upstream timeout
+	 */
+	drain_end = time(NULL) + config.upstream_timeout / 1000 + 2;
+	while (handed_over && time(NULL) < drain_end) {
+		busy = (upstream_waiting > 0);
+		for (idx = 0; idx < receivers_count; idx++)
+			busy |= (*(volatile unsigned int *)&receivers[idx].packets->queue_len > 0);
+		if (!busy)
+			break;
+		usleep(10000);
+	}
+
+	control_destroy(control);
+	metrics_destroy(metrics);
+	tcp_server_destroy(tcp_server);
+
+	for (idx = 0; idx < receivers_count; idx++) {
+		worker_pool_destroy(receivers[idx].pool);
+		packet_pool_destroy(receivers[idx].packets);
+		close(receivers[idx].sockfd);
+	}
+
+	upstream_destroy(upstream);
+	querylog_close(querylog);
+	rrl_destroy(rrl);
+	acl_destroy(acl);
+	hosts_destroy(hosts);
+	deny_destroy(deny);
+	dhcp_leases_destroy(leases);
+	cache_destroy(cache);
+	forward_destroy(forward);
+	dns_server_destroy(server);
+	free(pools);
+	free(receivers);
+
+	log_stop();
+
+	return 0;
+
+}
+
+/**
+ * Reads the packets of a receiver socket into free buffers and queues
+ * them to the workers of its pool
+ */
+void *receiver_loop(void *args) {
+
+	struct receiver *receiver = (struct receiver *)args;
+	struct packet_pool *packets = receiver->packets;
+	struct packet_buf *buf;
+	struct sockaddr_in dst_sa;
+	enum rrl_action action;
+	unsigned int token;
+	int allowed;
+	int numread;
+	
+
+	numa_set_local_node(receiver->node);
+
+	while(run_process) {
+
+		/*
+		 * Take a free buffer. If all of them are waiting for a worker
+		 * wait for some to come back, the socket buffer will hold the
+		 * packets in the meanwhile.
+		 */
+		buf = packet_pool_get(packets, &receiver->cache);
+		if (buf == NULL) {
+			debug ("All the packet buffers are in use, waiting...\n");
+			packet_pool_wait(packets);
+			continue;
 		}
 		
-		if ( time(NULL) > last_cache_purge + config.purge_time ) {
-			printf ("Beginning cache tree tidying up (%d nodes)\n", cache_count(cache));
-			cache_tidyup(cache, time(NULL));
-			printf ("Tidying up complete, remaining %d nodes\n", cache_count(cache));
-			last_cache_purge = (time(NULL));
+		numread = udp_packet_read( receiver->sockfd, &buf->pkt );
+		if (numread < 0 && errno == EINTR) {
+			packet_pool_put(packets, &receiver->cache, buf);
+			continue;
 		}
 
-		debug("Next request will be assigned to thread %x\n", target_thread->tid);
-		numread = udp_packet_read( sockfd, target_thread->pkt );
 		if( numread < 0 ) {
+			stats_count(STATS_DROPPED);
 			debug("no data ...\n");
-			pthread_mutex_unlock(&target_thread->mutex);
+			packet_pool_put(packets, &receiver->cache, buf);
 			continue;
 		}
 
+		/*
+		 * Refused clients are dropped before anything else looks at
+		 * their packets
+		 */
+		if (acl != NULL) {
+			token = reload_read_lock();
+			allowed = (acl == NULL || acl_check(acl, buf->pkt.src_ip));
+			reload_read_unlock(token);
+			if (!allowed) {
+				stats_count(STATS_ACL_REFUSED);
+				packet_pool_put(packets, &receiver->cache, buf);
+				continue;
+			}
+		}
+
 		if(numread < sizeof(struct dns_header)+1 ) {
+			stats_count(STATS_DROPPED);
 			debug("got packet with invalid size of %d \n",numread);
-			pthread_mutex_unlock(&target_thread->mutex);
+			packet_pool_put(packets, &receiver->cache, buf);
 			continue;
 		}
 
-		//debug("Dns query from %s port %d\n", inet_ntoa(target_thread->pkt->src_ip), target_thread->pkt->src_port);
+		//debug("Dns query from %s port %d\n", inet_ntoa(buf->pkt.src_ip), buf->pkt.src_port);
+
+		/*
+		 * Over the rate limit the query costs no worker and no upstream
+		 * query, and at most an empty truncated answer
+		 */
+		if (rrl != NULL) {
+			action = rrl_check(rrl, &buf->pkt, numread);
+			if (action == RRL_SLIP) {
+				numread = rrl_slip_reply(&buf->pkt.dns_data, numread);
+				if (numread > 0) {
+					memset(&dst_sa, 0, sizeof(dst_sa));
+					dst_sa.sin_addr = buf->pkt.src_ip;
+					dst_sa.sin_port = htons(buf->pkt.src_port);
+					dst_sa.sin_family = AF_INET;
+					sendto(receiver->sockfd, &buf->pkt.dns_data, numread, 0, (struct sockaddr *)&dst_sa, sizeof(dst_sa));
+				}
+				stats_count(STATS_RRL_SLIPPED);
+			} else if (action == RRL_DROP) {
+				stats_count(STATS_RRL_DROPPED);
+			}
+			if (action != RRL_PASS) {
+				packet_pool_put(packets, &receiver->cache, buf);
+				continue;
+			}
+		}
 
 		/*
-		 * Signal the thread that it has a job to do
+		 * Hand the packet to the workers
 		 */
-		pthread_cond_signal (&target_thread->cond);
-		pthread_mutex_unlock (&target_thread->mutex);
+		packet_queue_push(packets, buf);
 
 	}
 
-	stop_worker_threads(t_info, config.worker_threads_count);
-	cache_destroy(cache);
-	dns_server_destroy(server);
+	packet_pool_flush(packets, &receiver->cache);
 
-	return 0;
+	pthread_mutex_lock(&receivers_mutex);
+	receiver->stopped = 1;
+	pthread_mutex_unlock(&receivers_mutex);
+
+	return NULL;
 
 }
 
 /**
- * Creates a number of worker thread and fills a list of thread_info
- * structures
+ * Makes the receivers leave their loop, without touching the sockets.
+ * A signal sent just before a receiver blocks is lost, so it is sent
+ * again until all of them are out.
  */
-struct thread_info **create_worker_threads(unsigned int count) {
+static void receivers_stop(void) {
 
-	struct thread_info **t_info = malloc(sizeof(struct thread_info *) * count);
 	unsigned int idx;
+	int running;
 
-	debug ("Creating %d worker threads", count);
-
-	for (idx = 0; idx < count; idx++) {
-		t_info[idx] = malloc(sizeof(struct thread_info));
-		t_info[idx]->tid=0;
-		t_info[idx]->pkt=(struct udp_packet *)malloc(sizeof(struct udp_packet));
-		t_info[idx]->busy=0;
-		t_info[idx]->run=1;
-		pthread_cond_init(&t_info[idx]->cond, NULL);
-		pthread_mutex_init(&t_info[idx]->mutex, NULL);
-		pthread_create(&t_info[idx]->tid, NULL, thread_resolve, t_info[idx]);
-		debug("Created thread %d with tid %x\n", idx, t_info[idx]->tid);
-	}
+	run_process = 0;
 
-	return t_info;
+	do {
+		running = 0;
+		pthread_mutex_lock(&receivers_mutex);
+		for (idx = 0; idx < receivers_count; idx++) {
+			if (!receivers[idx].stopped) {
+				pthread_kill(receivers[idx].tid, SIGALRM);
+				running = 1;
+			}
+		}
+		pthread_mutex_unlock(&receivers_mutex);
+		if (running)
+			usleep(1000);
+	} while (running);
 
 }
 
 /**
- * Stops all worker threads and wait for their termination
+ * Replaces this process with binary, or the running one if NULL, see
+ * upgrade.c. On success this process answers the queries it already
+ * read and leaves.
+ * Returns 1 if the upgrade failed, this process goes on serving then
  */
-void stop_worker_threads(struct thread_info **t_info, unsigned int count) {
+int dproxy_upgrade(char *binary, FILE *out) {
 
+	int fds[UPGRADE_MAX_UDP];
 	unsigned int idx;
 
-	/*
-	 * Assign the run variable to 0 for all the worker threads
-	 */
-	for (idx = 0; idx < count; idx++)
-		t_info[idx]->run = 0;
+	if (binary == NULL)
+		binary = dproxy_binary;
 
-	/*
-	 * Then signal the condition variable over all the threads, then
-	 * wait for them to join
-	 */
-	for (idx = 0; idx < count; idx++) {
-		pthread_mutex_lock (&t_info[idx]->mutex);
-		pthread_cond_signal (&t_info[idx]->cond);
-		pthread_mutex_unlock (&t_info[idx]->mutex);
-	}
+	if (receivers_count > UPGRADE_MAX_UDP || !binary[0])
+		return 1;
 
-	/*
-	 * Finally wait for them to join
-	 */
-	for (idx = 0; idx < count; idx++) {
-		pthread_join (t_info[idx]->tid, NULL);
-	}
+	for (idx = 0; idx < receivers_count; idx++)
+		fds[idx] = receivers[idx].sockfd;
 
-	/*
-	 * And at last free the used memory for packets and destroy pthread
-	 * resources
-	 */
-	for (idx = 0; idx < count; idx++) {
-		free (t_info[idx]->pkt);
-		pthread_mutex_destroy (&t_info[idx]->mutex);
-		pthread_cond_destroy(&t_info[idx]->cond);
+	if (upgrade_exec(binary, dproxy_argv, fds, receivers_count, (tcp_server != NULL) ? tcp_server->listen_fd : -1, (metrics != NULL) ? metrics->fd : -1, cache, out) != 0)
+		return 1;
+
+	handed_over = 1;
+
+	tcp_server_handover(tcp_server);
+
+	/* The path of the metrics socket is the new process's now */
+	if (metrics != NULL) {
+		free(metrics->path);
+		metrics->path = NULL;
 	}
 
-	return;
+	receivers_stop();
+
+	return 0;
 
 }
 
 void *thread_resolve (void *args) {
 
-	int socket;
-	unsigned short data_len;
+	int data_len;
 	
 	/*
 	 * Thread private data
 	 */
 	struct thread_info *t_info;
+	struct packet_buf *buf;
 	struct udp_packet *pkt;
 	
 	t_info=(struct thread_info *)args;
-	pkt = t_info->pkt;
+	
+	numa_set_local_node(t_info->node);
+	pool_waiting = t_info->upstream_waiting;
 	
 	/*
 	 * Destination addresses
@@ -291,140 +705,317 @@ void *thread_resolve (void *args) {
 	unsigned int dst_salen;
 	
 	memset((void *)&dst_sa, 0, sizeof(dst_sa));
-	
+
 	/*
-	 * Generate the dns_sections static structures
+	 * Take the queued packets until the pool retires us
 	 */
+	while ((buf = packet_queue_pop(t_info->packets, &t_info->run, &t_info->cache)) != NULL) {
 
-	char query_host[DNS_NAME_SIZE];
-	unsigned short int type;
-	unsigned short int class;
-	int in_cache;
-	short int msg_id;
-	int res;
+		t_info->busy = 1;
+		pkt = &buf->pkt;
 		
+		stats_count(STATS_UDP_QUERIES);
+		data_len = resolve_packet(pkt);
+		
+		if (data_len > 0) {
+			
+			dst_sa.sin_addr = pkt->src_ip;
+			dst_sa.sin_port = htons(pkt->src_port);
+			dst_sa.sin_family = AF_INET;
+			dst_salen = sizeof(dst_sa);
+			
+			data_len = sendto(t_info->sockfd, &pkt->dns_data, data_len, 0, (struct sockaddr *)&dst_sa, dst_salen);
+
+		}
+
+		packet_pool_put(t_info->packets, &t_info->cache, buf);
+		t_info->busy = 0;
+
+		debug("Done.\n");
+
+	}
+
+	packet_pool_flush(t_info->packets, &t_info->cache);
+	stats_thread_exit();
+	topk_thread_exit();
+	log_thread_exit();
+
+	debug("Thread %lx terminated\n", (unsigned long)t_info->tid);
+	pthread_exit(NULL);
+
+}
+
+/**
+ * Counts a query and the time taken to answer it, and records it in the
+ * query log, see _resolve_packet()
+ */
+int resolve_packet(struct udp_packet *pkt) {
+
+	struct resolve_info info;
+	struct querylog_record record;
+	struct timespec ts;
+	unsigned long long start;
+	unsigned int token;
+	unsigned int len;
+	int data_len;
+
+	start = stats_now_usec();
+	stats_count(STATS_QUERIES);
+
+	info.host[0] = 0;
+	info.type = 0;
+	info.source = QUERYLOG_SOURCE_NONE;
+	info.server = NULL;
+
+	/* Tables and routes stay valid until the query is answered */
+	token = reload_read_lock();
+	data_len = _resolve_packet(pkt, &info);
+	reload_read_unlock(token);
+
+	if (data_len > 0)
+		stats_time(STATS_RESOLVE_TIME, stats_now_usec() - start);
+	else
+		stats_count(STATS_DROPPED);
+
 	/*
-	 * Open the listening socket
+	 * Keep track of who asks most, and for what
 	 */
-	struct in_addr lst_ip;
-	unsigned int lst_salen;
-	char lst_text_addr[16];
-	struct sockaddr_in lst_addr;
-	struct timeval tv;
-
-	lst_ip.s_addr = INADDR_ANY;
-	socket = udp_sock_open(lst_ip, 0);
-	tv.tv_sec = 1; // Socket timeout
-	tv.tv_usec = 0;
-	setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO,(struct timeval *)&tv,sizeof(struct timeval));
-	lst_salen = sizeof(struct sockaddr_in);
-	getsockname(socket, (struct sockaddr *)&lst_addr, &lst_salen);
-	inet_ntop (lst_addr.sin_family, &lst_addr.sin_addr, lst_text_addr, sizeof(lst_text_addr) );
-	
-	debug ("Socket %d opened with family %d address %s and port %d\n", socket, ntohs(lst_addr.sin_family), lst_text_addr, ntohs(lst_addr.sin_port));
-	
+	topk_count(TOPK_CLIENTS, &pkt->src_ip, sizeof(pkt->src_ip), start);
+	if (info.host[0]) {
+		topk_count(TOPK_NAMES, info.host, strlen(info.host), start);
+		if (data_len > 0 && (ntohs(pkt->dns_data.dns_hdr.dns_flags) & 0x0f) == 3)
+			topk_count(TOPK_NXDOMAIN, info.host, strlen(info.host), start);
+	}
 
-	while (t_info->run == 1) {
+	if (querylog != NULL) {
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		len = strlen(info.host);
+
+		/* No stack garbage in the file, past the name or anywhere */
+		memset(&record, 0, sizeof(record));
+		record.time_usec = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+		record.latency_usec = stats_now_usec() - start;
+		record.client_ip = pkt->src_ip.s_addr;
+		record.client_port = pkt->src_port;
+		record.upstream_ip = (info.server != NULL) ? info.server->inet_address.sin_addr.s_addr : 0;
+		record.upstream_port = (info.server != NULL) ? info.server->hr_port : 0;
+		record.qtype = info.type;
+		record.answer_len = (data_len > 0) ? data_len : 0;
+		record.rcode = (data_len > 0) ? ntohs(pkt->dns_data.dns_hdr.dns_flags) & 0x0f : 0;
+		record.source = info.source;
+		record.flags = (pkt->tcp ? QUERYLOG_FLAG_TCP : 0) | ((len > QUERYLOG_NAME_SIZE) ? QUERYLOG_FLAG_NAME_CUT : 0);
+		record.name_len = len;
+		memcpy(record.name, info.host, (len < QUERYLOG_NAME_SIZE) ? len + 1 : QUERYLOG_NAME_SIZE);
+
+		querylog_write(querylog, &record);
 
-		pthread_mutex_lock(&t_info->mutex);
-		t_info->busy = 0;
-		pthread_cond_wait(&t_info->cond, &t_info->mutex);
+	}
 
-		if (t_info->run == 0) {
-			pthread_mutex_unlock(&t_info->mutex);
-			break;
-		}
+	return data_len;
+
+}
+
+/**
+ * Resolves the DNS query held into pkt, looking first into the cache and
+ * then asking the remote server through the upstream engine. The answer is
+ * written back into pkt->dns_data, with the same message id of the query.
+ * This is shared by all the listeners (UDP worker threads and TCP
+ * connections), so they all see the same cache and the same upstream.
+ * 
+ * Returns the length of the answer, or 0 if there is nothing to send back
+ */
+static int _resolve_packet(struct udp_packet *pkt, struct resolve_info *info) {
+
+	char *query_host = info->host;
+	unsigned short int type = 0;
+	unsigned short int class = 0;
+	unsigned short int cached_len;
+	int data_len = 0;
+	int in_cache = 0;
+	short int msg_id;
+	int res;
+
+	/*
+	 * If query bit is set to 1, it is not query, so we skip
+	 * the resolution. We can't handle that packet.
+	 */
+	if (pkt->dns_chdr.query_bit != 0)
+		return 0;
 		
+	msg_id = pkt->dns_data.dns_hdr.dns_id;
+		
+	/*
+	 * In case we have multiple query sections, we just skip the 
+	 * caching and send the DNS packet to the main server. We can't
+	 * handle multiple queries inside a single DNS request
+	 */
+	if (ntohs(pkt->dns_data.dns_hdr.dns_no_questions) == 1) {
+		
+		res = extract_request(pkt->dns_data.buf, query_host, &type, &class);
 		/*
-		 * If query bit is set to 1, it is not query, so we skip
-		 * the resolution. We can't handle that packet.
-		 */
-		if (pkt->dns_chdr.query_bit != 0)
-			continue;
-			
-		msg_id = pkt->dns_data.dns_hdr.dns_id;
-			
-		/*
-		 * In case we have multiple query sections, we just skip the 
-		 * caching and send the DNS packet to the main server. We can't
-		 * handle multiple queries inside a single DNS request
+		 * Let's extract the name of the host, the type and the 
+		 * class of the request. extract_request returns 1 if there
+		 * is any problem, so we proceed to check the cache only
+		 * if we get 0.
 		 */
-		if (ntohs(pkt->dns_data.dns_hdr.dns_no_questions) == 1) {
-			
-			res = extract_request(pkt->dns_data.buf, query_host, &type, &class);
-			/*
-			 * Let's extract the name of the host, the type and the 
-			 * class of the request. extract_request returns 1 if there
-			 * is any problem, so we proceed to check the cache only
-			 * if we get 0.
-			 */
-			 if (res == 0 && class == 1) {
-				 
-				 debug("Host: %s, type: %d class: %d\n", query_host, type, class);
-				 
+		 if (res == 0 && class == 1) {
+			 
+			 debug("Host: %s, type: %d class: %d\n", query_host, type, class);
+			 stats_count_qtype(type);
+			 info->type = type;
+
+			 /*
+			  * Names of the hosts file come before everything else
+			  */
+			 if (hosts != NULL) {
+				 data_len = hosts_answer(hosts, query_host, type, &pkt->dns_data, pkt->dns_data_len);
+				 if (data_len > 0) {
+					 stats_count(STATS_LOCAL_ANSWERS);
+					 info->source = QUERYLOG_SOURCE_LOCAL;
+					 return data_len;
+				 }
+			 }
+
+			 /*
+			  * Then the blocked ones, which never go upstream
+			  */
+			 if (deny != NULL) {
+				 data_len = deny_answer(deny, query_host, type, &pkt->dns_data, pkt->dns_data_len);
+				 if (data_len > 0) {
+					 info->source = QUERYLOG_SOURCE_BLOCKED;
+					 return data_len;
+				 }
+			 }
+
+			 /*
+			  * And the hosts of the LAN
+			  */
+			 if (leases != NULL) {
+				 data_len = dhcp_leases_answer(leases, query_host, type, &pkt->dns_data, pkt->dns_data_len);
+				 if (data_len > 0) {
+					 stats_count(STATS_LOCAL_ANSWERS);
+					 info->source = QUERYLOG_SOURCE_LOCAL;
+					 return data_len;
+				 }
+			 }
+
+			 /*
+			  * Reverse lookups of private addresses that none of the
+			  * above knows about end here, unless routed to servers
+			  * of their own
+			  */
+			 if (config.local_zones && !forward_routed(forward, query_host)) {
+				 data_len = local_zones_answer(query_host, type, &pkt->dns_data, pkt->dns_data_len);
+				 if (data_len > 0) {
+					 stats_count(STATS_LOCAL_ANSWERS);
+					 info->source = QUERYLOG_SOURCE_LOCAL;
+					 return data_len;
+				 }
+			 }
+			 
+			 /*
+			  * Search the packet in cache
+			  */
+			 in_cache = cache_search(cache, query_host, type, time(NULL), (void *)&pkt->dns_data, &cached_len);
+			 
+			 if (in_cache == 1) {
 				 /*
-				  * Search the packet in cache
+				  * Change the msg id to reflect the same msgid of the request
 				  */
-				 in_cache = cache_search(cache, query_host, type, time(NULL), (void *)&pkt->dns_data, &data_len);
-				 
-				 if (in_cache == 1) {
-					 /*
-					  * Change the msg id to reflect the same msgid of the request
-					  */
-					 //debug ("Cache hit, found %d bytes\n", data_len);
-					 pkt->dns_data.dns_hdr.dns_id = msg_id;
-				 }
-				 
-				 
+				 //debug ("Cache hit, found %d bytes\n", cached_len);
+				 pkt->dns_data.dns_hdr.dns_id = msg_id;
+				 data_len = cached_len;
+				 info->source = QUERYLOG_SOURCE_CACHE;
+				 stats_count(STATS_CACHE_HITS);
 			 } else {
-				 
-				 debug("Extract request failed\n");
-				 
+				 stats_count(STATS_CACHE_MISSES);
 			 }
-				 
-		}
+			 
+			 
+		 } else {
+			 
+			 class = 0;
+			 query_host[0] = 0;
+			 debug("Extract request failed\n");
+			 
+		 }
+			 
+	}
+	
+	/* 
+	 * If the query is not in cache, ask a server to resolve the DNS query
+	 * and then cache the response
+	 */
+	if (in_cache == 0) {
+		
+		//debug ("Packet not in cache, resolving with server...\n");
+		__sync_fetch_and_add(&upstream_waiting, 1);
+		if (pool_waiting != NULL)
+			__sync_fetch_and_add(pool_waiting, 1);
+		info->source = QUERYLOG_SOURCE_UPSTREAM;
+		data_len = pkt->tcp ? _resolve_tcp(pkt, query_host, info) : 0;
+		/* UDP clients, and servers not answering over TCP */
+		if (data_len <= 0)
+			data_len = forward_resolve(forward, upstream, query_host, &pkt->dns_data, pkt->dns_data_len, &info->server);
+		if (pool_waiting != NULL)
+			__sync_fetch_and_sub(pool_waiting, 1);
+		__sync_fetch_and_sub(&upstream_waiting, 1);
 		
-		/* 
-		 * If the query is not in cache, ask a server to resolve the DNS query
-		 * and then cache the response
+		/*
+		 * A truncated answer is only good for sending the client to
+		 * TCP, and a long one doesn't fit in the cache
 		 */
-		if (in_cache == 0) {
-			
-			//debug ("Packet not in cache, resolving with server...\n");
-			data_len = dns_server_resolve(server, socket, &pkt->dns_data, pkt->dns_data_len);
-			
-			if (data_len > 0 && msg_id == pkt->dns_data.dns_hdr.dns_id && class == 1) {
-				cache_insert(cache, query_host, type, time(NULL) + config.purge_time, (void *)&pkt->dns_data, data_len);	
-				//debug("Cached %d bytes\n", data_len);
-			}
-			
+		if (data_len > 0 && data_len <= sizeof(struct dns_data) && msg_id == pkt->dns_data.dns_hdr.dns_id && class == 1 &&
+			!(ntohs(pkt->dns_data.dns_hdr.dns_flags) & 0x0200)) {
+			cache_insert(cache, query_host, type, time(NULL) + config.purge_time, (void *)&pkt->dns_data, data_len);	
+			//debug("Cached %d bytes\n", data_len);
 		}
 		
-		if (data_len > 0 && msg_id == pkt->dns_data.dns_hdr.dns_id) {
-			
-			dst_sa.sin_addr = pkt->src_ip;
-			dst_sa.sin_port = htons(pkt->src_port);
-			dst_sa.sin_family = AF_INET;
-			dst_salen = sizeof(dst_sa);
-			
-			data_len = sendto(sockfd, &pkt->dns_data, data_len, 0, (struct sockaddr *)&dst_sa, dst_salen);
+	}
+	
+	if (data_len <= 0 || msg_id != pkt->dns_data.dns_hdr.dns_id)
+		return 0;
 
-		}
+	return data_len;
 
-		pthread_mutex_unlock(&t_info->mutex);
+}
 
-		debug("Done.\n");
+/**
+ * Asks upstream over TCP for a TCP client, whose answer must not be cut
+ * to the size of a UDP one. An answer fitting in pkt is moved there, a
+ * longer one is left in pkt->long_answer.
+ * Returns the length of the answer, 0 if there is none
+ */
+static int _resolve_tcp(struct udp_packet *pkt, char *query_host, struct resolve_info *info) {
+
+	unsigned char *answer;
+	int len;
+
+	answer = (unsigned char *)malloc(DNS_TCP_SIZE);
+	if (answer == NULL)
+		return 0;
 
+	len = forward_resolve_tcp(forward, upstream, query_host, &pkt->dns_data, pkt->dns_data_len, answer, DNS_TCP_SIZE, &info->server);
+
+	if (len <= 0 || len <= sizeof(struct dns_data)) {
+		if (len > 0)
+			memcpy(&pkt->dns_data, answer, len);
+		free(answer);
+		return len;
 	}
 
-	debug("Thread %x terminated\n", t_info->tid);
-	pthread_exit(NULL);
+	memcpy(&pkt->dns_data.dns_hdr, answer, sizeof(struct dns_header));
+	pkt->long_answer = answer;
+
+	return len;
 
 }
 
 /*****************************************************************************/
-int udp_sock_open(struct in_addr ip, int port) {
+int udp_sock_open(struct in_addr ip, int port, int reuseport) {
 	int fd;
+	int on = 1;
 	struct sockaddr_in sa;
 
 	/* Clear it out */
@@ -442,6 +1033,12 @@ int udp_sock_open(struct in_addr ip, int port) {
 	memcpy((void *)&sa.sin_addr, (void *)&ip, sizeof(struct in_addr));
 	sa.sin_port = htons(port);
 
+	/* sockets of the different NUMA nodes share the same port */
+	if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+		debug_perror("Could not share the port");
+		exit(1);
+	}
+
 	/* bind() the socket to the interface */
 	if (bind(fd, (struct sockaddr *)&sa, sizeof(struct sockaddr)) < 0) {
 		debug_perror("Could not bind to port");
@@ -459,7 +1056,6 @@ int udp_packet_read(int sockfd, struct udp_packet *udp_pkt ) {
 	
 	struct sockaddr_in sa;
 	unsigned int salen;
-	unsigned short flags;
 
 	/* Read in the actual packet */
 	salen = sizeof(sa);
@@ -467,27 +1063,20 @@ int udp_packet_read(int sockfd, struct udp_packet *udp_pkt ) {
 	udp_pkt->dns_data_len = numread;
 
 	if (numread < 0) {
+		/* Woken up to stop, see receivers_stop() */
+		if (errno == EINTR)
+			return -1;
 		debug_perror("udp_read_read: recvfrom");
 		debug("udp_read_read: recvfrom\n");
 		return -1;
 	}
 	
-	flags = ntohs(udp_pkt->dns_data.dns_hdr.dns_flags);
-	
-	udp_pkt->dns_chdr.message_id = ntohs(udp_pkt->dns_data.dns_hdr.dns_id);
-	udp_pkt->dns_chdr.query_bit = flags & 0x01;
-	udp_pkt->dns_chdr.opcode = (flags & 0x1e) >> 1;
-	udp_pkt->dns_chdr.auth_answer = (flags & 0x20) >> 5;
-	udp_pkt->dns_chdr.truncated = (flags & 0x40) >> 6;
-	udp_pkt->dns_chdr.recurse_desired = (flags & 0x80) >> 7;
-	udp_pkt->dns_chdr.recurse_avail = (flags & 0x100) >> 8;
-	udp_pkt->dns_chdr.z_field = (flags & 0xe00) >> 9;
-	udp_pkt->dns_chdr.rcode = (flags & 0xf000) >> 12;
-	
+	dns_cook_header(&udp_pkt->dns_data.dns_hdr, &udp_pkt->dns_chdr);
 
 	/* Then record where the packet came from */
 	memcpy((void *)&udp_pkt->src_ip, (void *)&sa.sin_addr, sizeof(struct in_addr));
 	udp_pkt->src_port = ntohs(sa.sin_port);
+	udp_pkt->tcp = 0;
 	
 	return numread;
 }
@@ -525,69 +1114,45 @@ struct dns_server *get_system_dns(void) {
 		}
 	}
 	
-	debug ("Using dns server %s:53 from /etc/resolv.conf\n", address);
+	log_info ("Using dns server %s:53 from /etc/resolv.conf\n", address);
 	
 	return dns_server;
 	
 }
 
-/*****************************************************************************
- * same as debug_perror but writes to debug output.
- *
-*****************************************************************************/
-void debug_perror( char * msg ) {
-	debug( "%s : %s\n" , msg , strerror(errno) );
-}
-/*****************************************************************************/
-void debug(char *fmt, ...) {
-#define MAX_MESG_LEN 1024
-
-	va_list args;
-	char text[ MAX_MESG_LEN ];
-
-	sprintf( text, "[ %d ]: ", getpid());
-	va_start (args, fmt);
-	vsnprintf( &text[strlen(text)], MAX_MESG_LEN - strlen(text), fmt, args);
-	va_end (args);
-
-	if( config.debug_file[0] ) {
-		FILE *fp;
-		fp = fopen( config.debug_file, "a");
-		if(!fp) {
-			syslog( LOG_ERR, "could not open log file %m" );
-			return;
-		}
-		fprintf( fp, "%s", text);
-		fclose(fp);
-	}
-
-	/** if not in daemon-mode stderr was not closed, use it. */
-	if( ! config.daemon_mode ) {
-		fprintf( stderr, "%s", text);
-	}
-
-}
 /*****************************************************************************/
 
+/*
+ * The configuration is read again by the control thread too
+ */
 void sig_hup (int signo) {
-	//signal(SIGHUP, sig_hup); /* set this for the next sighup */
-	//conf_load (config.config_file);
+	control_reload_requested = 1;
 }
 
 void sig_int(int signo) {
+	unsigned int idx;
+	/* Already leaving, and the sockets are not ours to shut down */
+	if (handed_over)
+		return;
 	run_process = 0;
-	close(sockfd);
+	/* shutdown() wakes up the receivers blocked reading their socket */
+	for (idx = 0; idx < receivers_count; idx++)
+		shutdown(receivers[idx].sockfd, SHUT_RDWR);
 }
 
+void sig_alrm(int signo) {
+}
+
+/*
+ * The cache is printed and tidied up by the control thread, signal
+ * handlers can't take its locks
+ */
 void sig_usr1(int signo) {
-	printf ("Cached domain list:\n");
-	cache_print (cache);
+	control_dump_requested = 1;
 }
 
 void sig_usr2(int signo) {
-	printf ("Beginning cache tree pruning (%d nodes)\n", cache_count(cache));
-	cache_tidyup(cache, time(NULL));
-	printf ("Pruning complete, remaining %d nodes\n", cache_count(cache));
+	control_tidy_requested = 1;
 }
 
 /*****************************************************************************
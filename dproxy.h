@@ -32,6 +32,7 @@
 #include "dns.h"
 #include "dns_server.h"
 #include "btree.h"
+#include "log.h"
 
 #ifndef DPROXY_H
 #define DPROXY_H
@@ -72,9 +73,115 @@
 #ifndef WORKER_THREADS_COUNT_DEFAULT
 #define WORKER_THREADS_COUNT_DEFAULT 1
 #endif
+#ifndef WORKER_THREADS_MIN_DEFAULT
+#define WORKER_THREADS_MIN_DEFAULT 1
+#endif
+#ifndef WORKER_THREADS_MAX_DEFAULT
+#define WORKER_THREADS_MAX_DEFAULT 32
+#endif
+#ifndef WORKER_POOL_LATENCY_DEFAULT
+#define WORKER_POOL_LATENCY_DEFAULT 2000
+#endif
+#ifndef WORKER_CPUS_DEFAULT
+#define WORKER_CPUS_DEFAULT ""
+#endif
+#ifndef RECEIVER_CPUS_DEFAULT
+#define RECEIVER_CPUS_DEFAULT ""
+#endif
+#ifndef NUMA_AFFINITY_DEFAULT
+#define NUMA_AFFINITY_DEFAULT 0
+#endif
+#ifndef PACKET_POOL_SIZE_DEFAULT
+#define PACKET_POOL_SIZE_DEFAULT 1024
+#endif
+#ifndef TCP_LISTEN_DEFAULT
+#define TCP_LISTEN_DEFAULT 1
+#endif
+#ifndef TCP_THREADS_COUNT_DEFAULT
+#define TCP_THREADS_COUNT_DEFAULT 2
+#endif
+#ifndef TCP_MAX_CONNECTIONS_DEFAULT
+#define TCP_MAX_CONNECTIONS_DEFAULT 256
+#endif
+#ifndef TCP_IDLE_TIMEOUT_DEFAULT
+#define TCP_IDLE_TIMEOUT_DEFAULT 10
+#endif
+#ifndef UPSTREAM_SOCKETS_DEFAULT
+#define UPSTREAM_SOCKETS_DEFAULT 4
+#endif
+#ifndef UPSTREAM_TIMEOUT_DEFAULT
+#define UPSTREAM_TIMEOUT_DEFAULT 1000
+#endif
+#ifndef DENY_NXDOMAIN_DEFAULT
+#define DENY_NXDOMAIN_DEFAULT 1
+#endif
+#ifndef DHCP_DOMAIN_DEFAULT
+#define DHCP_DOMAIN_DEFAULT ""
+#endif
+#ifndef LOCAL_ZONES_DEFAULT
+#define LOCAL_ZONES_DEFAULT 1
+#endif
+#ifndef FORWARD_DEFAULT
+#define FORWARD_DEFAULT ""
+#endif
+#ifndef QUERY_LOG_DEFAULT
+#define QUERY_LOG_DEFAULT ""
+#endif
+#ifndef QUERY_LOG_SIZE_DEFAULT
+#define QUERY_LOG_SIZE_DEFAULT 64
+#endif
+#ifndef LOG_LEVEL_DEFAULT
+#define LOG_LEVEL_DEFAULT 2
+#endif
+#ifndef METRICS_LISTEN_DEFAULT
+#define METRICS_LISTEN_DEFAULT ""
+#endif
+#ifndef LISTEN_PORT_DEFAULT
+#define LISTEN_PORT_DEFAULT PORT
+#endif
+#ifndef CONTROL_SOCKET_DEFAULT
+#define CONTROL_SOCKET_DEFAULT ""
+#endif
+#ifndef CACHE_SHARED_DEFAULT
+#define CACHE_SHARED_DEFAULT 0
+#endif
+#ifndef CACHE_SIZE_DEFAULT
+#define CACHE_SIZE_DEFAULT 64
+#endif
+#ifndef RRL_CLIENTS_DEFAULT
+#define RRL_CLIENTS_DEFAULT 0
+#endif
+#ifndef RRL_RESPONSES_DEFAULT
+#define RRL_RESPONSES_DEFAULT 0
+#endif
+#ifndef RRL_PREFIX_DEFAULT
+#define RRL_PREFIX_DEFAULT 24
+#endif
+#ifndef RRL_SLIP_DEFAULT
+#define RRL_SLIP_DEFAULT 2
+#endif
+#ifndef RRL_TABLE_SIZE_DEFAULT
+#define RRL_TABLE_SIZE_DEFAULT 16384
+#endif
+#ifndef ACL_ALLOW_DEFAULT
+#define ACL_ALLOW_DEFAULT ""
+#endif
+#ifndef ACL_DENY_DEFAULT
+#define ACL_DENY_DEFAULT ""
+#endif
+#ifndef DPROXY_VERSION
+#define DPROXY_VERSION "unknown"
+#endif
 
 struct cache *cache;
 struct dns_server *server;
+struct upstream *upstream;
+struct hosts *hosts;
+struct deny *deny;
+struct dhcp_leases *leases;
+struct forward *forward;
+struct querylog *querylog;
+struct acl *acl;
 
 struct udp_packet {
 	struct dns_data dns_data;
@@ -82,20 +189,17 @@ struct udp_packet {
 	struct dns_cooked_header dns_chdr;
 	struct in_addr src_ip;
 	int src_port;
-};
-
-struct thread_info {
-	pthread_t tid;
-	pthread_cond_t cond;
-	pthread_mutex_t mutex;
-	struct udp_packet *pkt;
-	int busy;
-	int run;
+	int tcp;
+	/*
+	 * TCP queries only: an answer too long for dns_data, which holds
+	 * its header. The caller sends it and frees it.
+	 */
+	unsigned char *long_answer;
 };
 
 struct addrinfo af_inet_hints;
 
-void debug(char *fmt, ...);
-void debug_perror(char * msg);
+int resolve_packet(struct udp_packet *);
+int dproxy_upgrade(char *, FILE *);
 
 #endif
@@ -0,0 +1,352 @@
+/*
+  **
+  ** forward.c
+  **
+  ** Routes the queries to different upstream servers by domain. Routes
+  ** are configured as "domain/server/server...", a server being an
+  ** address with an optional ":port", and "." being the default route.
+  ** They are compiled into a trie of labels walked from the top level
+  ** domain down, so a lookup costs one step per label of the name and
+  ** finds the longest matching domain.
+  **
+*/
+
+#include "dproxy.h"
+#include "forward.h"
+
+static struct forward_node *_child(struct forward_node *node, char *label, unsigned int len) {
+
+	struct forward_node *child;
+
+	for (child = node->children; child != NULL; child = child->sibling)
+		if (child->label_len == len && memcmp(child->label, label, len) == 0)
+			return child;
+
+	return NULL;
+
+}
+
+static void _node_free(struct forward_node *node) {
+
+	struct forward_node *child;
+	struct forward_node *next;
+
+	for (child = node->children; child != NULL; child = next) {
+		next = child->sibling;
+		_node_free(child);
+		free(child->label);
+		free(child);
+	}
+
+}
+
+/**
+ * Finds the node of a zone, creating the missing ones
+ * Returns NULL if out of memory
+ */
+static struct forward_node *_node_get(struct forward *fwd, char *zone) {
+
+	struct forward_node *node = &fwd->root;
+	struct forward_node *child;
+	unsigned int start;
+	unsigned int end;
+
+	end = strlen(zone);
+
+	while (end > 0) {
+
+		for (start = end; start > 0 && zone[start - 1] != '.'; start--)
+			;
+
+		child = _child(node, zone + start, end - start);
+
+		if (child == NULL) {
+			child = malloc(sizeof(struct forward_node));
+			if (child == NULL)
+				return NULL;
+			memset(child, 0, sizeof(struct forward_node));
+			child->label = strndup(zone + start, end - start);
+			child->label_len = end - start;
+			child->sibling = node->children;
+			node->children = child;
+		}
+
+		node = child;
+		end = (start > 0) ? start - 1 : 0;
+
+	}
+
+	return node;
+
+}
+
+/**
+ * Parses a route, "domain/server/server..."
+ * Returns 1 if it is not valid
+ */
+static int _parse_route(struct forward *fwd, char *item) {
+
+	struct forward_route *route;
+	struct forward_node *node;
+	struct dns_server *srv;
+	char *token;
+	char *saveptr;
+	char *port;
+	unsigned int idx;
+
+	token = strtok_r(item, "/", &saveptr);
+	if (token == NULL)
+		return 1;
+
+	route = malloc(sizeof(struct forward_route));
+	if (route == NULL)
+		return 1;
+
+	memset(route, 0, sizeof(struct forward_route));
+
+	if (strcmp(token, ".") == 0)
+		route->zone[0] = 0;
+	else
+		dns_name_lower(route->zone, token, sizeof(route->zone));
+
+	while ((token = strtok_r(NULL, "/", &saveptr)) != NULL && route->servers_count < FORWARD_MAX_SERVERS) {
+
+		port = strchr(token, ':');
+		if (port != NULL)
+			*port++ = 0;
+
+		srv = dns_server_new(token, (port != NULL) ? atoi(port) : 53);
+		if (srv == NULL) {
+			fprintf(stderr, "Invalid server address %s\n", token);
+			continue;
+		}
+
+		route->servers[route->servers_count++] = srv;
+
+	}
+
+	node = _node_get(fwd, route->zone);
+
+	if (route->servers_count == 0 || node == NULL) {
+		for (idx = 0; idx < route->servers_count; idx++)
+			dns_server_destroy(route->servers[idx]);
+		free(route);
+		return 1;
+	}
+
+	/* A domain listed twice keeps the last route */
+	node->route = route;
+	route->list_next = fwd->routes;
+	fwd->routes = route;
+	fwd->routes_count++;
+
+	log_info("Forwarding %s to %d servers\n", route->zone[0] ? route->zone : ".", route->servers_count);
+
+	return 0;
+
+}
+
+/**
+ * Compiles the routes of a comma separated list. Without a default route
+ * in the list, the rest goes to default_server.
+ * Returns NULL if there is no default route at all
+ */
+struct forward *forward_new(char *list, struct dns_server *default_server) {
+
+	struct forward *fwd;
+	struct forward_route *route;
+	char *copy;
+	char *item;
+	char *saveptr;
+
+	fwd = malloc(sizeof(struct forward));
+	if (fwd == NULL)
+		return NULL;
+
+	memset(fwd, 0, sizeof(struct forward));
+
+	copy = strdup(list);
+	if (copy == NULL) {
+		free(fwd);
+		return NULL;
+	}
+
+	for (item = strtok_r(copy, ",", &saveptr); item != NULL; item = strtok_r(NULL, ",", &saveptr))
+		if (_parse_route(fwd, item))
+			fprintf(stderr, "Invalid forwarding route \"%s\", ignoring it\n", item);
+
+	free(copy);
+
+	if (fwd->root.route == NULL && default_server != NULL) {
+		route = malloc(sizeof(struct forward_route));
+		if (route != NULL) {
+			memset(route, 0, sizeof(struct forward_route));
+			route->servers[0] = dns_server_new(default_server->hr_address, default_server->hr_port);
+			route->servers_count = (route->servers[0] != NULL);
+			route->list_next = fwd->routes;
+			fwd->routes = route;
+			fwd->routes_count++;
+			fwd->root.route = route;
+		}
+	}
+
+	if (fwd->root.route == NULL || fwd->root.route->servers_count == 0) {
+		forward_destroy(fwd);
+		return NULL;
+	}
+
+	return fwd;
+
+}
+
+void forward_destroy(struct forward *fwd) {
+
+	struct forward_route *route;
+	struct forward_route *next;
+	unsigned int idx;
+
+	if (fwd == NULL)
+		return;
+
+	for (route = fwd->routes; route != NULL; route = next) {
+		next = route->list_next;
+		for (idx = 0; idx < route->servers_count; idx++)
+			dns_server_destroy(route->servers[idx]);
+		free(route);
+	}
+
+	_node_free(&fwd->root);
+	free(fwd);
+
+}
+
+/**
+ * Adds the statistics of the routes of old to the routes of the same
+ * domain in fwd, so a reload doesn't reset them
+ */
+void forward_carry(struct forward *fwd, struct forward *old) {
+
+	struct forward_route *route;
+	struct forward_route *prev;
+
+	for (route = fwd->routes; route != NULL; route = route->list_next) {
+		for (prev = old->routes; prev != NULL; prev = prev->list_next) {
+			if (strcmp(route->zone, prev->zone) == 0) {
+				__sync_fetch_and_add(&route->queries, prev->queries);
+				__sync_fetch_and_add(&route->answered, prev->answered);
+				__sync_fetch_and_add(&route->failed, prev->failed);
+				break;
+			}
+		}
+	}
+
+}
+
+/**
+ * Finds the route of the longest domain name belongs to. name must be
+ * lowercase
+ */
+struct forward_route *forward_lookup(struct forward *fwd, char *name) {
+
+	struct forward_node *node = &fwd->root;
+	struct forward_route *route = fwd->root.route;
+	unsigned int start;
+	unsigned int end;
+
+	end = strlen(name);
+
+	while (end > 0 && node->children != NULL) {
+
+		for (start = end; start > 0 && name[start - 1] != '.'; start--)
+			;
+
+		node = _child(node, name + start, end - start);
+		if (node == NULL)
+			break;
+
+		if (node->route != NULL)
+			route = node->route;
+
+		end = (start > 0) ? start - 1 : 0;
+
+	}
+
+	return route;
+
+}
+
+/**
+ * Returns 1 if name belongs to a domain with a route of its own, not
+ * only to the default one
+ */
+int forward_routed(struct forward *fwd, char *name) {
+
+	char lname[DNS_NAME_SIZE];
+
+	if (fwd->root.children == NULL)
+		return 0;
+
+	dns_name_lower(lname, name, sizeof(lname));
+
+	return forward_lookup(fwd, lname) != fwd->root.route;
+
+}
+
+/**
+ * Sends a query for name to the servers of its route, starting from a
+ * different one each time and moving to the next when one doesn't
+ * answer. The last server asked is stored in used, unless NULL. The
+ * answer is written in answer over TCP if given, back in data over UDP
+ * otherwise.
+ * Returns the length of the answer, 0 if no server answered
+ */
+static int _resolve(struct forward *fwd, struct upstream *up, char *name, struct dns_data *data, unsigned int data_len, unsigned char *answer, unsigned int size, struct dns_server **used) {
+
+	struct forward_route *route;
+	struct dns_server *srv;
+	char lname[DNS_NAME_SIZE];
+	unsigned int first;
+	unsigned int idx;
+	int res;
+
+	dns_name_lower(lname, name, sizeof(lname));
+	route = forward_lookup(fwd, lname);
+
+	__sync_fetch_and_add(&route->queries, 1);
+	first = __sync_fetch_and_add(&route->next, 1);
+
+	for (idx = 0; idx < route->servers_count; idx++) {
+		srv = route->servers[(first + idx) % route->servers_count];
+		if (used != NULL)
+			*used = srv;
+		if (answer != NULL)
+			res = upstream_resolve_tcp(up, srv, data, data_len, answer, size);
+		else
+			res = upstream_resolve(up, srv, data, data_len);
+		if (res > 0) {
+			__sync_fetch_and_add(&route->answered, 1);
+			return res;
+		}
+	}
+
+	__sync_fetch_and_add(&route->failed, 1);
+
+	return 0;
+
+}
+
+int forward_resolve(struct forward *fwd, struct upstream *up, char *name, struct dns_data *data, unsigned int data_len, struct dns_server **used) {
+
+	return _resolve(fwd, up, name, data, data_len, NULL, 0, used);
+
+}
+
+/**
+ * Like forward_resolve(), over TCP, the answer going in answer, size
+ * bytes at most
+ */
+int forward_resolve_tcp(struct forward *fwd, struct upstream *up, char *name, struct dns_data *data, unsigned int data_len, unsigned char *answer, unsigned int size, struct dns_server **used) {
+
+	return _resolve(fwd, up, name, data, data_len, answer, size, used);
+
+}
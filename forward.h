@@ -0,0 +1,54 @@
+#include "dns.h"
+#include "dns_server.h"
+#include "upstream.h"
+
+#ifndef FORWARD_H
+#define FORWARD_H
+
+#define FORWARD_MAX_SERVERS 8
+
+/*
+ * A forwarding route: the servers answering for a domain, tried in
+ * turn, and what they did
+ */
+struct forward_route {
+	char zone[DNS_NAME_SIZE];
+	struct dns_server *servers[FORWARD_MAX_SERVERS];
+	unsigned int servers_count;
+	unsigned int next;
+	/*
+	 * Statistics
+	 */
+	unsigned long queries;
+	unsigned long answered;
+	unsigned long failed;
+	struct forward_route *list_next;
+};
+
+/*
+ * Node of the suffix trie, one label each, walked from the top level
+ * domain down
+ */
+struct forward_node {
+	char *label;
+	unsigned int label_len;
+	struct forward_route *route;
+	struct forward_node *children;
+	struct forward_node *sibling;
+};
+
+struct forward {
+	struct forward_node root;
+	struct forward_route *routes;
+	unsigned int routes_count;
+};
+
+struct forward *forward_new(char *, struct dns_server *);
+void forward_destroy(struct forward *);
+void forward_carry(struct forward *, struct forward *);
+struct forward_route *forward_lookup(struct forward *, char *);
+int forward_routed(struct forward *, char *);
+int forward_resolve(struct forward *, struct upstream *, char *, struct dns_data *, unsigned int, struct dns_server **);
+int forward_resolve_tcp(struct forward *, struct upstream *, char *, struct dns_data *, unsigned int, unsigned char *, unsigned int, struct dns_server **);
+
+#endif
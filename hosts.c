@@ -0,0 +1,430 @@
+/*
+  **
+  ** hosts.c
+  **
+  ** Answers A, AAAA and PTR queries from the hosts file. The file is
+  ** compiled into a hash table held in a few flat arrays, which is never
+  ** modified once built. When the file changes a new table is built by
+  ** the watching thread and swapped in, so the resolver threads never
+  ** wait for the file to be parsed.
+  **
+*/
+
+#include <pthread.h>
+#include "dproxy.h"
+#include "hosts.h"
+
+static void _table_free(struct hosts_table *table) {
+
+	if (table == NULL)
+		return;
+
+	free(table->buckets);
+	free(table->records);
+	free(table->pool);
+	free(table);
+
+}
+
+/**
+ * Appends data to the string pool
+ * Returns its offset, or HOSTS_NONE if out of memory
+ */
+static unsigned int _pool_add(struct hosts_table *table, void *data, unsigned int len) {
+
+	char *pool;
+	unsigned int offset;
+
+	if (table->pool_len + len > table->pool_size) {
+		pool = realloc(table->pool, (table->pool_size + len) * 2);
+		if (pool == NULL)
+			return HOSTS_NONE;
+		table->pool = pool;
+		table->pool_size = (table->pool_size + len) * 2;
+	}
+
+	offset = table->pool_len;
+	memcpy(table->pool + offset, data, len);
+	table->pool_len += len;
+
+	return offset;
+
+}
+
+/**
+ * Links all the records in a hash table twice as large as the current
+ * one. Returns 1 if out of memory
+ */
+static int _rehash(struct hosts_table *table) {
+
+	unsigned int *buckets;
+	unsigned int size;
+	unsigned int idx;
+	struct hosts_record *record;
+
+	size = (table->buckets_mask + 1) * 2;
+
+	buckets = malloc(sizeof(unsigned int) * size);
+	if (buckets == NULL)
+		return 1;
+
+	memset(buckets, 0xff, sizeof(unsigned int) * size);
+
+	/*
+	 * Link in reverse order, so the chains keep the order of the records
+	 */
+	for (idx = table->records_count; idx-- > 0; ) {
+		record = &table->records[idx];
+		record->next = buckets[record->hash & (size - 1)];
+		buckets[record->hash & (size - 1)] = idx;
+	}
+
+	free(table->buckets);
+	table->buckets = buckets;
+	table->buckets_mask = size - 1;
+
+	return 0;
+
+}
+
+/**
+ * Looks for a record with the given name and type, and with the given
+ * record data unless rdata is NULL
+ */
+static struct hosts_record *_find(struct hosts_table *table, unsigned int hash, char *name, unsigned short int type, void *rdata, unsigned short int rdata_len) {
+
+	unsigned int idx;
+	struct hosts_record *record;
+
+	for (idx = table->buckets[hash & table->buckets_mask]; idx != HOSTS_NONE; idx = record->next) {
+		record = &table->records[idx];
+		if (record->hash != hash || record->type != type || strcmp(table->pool + record->name, name) != 0)
+			continue;
+		if (rdata == NULL || (record->rdata_len == rdata_len && memcmp(table->pool + record->rdata, rdata, rdata_len) == 0))
+			return record;
+	}
+
+	return NULL;
+
+}
+
+/**
+ * Adds a record to the table, unless it is already there. Only the first
+ * PTR record of a name is kept, so an address maps back to the first
+ * name it was given. Returns 1 if out of memory
+ */
+static int _table_add(struct hosts_table *table, char *name, unsigned short int type, void *rdata, unsigned short int rdata_len) {
+
+	struct hosts_record *records;
+	struct hosts_record *record;
+	unsigned int *next;
+	unsigned int hash;
+
+	hash = dns_name_hash(name);
+
+	if (_find(table, hash, name, type, (type == DNS_TYPE_PTR) ? NULL : rdata, rdata_len) != NULL)
+		return 0;
+
+	if (table->records_count == table->records_size) {
+		records = realloc(table->records, sizeof(struct hosts_record) * table->records_size * 2);
+		if (records == NULL)
+			return 1;
+		table->records = records;
+		table->records_size *= 2;
+	}
+
+	record = &table->records[table->records_count];
+	record->hash = hash;
+	record->type = type;
+	record->rdata_len = rdata_len;
+	record->name = _pool_add(table, name, strlen(name) + 1);
+	record->rdata = _pool_add(table, rdata, rdata_len);
+	if (record->name == HOSTS_NONE || record->rdata == HOSTS_NONE)
+		return 1;
+
+	/*
+	 * Append to the chain, so the answers keep the order of the file
+	 */
+	record->next = HOSTS_NONE;
+	for (next = &table->buckets[hash & table->buckets_mask]; *next != HOSTS_NONE; next = &table->records[*next].next)
+		;
+	*next = table->records_count;
+	table->records_count++;
+
+	if (table->records_count > table->buckets_mask + 1)
+		return _rehash(table);
+
+	return 0;
+
+}
+
+/**
+ * Writes the name used for reverse lookups of an address
+ */
+static void _reverse_name(int family, unsigned char *addr, char *name) {
+
+	int idx;
+	static const char hex[] = "0123456789abcdef";
+
+	if (family == AF_INET) {
+		sprintf(name, "%d.%d.%d.%d.in-addr.arpa", addr[3], addr[2], addr[1], addr[0]);
+		return;
+	}
+
+	for (idx = 15; idx >= 0; idx--) {
+		*name++ = hex[addr[idx] & 0x0f];
+		*name++ = '.';
+		*name++ = hex[addr[idx] >> 4];
+		*name++ = '.';
+	}
+	strcpy(name, "ip6.arpa");
+
+}
+
+/**
+ * Adds the records of a line of the hosts file: an address followed by
+ * its names. The first name is also the target of the PTR record.
+ * Returns 1 if out of memory
+ */
+static int _parse_line(struct hosts_table *table, char *line) {
+
+	char *token;
+	char *saveptr;
+	char name[DNS_NAME_SIZE];
+	char encoded[DNS_NAME_SIZE];
+	char reverse[DNS_NAME_SIZE];
+	unsigned char addr[16];
+	unsigned short int type;
+	unsigned short int addr_len;
+	int family;
+	int first = 1;
+
+	if ((token = strchr(line, '#')) != NULL)
+		*token = 0;
+
+	token = strtok_r(line, " \t\r\n", &saveptr);
+	if (token == NULL)
+		return 0;
+
+	if (inet_pton(AF_INET, token, addr) == 1) {
+		family = AF_INET;
+		type = DNS_TYPE_A;
+		addr_len = 4;
+	} else if (inet_pton(AF_INET6, token, addr) == 1) {
+		family = AF_INET6;
+		type = DNS_TYPE_AAAA;
+		addr_len = 16;
+	} else {
+		return 0;
+	}
+
+	while ((token = strtok_r(NULL, " \t\r\n", &saveptr)) != NULL) {
+
+		dns_name_lower(name, token, sizeof(name));
+
+		if (!dns_name_valid(name))
+			continue;
+
+		if (_table_add(table, name, type, addr, addr_len))
+			return 1;
+
+		if (first) {
+			strcpy(encoded, name);
+			encode_domain_name(encoded);
+			_reverse_name(family, addr, reverse);
+			if (_table_add(table, reverse, DNS_TYPE_PTR, encoded, strlen(name) + 2))
+				return 1;
+			first = 0;
+		}
+
+	}
+
+	return 0;
+
+}
+
+/**
+ * Compiles a hosts file into a table. A missing file gives an empty one.
+ * Returns NULL if out of memory
+ */
+static struct hosts_table *hosts_table_load(char *path) {
+
+	struct hosts_table *table;
+	FILE *fp;
+	char *line = NULL;
+	size_t line_size = 0;
+	int failed = 0;
+
+	table = malloc(sizeof(struct hosts_table));
+	if (table == NULL)
+		return NULL;
+
+	memset(table, 0, sizeof(struct hosts_table));
+
+	table->records_size = 64;
+	table->records = malloc(sizeof(struct hosts_record) * table->records_size);
+	table->buckets = malloc(sizeof(unsigned int) * 64);
+	if (table->records == NULL || table->buckets == NULL) {
+		_table_free(table);
+		return NULL;
+	}
+	memset(table->buckets, 0xff, sizeof(unsigned int) * 64);
+	table->buckets_mask = 63;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		debug_perror("Could not open the hosts file");
+		return table;
+	}
+
+	while (!failed && getline(&line, &line_size, fp) != -1)
+		failed = _parse_line(table, line);
+
+	free(line);
+	fclose(fp);
+
+	if (failed) {
+		_table_free(table);
+		return NULL;
+	}
+
+	return table;
+
+}
+
+static void _changed(void *arg) {
+
+	hosts_reload((struct hosts *)arg);
+
+}
+
+/**
+ * Loads the hosts file and starts watching it for changes
+ */
+struct hosts *hosts_new(char *path) {
+
+	struct hosts *hosts;
+
+	hosts = malloc(sizeof(struct hosts));
+	if (hosts == NULL)
+		return NULL;
+
+	memset(hosts, 0, sizeof(struct hosts));
+
+	hosts->path = strdup(path);
+	pthread_rwlock_init(&hosts->lock, NULL);
+
+	if (hosts->path == NULL || hosts_reload(hosts)) {
+		hosts_destroy(hosts);
+		return NULL;
+	}
+
+	hosts->watch = file_watch_new(path, _changed, hosts);
+
+	return hosts;
+
+}
+
+void hosts_destroy(struct hosts *hosts) {
+
+	if (hosts == NULL)
+		return;
+
+	file_watch_destroy(hosts->watch);
+
+	_table_free(hosts->table);
+	pthread_rwlock_destroy(&hosts->lock);
+	free(hosts->path);
+	free(hosts);
+
+}
+
+/**
+ * Builds a new table from the file and swaps it with the current one.
+ * Returns 1 on failure, the current table is kept then.
+ */
+int hosts_reload(struct hosts *hosts) {
+
+	struct hosts_table *table;
+	struct hosts_table *old;
+
+	table = hosts_table_load(hosts->path);
+	if (table == NULL) {
+		fprintf(stderr, "Could not load the hosts file %s\n", hosts->path);
+		return 1;
+	}
+
+	pthread_rwlock_wrlock(&hosts->lock);
+	old = hosts->table;
+	hosts->table = table;
+	pthread_rwlock_unlock(&hosts->lock);
+
+	_table_free(old);
+	hosts->reloads++;
+
+	log_info("Loaded %d records from %s\n", table->records_count, hosts->path);
+
+	return 0;
+
+}
+
+/**
+ * Answers a query for name, type class IN, from the hosts file. data
+ * holds the query, data_len bytes long, and receives the answer. A name
+ * in the file without addresses of the requested family gets an empty
+ * answer, so it does not leak upstream.
+ * Returns the length of the answer, or 0 if the name is not in the file
+ */
+int hosts_answer(struct hosts *hosts, char *name, unsigned short int type, struct dns_data *data, unsigned int data_len) {
+
+	struct hosts_table *table;
+	struct hosts_record *record;
+	char lname[DNS_NAME_SIZE];
+	unsigned int question_len;
+	unsigned int hash;
+	unsigned int idx;
+	unsigned int len = 0;
+	unsigned int res;
+	int found = 0;
+
+	if (type != DNS_TYPE_A && type != DNS_TYPE_AAAA && type != DNS_TYPE_PTR)
+		return 0;
+
+	question_len = dns_question_len(data, data_len);
+	if (question_len == 0)
+		return 0;
+
+	dns_name_lower(lname, name, sizeof(lname));
+	hash = dns_name_hash(lname);
+
+	pthread_rwlock_rdlock(&hosts->lock);
+
+	table = hosts->table;
+
+	for (idx = table->buckets[hash & table->buckets_mask]; idx != HOSTS_NONE; idx = record->next) {
+
+		record = &table->records[idx];
+		if (record->hash != hash || strcmp(table->pool + record->name, lname) != 0)
+			continue;
+
+		if (!found) {
+			len = dns_reply_init(data, question_len, 0);
+			found = 1;
+		}
+
+		if (record->type != type)
+			continue;
+
+		/* Answer full: send what fits */
+		res = dns_reply_add_rr(data, len, type, HOSTS_TTL, table->pool + record->rdata, record->rdata_len);
+		if (res == 0)
+			break;
+		len = res;
+
+	}
+
+	pthread_rwlock_unlock(&hosts->lock);
+
+	return len;
+
+}
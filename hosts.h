@@ -0,0 +1,59 @@
+#include <pthread.h>
+#include "dns.h"
+#include "watch.h"
+
+#ifndef HOSTS_H
+#define HOSTS_H
+
+/*
+ * TTL of the answers built from the hosts file
+ */
+#define HOSTS_TTL 300
+#define HOSTS_NONE 0xffffffff
+
+/*
+ * A record of the table. Names and record data live in the string pool
+ * of the table, records refer to them by offset.
+ */
+struct hosts_record {
+	unsigned int hash;
+	unsigned int name;
+	unsigned int rdata;
+	unsigned short int rdata_len;
+	unsigned short int type;
+	unsigned int next;
+};
+
+/*
+ * Read-only once built. Chains of the hash table are linked by record
+ * index, HOSTS_NONE ends them.
+ */
+struct hosts_table {
+	unsigned int *buckets;
+	unsigned int buckets_mask;
+	struct hosts_record *records;
+	unsigned int records_count;
+	unsigned int records_size;
+	char *pool;
+	unsigned int pool_len;
+	unsigned int pool_size;
+};
+
+struct hosts {
+	char *path;
+	/*
+	 * The lock is held for writing only to swap the table pointer, the
+	 * new table is built without it
+	 */
+	struct hosts_table *table;
+	pthread_rwlock_t lock;
+	struct file_watch *watch;
+	unsigned long reloads;
+};
+
+struct hosts *hosts_new(char *);
+void hosts_destroy(struct hosts *);
+int hosts_reload(struct hosts *);
+int hosts_answer(struct hosts *, char *, unsigned short int, struct dns_data *, unsigned int);
+
+#endif
@@ -0,0 +1,618 @@
+/*
+  **
+  ** load_gen.c
+  **
+  ** dproxy-load: sends queries to a DNS server at a target rate and
+  ** measures how fast and how many it answers. The names are drawn from
+  ** a file, one "name [type]" per line, or made up with a Zipfian or
+  ** uniform popularity, so a part of them hits the cache of dproxy.
+  **
+  ** Each thread has its own socket, or TCP connection with -T, and sends
+  ** its share of the rate on a fixed schedule whatever the answers do,
+  ** so a slow server shows up as latency and timeouts rather than as a
+  ** lower rate. The result is a line of key=value pairs:
+  **
+  **   transport=udp threads=2 rate=20000 duration=10 sent=200000
+  **   received=200000 timeouts=0 truncated=0 errors=0 qps=19998
+  **   p50_us=95 p99_us=410 p999_us=1800 max_us=5120
+  **
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/tcp.h>
+#include "dproxy.h"
+
+#define LOAD_IDS 65536
+#define LOAD_NAME_LEN 64
+
+struct load_name {
+	char name[LOAD_NAME_LEN];
+	unsigned short int type;
+};
+
+struct load_thread {
+	pthread_t tid;
+	unsigned int idx;
+	int sockfd;
+	/*
+	 * Send time of the query with each id, 0 when none is in flight
+	 */
+	unsigned long long *in_flight;
+	unsigned int oldest;
+	unsigned int next;
+	unsigned long long seed;
+	unsigned int *samples;
+	unsigned long samples_count;
+	unsigned long samples_size;
+	unsigned long sent;
+	unsigned long received;
+	unsigned long timeouts;
+	unsigned long truncated;
+	unsigned long errors;
+	/*
+	 * Bytes of the TCP stream not parsed yet
+	 */
+	unsigned char stream[2 + sizeof(struct dns_data)];
+	unsigned int stream_len;
+};
+
+static struct sockaddr_in load_server;
+static struct load_name *load_names;
+static unsigned long load_names_count = 10000;
+static unsigned long load_rate = 1000;
+static unsigned int load_threads = 1;
+static unsigned int load_duration = 10;
+static unsigned int load_window = 1000;
+static unsigned long long load_timeout = 2000000000ULL;
+static int load_tcp = 0;
+static double load_theta = 0.99;
+static double *load_cdf = NULL;
+
+static unsigned long long load_now_nsec(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+}
+
+static unsigned long long load_random(unsigned long long *state) {
+
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+
+	return *state * 2685821657736338717ULL;
+
+}
+
+/**
+ * Draws the index of a name, by binary search of the cumulative
+ * popularity for a Zipfian draw
+ */
+static unsigned long load_draw(unsigned long long *state) {
+
+	double u;
+	unsigned long low = 0;
+	unsigned long high = load_names_count - 1;
+	unsigned long middle;
+
+	if (load_cdf == NULL)
+		return load_random(state) % load_names_count;
+
+	u = (load_random(state) >> 11) * (1.0 / 9007199254740992.0);
+
+	while (low < high) {
+		middle = (low + high) / 2;
+		if (load_cdf[middle] < u)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	return low;
+
+}
+
+/**
+ * Reads the names of a file, "name [type]" on each line
+ * Returns 1 on failure
+ */
+static int load_read_names(char *path) {
+
+	FILE *fp;
+	char line[256];
+	char name[LOAD_NAME_LEN];
+	unsigned int type;
+	unsigned long size = 1024;
+	struct load_name *names;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		perror(path);
+		return 1;
+	}
+
+	load_names = malloc(sizeof(struct load_name) * size);
+	load_names_count = 0;
+
+	while (load_names != NULL && fgets(line, sizeof(line), fp) != NULL) {
+
+		type = DNS_TYPE_A;
+		if (line[0] == '#' || sscanf(line, "%63s %u", name, &type) < 1)
+			continue;
+
+		if (load_names_count == size) {
+			names = realloc(load_names, sizeof(struct load_name) * size * 2);
+			if (names == NULL) {
+				free(load_names);
+				load_names = NULL;
+				break;
+			}
+			load_names = names;
+			size *= 2;
+		}
+
+		strcpy(load_names[load_names_count].name, name);
+		load_names[load_names_count].type = type;
+		load_names_count++;
+
+	}
+
+	fclose(fp);
+
+	return load_names == NULL || load_names_count == 0;
+
+}
+
+/**
+ * Makes up the names, the first ones the most popular
+ * Returns 1 if out of memory
+ */
+static int load_make_names(void) {
+
+	unsigned long idx;
+	double total = 0;
+
+	load_names = malloc(sizeof(struct load_name) * load_names_count);
+	if (load_names == NULL)
+		return 1;
+
+	for (idx = 0; idx < load_names_count; idx++) {
+		snprintf(load_names[idx].name, LOAD_NAME_LEN, "q%lx.perf%lu.example", idx, idx % 97);
+		load_names[idx].type = DNS_TYPE_A;
+	}
+
+	if (load_theta <= 0)
+		return 0;
+
+	load_cdf = malloc(sizeof(double) * load_names_count);
+	if (load_cdf == NULL)
+		return 1;
+
+	for (idx = 0; idx < load_names_count; idx++) {
+		total += 1.0 / pow(idx + 1, load_theta);
+		load_cdf[idx] = total;
+	}
+
+	for (idx = 0; idx < load_names_count; idx++)
+		load_cdf[idx] /= total;
+
+	return 0;
+
+}
+
+/**
+ * Builds the query of name, with the given id
+ * Returns its length
+ */
+static unsigned int load_query(struct dns_data *data, struct load_name *name, unsigned short int id) {
+
+	unsigned short int tail[2];
+	unsigned int len;
+
+	memset(&data->dns_hdr, 0, sizeof(struct dns_header));
+	data->dns_hdr.dns_id = htons(id);
+	data->dns_hdr.dns_flags = htons(0x0100);
+	data->dns_hdr.dns_no_questions = htons(1);
+
+	strcpy(data->buf, name->name);
+	encode_domain_name(data->buf);
+	len = strlen(data->buf) + 1;
+
+	tail[0] = htons(name->type);
+	tail[1] = htons(1);
+	memcpy(data->buf + len, tail, sizeof(tail));
+
+	return sizeof(struct dns_header) + len + sizeof(tail);
+
+}
+
+static void load_sample(struct load_thread *thread, unsigned long long usec) {
+
+	unsigned int *samples;
+
+	if (thread->samples_count == thread->samples_size) {
+		samples = realloc(thread->samples, sizeof(unsigned int) * thread->samples_size * 2);
+		if (samples == NULL)
+			return;
+		thread->samples = samples;
+		thread->samples_size *= 2;
+	}
+
+	thread->samples[thread->samples_count++] = usec;
+
+}
+
+/**
+ * Matches an answer with its query
+ */
+static void load_answer(struct load_thread *thread, struct dns_data *data, unsigned int len, unsigned long long now) {
+
+	unsigned short int id;
+	unsigned short int flags;
+
+	if (len < sizeof(struct dns_header))
+		return;
+
+	id = ntohs(data->dns_hdr.dns_id);
+	if (thread->in_flight[id] == 0)
+		return;
+
+	flags = ntohs(data->dns_hdr.dns_flags);
+	if (flags & 0x0200)
+		thread->truncated++;
+	/* NXDOMAIN is an answer as good as any */
+	if ((flags & 0x000f) != 0 && (flags & 0x000f) != 3)
+		thread->errors++;
+
+	load_sample(thread, (now - thread->in_flight[id]) / 1000);
+	thread->in_flight[id] = 0;
+	thread->received++;
+
+}
+
+/**
+ * Reads the answers waiting on the socket
+ * Returns 1 if the connection was closed
+ */
+static int load_receive(struct load_thread *thread) {
+
+	struct dns_data data;
+	unsigned int len;
+	int res;
+
+	if (!load_tcp) {
+		while ((res = recv(thread->sockfd, &data, sizeof(data), MSG_DONTWAIT)) > 0)
+			load_answer(thread, &data, res, load_now_nsec());
+		return 0;
+	}
+
+	for (;;) {
+
+		res = recv(thread->sockfd, thread->stream + thread->stream_len, sizeof(thread->stream) - thread->stream_len, MSG_DONTWAIT);
+		if (res == 0)
+			return 1;
+		if (res < 0)
+			return 0;
+
+		thread->stream_len += res;
+
+		/* Messages are prefixed by their length */
+		while (thread->stream_len >= 2) {
+			len = (thread->stream[0] << 8) | thread->stream[1];
+			if (len > sizeof(struct dns_data))
+				return 1;
+			if (thread->stream_len < len + 2)
+				break;
+			memcpy(&data, thread->stream + 2, len);
+			load_answer(thread, &data, len, load_now_nsec());
+			thread->stream_len -= len + 2;
+			memmove(thread->stream, thread->stream + len + 2, thread->stream_len);
+		}
+
+	}
+
+}
+
+/**
+ * Sends a query. Queries are numbered in order, the oldest ones in
+ * flight time out first.
+ */
+static void load_send(struct load_thread *thread, unsigned long long now) {
+
+	unsigned char packet[2 + sizeof(struct dns_data)];
+	unsigned short int id = thread->next;
+	unsigned int len;
+
+	len = load_query((struct dns_data *)(packet + 2), &load_names[load_draw(&thread->seed)], id);
+
+	if (load_tcp) {
+		packet[0] = len >> 8;
+		packet[1] = len & 0xff;
+		if (send(thread->sockfd, packet, len + 2, MSG_NOSIGNAL) != len + 2)
+			return;
+	} else if (send(thread->sockfd, packet + 2, len, 0) != len) {
+		return;
+	}
+
+	thread->in_flight[id] = now;
+	thread->next++;
+	thread->sent++;
+
+}
+
+static void load_expire(struct load_thread *thread, unsigned long long now, unsigned long long timeout) {
+
+	unsigned short int id;
+
+	while (thread->oldest != thread->next) {
+		id = thread->oldest;
+		if (thread->in_flight[id] != 0) {
+			if (thread->in_flight[id] + timeout > now)
+				break;
+			thread->in_flight[id] = 0;
+			thread->timeouts++;
+		}
+		thread->oldest++;
+	}
+
+}
+
+static int load_connect(void) {
+
+	int fd;
+	int on = 1;
+
+	fd = socket(AF_INET, load_tcp ? SOCK_STREAM : SOCK_DGRAM, 0);
+	if (fd < 0)
+		return -1;
+
+	if (load_tcp)
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	if (connect(fd, (struct sockaddr *)&load_server, sizeof(load_server)) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+
+}
+
+static void *load_thread_run(void *args) {
+
+	struct load_thread *thread = (struct load_thread *)args;
+	struct pollfd pfd;
+	struct timespec wait;
+	unsigned long long interval;
+	unsigned long long start;
+	unsigned long long next_send;
+	unsigned long long end;
+	unsigned long long now;
+	int closed = 0;
+
+	interval = 1000000000ULL * load_threads / load_rate;
+
+	pfd.fd = thread->sockfd;
+	pfd.events = POLLIN;
+
+	start = load_now_nsec();
+	end = start + load_duration * 1000000000ULL;
+	/* Threads don't send at the same time */
+	next_send = start + interval * thread->idx / load_threads;
+
+	while (!closed) {
+
+		now = load_now_nsec();
+
+		if (now >= end + load_timeout || (now >= end && thread->oldest == thread->next))
+			break;
+
+		while (now < end && now >= next_send && thread->next - thread->oldest < load_window) {
+			load_send(thread, now);
+			next_send += interval;
+		}
+
+		/* Behind the schedule with the window full */
+		if (now >= next_send)
+			next_send = now + interval;
+
+		wait.tv_sec = 0;
+		wait.tv_nsec = (now < end && next_send > now) ? next_send - now : 1000000;
+		if (wait.tv_nsec > 1000000)
+			wait.tv_nsec = 1000000;
+
+		if (ppoll(&pfd, 1, &wait, NULL) > 0)
+			closed = load_receive(thread);
+
+		load_expire(thread, load_now_nsec(), load_timeout);
+
+	}
+
+	/* What is left never got an answer */
+	load_expire(thread, ~0ULL, 0);
+
+	return NULL;
+
+}
+
+static int load_compare(const void *a, const void *b) {
+
+	unsigned int sa = *(const unsigned int *)a;
+	unsigned int sb = *(const unsigned int *)b;
+
+	return (sa > sb) - (sa < sb);
+
+}
+
+static void load_usage(char *program) {
+
+	fprintf(stderr, "usage: %s [-s address] [-p port] [-r rate] [-d seconds] [-j threads] [-n names] [-z theta] [-f file] [-c window] [-w msec] [-T]\n", program);
+	fprintf(stderr, "\t-s\tserver address, default 127.0.0.1\n");
+	fprintf(stderr, "\t-p\tserver port, default 53\n");
+	fprintf(stderr, "\t-r\tqueries per second, default 1000\n");
+	fprintf(stderr, "\t-d\tduration in seconds, default 10\n");
+	fprintf(stderr, "\t-j\tthreads, default 1\n");
+	fprintf(stderr, "\t-n\tnames made up, default 10000\n");
+	fprintf(stderr, "\t-z\texponent of their Zipfian popularity, 0 for uniform, default 0.99\n");
+	fprintf(stderr, "\t-f\tread the names from a file instead, \"name [type]\" per line\n");
+	fprintf(stderr, "\t-c\tqueries in flight per thread at most, default 1000\n");
+	fprintf(stderr, "\t-w\tmilliseconds before a query times out, default 2000\n");
+	fprintf(stderr, "\t-T\tsend the queries over TCP, a connection per thread\n");
+
+}
+
+int main(int argc, char *argv[]) {
+
+	struct load_thread *threads;
+	struct load_thread total;
+	unsigned int *samples;
+	unsigned long count;
+	unsigned int idx;
+	char *file = NULL;
+	int opt;
+
+	memset(&load_server, 0, sizeof(load_server));
+	load_server.sin_family = AF_INET;
+	load_server.sin_port = htons(53);
+	load_server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	while ((opt = getopt(argc, argv, "s:p:r:d:j:n:z:f:c:w:Th")) != -1) {
+		switch (opt) {
+		case 's':
+			if (inet_pton(AF_INET, optarg, &load_server.sin_addr) != 1) {
+				fprintf(stderr, "Invalid address %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'p':
+			load_server.sin_port = htons(atoi(optarg));
+			break;
+		case 'r':
+			load_rate = strtoul(optarg, NULL, 10);
+			break;
+		case 'd':
+			load_duration = atoi(optarg);
+			break;
+		case 'j':
+			load_threads = atoi(optarg);
+			break;
+		case 'n':
+			load_names_count = strtoul(optarg, NULL, 10);
+			break;
+		case 'z':
+			load_theta = atof(optarg);
+			break;
+		case 'f':
+			file = optarg;
+			break;
+		case 'c':
+			load_window = atoi(optarg);
+			break;
+		case 'w':
+			load_timeout = strtoull(optarg, NULL, 10) * 1000000ULL;
+			break;
+		case 'T':
+			load_tcp = 1;
+			break;
+		default:
+			load_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (load_rate == 0 || load_duration == 0 || load_threads == 0 || load_names_count == 0 || load_window == 0 || load_window >= LOAD_IDS) {
+		load_usage(argv[0]);
+		return 1;
+	}
+
+	if (file != NULL ? load_read_names(file) : load_make_names()) {
+		fprintf(stderr, "Could not prepare the names\n");
+		return 1;
+	}
+
+	threads = calloc(load_threads, sizeof(struct load_thread));
+	if (threads == NULL)
+		return 1;
+
+	for (idx = 0; idx < load_threads; idx++) {
+
+		threads[idx].idx = idx;
+		threads[idx].seed = 0x9e3779b97f4a7c15ULL * (idx + 1);
+		threads[idx].in_flight = calloc(LOAD_IDS, sizeof(unsigned long long));
+		threads[idx].samples_size = 4096;
+		threads[idx].samples = malloc(sizeof(unsigned int) * threads[idx].samples_size);
+		threads[idx].sockfd = load_connect();
+
+		if (threads[idx].in_flight == NULL || threads[idx].samples == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			return 1;
+		}
+
+		if (threads[idx].sockfd < 0) {
+			perror("Could not connect to the server");
+			return 1;
+		}
+
+	}
+
+	for (idx = 0; idx < load_threads; idx++)
+		pthread_create(&threads[idx].tid, NULL, load_thread_run, &threads[idx]);
+
+	memset(&total, 0, sizeof(total));
+
+	for (idx = 0; idx < load_threads; idx++) {
+		pthread_join(threads[idx].tid, NULL);
+		total.sent += threads[idx].sent;
+		total.received += threads[idx].received;
+		total.timeouts += threads[idx].timeouts;
+		total.truncated += threads[idx].truncated;
+		total.errors += threads[idx].errors;
+		total.samples_count += threads[idx].samples_count;
+		close(threads[idx].sockfd);
+	}
+
+	samples = malloc(sizeof(unsigned int) * (total.samples_count + 1));
+	if (samples == NULL)
+		return 1;
+
+	count = 0;
+	for (idx = 0; idx < load_threads; idx++) {
+		memcpy(samples + count, threads[idx].samples, sizeof(unsigned int) * threads[idx].samples_count);
+		count += threads[idx].samples_count;
+		free(threads[idx].samples);
+		free(threads[idx].in_flight);
+	}
+
+	/* Without answers there is no latency to speak of */
+	if (count == 0)
+		samples[0] = 0;
+
+	qsort(samples, count, sizeof(unsigned int), load_compare);
+
+	printf("transport=%s threads=%u rate=%lu duration=%u sent=%lu received=%lu timeouts=%lu truncated=%lu errors=%lu qps=%.0f p50_us=%u p99_us=%u p999_us=%u max_us=%u\n",
+		load_tcp ? "tcp" : "udp", load_threads, load_rate, load_duration,
+		total.sent, total.received, total.timeouts, total.truncated, total.errors,
+		(double)total.received / load_duration,
+		samples[count * 50 / 100], samples[count * 99 / 100], samples[count * 999 / 1000], samples[count ? count - 1 : 0]);
+
+	free(samples);
+	free(threads);
+	free(load_names);
+	free(load_cdf);
+
+	/* Lost answers fail the run, so regressions stop a script */
+	return total.timeouts > 0;
+
+}
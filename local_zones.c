@@ -0,0 +1,111 @@
+/*
+  **
+  ** local_zones.c
+  **
+  ** Reverse zones of the private and special-use address ranges, served
+  ** locally as RFC 6303 asks. Nobody on the Internet can answer for them,
+  ** so forwarding the queries only buys a slow NXDOMAIN and leaks the
+  ** addresses of the LAN. Names of these zones get an authoritative
+  ** negative answer right away, with the SOA record of the zone so the
+  ** clients cache it. Mappings from the hosts file or the dhcp leases
+  ** are looked up before, and win.
+  **
+*/
+
+#include "dproxy.h"
+#include "local_zones.h"
+
+static char *local_zones[] = {
+	/* RFC 1918 */
+	"10.in-addr.arpa",
+	"16.172.in-addr.arpa",
+	"17.172.in-addr.arpa",
+	"18.172.in-addr.arpa",
+	"19.172.in-addr.arpa",
+	"20.172.in-addr.arpa",
+	"21.172.in-addr.arpa",
+	"22.172.in-addr.arpa",
+	"23.172.in-addr.arpa",
+	"24.172.in-addr.arpa",
+	"25.172.in-addr.arpa",
+	"26.172.in-addr.arpa",
+	"27.172.in-addr.arpa",
+	"28.172.in-addr.arpa",
+	"29.172.in-addr.arpa",
+	"30.172.in-addr.arpa",
+	"31.172.in-addr.arpa",
+	"168.192.in-addr.arpa",
+	/* RFC 5735, 5737 */
+	"0.in-addr.arpa",
+	"127.in-addr.arpa",
+	"254.169.in-addr.arpa",
+	"2.0.192.in-addr.arpa",
+	"100.51.198.in-addr.arpa",
+	"113.0.203.in-addr.arpa",
+	"255.255.255.255.in-addr.arpa",
+	/* RFC 4291, unspecified and loopback */
+	"0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.ip6.arpa",
+	"1.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.ip6.arpa",
+	/* RFC 4193, unique local */
+	"d.f.ip6.arpa",
+	/* RFC 4291, link local */
+	"8.e.f.ip6.arpa",
+	"9.e.f.ip6.arpa",
+	"a.e.f.ip6.arpa",
+	"b.e.f.ip6.arpa",
+	/* RFC 3849, documentation */
+	"8.b.d.0.1.0.0.2.ip6.arpa",
+	NULL
+};
+
+/**
+ * Answers a query for name, type class IN, if the name belongs to one of
+ * the local zones: NXDOMAIN for the names in the zone, an empty answer
+ * (or the SOA record if asked for) for the zone itself. data holds the
+ * query, data_len bytes long, and receives the answer.
+ * Returns the length of the answer, or 0 if the name is not local
+ */
+int local_zones_answer(char *name, unsigned short int type, struct dns_data *data, unsigned int data_len) {
+
+	char lname[DNS_NAME_SIZE];
+	char **zone;
+	unsigned int question_len;
+	unsigned int name_len;
+	unsigned int zone_len;
+	unsigned int offset;
+	unsigned int len;
+
+	dns_name_lower(lname, name, sizeof(lname));
+	name_len = strlen(lname);
+
+	for (zone = local_zones; *zone != NULL; zone++) {
+		zone_len = strlen(*zone);
+		if (name_len == zone_len && strcmp(lname, *zone) == 0)
+			break;
+		if (name_len > zone_len && lname[name_len - zone_len - 1] == '.' && strcmp(lname + name_len - zone_len, *zone) == 0)
+			break;
+	}
+
+	if (*zone == NULL)
+		return 0;
+
+	question_len = dns_question_len(data, data_len);
+	if (question_len == 0)
+		return 0;
+
+	/*
+	 * The labels of the dotted name start where they do in the encoded
+	 * one, so the zone name can be pointed to within the question
+	 */
+	offset = sizeof(struct dns_header) + name_len - zone_len;
+
+	if (name_len > zone_len) {
+		len = dns_reply_init(data, question_len, 3);
+		return dns_reply_add_soa(data, len, 1, offset, LOCAL_ZONES_TTL);
+	}
+
+	len = dns_reply_init(data, question_len, 0);
+
+	return dns_reply_add_soa(data, len, type != DNS_TYPE_SOA, offset, LOCAL_ZONES_TTL);
+
+}
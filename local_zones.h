@@ -0,0 +1,14 @@
+#include "dns.h"
+
+#ifndef LOCAL_ZONES_H
+#define LOCAL_ZONES_H
+
+/*
+ * TTL of the SOA records of the local zones, which is also how long
+ * the negative answers may be cached
+ */
+#define LOCAL_ZONES_TTL 10800
+
+int local_zones_answer(char *, unsigned short int, struct dns_data *, unsigned int);
+
+#endif
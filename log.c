@@ -0,0 +1,276 @@
+/*
+  **
+  ** log.c
+  **
+  ** The log. Threads format their lines into rings of their own, without
+  ** locks or system calls, and a writer thread copies them to the debug
+  ** file and to stderr. The level is checked by the macros of log.h
+  ** before any formatting, so disabled lines cost next to nothing. Lines
+  ** written before the writer starts, or after it stops, go straight to
+  ** the output.
+  **
+*/
+
+#include <pthread.h>
+#include "dproxy.h"
+#include "conf.h"
+#include "log.h"
+
+int log_level = LOG_LEVEL_DEFAULT;
+
+static __thread struct log_ring *log_local = NULL;
+
+/*
+ * Rings are never freed while the writer runs: the ring of a thread
+ * going away is released and taken over by the next new thread
+ */
+static struct log_ring *log_rings = NULL;
+static pthread_mutex_t log_rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static volatile int log_running = 0;
+static pthread_t log_tid;
+static FILE *log_fp = NULL;
+static pid_t log_pid;
+
+/**
+ * Writes a line to the debug file, if any, and to stderr unless in
+ * daemon mode
+ */
+static void log_output(FILE *fp, char *text, unsigned int len) {
+
+	if (fp != NULL) {
+		fprintf(fp, "[ %d ]: ", log_pid);
+		fwrite(text, 1, len, fp);
+	}
+
+	if (!config.daemon_mode) {
+		fprintf(stderr, "[ %d ]: ", log_pid);
+		fwrite(text, 1, len, stderr);
+	}
+
+}
+
+/**
+ * Takes a released ring, or allocates a new one
+ * Returns NULL if out of memory
+ */
+static struct log_ring *log_ring_get(void) {
+
+	struct log_ring *ring;
+
+	for (ring = log_rings; ring != NULL; ring = ring->next) {
+		if (ring->released && __sync_bool_compare_and_swap(&ring->released, 1, 0)) {
+			log_local = ring;
+			return ring;
+		}
+	}
+
+	if (posix_memalign((void **)&ring, 64, sizeof(struct log_ring)) != 0)
+		return NULL;
+
+	memset(ring, 0, sizeof(struct log_ring));
+
+	pthread_mutex_lock(&log_rings_mutex);
+	ring->next = log_rings;
+	__atomic_store_n(&log_rings, ring, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&log_rings_mutex);
+
+	log_local = ring;
+
+	return ring;
+
+}
+
+void log_write(int level, char *fmt, ...) {
+
+	struct log_ring *ring;
+	struct log_record *record;
+	char text[LOG_RECORD_SIZE];
+	unsigned long head;
+	va_list args;
+	FILE *fp = NULL;
+	int len;
+
+	if (!log_running) {
+
+		va_start(args, fmt);
+		len = vsnprintf(text, sizeof(text), fmt, args);
+		va_end(args);
+
+		if (len >= (int)sizeof(text))
+			len = sizeof(text) - 1;
+
+		log_pid = getpid();
+		if (config.debug_file[0] && (fp = fopen(config.debug_file, "a")) == NULL)
+			syslog(LOG_ERR, "could not open log file %m");
+
+		log_output(fp, text, len);
+
+		if (fp != NULL)
+			fclose(fp);
+
+		return;
+
+	}
+
+	ring = (log_local != NULL) ? log_local : log_ring_get();
+	if (ring == NULL)
+		return;
+
+	head = ring->head;
+
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= LOG_RING_SLOTS) {
+		ring->dropped++;
+		return;
+	}
+
+	record = &ring->records[head % LOG_RING_SLOTS];
+
+	va_start(args, fmt);
+	len = vsnprintf(record->text, sizeof(record->text), fmt, args);
+	va_end(args);
+
+	if (len < 0)
+		return;
+
+	record->len = (len < (int)sizeof(record->text)) ? len : sizeof(record->text) - 1;
+	record->level = level;
+
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+}
+
+/**
+ * Copies the lines of all the rings to the output
+ * Returns the number of lines copied
+ */
+static unsigned int log_drain(void) {
+
+	struct log_ring *ring;
+	struct log_record *record;
+	char text[64];
+	unsigned long head;
+	unsigned long tail;
+	unsigned long dropped;
+	unsigned int count = 0;
+
+	for (ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+		for (tail = ring->tail; tail != head; tail++) {
+			record = &ring->records[tail % LOG_RING_SLOTS];
+			log_output(log_fp, record->text, record->len);
+			count++;
+		}
+
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+		dropped = ring->dropped;
+		if (dropped != ring->dropped_reported) {
+			snprintf(text, sizeof(text), "%lu log lines dropped\n", dropped - ring->dropped_reported);
+			log_output(log_fp, text, strlen(text));
+			ring->dropped_reported = dropped;
+			count++;
+		}
+
+	}
+
+	if (count > 0) {
+		if (log_fp != NULL)
+			fflush(log_fp);
+		if (!config.daemon_mode)
+			fflush(stderr);
+	}
+
+	return count;
+
+}
+
+static void *log_writer(void *args) {
+
+	while (log_running)
+		if (log_drain() == 0)
+			usleep(LOG_FLUSH_MSEC * 1000);
+
+	/* Whatever was written before log_stop() */
+	log_drain();
+
+	return NULL;
+
+}
+
+/**
+ * Starts the writer thread and logs from now on at the given level. To
+ * be called after the daemon has forked.
+ * Returns 1 on failure, lines are then written directly
+ */
+int log_start(int level) {
+
+	log_level = level;
+	log_pid = getpid();
+
+	if (config.debug_file[0]) {
+		log_fp = fopen(config.debug_file, "a");
+		if (log_fp == NULL)
+			syslog(LOG_ERR, "could not open log file %m");
+	}
+
+	log_running = 1;
+
+	if (pthread_create(&log_tid, NULL, log_writer, NULL) != 0) {
+		log_running = 0;
+		if (log_fp != NULL)
+			fclose(log_fp);
+		log_fp = NULL;
+		return 1;
+	}
+
+	return 0;
+
+}
+
+/**
+ * Writes the pending lines and stops the writer thread
+ */
+void log_stop(void) {
+
+	struct log_ring *ring;
+
+	if (!log_running)
+		return;
+
+	log_running = 0;
+	pthread_join(log_tid, NULL);
+
+	if (log_fp != NULL)
+		fclose(log_fp);
+	log_fp = NULL;
+
+	/*
+	 * The other threads are gone by now, and their rings with them
+	 */
+	pthread_mutex_lock(&log_rings_mutex);
+	while ((ring = log_rings) != NULL) {
+		log_rings = ring->next;
+		free(ring);
+	}
+	pthread_mutex_unlock(&log_rings_mutex);
+
+	log_local = NULL;
+
+}
+
+/**
+ * Releases the ring of the calling thread, to be called by threads about
+ * to exit. Its lines are still written out.
+ */
+void log_thread_exit(void) {
+
+	if (log_local == NULL)
+		return;
+
+	__atomic_store_n(&log_local->released, 1, __ATOMIC_RELEASE);
+	log_local = NULL;
+
+}
@@ -0,0 +1,58 @@
+#include <pthread.h>
+
+#ifndef LOG_H
+#define LOG_H
+
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARNING 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_DEBUG 3
+
+/*
+ * Each thread writes its lines into a ring of LOG_RING_SLOTS records of
+ * its own. Lines longer than a record are cut, lines finding the ring
+ * full are dropped and counted. The writer thread looks for new lines
+ * every LOG_FLUSH_MSEC when the rings are empty.
+ */
+#define LOG_RING_SLOTS 128
+#define LOG_RECORD_SIZE 512
+#define LOG_FLUSH_MSEC 50
+
+struct log_record {
+	unsigned short int len;
+	unsigned char level;
+	char text[LOG_RECORD_SIZE - 3];
+};
+
+/*
+ * Single producer, single consumer: head is only written by the owning
+ * thread, tail only by the writer thread, each on its own cache line
+ */
+struct log_ring {
+	volatile unsigned long head __attribute__((aligned(64)));
+	unsigned long dropped;
+	volatile unsigned long tail __attribute__((aligned(64)));
+	unsigned long dropped_reported;
+	int released __attribute__((aligned(64)));
+	struct log_ring *next;
+	struct log_record records[LOG_RING_SLOTS];
+};
+
+extern int log_level;
+
+/*
+ * The level is checked before the arguments are even evaluated, so a
+ * disabled line costs a compare
+ */
+#define log_error(...) do { if (log_level >= LOG_LEVEL_ERROR) log_write(LOG_LEVEL_ERROR, __VA_ARGS__); } while (0)
+#define log_warning(...) do { if (log_level >= LOG_LEVEL_WARNING) log_write(LOG_LEVEL_WARNING, __VA_ARGS__); } while (0)
+#define log_info(...) do { if (log_level >= LOG_LEVEL_INFO) log_write(LOG_LEVEL_INFO, __VA_ARGS__); } while (0)
+#define debug(...) do { if (log_level >= LOG_LEVEL_DEBUG) log_write(LOG_LEVEL_DEBUG, __VA_ARGS__); } while (0)
+#define debug_perror(msg) log_error("%s : %s\n", (msg), strerror(errno))
+
+void log_write(int, char *, ...) __attribute__((format(printf, 2, 3)));
+int log_start(int);
+void log_stop(void);
+void log_thread_exit(void);
+
+#endif
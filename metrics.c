@@ -0,0 +1,455 @@
+/*
+  **
+  ** metrics.c
+  **
+  ** Serves the statistics in the Prometheus text exposition format, over
+  ** HTTP on a local TCP port or on a unix socket. Scrapes are answered
+  ** one at a time by a thread of its own, from the per-thread counters
+  ** of stats.c and from numbers the other modules keep up to date, so a
+  ** scrape never walks the cache or holds a lock the resolvers need.
+  ** The top names and clients are left to the control socket: as label
+  ** values every name or client that made the list would be a series.
+  **
+*/
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <poll.h>
+#include <sys/un.h>
+#include "dproxy.h"
+#include "cache.h"
+#include "forward.h"
+#include "conf.h"
+#include "stats.h"
+#include "metrics.h"
+#include "reload.h"
+
+static void *metrics_loop(void *);
+
+/*
+ * Names of the query types worth a name, the others are reported by
+ * number
+ */
+static struct {
+	unsigned short int type;
+	char *name;
+} metrics_qtypes[] = {
+	{ 1, "A" }, { 2, "NS" }, { 5, "CNAME" }, { 6, "SOA" }, { 12, "PTR" },
+	{ 15, "MX" }, { 16, "TXT" }, { 28, "AAAA" }, { 33, "SRV" }, { 35, "NAPTR" },
+	{ 43, "DS" }, { 48, "DNSKEY" }, { 64, "SVCB" }, { 65, "HTTPS" }, { 255, "ANY" },
+	{ 0, NULL }
+};
+
+/**
+ * Opens the listening socket: a unix socket if listen is a path, a TCP
+ * port of the loopback address otherwise, or of the address given as
+ * "address:port"
+ * Returns the socket, or -1 on failure
+ */
+static int metrics_sock_open(struct metrics *metrics, char *listen_on) {
+
+	struct sockaddr_un su;
+	struct sockaddr_in sa;
+	char address[CONF_PATH_LEN];
+	char *port;
+	int fd;
+	int on = 1;
+
+	if (listen_on[0] == '/') {
+
+		memset(&su, 0, sizeof(su));
+		su.sun_family = AF_UNIX;
+		if (strlen(listen_on) >= sizeof(su.sun_path))
+			return -1;
+		strcpy(su.sun_path, listen_on);
+
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0)
+			return -1;
+
+		/* Left behind by a previous run */
+		unlink(listen_on);
+
+		if (bind(fd, (struct sockaddr *)&su, sizeof(su)) < 0 || listen(fd, 8) < 0) {
+			close(fd);
+			return -1;
+		}
+
+		metrics->path = strdup(listen_on);
+
+		return fd;
+
+	}
+
+	strncpy(address, listen_on, sizeof(address) - 1);
+	address[sizeof(address) - 1] = 0;
+
+	port = strrchr(address, ':');
+	if (port != NULL)
+		*port++ = 0;
+	else
+		port = address;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(atoi(port));
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (port != address && inet_pton(AF_INET, address, &sa.sin_addr) != 1)
+		return -1;
+
+	if (sa.sin_port == 0)
+		return -1;
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+	if (fd < 0)
+		return -1;
+
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 || listen(fd, 8) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+
+}
+
+/**
+ * Starts serving the metrics on listen_on, or on fd if not -1, a socket
+ * already listening there. The worker pools and the TCP server, which
+ * may be NULL, are reported too.
+ * Returns NULL on failure
+ */
+struct metrics *metrics_new(char *listen_on, int fd, struct worker_pool **pools, unsigned int pools_count, struct tcp_server *tcp_server) {
+
+	struct metrics *metrics;
+
+	metrics = malloc(sizeof(struct metrics));
+	if (metrics == NULL)
+		return NULL;
+
+	memset(metrics, 0, sizeof(struct metrics));
+
+	if (fd >= 0) {
+		metrics->fd = fd;
+		if (listen_on[0] == '/')
+			metrics->path = strdup(listen_on);
+	} else
+		metrics->fd = metrics_sock_open(metrics, listen_on);
+
+	if (metrics->fd < 0) {
+		fprintf(stderr, "Could not listen for metrics on %s: %s\n", listen_on, strerror(errno));
+		free(metrics);
+		return NULL;
+	}
+
+	metrics->pools = pools;
+	metrics->pools_count = pools_count;
+	metrics->tcp_server = tcp_server;
+	metrics->run = 1;
+
+	if (pthread_create(&metrics->tid, NULL, metrics_loop, metrics) != 0) {
+		close(metrics->fd);
+		if (metrics->path != NULL)
+			unlink(metrics->path);
+		free(metrics->path);
+		free(metrics);
+		return NULL;
+	}
+
+	return metrics;
+
+}
+
+void metrics_destroy(struct metrics *metrics) {
+
+	if (metrics == NULL)
+		return;
+
+	metrics->run = 0;
+	pthread_join(metrics->tid, NULL);
+
+	close(metrics->fd);
+	if (metrics->path != NULL)
+		unlink(metrics->path);
+
+	free(metrics->path);
+	free(metrics);
+
+}
+
+static void metrics_header(FILE *fp, char *name, char *type, char *help) {
+
+	fprintf(fp, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+
+}
+
+static void metrics_counter(FILE *fp, char *name, char *help, unsigned long value) {
+
+	metrics_header(fp, name, "counter", help);
+	fprintf(fp, "%s %lu\n", name, value);
+
+}
+
+static void metrics_gauge(FILE *fp, char *name, char *help, unsigned long value) {
+
+	metrics_header(fp, name, "gauge", help);
+	fprintf(fp, "%s %lu\n", name, value);
+
+}
+
+/**
+ * Writes a histogram of microseconds in seconds, with cumulative buckets
+ */
+static void metrics_histogram(FILE *fp, char *name, char *help, struct stats_histogram_data *data) {
+
+	unsigned long total = 0;
+	unsigned int idx;
+
+	metrics_header(fp, name, "histogram", help);
+
+	for (idx = 0; idx < STATS_BUCKETS - 1; idx++) {
+		total += data->buckets[idx];
+		fprintf(fp, "%s_bucket{le=\"%g\"} %lu\n", name, stats_bucket_bounds[idx] / 1000000.0, total);
+	}
+
+	fprintf(fp, "%s_bucket{le=\"+Inf\"} %lu\n", name, data->count);
+	fprintf(fp, "%s_sum %.6f\n", name, data->sum / 1000000.0);
+	fprintf(fp, "%s_count %lu\n", name, data->count);
+
+}
+
+static void metrics_write_qtypes(FILE *fp, struct stats_thread *total) {
+
+	unsigned int type;
+	unsigned int idx;
+
+	metrics_header(fp, "dproxy_queries_by_type_total", "counter", "Queries by type, 0 for the types above 255.");
+
+	for (type = 0; type < STATS_QTYPES; type++) {
+
+		if (total->qtypes[type] == 0)
+			continue;
+
+		for (idx = 0; metrics_qtypes[idx].name != NULL && metrics_qtypes[idx].type != type; idx++)
+			;
+
+		if (metrics_qtypes[idx].name != NULL)
+			fprintf(fp, "dproxy_queries_by_type_total{type=\"%s\"} %lu\n", metrics_qtypes[idx].name, total->qtypes[type]);
+		else
+			fprintf(fp, "dproxy_queries_by_type_total{type=\"%u\"} %lu\n", type, total->qtypes[type]);
+
+	}
+
+}
+
+static void metrics_write_pools(FILE *fp, struct metrics *metrics) {
+
+	struct worker_pool *pool;
+	unsigned int idx;
+	unsigned int thread;
+	unsigned int busy;
+
+	metrics_header(fp, "dproxy_workers", "gauge", "Worker threads of the node.");
+	for (idx = 0; idx < metrics->pools_count; idx++)
+		fprintf(fp, "dproxy_workers{node=\"%u\"} %u\n", idx, metrics->pools[idx]->count);
+
+	metrics_header(fp, "dproxy_workers_busy", "gauge", "Worker threads of the node resolving a query.");
+	for (idx = 0; idx < metrics->pools_count; idx++) {
+		pool = metrics->pools[idx];
+		busy = 0;
+		for (thread = 0; thread < pool->count; thread++)
+			busy += (pool->t_info[thread] != NULL && pool->t_info[thread]->busy);
+		fprintf(fp, "dproxy_workers_busy{node=\"%u\"} %u\n", idx, busy);
+	}
+
+	metrics_header(fp, "dproxy_worker_pool_grown_total", "counter", "Times the worker pool of the node grew.");
+	for (idx = 0; idx < metrics->pools_count; idx++)
+		fprintf(fp, "dproxy_worker_pool_grown_total{node=\"%u\"} %lu\n", idx, metrics->pools[idx]->grown);
+
+	metrics_header(fp, "dproxy_worker_pool_shrunk_total", "counter", "Times the worker pool of the node shrank.");
+	for (idx = 0; idx < metrics->pools_count; idx++)
+		fprintf(fp, "dproxy_worker_pool_shrunk_total{node=\"%u\"} %lu\n", idx, metrics->pools[idx]->shrunk);
+
+	metrics_header(fp, "dproxy_packet_buffers", "gauge", "Packet buffers of the node.");
+	for (idx = 0; idx < metrics->pools_count; idx++)
+		fprintf(fp, "dproxy_packet_buffers{node=\"%u\"} %u\n", idx, metrics->pools[idx]->packets->size);
+
+	metrics_header(fp, "dproxy_packet_buffers_free", "gauge", "Packet buffers of the node in the shared free list.");
+	for (idx = 0; idx < metrics->pools_count; idx++)
+		fprintf(fp, "dproxy_packet_buffers_free{node=\"%u\"} %u\n", idx, metrics->pools[idx]->packets->free_count);
+
+	metrics_header(fp, "dproxy_packet_queue_length", "gauge", "Packets of the node waiting for a worker.");
+	for (idx = 0; idx < metrics->pools_count; idx++)
+		fprintf(fp, "dproxy_packet_queue_length{node=\"%u\"} %u\n", idx, metrics->pools[idx]->packets->queue_len);
+
+	metrics_header(fp, "dproxy_packet_pool_exhausted_total", "counter", "Times the receiver of the node found no free packet buffer.");
+	for (idx = 0; idx < metrics->pools_count; idx++)
+		fprintf(fp, "dproxy_packet_pool_exhausted_total{node=\"%u\"} %lu\n", idx, metrics->pools[idx]->packets->exhausted);
+
+}
+
+static void metrics_write_routes(FILE *fp) {
+
+	struct forward_route *route;
+	unsigned int token;
+
+	/* A reload may swap the routes meanwhile */
+	token = reload_read_lock();
+
+	metrics_header(fp, "dproxy_forward_queries_total", "counter", "Queries sent to the servers of the domain.");
+	for (route = forward->routes; route != NULL; route = route->list_next)
+		fprintf(fp, "dproxy_forward_queries_total{domain=\"%s\"} %lu\n", route->zone[0] ? route->zone : ".", route->queries);
+
+	metrics_header(fp, "dproxy_forward_answered_total", "counter", "Queries of the domain answered by one of its servers.");
+	for (route = forward->routes; route != NULL; route = route->list_next)
+		fprintf(fp, "dproxy_forward_answered_total{domain=\"%s\"} %lu\n", route->zone[0] ? route->zone : ".", route->answered);
+
+	metrics_header(fp, "dproxy_forward_failed_total", "counter", "Queries of the domain none of its servers answered.");
+	for (route = forward->routes; route != NULL; route = route->list_next)
+		fprintf(fp, "dproxy_forward_failed_total{domain=\"%s\"} %lu\n", route->zone[0] ? route->zone : ".", route->failed);
+
+	reload_read_unlock(token);
+
+}
+
+/**
+ * Writes all the metrics
+ */
+static void metrics_write(FILE *fp, struct metrics *metrics) {
+
+	struct stats_thread *total;
+
+	/* Too large for the stack of a thread */
+	total = malloc(sizeof(struct stats_thread));
+	if (total == NULL)
+		return;
+
+	stats_read(total);
+
+	metrics_header(fp, "dproxy_build_info", "gauge", "Version of dproxy.");
+	fprintf(fp, "dproxy_build_info{version=\"%s\",compiler=\"%s\"} 1\n", DPROXY_VERSION, __VERSION__);
+
+	metrics_header(fp, "dproxy_queries_total", "counter", "Queries received.");
+	fprintf(fp, "dproxy_queries_total{transport=\"udp\"} %lu\n", total->counters[STATS_UDP_QUERIES]);
+	fprintf(fp, "dproxy_queries_total{transport=\"tcp\"} %lu\n", total->counters[STATS_TCP_QUERIES]);
+
+	metrics_write_qtypes(fp, total);
+
+	metrics_counter(fp, "dproxy_cache_hits_total", "Queries answered from the cache.", total->counters[STATS_CACHE_HITS]);
+	metrics_counter(fp, "dproxy_cache_misses_total", "Queries not found in the cache.", total->counters[STATS_CACHE_MISSES]);
+	metrics_counter(fp, "dproxy_local_answers_total", "Queries answered from the hosts file, the dhcp leases or the local zones.", total->counters[STATS_LOCAL_ANSWERS]);
+	metrics_counter(fp, "dproxy_blocked_total", "Queries for names of the deny file.", total->counters[STATS_BLOCKED]);
+	metrics_counter(fp, "dproxy_dropped_total", "Packets read and left without an answer.", total->counters[STATS_DROPPED]);
+	metrics_counter(fp, "dproxy_rrl_dropped_total", "Queries over the rate limit left without an answer.", total->counters[STATS_RRL_DROPPED]);
+	metrics_counter(fp, "dproxy_rrl_slipped_total", "Queries over the rate limit answered truncated.", total->counters[STATS_RRL_SLIPPED]);
+	metrics_counter(fp, "dproxy_acl_refused_total", "Packets and connections of clients the ACL refuses.", total->counters[STATS_ACL_REFUSED]);
+	metrics_counter(fp, "dproxy_upstream_queries_total", "Queries sent upstream.", total->counters[STATS_UPSTREAM_QUERIES]);
+	metrics_counter(fp, "dproxy_upstream_answers_total", "Answers received from upstream.", total->counters[STATS_UPSTREAM_ANSWERS]);
+	metrics_counter(fp, "dproxy_upstream_timeouts_total", "Upstream queries not answered in time.", total->counters[STATS_UPSTREAM_TIMEOUTS]);
+	metrics_counter(fp, "dproxy_upstream_unmatched_total", "Upstream answers matching no query in flight.", total->counters[STATS_UPSTREAM_UNMATCHED]);
+	metrics_counter(fp, "dproxy_upstream_truncated_total", "Upstream answers with the TC bit set.", total->counters[STATS_TRUNCATED]);
+	metrics_counter(fp, "dproxy_reloads_total", "Configuration reloads applied.", reload_count);
+	metrics_counter(fp, "dproxy_reload_failures_total", "Configuration reloads refused as not valid.", reload_failures);
+
+	metrics_histogram(fp, "dproxy_upstream_rtt_seconds", "Round trip time of the upstream queries.", &total->histograms[STATS_UPSTREAM_RTT]);
+	metrics_histogram(fp, "dproxy_resolve_duration_seconds", "Time taken to answer a query.", &total->histograms[STATS_RESOLVE_TIME]);
+
+	metrics_gauge(fp, "dproxy_upstream_waiting", "Threads waiting for an upstream answer.", upstream_waiting);
+	metrics_gauge(fp, "dproxy_cache_entries", "Entries in the cache.", cache_count(cache));
+	metrics_gauge(fp, "dproxy_cache_memory_bytes", "Memory taken by the cache entries.", cache_memory(cache));
+
+	metrics_write_pools(fp, metrics);
+
+	if (metrics->tcp_server != NULL)
+		metrics_gauge(fp, "dproxy_tcp_connections", "Open TCP client connections.", metrics->tcp_server->conns_count);
+
+	metrics_write_routes(fp);
+
+	free(total);
+
+}
+
+/**
+ * Reads the request of a client and answers it
+ */
+static void metrics_serve(struct metrics *metrics, int fd) {
+
+	struct timeval tv;
+	char request[2048];
+	char *response = NULL;
+	size_t response_len = 0;
+	unsigned int len = 0;
+	int numread;
+	int sent;
+	FILE *fp;
+
+	tv.tv_sec = METRICS_CLIENT_TIMEOUT;
+	tv.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	/*
+	 * Only the request line matters, the headers are read and ignored
+	 */
+	while (len < sizeof(request) - 1) {
+		numread = recv(fd, request + len, sizeof(request) - 1 - len, 0);
+		if (numread <= 0)
+			return;
+		len += numread;
+		request[len] = 0;
+		if (strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL)
+			break;
+	}
+
+	fp = open_memstream(&response, &response_len);
+	if (fp == NULL)
+		return;
+
+	if (strncmp(request, "GET / ", 6) == 0 || strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET /metrics?", 13) == 0) {
+		fprintf(fp, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n");
+		metrics_write(fp, metrics);
+	} else {
+		fprintf(fp, "HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\nConnection: close\r\n\r\nNot found\n");
+	}
+
+	fclose(fp);
+
+	for (len = 0; len < response_len; len += sent) {
+		sent = send(fd, response + len, response_len - len, MSG_NOSIGNAL);
+		if (sent <= 0)
+			break;
+	}
+
+	free(response);
+
+}
+
+static void *metrics_loop(void *args) {
+
+	struct metrics *metrics = (struct metrics *)args;
+	struct pollfd pfd;
+	int fd;
+
+	pfd.fd = metrics->fd;
+	pfd.events = POLLIN;
+
+	while (metrics->run) {
+
+		if (poll(&pfd, 1, 1000) <= 0)
+			continue;
+
+		fd = accept4(metrics->fd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0)
+			continue;
+
+		metrics_serve(metrics, fd);
+		close(fd);
+
+	}
+
+	return NULL;
+
+}
@@ -0,0 +1,29 @@
+#include <pthread.h>
+#include "worker_pool.h"
+#include "tcp_server.h"
+
+#ifndef METRICS_H
+#define METRICS_H
+
+/*
+ * Seconds a scraper has to send its request and to read the answer
+ */
+#define METRICS_CLIENT_TIMEOUT 2
+
+struct metrics {
+	int fd;
+	char *path;
+	/*
+	 * Whatever is reported besides the statistics of stats.c
+	 */
+	struct worker_pool **pools;
+	unsigned int pools_count;
+	struct tcp_server *tcp_server;
+	pthread_t tid;
+	int run;
+};
+
+struct metrics *metrics_new(char *, int, struct worker_pool **, unsigned int, struct tcp_server *);
+void metrics_destroy(struct metrics *);
+
+#endif
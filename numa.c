@@ -0,0 +1,215 @@
+/*
+  **
+  ** numa.c
+  **
+  ** CPU and NUMA node helpers. The topology is read from sysfs, so no
+  ** external library is needed; on machines without NUMA information
+  ** everything runs as a single node holding all the CPUs.
+  **
+  ** Memory is made node local by first touch: buffers are allocated and
+  ** initialized by threads already pinned to the CPUs of their node.
+  **
+*/
+
+#define _GNU_SOURCE
+#include "numa.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <linux/filter.h>
+#include "dproxy.h"
+
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+
+/*
+ * Node of the CPUs the calling thread is pinned to
+ */
+static __thread int local_node = 0;
+
+/**
+ * Parses a CPU list in the kernel format (e.g. "0-3,8,10-11") into set
+ * Returns 0 on success, 1 if the list is malformed
+ */
+int numa_parse_cpulist(const char *list, cpu_set_t *set) {
+
+	const char *ptr = list;
+	char *end;
+	long first;
+	long last;
+
+	CPU_ZERO(set);
+
+	while (*ptr != 0 && *ptr != '\n') {
+
+		first = strtol(ptr, &end, 10);
+		if (end == ptr || first < 0)
+			return 1;
+
+		last = first;
+		ptr = end;
+
+		if (*ptr == '-') {
+			ptr++;
+			last = strtol(ptr, &end, 10);
+			if (end == ptr || last < first)
+				return 1;
+			ptr = end;
+		}
+
+		for (; first <= last && first < CPU_SETSIZE; first++)
+			CPU_SET(first, set);
+
+		if (*ptr == ',')
+			ptr++;
+		else if (*ptr != 0 && *ptr != '\n')
+			return 1;
+
+	}
+
+	return 0;
+
+}
+
+/**
+ * Returns the number of NUMA nodes with at least one CPU, 1 if the
+ * topology is unknown
+ */
+int numa_nodes_count(void) {
+
+	int node;
+	cpu_set_t set;
+
+	for (node = 0; node < NUMA_MAX_NODES; node++)
+		if (numa_node_cpus(node, &set) != 0 || CPU_COUNT(&set) == 0)
+			break;
+
+	return node > 0 ? node : 1;
+
+}
+
+/**
+ * Fills set with the CPUs of a NUMA node. Without NUMA information node
+ * 0 gets all the CPUs the process may run on.
+ * Returns 0 on success, 1 if the node doesn't exist
+ */
+int numa_node_cpus(int node, cpu_set_t *set) {
+
+	char path[128];
+	char row[1024];
+	FILE *f_in;
+	int ret;
+
+	snprintf(path, sizeof(path), NUMA_SYSFS_PATH "/node%d/cpulist", node);
+
+	f_in = fopen(path, "rt");
+	if (f_in == NULL) {
+		if (node != 0)
+			return 1;
+		return sched_getaffinity(0, sizeof(cpu_set_t), set) == 0 ? 0 : 1;
+	}
+
+	if (fgets(row, sizeof(row), f_in) == NULL)
+		row[0] = 0;
+	fclose(f_in);
+
+	ret = numa_parse_cpulist(row, set);
+
+	return ret;
+
+}
+
+/**
+ * Sets the affinity of a thread yet to be created. An empty set leaves
+ * the thread free to float.
+ */
+int numa_pin_attr(pthread_attr_t *attr, cpu_set_t *set) {
+
+	if (set == NULL || CPU_COUNT(set) == 0)
+		return 0;
+
+	return pthread_attr_setaffinity_np(attr, sizeof(cpu_set_t), set);
+
+}
+
+/**
+ * Pins the calling thread to the CPUs in set
+ */
+int numa_pin_self(cpu_set_t *set) {
+
+	if (set == NULL || CPU_COUNT(set) == 0)
+		return 0;
+
+	return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), set);
+
+}
+
+/**
+ * Steers the packets of a SO_REUSEPORT group to the socket of the node
+ * whose CPU received them. The sockets must have been bound in node
+ * order; sock is any socket of the group.
+ * The classic BPF program loads the current CPU and compares it against
+ * each known CPU, returning the index of its node.
+ * Returns 0 on success. On failure the kernel keeps hashing packets
+ * among the sockets, which still works, just without locality.
+ */
+int numa_steer_sockets(int sock, int nodes) {
+
+	struct sock_filter *code;
+	struct sock_fprog prog;
+	cpu_set_t set;
+	unsigned int len = 0;
+	int node;
+	int cpu;
+	int ret;
+
+	code = (struct sock_filter *)malloc(sizeof(struct sock_filter) * (2 + 2 * CPU_SETSIZE));
+	if (code == NULL)
+		return 1;
+
+	code[len++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+
+	for (node = 0; node < nodes; node++) {
+		if (numa_node_cpus(node, &set) != 0)
+			continue;
+		for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+			if (!CPU_ISSET(cpu, &set))
+				continue;
+			code[len++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, cpu, 0, 1);
+			code[len++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, node);
+		}
+	}
+
+	code[len++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+
+	prog.len = len;
+	prog.filter = code;
+
+	ret = setsockopt(sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+	if (ret != 0)
+		debug_perror("Could not steer packets to NUMA nodes");
+
+	free(code);
+
+	return ret != 0;
+
+}
+
+/**
+ * Returns the node the calling thread has been assigned to
+ */
+int numa_local_node(void) {
+
+	return local_node;
+
+}
+
+void numa_set_local_node(int node) {
+
+	local_node = node;
+
+}
@@ -0,0 +1,21 @@
+#include <sched.h>
+#include <pthread.h>
+
+#ifndef NUMA_H
+#define NUMA_H
+
+#define NUMA_MAX_NODES 64
+#ifndef NUMA_SYSFS_PATH
+#define NUMA_SYSFS_PATH "/sys/devices/system/node"
+#endif
+
+int numa_nodes_count(void);
+int numa_node_cpus(int, cpu_set_t *);
+int numa_parse_cpulist(const char *, cpu_set_t *);
+int numa_pin_attr(pthread_attr_t *, cpu_set_t *);
+int numa_pin_self(cpu_set_t *);
+int numa_steer_sockets(int, int);
+int numa_local_node(void);
+void numa_set_local_node(int);
+
+#endif
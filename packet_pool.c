@@ -0,0 +1,278 @@
+/*
+  **
+  ** packet_pool.c
+  **
+  ** Preallocated packet buffers. The receiver takes a free buffer, reads
+  ** a packet into it and queues it; any idle worker picks it up and
+  ** gives the buffer back once the answer has been sent. The number of
+  ** packets in flight is bounded by the pool size, not by the number of
+  ** worker threads, so the receiver keeps draining the socket while the
+  ** workers are busy.
+  **
+  ** Every thread keeps a short private free list, exchanged with the
+  ** shared one in batches, to keep the shared lock out of the per packet
+  ** path.
+  **
+*/
+
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+#include "dproxy.h"
+#include "packet_pool.h"
+
+static unsigned long long _now_usec(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+
+}
+
+/**
+ * Allocates a pool of size buffers. The buffers are cache line aligned
+ * and written once here, so they end up in the memory of the node the
+ * calling thread runs on.
+ */
+struct packet_pool *packet_pool_new(unsigned int size) {
+
+	struct packet_pool *pool;
+	unsigned int idx;
+
+	if (size < 2 * PACKET_POOL_BATCH)
+		size = 2 * PACKET_POOL_BATCH;
+
+	pool = (struct packet_pool *)malloc(sizeof(struct packet_pool));
+	if (pool == NULL)
+		return NULL;
+
+	memset(pool, 0, sizeof(struct packet_pool));
+
+	if (posix_memalign((void **)&pool->bufs, 64, sizeof(struct packet_buf) * size) != 0) {
+		free(pool);
+		return NULL;
+	}
+
+	memset(pool->bufs, 0, sizeof(struct packet_buf) * size);
+
+	for (idx = 0; idx < size; idx++)
+		pool->bufs[idx].next = (idx + 1 < size) ? &pool->bufs[idx + 1] : NULL;
+
+	pool->size = size;
+	pool->free_list = &pool->bufs[0];
+	pool->free_count = size;
+
+	pthread_mutex_init(&pool->free_mutex, NULL);
+	pthread_cond_init(&pool->free_cond, NULL);
+	pthread_mutex_init(&pool->queue_mutex, NULL);
+	pthread_cond_init(&pool->queue_cond, NULL);
+
+	return pool;
+
+}
+
+void packet_pool_destroy(struct packet_pool *pool) {
+
+	if (pool == NULL)
+		return;
+
+	pthread_mutex_destroy(&pool->free_mutex);
+	pthread_cond_destroy(&pool->free_cond);
+	pthread_mutex_destroy(&pool->queue_mutex);
+	pthread_cond_destroy(&pool->queue_cond);
+
+	free(pool->bufs);
+	free(pool);
+
+}
+
+/**
+ * Takes a free buffer, refilling the private list from the shared one
+ * when empty. Returns NULL if the pool is exhausted.
+ */
+struct packet_buf *packet_pool_get(struct packet_pool *pool, struct packet_cache *cache) {
+
+	struct packet_buf *buf;
+
+	if (cache->head == NULL) {
+
+		pthread_mutex_lock(&pool->free_mutex);
+
+		while (pool->free_list != NULL && cache->count < PACKET_POOL_BATCH) {
+			buf = pool->free_list;
+			pool->free_list = buf->next;
+			pool->free_count--;
+			buf->next = cache->head;
+			cache->head = buf;
+			cache->count++;
+		}
+
+		if (cache->head == NULL)
+			pool->exhausted++;
+
+		pthread_mutex_unlock(&pool->free_mutex);
+
+		if (cache->head == NULL)
+			return NULL;
+
+	}
+
+	buf = cache->head;
+	cache->head = buf->next;
+	cache->count--;
+
+	return buf;
+
+}
+
+/**
+ * Moves count buffers of a private list back to the shared one, waking
+ * up the receiver if it is waiting for them
+ */
+static void _give_back(struct packet_pool *pool, struct packet_cache *cache, unsigned int count) {
+
+	struct packet_buf *buf;
+
+	pthread_mutex_lock(&pool->free_mutex);
+
+	while (cache->head != NULL && count > 0) {
+		buf = cache->head;
+		cache->head = buf->next;
+		cache->count--;
+		buf->next = pool->free_list;
+		pool->free_list = buf;
+		pool->free_count++;
+		count--;
+	}
+
+	if (pool->receiver_waiting)
+		pthread_cond_signal(&pool->free_cond);
+
+	pthread_mutex_unlock(&pool->free_mutex);
+
+}
+
+/**
+ * Gives a buffer back to the pool
+ */
+void packet_pool_put(struct packet_pool *pool, struct packet_cache *cache, struct packet_buf *buf) {
+
+	buf->next = cache->head;
+	cache->head = buf;
+	cache->count++;
+
+	if (cache->count >= PACKET_POOL_BATCH)
+		_give_back(pool, cache, cache->count);
+
+}
+
+/**
+ * Gives all the buffers of a private list back to the pool, so idle
+ * threads don't hoard them
+ */
+void packet_pool_flush(struct packet_pool *pool, struct packet_cache *cache) {
+
+	if (cache->count > 0)
+		_give_back(pool, cache, cache->count);
+
+}
+
+/**
+ * Waits (at most one second) for some buffers to be given back
+ */
+void packet_pool_wait(struct packet_pool *pool) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += 1;
+
+	pthread_mutex_lock(&pool->free_mutex);
+	pool->receiver_waiting = 1;
+	while (pool->free_list == NULL)
+		if (pthread_cond_timedwait(&pool->free_cond, &pool->free_mutex, &ts) != 0)
+			break;
+	pool->receiver_waiting = 0;
+	pthread_mutex_unlock(&pool->free_mutex);
+
+}
+
+/**
+ * Queues a packet for the workers
+ */
+void packet_queue_push(struct packet_pool *pool, struct packet_buf *buf) {
+
+	buf->queued_usec = _now_usec();
+	buf->next = NULL;
+
+	pthread_mutex_lock(&pool->queue_mutex);
+
+	if (pool->queue_tail != NULL)
+		pool->queue_tail->next = buf;
+	else
+		pool->queue_head = buf;
+	pool->queue_tail = buf;
+	pool->queue_len++;
+
+	if (pool->workers_waiting > 0)
+		pthread_cond_signal(&pool->queue_cond);
+
+	pthread_mutex_unlock(&pool->queue_mutex);
+
+}
+
+/**
+ * Takes the oldest queued packet, waiting for one as long as *run is
+ * set. A worker about to sleep first gives back its private buffers.
+ * Returns NULL when *run has been cleared.
+ */
+struct packet_buf *packet_queue_pop(struct packet_pool *pool, volatile int *run, struct packet_cache *cache) {
+
+	struct packet_buf *buf;
+
+	pthread_mutex_lock(&pool->queue_mutex);
+
+	while (pool->queue_head == NULL && *run) {
+		if (cache->count > 0) {
+			pthread_mutex_unlock(&pool->queue_mutex);
+			packet_pool_flush(pool, cache);
+			pthread_mutex_lock(&pool->queue_mutex);
+			continue;
+		}
+		pool->workers_waiting++;
+		pthread_cond_wait(&pool->queue_cond, &pool->queue_mutex);
+		pool->workers_waiting--;
+	}
+
+	if (!*run) {
+		pthread_mutex_unlock(&pool->queue_mutex);
+		return NULL;
+	}
+
+	buf = pool->queue_head;
+	pool->queue_head = buf->next;
+	if (pool->queue_head == NULL)
+		pool->queue_tail = NULL;
+	pool->queue_len--;
+
+	pool->queue_wait_usec += _now_usec() - buf->queued_usec;
+	pool->dequeued++;
+
+	pthread_mutex_unlock(&pool->queue_mutex);
+
+	return buf;
+
+}
+
+/**
+ * Wakes up all the waiting workers, so they can check their run flag
+ */
+void packet_queue_wakeup(struct packet_pool *pool) {
+
+	pthread_mutex_lock(&pool->queue_mutex);
+	pthread_cond_broadcast(&pool->queue_cond);
+	pthread_mutex_unlock(&pool->queue_mutex);
+
+}
@@ -0,0 +1,68 @@
+#include <pthread.h>
+#include "dproxy.h"
+
+#ifndef PACKET_POOL_H
+#define PACKET_POOL_H
+
+/*
+ * Buffers move between the shared free list and the private lists of
+ * the threads in batches of PACKET_POOL_BATCH, so the shared lock is
+ * taken once every few packets.
+ */
+#define PACKET_POOL_BATCH 8
+
+struct packet_buf {
+	struct udp_packet pkt;
+	unsigned long long queued_usec;
+	struct packet_buf *next;
+} __attribute__((aligned(64)));
+
+/*
+ * Private free list of a thread
+ */
+struct packet_cache {
+	struct packet_buf *head;
+	unsigned int count;
+};
+
+struct packet_pool {
+	struct packet_buf *bufs;
+	unsigned int size;
+	/*
+	 * Shared free list, refilled by the workers and drained by the
+	 * receiver
+	 */
+	pthread_mutex_t free_mutex;
+	pthread_cond_t free_cond;
+	struct packet_buf *free_list;
+	unsigned int free_count;
+	int receiver_waiting;
+	/*
+	 * Packets read by the receiver, waiting for a worker
+	 */
+	pthread_mutex_t queue_mutex;
+	pthread_cond_t queue_cond;
+	struct packet_buf *queue_head;
+	struct packet_buf *queue_tail;
+	unsigned int queue_len;
+	unsigned int workers_waiting;
+	/*
+	 * Statistics: times the receiver found no free buffer, and time
+	 * spent in the queue by the packets taken since the last reset
+	 */
+	unsigned long exhausted;
+	unsigned long queue_wait_usec;
+	unsigned long dequeued;
+};
+
+struct packet_pool *packet_pool_new(unsigned int);
+void packet_pool_destroy(struct packet_pool *);
+struct packet_buf *packet_pool_get(struct packet_pool *, struct packet_cache *);
+void packet_pool_put(struct packet_pool *, struct packet_cache *, struct packet_buf *);
+void packet_pool_flush(struct packet_pool *, struct packet_cache *);
+void packet_pool_wait(struct packet_pool *);
+void packet_queue_push(struct packet_pool *, struct packet_buf *);
+struct packet_buf *packet_queue_pop(struct packet_pool *, volatile int *, struct packet_cache *);
+void packet_queue_wakeup(struct packet_pool *);
+
+#endif
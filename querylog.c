@@ -0,0 +1,141 @@
+/*
+  **
+  ** querylog.c
+  **
+  ** Records every query and its outcome in a ring of fixed size records
+  ** kept in a memory mapped file. Writing a record is a copy to memory,
+  ** the kernel writes the pages back to the file when it likes. When the
+  ** ring is full the oldest records are overwritten. The file is read
+  ** by dproxy-querylog, see querylog_dump.c.
+  **
+*/
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include "dproxy.h"
+#include "querylog.h"
+
+/*
+ * Slots taken by the calling thread and not used yet
+ */
+static __thread struct querylog *querylog_chunk_owner = NULL;
+static __thread uint64_t querylog_chunk_next;
+static __thread unsigned int querylog_chunk_left = 0;
+
+/**
+ * Maps the query log file, size_mb megabytes large, creating it if
+ * needed. A file left by a previous run with the same layout is kept
+ * and written on from where it stopped.
+ * Returns NULL on failure
+ */
+struct querylog *querylog_open(char *path, unsigned int size_mb) {
+
+	struct querylog *qlog;
+	struct querylog_header *header;
+	struct stat st;
+	uint64_t slots;
+
+	if (size_mb == 0)
+		size_mb = 1;
+
+	qlog = malloc(sizeof(struct querylog));
+	if (qlog == NULL)
+		return NULL;
+
+	slots = ((uint64_t)size_mb * 1024 * 1024 - QUERYLOG_HEADER_SIZE) / QUERYLOG_RECORD_SIZE;
+	qlog->size = QUERYLOG_HEADER_SIZE + slots * QUERYLOG_RECORD_SIZE;
+
+	qlog->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0640);
+	if (qlog->fd < 0 || fstat(qlog->fd, &st) < 0) {
+		debug_perror("Could not open the query log");
+		goto failed;
+	}
+
+	if (st.st_size != qlog->size && ftruncate(qlog->fd, qlog->size) < 0) {
+		debug_perror("Could not size the query log");
+		goto failed;
+	}
+
+	qlog->header = mmap(NULL, qlog->size, PROT_READ | PROT_WRITE, MAP_SHARED, qlog->fd, 0);
+	if (qlog->header == MAP_FAILED) {
+		debug_perror("Could not map the query log");
+		goto failed;
+	}
+
+	header = qlog->header;
+	qlog->records = (struct querylog_record *)((char *)header + QUERYLOG_HEADER_SIZE);
+
+	if (st.st_size != qlog->size || memcmp(header->magic, QUERYLOG_MAGIC, sizeof(header->magic)) != 0 ||
+		header->version != QUERYLOG_VERSION || header->record_size != QUERYLOG_RECORD_SIZE || header->slots != slots) {
+
+		memset(header, 0, QUERYLOG_HEADER_SIZE);
+		memset(qlog->records, 0, slots * QUERYLOG_RECORD_SIZE);
+		memcpy(header->magic, QUERYLOG_MAGIC, sizeof(header->magic));
+		header->version = QUERYLOG_VERSION;
+		header->record_size = QUERYLOG_RECORD_SIZE;
+		header->slots = slots;
+		header->created = time(NULL);
+		header->next = 1;
+
+	}
+
+	log_info("Query log %s holds %lu records\n", path, (unsigned long)slots);
+
+	return qlog;
+
+failed:
+	if (qlog->fd >= 0)
+		close(qlog->fd);
+	free(qlog);
+	return NULL;
+
+}
+
+void querylog_close(struct querylog *qlog) {
+
+	if (qlog == NULL)
+		return;
+
+	munmap(qlog->header, qlog->size);
+	close(qlog->fd);
+	free(qlog);
+
+}
+
+/**
+ * Copies a record into the next slot of the calling thread. The seq of
+ * the record is set here.
+ */
+void querylog_write(struct querylog *qlog, struct querylog_record *record) {
+
+	struct querylog_record *slot;
+	uint64_t seq;
+
+	/*
+	 * A chunk left idle while the others went around the ring is
+	 * given up, its slots now hold newer records
+	 */
+	if (querylog_chunk_owner == qlog && querylog_chunk_left > 0 &&
+		__atomic_load_n(&qlog->header->next, __ATOMIC_RELAXED) - querylog_chunk_next > qlog->header->slots - QUERYLOG_CHUNK)
+		querylog_chunk_left = 0;
+
+	if (querylog_chunk_owner != qlog || querylog_chunk_left == 0) {
+		querylog_chunk_next = __sync_fetch_and_add(&qlog->header->next, QUERYLOG_CHUNK);
+		querylog_chunk_left = QUERYLOG_CHUNK;
+		querylog_chunk_owner = qlog;
+	}
+
+	seq = querylog_chunk_next++;
+	querylog_chunk_left--;
+
+	slot = &qlog->records[(seq - 1) % qlog->header->slots];
+
+	/*
+	 * Readers of a live file skip the slot while it is being written
+	 */
+	__atomic_store_n(&slot->seq, 0, __ATOMIC_RELEASE);
+	memcpy((char *)slot + sizeof(slot->seq), (char *)record + sizeof(record->seq), sizeof(struct querylog_record) - sizeof(record->seq));
+	__atomic_store_n(&slot->seq, seq, __ATOMIC_RELEASE);
+
+}
@@ -0,0 +1,83 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef QUERYLOG_H
+#define QUERYLOG_H
+
+/*
+ * The query log file: a header of QUERYLOG_HEADER_SIZE bytes followed by
+ * a ring of fixed size records. All the numbers are in host byte order,
+ * addresses in network byte order.
+ */
+#define QUERYLOG_MAGIC "DPQLOG1"
+#define QUERYLOG_VERSION 1
+#define QUERYLOG_HEADER_SIZE 4096
+#define QUERYLOG_RECORD_SIZE 128
+#define QUERYLOG_NAME_SIZE (QUERYLOG_RECORD_SIZE - 40)
+
+/*
+ * Slots are taken by the threads QUERYLOG_CHUNK at a time, so the shared
+ * counter is touched once every few queries
+ */
+#define QUERYLOG_CHUNK 16
+
+/*
+ * Where the answer came from
+ */
+#define QUERYLOG_SOURCE_NONE 0
+#define QUERYLOG_SOURCE_CACHE 1
+#define QUERYLOG_SOURCE_UPSTREAM 2
+#define QUERYLOG_SOURCE_LOCAL 3
+#define QUERYLOG_SOURCE_BLOCKED 4
+
+/*
+ * Flags of a record
+ */
+#define QUERYLOG_FLAG_TCP 0x01
+#define QUERYLOG_FLAG_NAME_CUT 0x02
+
+/*
+ * A record is valid if seq, written last, is its position in the ring
+ * plus one for each time the ring has been around
+ */
+struct querylog_record {
+	uint64_t seq;
+	uint64_t time_usec;
+	uint32_t client_ip;
+	uint32_t upstream_ip;
+	uint32_t latency_usec;
+	uint16_t client_port;
+	uint16_t upstream_port;
+	uint16_t qtype;
+	uint16_t answer_len;
+	uint8_t rcode;
+	uint8_t source;
+	uint8_t flags;
+	uint8_t name_len;
+	char name[QUERYLOG_NAME_SIZE];
+};
+
+struct querylog_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint64_t slots;
+	uint64_t created;
+	/*
+	 * Sequence number of the next slot to hand out
+	 */
+	volatile uint64_t next __attribute__((aligned(64)));
+};
+
+struct querylog {
+	int fd;
+	size_t size;
+	struct querylog_header *header;
+	struct querylog_record *records;
+};
+
+struct querylog *querylog_open(char *, unsigned int);
+void querylog_close(struct querylog *);
+void querylog_write(struct querylog *, struct querylog_record *);
+
+#endif
@@ -0,0 +1,211 @@
+/*
+  **
+  ** querylog_dump.c
+  **
+  ** dproxy-querylog: prints the records of a query log file written by
+  ** dproxy, oldest first. The file may be read while dproxy writes it.
+  ** With -r it prints "microseconds name type" lines instead, the time
+  ** counted from the first query, which dproxy-replay takes as input.
+  ** Queries whose name was too long to be recorded whole are left out
+  ** of those, asking for a shorter name would be another query.
+  **
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include "querylog.h"
+
+static struct {
+	unsigned short int type;
+	char *name;
+} qtypes[] = {
+	{ 1, "A" }, { 2, "NS" }, { 5, "CNAME" }, { 6, "SOA" }, { 12, "PTR" },
+	{ 15, "MX" }, { 16, "TXT" }, { 28, "AAAA" }, { 33, "SRV" }, { 35, "NAPTR" },
+	{ 43, "DS" }, { 48, "DNSKEY" }, { 64, "SVCB" }, { 65, "HTTPS" }, { 255, "ANY" },
+	{ 0, NULL }
+};
+
+static char *rcodes[] = { "NOERROR", "FORMERR", "SERVFAIL", "NXDOMAIN", "NOTIMP", "REFUSED" };
+
+static char *sources[] = { "none", "cache", "upstream", "local", "blocked" };
+
+static int compare_time(const void *a, const void *b) {
+
+	const struct querylog_record *ra = a;
+	const struct querylog_record *rb = b;
+
+	if (ra->time_usec != rb->time_usec)
+		return (ra->time_usec < rb->time_usec) ? -1 : 1;
+
+	return (ra->seq < rb->seq) ? -1 : (ra->seq > rb->seq);
+
+}
+
+static void print_record(struct querylog_record *record) {
+
+	struct in_addr addr;
+	struct tm tm;
+	time_t sec;
+	char date[32];
+	char type[8];
+	char rcode[16];
+	char client[INET_ADDRSTRLEN];
+	char server[INET_ADDRSTRLEN];
+	unsigned int idx;
+
+	sec = record->time_usec / 1000000;
+	localtime_r(&sec, &tm);
+	strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm);
+
+	for (idx = 0; qtypes[idx].name != NULL && qtypes[idx].type != record->qtype; idx++)
+		;
+	if (qtypes[idx].name != NULL)
+		strcpy(type, qtypes[idx].name);
+	else
+		snprintf(type, sizeof(type), "%u", record->qtype);
+
+	if (record->answer_len == 0)
+		strcpy(rcode, "-");
+	else if (record->rcode < sizeof(rcodes) / sizeof(rcodes[0]))
+		strcpy(rcode, rcodes[record->rcode]);
+	else
+		snprintf(rcode, sizeof(rcode), "%u", record->rcode);
+
+	addr.s_addr = record->client_ip;
+	inet_ntop(AF_INET, &addr, client, sizeof(client));
+	addr.s_addr = record->upstream_ip;
+	inet_ntop(AF_INET, &addr, server, sizeof(server));
+
+	printf("%s.%06u %s#%u %s %.*s%s %s %s %s",
+		date, (unsigned int)(record->time_usec % 1000000),
+		client, record->client_port,
+		(record->flags & QUERYLOG_FLAG_TCP) ? "tcp" : "udp",
+		(int)strnlen(record->name, QUERYLOG_NAME_SIZE), record->name,
+		(record->flags & QUERYLOG_FLAG_NAME_CUT) ? "..." : "",
+		type, rcode,
+		(record->source < sizeof(sources) / sizeof(sources[0])) ? sources[record->source] : "?");
+
+	if (record->upstream_ip != 0)
+		printf(" %s#%u", server, record->upstream_port);
+
+	printf(" %uus %uB\n", record->latency_usec, record->answer_len);
+
+}
+
+static void usage(char *progname) {
+
+	fprintf(stderr, "usage : %s [-r] <query-log-file>\n", progname);
+	fprintf(stderr, "\t-r \t\tprint the queries for dproxy-replay\n");
+
+}
+
+int main(int argc, char **argv) {
+
+	struct querylog_header *header;
+	struct querylog_record *records;
+	struct querylog_record *valid;
+	struct stat st;
+	unsigned long count = 0;
+	unsigned long skipped = 0;
+	unsigned long idx;
+	uint64_t seq;
+	uint64_t first;
+	uint64_t next;
+	int replay = 0;
+	int fd;
+	int c;
+
+	while ((c = getopt(argc, argv, "rh")) != -1) {
+		switch (c) {
+		case 'r':
+			replay = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	fd = open(argv[optind], O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	if (st.st_size < QUERYLOG_HEADER_SIZE) {
+		fprintf(stderr, "%s is not a query log\n", argv[optind]);
+		return 1;
+	}
+
+	header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (header == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	if (memcmp(header->magic, QUERYLOG_MAGIC, sizeof(header->magic)) != 0 || header->version != QUERYLOG_VERSION ||
+		header->record_size != QUERYLOG_RECORD_SIZE || QUERYLOG_HEADER_SIZE + header->slots * QUERYLOG_RECORD_SIZE > (uint64_t)st.st_size) {
+		fprintf(stderr, "%s is not a query log, or of another version\n", argv[optind]);
+		return 1;
+	}
+
+	records = (struct querylog_record *)((char *)header + QUERYLOG_HEADER_SIZE);
+
+	valid = malloc(sizeof(struct querylog_record) * header->slots);
+	if (valid == NULL) {
+		perror("malloc");
+		return 1;
+	}
+
+	/*
+	 * Slots handed out but not written yet, or being written, don't
+	 * carry their sequence number
+	 */
+	next = __atomic_load_n(&header->next, __ATOMIC_ACQUIRE);
+	first = (next > header->slots) ? next - header->slots : 1;
+
+	for (seq = first; seq < next; seq++) {
+		memcpy(&valid[count], &records[(seq - 1) % header->slots], sizeof(struct querylog_record));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (valid[count].seq == seq && records[(seq - 1) % header->slots].seq == seq)
+			count++;
+	}
+
+	/*
+	 * Threads take their slots in chunks, so the sequence is only
+	 * roughly the order of arrival
+	 */
+	qsort(valid, count, sizeof(struct querylog_record), compare_time);
+
+	for (idx = 0; idx < count; idx++) {
+		if (replay && (valid[idx].flags & QUERYLOG_FLAG_NAME_CUT))
+			skipped++;
+		else if (replay)
+			printf("%llu %.*s %u\n", (unsigned long long)(valid[idx].time_usec - valid[0].time_usec),
+				(int)strnlen(valid[idx].name, QUERYLOG_NAME_SIZE), valid[idx].name, valid[idx].qtype);
+		else
+			print_record(&valid[idx]);
+	}
+
+	if (skipped > 0)
+		fprintf(stderr, "%lu queries left out, their name is cut in the log\n", skipped);
+
+	free(valid);
+	munmap(header, st.st_size);
+	close(fd);
+
+	return 0;
+
+}
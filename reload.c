@@ -0,0 +1,392 @@
+/*
+  **
+  ** reload.c
+  **
+  ** Applies a new configuration to the running process: the file is read
+  ** and checked aside, the tables it names are built while the old ones
+  ** keep answering, then they are swapped in. Cache, sockets and queries
+  ** in flight are left alone.
+  **
+  ** Resolving threads read the tables between reload_read_lock() and
+  ** reload_read_unlock(). Each of them counts itself on a counter of the
+  ** current epoch. After a swap reload_synchronize() moves to the next
+  ** epoch and waits for the counters of the previous one to drop to
+  ** zero, so the old tables are freed when no thread can still be
+  ** looking at them. Readers never wait.
+  **
+*/
+
+#include <stddef.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include "dproxy.h"
+#include "conf.h"
+#include "reload.h"
+#include "hosts.h"
+#include "deny.h"
+#include "dhcp.h"
+#include "forward.h"
+#include "upstream.h"
+#include "acl.h"
+
+unsigned long reload_count = 0;
+unsigned long reload_failures = 0;
+
+static struct reload_stripe reload_stripes[RELOAD_STRIPES];
+static volatile unsigned int reload_epoch = 0;
+static unsigned int reload_stripe_next = 0;
+static pthread_mutex_t reload_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread int reload_stripe = -1;
+
+/*
+ * Options read only at start, a reload just says they changed
+ */
+static struct {
+	char *name;
+	size_t offset;
+	int string;
+} reload_fixed[] = {
+	{ "listen_port", offsetof(struct config, listen_port), 0 },
+	{ "tcp_listen", offsetof(struct config, tcp_listen), 0 },
+	{ "tcp_threads_count", offsetof(struct config, tcp_threads_count), 0 },
+	{ "tcp_max_connections", offsetof(struct config, tcp_max_connections), 0 },
+	{ "tcp_idle_timeout", offsetof(struct config, tcp_idle_timeout), 0 },
+	{ "numa_affinity", offsetof(struct config, numa_affinity), 0 },
+	{ "packet_pool_size", offsetof(struct config, packet_pool_size), 0 },
+	{ "upstream_sockets", offsetof(struct config, upstream_sockets), 0 },
+	{ "query_log_size", offsetof(struct config, query_log_size), 0 },
+	{ "cache_shared", offsetof(struct config, cache_shared), 0 },
+	{ "cache_size", offsetof(struct config, cache_size), 0 },
+	{ "rrl_table_size", offsetof(struct config, rrl_table_size), 0 },
+	{ "worker_cpus", offsetof(struct config, worker_cpus), 1 },
+	{ "receiver_cpus", offsetof(struct config, receiver_cpus), 1 },
+	{ "metrics_listen", offsetof(struct config, metrics_listen), 1 },
+	{ "control_socket", offsetof(struct config, control_socket), 1 },
+	{ "query_log", offsetof(struct config, query_log), 1 },
+	{ "cache_file", offsetof(struct config, cache_file), 1 },
+	{ NULL, 0, 0 }
+};
+
+/**
+ * Starts reading the tables a reload may swap
+ * Returns what reload_read_unlock() takes back
+ */
+unsigned int reload_read_lock(void) {
+
+	unsigned int epoch;
+
+	if (reload_stripe < 0)
+		reload_stripe = __sync_fetch_and_add(&reload_stripe_next, 1) % RELOAD_STRIPES;
+
+	epoch = reload_epoch & 1;
+	/* Full barrier, the tables are read after being counted */
+	__sync_fetch_and_add(&reload_stripes[reload_stripe].readers[epoch], 1);
+
+	return (reload_stripe << 1) | epoch;
+
+}
+
+void reload_read_unlock(unsigned int token) {
+
+	__sync_fetch_and_sub(&reload_stripes[token >> 1].readers[token & 1], 1);
+
+}
+
+/**
+ * Waits for the threads that may have seen the tables swapped before
+ * the call. Queries waiting for the upstream servers hold it up to the
+ * upstream timeout.
+ */
+void reload_synchronize(void) {
+
+	unsigned int old;
+	unsigned int idx;
+
+	pthread_mutex_lock(&reload_mutex);
+
+	old = __sync_fetch_and_add(&reload_epoch, 1) & 1;
+
+	for (idx = 0; idx < RELOAD_STRIPES; idx++)
+		while (reload_stripes[idx].readers[old] != 0)
+			usleep(RELOAD_WAIT_MSEC * 1000);
+
+	pthread_mutex_unlock(&reload_mutex);
+
+}
+
+/**
+ * Logs a line of the reload, and writes it on out unless NULL
+ */
+static void reload_report(FILE *out, int level, char *fmt, ...) {
+
+	char line[LOG_RECORD_SIZE];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+
+	if (level == LOG_LEVEL_ERROR)
+		log_error("%s", line);
+	else
+		log_info("%s", line);
+
+	if (out != NULL)
+		fputs(line, out);
+
+}
+
+/**
+ * Checks the new configuration and builds its tables
+ * Returns 1 if it can't be used, nothing is built then
+ */
+static int reload_check(struct config *next, struct worker_pool **pools, unsigned int pools_count, FILE *out,
+		struct forward **new_forward, struct hosts **new_hosts, struct deny **new_deny, struct dhcp_leases **new_leases,
+		struct acl **new_acl) {
+
+	unsigned int idx;
+
+	if (next->purge_time <= 0) {
+		reload_report(out, LOG_LEVEL_ERROR, "purge_time must be positive\n");
+		return 1;
+	}
+
+	if (next->upstream_timeout <= 0) {
+		reload_report(out, LOG_LEVEL_ERROR, "upstream_timeout must be positive\n");
+		return 1;
+	}
+
+	if (next->log_level < LOG_LEVEL_ERROR || next->log_level > LOG_LEVEL_DEBUG) {
+		reload_report(out, LOG_LEVEL_ERROR, "log_level must be between %d and %d\n", LOG_LEVEL_ERROR, LOG_LEVEL_DEBUG);
+		return 1;
+	}
+
+	if (next->rrl_clients < 0 || next->rrl_responses < 0 || next->rrl_slip < 0) {
+		reload_report(out, LOG_LEVEL_ERROR, "rrl_clients, rrl_responses and rrl_slip can't be negative\n");
+		return 1;
+	}
+
+	if (next->rrl_prefix < 0 || next->rrl_prefix > 32) {
+		reload_report(out, LOG_LEVEL_ERROR, "rrl_prefix must be between 0 and 32\n");
+		return 1;
+	}
+
+	if (next->worker_threads_min > next->worker_threads_max) {
+		reload_report(out, LOG_LEVEL_ERROR, "worker_threads_min is over worker_threads_max\n");
+		return 1;
+	}
+
+	for (idx = 0; idx < pools_count; idx++) {
+		if (next->worker_threads_max > pools[idx]->slots) {
+			reload_report(out, LOG_LEVEL_ERROR, "worker_threads_max can't go over %u without a restart\n", pools[idx]->slots);
+			return 1;
+		}
+	}
+
+	if (strcmp(next->forward, config.forward) != 0) {
+		*new_forward = forward_new(next->forward, server);
+		if (*new_forward == NULL) {
+			reload_report(out, LOG_LEVEL_ERROR, "forward has no usable default route\n");
+			return 1;
+		}
+	}
+
+	if (strcmp(next->hosts_file, config.hosts_file) != 0 && next->hosts_file[0]) {
+		*new_hosts = hosts_new(next->hosts_file);
+		if (*new_hosts == NULL) {
+			reload_report(out, LOG_LEVEL_ERROR, "Could not load the hosts file %s\n", next->hosts_file);
+			return 1;
+		}
+	}
+
+	if ((strcmp(next->deny_file, config.deny_file) != 0 || next->deny_nxdomain != config.deny_nxdomain) && next->deny_file[0]) {
+		*new_deny = deny_new(next->deny_file, next->deny_nxdomain);
+		if (*new_deny == NULL) {
+			reload_report(out, LOG_LEVEL_ERROR, "Could not load the deny file %s\n", next->deny_file);
+			return 1;
+		}
+	}
+
+	if ((strcmp(next->dhcp_lease_file, config.dhcp_lease_file) != 0 || strcmp(next->dhcp_domain, config.dhcp_domain) != 0) && next->dhcp_lease_file[0]) {
+		*new_leases = dhcp_leases_new(next->dhcp_lease_file, next->dhcp_domain);
+		if (*new_leases == NULL) {
+			reload_report(out, LOG_LEVEL_ERROR, "Could not follow the dhcp leases %s\n", next->dhcp_lease_file);
+			return 1;
+		}
+	}
+
+	/* Compiled again anyway, its files may have changed */
+	if (next->acl_allow[0] || next->acl_deny[0]) {
+		*new_acl = acl_new(next->acl_allow, next->acl_deny);
+		if (*new_acl == NULL) {
+			reload_report(out, LOG_LEVEL_ERROR, "Could not compile the client ACL\n");
+			return 1;
+		}
+	}
+
+	return 0;
+
+}
+
+/**
+ * Reads the configuration file path and applies what changed: purge
+ * time, log level, upstream timeout, forwarding routes, hosts, deny and
+ * leases files, client ACL, rate limits and the bounds of the worker
+ * pools. The files in use are
+ * read again even if unchanged. Options read only at start are reported.
+ * Must be called by one thread at a time, the control thread.
+ * Returns 1 if the file was not valid, the configuration is kept then
+ */
+int reload_config(char *path, struct worker_pool **pools, unsigned int pools_count, FILE *out) {
+
+	struct config *next;
+	struct forward *new_forward = NULL;
+	struct hosts *new_hosts = NULL;
+	struct deny *new_deny = NULL;
+	struct dhcp_leases *new_leases = NULL;
+	struct acl *new_acl = NULL;
+	struct forward *old_forward;
+	struct hosts *old_hosts;
+	struct deny *old_deny;
+	struct dhcp_leases *old_leases;
+	struct acl *old_acl;
+	int forward_changed;
+	int hosts_changed;
+	int deny_changed;
+	int leases_changed;
+	unsigned int running;
+	unsigned int idx;
+	char *was;
+	char *is;
+
+	next = malloc(sizeof(struct config));
+	if (next == NULL)
+		return 1;
+
+	if (conf_parse(path, next)) {
+		reload_report(out, LOG_LEVEL_ERROR, "Could not read %s: %s\n", path, strerror(errno));
+		free(next);
+		reload_failures++;
+		return 1;
+	}
+
+	if (reload_check(next, pools, pools_count, out, &new_forward, &new_hosts, &new_deny, &new_leases, &new_acl)) {
+		acl_destroy(new_acl);
+		forward_destroy(new_forward);
+		hosts_destroy(new_hosts);
+		deny_destroy(new_deny);
+		dhcp_leases_destroy(new_leases);
+		free(next);
+		reload_failures++;
+		return 1;
+	}
+
+	forward_changed = (strcmp(next->forward, config.forward) != 0);
+	hosts_changed = (strcmp(next->hosts_file, config.hosts_file) != 0);
+	deny_changed = (strcmp(next->deny_file, config.deny_file) != 0 || next->deny_nxdomain != config.deny_nxdomain);
+	leases_changed = (strcmp(next->dhcp_lease_file, config.dhcp_lease_file) != 0 || strcmp(next->dhcp_domain, config.dhcp_domain) != 0);
+
+	/*
+	 * Swap the tables. Threads still reading the old ones finish with
+	 * them, the next queries see the new ones.
+	 */
+	old_forward = forward;
+	old_hosts = hosts;
+	old_deny = deny;
+	old_leases = leases;
+	old_acl = acl;
+
+	if (forward_changed)
+		forward = new_forward;
+	if (hosts_changed)
+		hosts = new_hosts;
+	if (deny_changed)
+		deny = new_deny;
+	if (leases_changed)
+		leases = new_leases;
+	acl = new_acl;
+
+	config.purge_time = next->purge_time;
+	config.local_zones = next->local_zones;
+	config.upstream_timeout = next->upstream_timeout;
+	upstream->timeout = next->upstream_timeout;
+	config.log_level = next->log_level;
+	log_level = next->log_level;
+	config.rrl_clients = next->rrl_clients;
+	config.rrl_responses = next->rrl_responses;
+	config.rrl_prefix = next->rrl_prefix;
+	config.rrl_slip = next->rrl_slip;
+
+	reload_synchronize();
+
+	if (forward_changed) {
+		forward_carry(forward, old_forward);
+		forward_destroy(old_forward);
+		strcpy(config.forward, next->forward);
+		reload_report(out, LOG_LEVEL_INFO, "Forwarding through %u routes\n", forward->routes_count);
+	}
+
+	if (hosts_changed) {
+		hosts_destroy(old_hosts);
+		strcpy(config.hosts_file, next->hosts_file);
+		reload_report(out, LOG_LEVEL_INFO, "Hosts file %s\n", hosts != NULL ? config.hosts_file : "disabled");
+	} else if (hosts != NULL) {
+		hosts_reload(hosts);
+	}
+
+	if (deny_changed) {
+		deny_destroy(old_deny);
+		strcpy(config.deny_file, next->deny_file);
+		config.deny_nxdomain = next->deny_nxdomain;
+		reload_report(out, LOG_LEVEL_INFO, "Deny file %s\n", deny != NULL ? config.deny_file : "disabled");
+	} else if (deny != NULL) {
+		deny_reload(deny);
+	}
+
+	if (leases_changed) {
+		dhcp_leases_destroy(old_leases);
+		strcpy(config.dhcp_lease_file, next->dhcp_lease_file);
+		strcpy(config.dhcp_domain, next->dhcp_domain);
+		reload_report(out, LOG_LEVEL_INFO, "DHCP leases %s\n", leases != NULL ? config.dhcp_lease_file : "disabled");
+	} else if (leases != NULL) {
+		dhcp_leases_update(leases);
+	}
+
+	acl_destroy(old_acl);
+	strcpy(config.acl_allow, next->acl_allow);
+	strcpy(config.acl_deny, next->acl_deny);
+	if (acl != NULL)
+		reload_report(out, LOG_LEVEL_INFO, "Client ACL of %u allowed and %u denied networks\n", acl->allowed, acl->denied);
+
+	/* Checked against the slots of the pools already */
+	running = 0;
+	for (idx = 0; idx < pools_count; idx++) {
+		worker_pool_limits(pools[idx], next->worker_threads_min, next->worker_threads_max, next->worker_pool_latency);
+		if (next->worker_threads_count != config.worker_threads_count)
+			worker_pool_resize(pools[idx], next->worker_threads_count);
+		running += pools[idx]->count;
+	}
+
+	if (next->worker_threads_min != config.worker_threads_min || next->worker_threads_max != config.worker_threads_max || next->worker_threads_count != config.worker_threads_count)
+		reload_report(out, LOG_LEVEL_INFO, "Workers between %d and %d per node, %u running\n", next->worker_threads_min, next->worker_threads_max, running);
+
+	config.worker_threads_count = next->worker_threads_count;
+	config.worker_threads_min = next->worker_threads_min;
+	config.worker_threads_max = next->worker_threads_max;
+	config.worker_pool_latency = next->worker_pool_latency;
+
+	for (idx = 0; reload_fixed[idx].name != NULL; idx++) {
+		was = (char *)&config + reload_fixed[idx].offset;
+		is = (char *)next + reload_fixed[idx].offset;
+		if (reload_fixed[idx].string ? strcmp(was, is) != 0 : *(int *)was != *(int *)is)
+			reload_report(out, LOG_LEVEL_INFO, "%s changed, it takes a restart\n", reload_fixed[idx].name);
+	}
+
+	reload_count++;
+	reload_report(out, LOG_LEVEL_INFO, "Reloaded %s\n", path);
+
+	free(next);
+
+	return 0;
+
+}
@@ -0,0 +1,30 @@
+#include <stdio.h>
+#include "worker_pool.h"
+
+#ifndef RELOAD_H
+#define RELOAD_H
+
+/*
+ * Readers count themselves on one of RELOAD_STRIPES counters, chosen by
+ * thread, so they don't all write the same cache line
+ */
+#define RELOAD_STRIPES 16
+
+/*
+ * Milliseconds between two looks at the readers of the old tables
+ */
+#define RELOAD_WAIT_MSEC 1
+
+struct reload_stripe {
+	volatile long readers[2];
+} __attribute__((aligned(64)));
+
+extern unsigned long reload_count;
+extern unsigned long reload_failures;
+
+unsigned int reload_read_lock(void);
+void reload_read_unlock(unsigned int);
+void reload_synchronize(void);
+int reload_config(char *, struct worker_pool **, unsigned int, FILE *);
+
+#endif
@@ -0,0 +1,769 @@
+/*
+  **
+  ** replay.c
+  **
+  ** dproxy-replay: sends recorded queries to a DNS server, keeping the
+  ** time between them or playing them faster by a factor, and measures
+  ** how it answers. The queries come from a pcap file, the UDP queries to
+  ** port 53 in it, or from the "microseconds name type" lines printed by
+  ** dproxy-querylog -r.
+  **
+  ** Given the control socket of dproxy, it also reads its counters before
+  ** and after, to tell the share of the queries answered from the cache
+  ** and how many queries went upstream for each one received. The result
+  ** is a line of key=value pairs:
+  **
+  **   queries=120000 threads=1 speed=1.0 duration=60.0 sent=120000
+  **   received=119998 timeouts=2 errors=0 nxdomain=5121 late=0 qps=1999
+  **   p50_us=80 p99_us=21000 p999_us=64000 max_us=180000
+  **   hit_ratio=0.871 upstream_per_query=0.132
+  **
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/un.h>
+#include "dproxy.h"
+
+#define REPLAY_IDS 65536
+/*
+ * Queries sent later than this after their time are counted as late
+ */
+#define REPLAY_LATE_NSEC 1000000ULL
+
+#define PCAP_MAGIC 0xa1b2c3d4
+#define PCAP_MAGIC_NSEC 0xa1b23c4d
+
+#define LINKTYPE_NULL 0
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW 101
+#define LINKTYPE_LINUX_SLL 113
+#define LINKTYPE_LINUX_SLL2 276
+
+struct replay_query {
+	unsigned long long usec;
+	char *name;
+	unsigned short int type;
+};
+
+struct replay_thread {
+	pthread_t tid;
+	unsigned int idx;
+	int sockfd;
+	unsigned long long *in_flight;
+	unsigned int oldest;
+	unsigned int next;
+	unsigned int *samples;
+	unsigned long samples_count;
+	unsigned long samples_size;
+	unsigned long sent;
+	unsigned long received;
+	unsigned long timeouts;
+	unsigned long errors;
+	unsigned long nxdomain;
+	unsigned long late;
+};
+
+/*
+ * Counters of dproxy, read from its control socket
+ */
+struct replay_counters {
+	unsigned long queries;
+	unsigned long cache_hits;
+	unsigned long cache_misses;
+	unsigned long upstream_queries;
+};
+
+struct pcap_header {
+	unsigned int magic;
+	unsigned short int version_major;
+	unsigned short int version_minor;
+	int thiszone;
+	unsigned int sigfigs;
+	unsigned int snaplen;
+	unsigned int linktype;
+};
+
+struct pcap_record {
+	unsigned int ts_sec;
+	unsigned int ts_frac;
+	unsigned int incl_len;
+	unsigned int orig_len;
+};
+
+static struct sockaddr_in replay_server;
+static struct replay_query *replay_queries = NULL;
+static unsigned long replay_count = 0;
+static unsigned long replay_size = 0;
+static unsigned int replay_threads = 1;
+static unsigned int replay_window = 1000;
+static unsigned long long replay_timeout = 2000000000ULL;
+static unsigned short int replay_port = 53;
+static double replay_speed = 1.0;
+
+static unsigned long long replay_now_nsec(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+}
+
+/**
+ * Appends a query to the list
+ * Returns 1 if out of memory
+ */
+static int replay_add(unsigned long long usec, char *name, unsigned short int type) {
+
+	struct replay_query *queries;
+
+	if (replay_count == replay_size) {
+		replay_size = replay_size ? replay_size * 2 : 4096;
+		queries = realloc(replay_queries, sizeof(struct replay_query) * replay_size);
+		if (queries == NULL)
+			return 1;
+		replay_queries = queries;
+	}
+
+	replay_queries[replay_count].name = strdup(name);
+	if (replay_queries[replay_count].name == NULL)
+		return 1;
+
+	replay_queries[replay_count].usec = usec;
+	replay_queries[replay_count].type = type;
+	replay_count++;
+
+	return 0;
+
+}
+
+/**
+ * Reads the lines of dproxy-querylog -r
+ * Returns 1 on failure
+ */
+static int replay_read_text(FILE *fp) {
+
+	char line[512];
+	char name[DNS_NAME_SIZE];
+	unsigned long long usec;
+	unsigned int type;
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+
+		type = DNS_TYPE_A;
+		if (line[0] == '#' || sscanf(line, "%llu %255s %u", &usec, name, &type) < 2)
+			continue;
+
+		if (replay_add(usec, name, type))
+			return 1;
+
+	}
+
+	return 0;
+
+}
+
+static unsigned int pcap_u32(unsigned int value, int swap) {
+
+	return swap ? __builtin_bswap32(value) : value;
+
+}
+
+/**
+ * Finds the DNS query in a captured frame
+ * Returns its length, 0 if the frame is not a UDP query to the port
+ */
+static unsigned int pcap_query(unsigned char *frame, unsigned int len, unsigned int linktype, struct dns_data *data) {
+
+	unsigned int offset = 0;
+	unsigned int ethertype;
+	unsigned int udp_len;
+
+	switch (linktype) {
+	case LINKTYPE_NULL:
+		offset = 4;
+		break;
+	case LINKTYPE_ETHERNET:
+		offset = 14;
+		if (len < offset)
+			return 0;
+		ethertype = (frame[12] << 8) | frame[13];
+		/* VLAN tags */
+		while ((ethertype == 0x8100 || ethertype == 0x88a8) && len >= offset + 4) {
+			ethertype = (frame[offset + 2] << 8) | frame[offset + 3];
+			offset += 4;
+		}
+		break;
+	case LINKTYPE_RAW:
+		break;
+	case LINKTYPE_LINUX_SLL:
+		offset = 16;
+		break;
+	case LINKTYPE_LINUX_SLL2:
+		offset = 20;
+		break;
+	default:
+		return 0;
+	}
+
+	if (len < offset + 1)
+		return 0;
+
+	if ((frame[offset] >> 4) == 4) {
+		/* Later fragments have no UDP header */
+		if (len < offset + 20 || frame[offset + 9] != IPPROTO_UDP || ((frame[offset + 6] & 0x3f) | frame[offset + 7]) != 0)
+			return 0;
+		offset += (frame[offset] & 0x0f) * 4;
+	} else if ((frame[offset] >> 4) == 6) {
+		if (len < offset + 40 || frame[offset + 6] != IPPROTO_UDP)
+			return 0;
+		offset += 40;
+	} else {
+		return 0;
+	}
+
+	if (len < offset + 8 || ((frame[offset + 2] << 8) | frame[offset + 3]) != replay_port)
+		return 0;
+
+	udp_len = (frame[offset + 4] << 8) | frame[offset + 5];
+	offset += 8;
+
+	if (udp_len < 8 || offset + udp_len - 8 > len)
+		udp_len = len - offset + 8;
+	udp_len -= 8;
+
+	if (udp_len < sizeof(struct dns_header) || udp_len > sizeof(struct dns_data))
+		return 0;
+
+	memcpy(data, frame + offset, udp_len);
+
+	/* Answers and other opcodes */
+	if (ntohs(data->dns_hdr.dns_flags) & 0xf800)
+		return 0;
+
+	return udp_len;
+
+}
+
+/**
+ * Reads the queries of a pcap file, without its header
+ * Returns 1 on failure
+ */
+static int replay_read_pcap(FILE *fp, struct pcap_header *header) {
+
+	struct pcap_record record;
+	struct dns_data data;
+	unsigned char *frame;
+	char name[DNS_NAME_SIZE];
+	unsigned short int type;
+	unsigned short int class;
+	unsigned long long usec;
+	unsigned long long first = 0;
+	unsigned int len;
+	unsigned int frac;
+	int swap;
+	int nsec;
+
+	swap = (header->magic != PCAP_MAGIC && header->magic != PCAP_MAGIC_NSEC);
+	nsec = (pcap_u32(header->magic, swap) == PCAP_MAGIC_NSEC);
+
+	frame = malloc(65536);
+	if (frame == NULL)
+		return 1;
+
+	while (fread(&record, sizeof(record), 1, fp) == 1) {
+
+		len = pcap_u32(record.incl_len, swap);
+		if (len > 65536) {
+			fprintf(stderr, "Corrupted capture, a frame of %u bytes\n", len);
+			break;
+		}
+
+		if (fread(frame, 1, len, fp) != len)
+			break;
+
+		len = pcap_query(frame, len, pcap_u32(header->linktype, swap), &data);
+		if (len == 0 || dns_question_len(&data, len) == 0)
+			continue;
+
+		if (extract_request(data.buf, name, &type, &class) != 0)
+			continue;
+
+		frac = pcap_u32(record.ts_frac, swap);
+		usec = (unsigned long long)pcap_u32(record.ts_sec, swap) * 1000000ULL + (nsec ? frac / 1000 : frac);
+
+		if (replay_count == 0)
+			first = usec;
+
+		/* Captures are not always in order, by a little */
+		if (replay_add((usec > first) ? usec - first : 0, name, type)) {
+			free(frame);
+			return 1;
+		}
+
+	}
+
+	free(frame);
+
+	return 0;
+
+}
+
+/**
+ * Reads the queries of a file, a pcap capture or the output of
+ * dproxy-querylog -r, "-" being the standard input
+ * Returns 1 on failure
+ */
+static int replay_read(char *path) {
+
+	struct pcap_header header;
+	FILE *fp;
+	unsigned int magic;
+	int first;
+	int res;
+
+	fp = (strcmp(path, "-") == 0) ? stdin : fopen(path, "r");
+	if (fp == NULL) {
+		perror(path);
+		return 1;
+	}
+
+	/* Text begins with a digit, captures with their magic number */
+	first = getc(fp);
+	ungetc(first, fp);
+
+	if (first == EOF || isdigit(first) || first == '#') {
+		res = replay_read_text(fp);
+	} else if (fread(&header, sizeof(header), 1, fp) == 1
+			&& ((magic = pcap_u32(header.magic, header.magic != PCAP_MAGIC && header.magic != PCAP_MAGIC_NSEC)) == PCAP_MAGIC || magic == PCAP_MAGIC_NSEC)) {
+		res = replay_read_pcap(fp, &header);
+	} else {
+		fprintf(stderr, "%s is neither a pcap capture nor a replay file%s\n", path,
+			(header.magic == 0x0a0d0d0a) ? ", pcapng may be converted with \"editcap -F pcap\"" : "");
+		res = 1;
+	}
+
+	if (fp != stdin)
+		fclose(fp);
+
+	return res;
+
+}
+
+static int replay_compare_time(const void *a, const void *b) {
+
+	const struct replay_query *qa = a;
+	const struct replay_query *qb = b;
+
+	return (qa->usec > qb->usec) - (qa->usec < qb->usec);
+
+}
+
+/**
+ * Reads the counters of dproxy from its control socket
+ * Returns 1 on failure
+ */
+static int replay_counters_read(char *path, struct replay_counters *counters) {
+
+	struct sockaddr_un sa;
+	char line[256];
+	char key[64];
+	unsigned long value;
+	FILE *fp;
+	int fd;
+
+	memset(counters, 0, sizeof(struct replay_counters));
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return 1;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strncpy(sa.sun_path, path, sizeof(sa.sun_path) - 1);
+
+	if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 || write(fd, "stats\nquit\n", 11) != 11) {
+		close(fd);
+		return 1;
+	}
+
+	fp = fdopen(fd, "r");
+	if (fp == NULL) {
+		close(fd);
+		return 1;
+	}
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "%63s %lu", key, &value) != 2)
+			continue;
+		if (strcmp(key, "queries") == 0)
+			counters->queries = value;
+		else if (strcmp(key, "cache_hits") == 0)
+			counters->cache_hits = value;
+		else if (strcmp(key, "cache_misses") == 0)
+			counters->cache_misses = value;
+		else if (strcmp(key, "upstream_queries") == 0)
+			counters->upstream_queries = value;
+	}
+
+	fclose(fp);
+
+	return 0;
+
+}
+
+/**
+ * Builds the query of q, with the given id
+ * Returns its length
+ */
+static unsigned int replay_query_build(struct dns_data *data, struct replay_query *q, unsigned short int id) {
+
+	unsigned short int tail[2];
+	unsigned int len;
+
+	memset(&data->dns_hdr, 0, sizeof(struct dns_header));
+	data->dns_hdr.dns_id = htons(id);
+	data->dns_hdr.dns_flags = htons(0x0100);
+	data->dns_hdr.dns_no_questions = htons(1);
+
+	strcpy(data->buf, q->name);
+	encode_domain_name(data->buf);
+	len = strlen(data->buf) + 1;
+
+	tail[0] = htons(q->type);
+	tail[1] = htons(1);
+	memcpy(data->buf + len, tail, sizeof(tail));
+
+	return sizeof(struct dns_header) + len + sizeof(tail);
+
+}
+
+static void replay_receive(struct replay_thread *thread) {
+
+	struct dns_data data;
+	unsigned int *samples;
+	unsigned short int id;
+	unsigned short int rcode;
+	int res;
+
+	while ((res = recv(thread->sockfd, &data, sizeof(data), MSG_DONTWAIT)) > 0) {
+
+		if (res < sizeof(struct dns_header))
+			continue;
+
+		id = ntohs(data.dns_hdr.dns_id);
+		if (thread->in_flight[id] == 0)
+			continue;
+
+		rcode = ntohs(data.dns_hdr.dns_flags) & 0x000f;
+		if (rcode == 3)
+			thread->nxdomain++;
+		else if (rcode != 0)
+			thread->errors++;
+
+		if (thread->samples_count == thread->samples_size) {
+			samples = realloc(thread->samples, sizeof(unsigned int) * thread->samples_size * 2);
+			if (samples != NULL) {
+				thread->samples = samples;
+				thread->samples_size *= 2;
+			}
+		}
+
+		if (thread->samples_count < thread->samples_size)
+			thread->samples[thread->samples_count++] = (replay_now_nsec() - thread->in_flight[id]) / 1000;
+
+		thread->in_flight[id] = 0;
+		thread->received++;
+
+	}
+
+}
+
+static void replay_expire(struct replay_thread *thread, unsigned long long now, unsigned long long timeout) {
+
+	unsigned short int id;
+
+	while (thread->oldest != thread->next) {
+		id = thread->oldest;
+		if (thread->in_flight[id] != 0) {
+			if (thread->in_flight[id] + timeout > now)
+				break;
+			thread->in_flight[id] = 0;
+			thread->timeouts++;
+		}
+		thread->oldest++;
+	}
+
+}
+
+/**
+ * Sends the queries of a thread, every replay_threads-th of the list
+ * starting from its index, each at its time divided by the speed
+ */
+static void *replay_thread_run(void *args) {
+
+	struct replay_thread *thread = (struct replay_thread *)args;
+	struct dns_data data;
+	struct pollfd pfd;
+	struct timespec wait;
+	unsigned long long start;
+	unsigned long long due;
+	unsigned long long now;
+	unsigned long long last = 0;
+	unsigned long idx = thread->idx;
+	unsigned short int id;
+	unsigned int len;
+
+	pfd.fd = thread->sockfd;
+	pfd.events = POLLIN;
+
+	start = replay_now_nsec();
+
+	for (;;) {
+
+		now = replay_now_nsec();
+
+		if (idx >= replay_count && (thread->oldest == thread->next || now >= last + replay_timeout))
+			break;
+
+		due = 0;
+
+		while (idx < replay_count && thread->next - thread->oldest < replay_window) {
+
+			due = (replay_speed > 0) ? start + (unsigned long long)(replay_queries[idx].usec * 1000 / replay_speed) : now;
+			if (due > now)
+				break;
+
+			if (replay_speed > 0 && now - due > REPLAY_LATE_NSEC)
+				thread->late++;
+
+			id = thread->next;
+			len = replay_query_build(&data, &replay_queries[idx], id);
+			if (send(thread->sockfd, &data, len, 0) == len) {
+				thread->in_flight[id] = now;
+				thread->next++;
+				thread->sent++;
+			}
+
+			last = now;
+			idx += replay_threads;
+			due = 0;
+
+		}
+
+		wait.tv_sec = 0;
+		wait.tv_nsec = (due > now && due - now < 1000000) ? due - now : 1000000;
+
+		if (ppoll(&pfd, 1, &wait, NULL) > 0)
+			replay_receive(thread);
+
+		replay_expire(thread, replay_now_nsec(), replay_timeout);
+
+	}
+
+	/* What is left never got an answer */
+	replay_expire(thread, ~0ULL, 0);
+
+	return NULL;
+
+}
+
+static int replay_compare(const void *a, const void *b) {
+
+	unsigned int sa = *(const unsigned int *)a;
+	unsigned int sb = *(const unsigned int *)b;
+
+	return (sa > sb) - (sa < sb);
+
+}
+
+static void replay_usage(char *program) {
+
+	fprintf(stderr, "usage: %s [-s address] [-p port] [-x speed] [-j threads] [-c window] [-w msec] [-P port] [-C control-socket] <pcap-or-replay-file>\n", program);
+	fprintf(stderr, "\t-s\tserver address, default 127.0.0.1\n");
+	fprintf(stderr, "\t-p\tserver port, default 53\n");
+	fprintf(stderr, "\t-x\tspeed, 2 to play twice as fast, 0 as fast as possible, default 1\n");
+	fprintf(stderr, "\t-j\tthreads, default 1\n");
+	fprintf(stderr, "\t-c\tqueries in flight per thread at most, default 1000\n");
+	fprintf(stderr, "\t-w\tmilliseconds before a query times out, default 2000\n");
+	fprintf(stderr, "\t-P\tport of the queries in the capture, default 53\n");
+	fprintf(stderr, "\t-C\tcontrol socket of dproxy, to report its hit ratio\n");
+	fprintf(stderr, "The file is a pcap capture, or the output of dproxy-querylog -r, \"-\" for the standard input\n");
+
+}
+
+int main(int argc, char *argv[]) {
+
+	struct replay_thread *threads;
+	struct replay_thread total;
+	struct replay_counters before;
+	struct replay_counters after;
+	unsigned long long start;
+	unsigned int *samples;
+	unsigned long count;
+	unsigned long hits;
+	unsigned long lookups;
+	unsigned long queries;
+	unsigned int idx;
+	char *control = NULL;
+	double duration;
+	int opt;
+
+	memset(&replay_server, 0, sizeof(replay_server));
+	replay_server.sin_family = AF_INET;
+	replay_server.sin_port = htons(53);
+	replay_server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	while ((opt = getopt(argc, argv, "s:p:x:j:c:w:P:C:h")) != -1) {
+		switch (opt) {
+		case 's':
+			if (inet_pton(AF_INET, optarg, &replay_server.sin_addr) != 1) {
+				fprintf(stderr, "Invalid address %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'p':
+			replay_server.sin_port = htons(atoi(optarg));
+			break;
+		case 'x':
+			replay_speed = atof(optarg);
+			break;
+		case 'j':
+			replay_threads = atoi(optarg);
+			break;
+		case 'c':
+			replay_window = atoi(optarg);
+			break;
+		case 'w':
+			replay_timeout = strtoull(optarg, NULL, 10) * 1000000ULL;
+			break;
+		case 'P':
+			replay_port = atoi(optarg);
+			break;
+		case 'C':
+			control = optarg;
+			break;
+		default:
+			replay_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind != argc - 1 || replay_threads == 0 || replay_window == 0 || replay_window >= REPLAY_IDS || replay_speed < 0) {
+		replay_usage(argv[0]);
+		return 1;
+	}
+
+	if (replay_read(argv[optind]))
+		return 1;
+
+	if (replay_count == 0) {
+		fprintf(stderr, "No queries in %s\n", argv[optind]);
+		return 1;
+	}
+
+	qsort(replay_queries, replay_count, sizeof(struct replay_query), replay_compare_time);
+
+	threads = calloc(replay_threads, sizeof(struct replay_thread));
+	if (threads == NULL)
+		return 1;
+
+	for (idx = 0; idx < replay_threads; idx++) {
+
+		threads[idx].idx = idx;
+		threads[idx].in_flight = calloc(REPLAY_IDS, sizeof(unsigned long long));
+		threads[idx].samples_size = 4096;
+		threads[idx].samples = malloc(sizeof(unsigned int) * threads[idx].samples_size);
+		threads[idx].sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+
+		if (threads[idx].in_flight == NULL || threads[idx].samples == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			return 1;
+		}
+
+		if (threads[idx].sockfd < 0 || connect(threads[idx].sockfd, (struct sockaddr *)&replay_server, sizeof(replay_server)) < 0) {
+			perror("Could not connect to the server");
+			return 1;
+		}
+
+	}
+
+	if (control != NULL && replay_counters_read(control, &before)) {
+		perror(control);
+		return 1;
+	}
+
+	start = replay_now_nsec();
+
+	for (idx = 0; idx < replay_threads; idx++)
+		pthread_create(&threads[idx].tid, NULL, replay_thread_run, &threads[idx]);
+
+	memset(&total, 0, sizeof(total));
+
+	for (idx = 0; idx < replay_threads; idx++) {
+		pthread_join(threads[idx].tid, NULL);
+		total.sent += threads[idx].sent;
+		total.received += threads[idx].received;
+		total.timeouts += threads[idx].timeouts;
+		total.errors += threads[idx].errors;
+		total.nxdomain += threads[idx].nxdomain;
+		total.late += threads[idx].late;
+		total.samples_count += threads[idx].samples_count;
+		close(threads[idx].sockfd);
+	}
+
+	duration = (replay_now_nsec() - start) / 1e9;
+
+	samples = malloc(sizeof(unsigned int) * (total.samples_count + 1));
+	if (samples == NULL)
+		return 1;
+
+	count = 0;
+	for (idx = 0; idx < replay_threads; idx++) {
+		memcpy(samples + count, threads[idx].samples, sizeof(unsigned int) * threads[idx].samples_count);
+		count += threads[idx].samples_count;
+		free(threads[idx].samples);
+		free(threads[idx].in_flight);
+	}
+
+	if (count == 0)
+		samples[0] = 0;
+
+	qsort(samples, count, sizeof(unsigned int), replay_compare);
+
+	printf("queries=%lu threads=%u speed=%.1f duration=%.1f sent=%lu received=%lu timeouts=%lu errors=%lu nxdomain=%lu late=%lu qps=%.0f p50_us=%u p99_us=%u p999_us=%u max_us=%u",
+		replay_count, replay_threads, replay_speed, duration,
+		total.sent, total.received, total.timeouts, total.errors, total.nxdomain, total.late,
+		total.received / duration,
+		samples[count * 50 / 100], samples[count * 99 / 100], samples[count * 999 / 1000], samples[count ? count - 1 : 0]);
+
+	/* The counters include the queries of other clients meanwhile */
+	if (control != NULL && replay_counters_read(control, &after) == 0) {
+		hits = after.cache_hits - before.cache_hits;
+		lookups = hits + after.cache_misses - before.cache_misses;
+		queries = after.queries - before.queries;
+		printf(" hit_ratio=%.3f upstream_per_query=%.3f",
+			lookups ? (double)hits / lookups : 0.0,
+			queries ? (double)(after.upstream_queries - before.upstream_queries) / queries : 0.0);
+	}
+
+	printf("\n");
+
+	for (count = 0; count < replay_count; count++)
+		free(replay_queries[count].name);
+
+	free(replay_queries);
+	free(samples);
+	free(threads);
+
+	return 0;
+
+}
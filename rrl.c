@@ -0,0 +1,304 @@
+/*
+  **
+  ** rrl.c
+  **
+  ** Response rate limiting of the UDP clients, checked by the receivers
+  ** before a packet goes to the workers. Clients are grouped by network
+  ** prefix, since a spoofed flood doesn't keep one address. Each network
+  ** has a token bucket for all its responses, rrl_clients per second,
+  ** and one for each question asked, rrl_responses per second. Over
+  ** either limit one response in rrl_slip is sent empty and truncated,
+  ** so a real client asks again over TCP, and the others are dropped.
+  **
+  ** The buckets are kept in a fixed table, by hash with a short linear
+  ** probe and no lock. A bucket not used for RRL_AGE_MSEC is as good as
+  ** new, so its slot is reused; with no such slot the least recently
+  ** used one of the probe goes. Under a flood of spoofed sources the
+  ** table only forgets quiet networks.
+  **
+*/
+
+#define _GNU_SOURCE
+#include <time.h>
+#include <sys/random.h>
+#include "dproxy.h"
+#include "conf.h"
+#include "rrl.h"
+
+/**
+ * Allocates a table of at least size buckets, rounded up to a power
+ * of two
+ * Returns NULL if out of memory
+ */
+struct rrl *rrl_new(unsigned int size) {
+
+	struct rrl *rrl;
+	unsigned int slots = RRL_PROBES;
+
+	while (slots < size && slots < (1u << 30))
+		slots *= 2;
+
+	rrl = malloc(sizeof(struct rrl));
+	if (rrl == NULL)
+		return NULL;
+
+	if (posix_memalign((void **)&rrl->buckets, 64, sizeof(struct rrl_bucket) * slots) != 0) {
+		free(rrl);
+		return NULL;
+	}
+
+	memset(rrl->buckets, 0, sizeof(struct rrl_bucket) * slots);
+	rrl->mask = slots - 1;
+
+	/* Keys an attacker can't aim at a slot */
+	if (getrandom(&rrl->seed, sizeof(rrl->seed), GRND_NONBLOCK) != sizeof(rrl->seed))
+		rrl->seed = time(NULL) ^ (getpid() << 16);
+
+	return rrl;
+
+}
+
+void rrl_destroy(struct rrl *rrl) {
+
+	if (rrl == NULL)
+		return;
+
+	free(rrl->buckets);
+	free(rrl);
+
+}
+
+static inline uint32_t _now_msec(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+	return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+
+}
+
+/**
+ * Returns the milliseconds from last to now. A last slightly later is
+ * a millisecond another receiver read after ours, and counts as 0. One
+ * much later is a bucket idle for more than half the range of the
+ * clock, which wrapped since: as old as can be.
+ */
+static inline uint32_t _elapsed(uint32_t now, uint32_t last) {
+
+	int32_t diff = (int32_t)(now - last);
+
+	if (diff <= 0 && diff > -RRL_AGE_MSEC)
+		return 0;
+
+	return now - last;
+
+}
+
+static inline uint32_t _hash(uint32_t hash, unsigned char byte) {
+
+	return (hash ^ byte) * 16777619;
+
+}
+
+static inline unsigned int _rate(int rate) {
+
+	if (rate <= 0)
+		return 0;
+
+	return (rate > RRL_MAX_RATE) ? RRL_MAX_RATE : rate;
+
+}
+
+/**
+ * Finds the bucket of key, or takes a slot for it
+ * Returns NULL if another thread took the slot meanwhile
+ */
+static struct rrl_bucket *_bucket(struct rrl *rrl, uint32_t key, uint32_t now, uint32_t rate) {
+
+	struct rrl_bucket *bucket;
+	struct rrl_bucket *victim = NULL;
+	uint32_t victim_key = 0;
+	uint32_t victim_age = 0;
+	uint32_t seen;
+	uint32_t age;
+	unsigned int probe;
+
+	for (probe = 0; probe < RRL_PROBES; probe++) {
+
+		bucket = &rrl->buckets[(key + probe) & rrl->mask];
+		seen = bucket->key;
+
+		if (seen == key)
+			return bucket;
+
+		age = _elapsed(now, (uint32_t)(bucket->state >> 32));
+
+		if (seen == 0 || age >= RRL_AGE_MSEC) {
+			victim = bucket;
+			victim_key = seen;
+			break;
+		}
+
+		if (victim == NULL || age > victim_age) {
+			victim = bucket;
+			victim_key = seen;
+			victim_age = age;
+		}
+
+	}
+
+	if (!__sync_bool_compare_and_swap(&victim->key, victim_key, key))
+		return NULL;
+
+	victim->limited = 0;
+	victim->state = ((uint64_t)now << 32) | ((uint64_t)rate * RRL_TOKEN);
+
+	return victim;
+
+}
+
+/**
+ * Refills the bucket for the time gone and takes a token
+ * Returns 1 if there was none
+ */
+static int _take(struct rrl_bucket *bucket, uint32_t now, uint32_t rate) {
+
+	uint64_t state;
+	uint64_t tokens;
+	uint64_t full = (uint64_t)rate * RRL_TOKEN;
+	uint32_t elapsed;
+	uint32_t last;
+	int empty;
+
+	do {
+
+		state = bucket->state;
+		last = (uint32_t)(state >> 32);
+		elapsed = _elapsed(now, last);
+		tokens = (uint32_t)state;
+
+		/* rate thousandths of a token each millisecond */
+		if (elapsed >= RRL_AGE_MSEC || tokens + (uint64_t)elapsed * rate >= full)
+			tokens = full;
+		else
+			tokens += (uint64_t)elapsed * rate;
+
+		empty = (tokens < RRL_TOKEN);
+		if (!empty)
+			tokens -= RRL_TOKEN;
+
+		/* The refill time never goes back */
+		if (elapsed > 0)
+			last = now;
+
+	} while (!__sync_bool_compare_and_swap(&bucket->state, state, ((uint64_t)last << 32) | tokens));
+
+	return empty;
+
+}
+
+/**
+ * Charges a response to the bucket of key
+ * Returns 1 if over the limit
+ */
+static int _limited(struct rrl *rrl, uint32_t key, uint32_t now, uint32_t rate, struct rrl_bucket **limited) {
+
+	struct rrl_bucket *bucket;
+
+	/* 0 stands for a free slot */
+	if (key == 0)
+		key = 1;
+
+	bucket = _bucket(rrl, key, now, rate);
+	if (bucket == NULL || !_take(bucket, now, rate))
+		return 0;
+
+	*limited = bucket;
+
+	return 1;
+
+}
+
+/**
+ * Decides what to do with the query just read in pkt, len bytes long.
+ * Only queries count, the rest is left to the workers.
+ */
+enum rrl_action rrl_check(struct rrl *rrl, struct udp_packet *pkt, unsigned int len) {
+
+	struct rrl_bucket *bucket = NULL;
+	unsigned char *byte;
+	unsigned int question_len;
+	unsigned int idx;
+	unsigned int clients = _rate(config.rrl_clients);
+	unsigned int responses = _rate(config.rrl_responses);
+	unsigned int slip = (config.rrl_slip > 0) ? config.rrl_slip : 0;
+	uint32_t network;
+	uint32_t hash;
+	uint32_t now;
+
+	if ((clients == 0 && responses == 0) || pkt->dns_chdr.query_bit != 0)
+		return RRL_PASS;
+
+	network = ntohl(pkt->src_ip.s_addr);
+	if (config.rrl_prefix <= 0)
+		network = 0;
+	else if (config.rrl_prefix < 32)
+		network &= ~(0xffffffffu >> config.rrl_prefix);
+
+	hash = 2166136261u ^ rrl->seed;
+	for (idx = 0; idx < 4; idx++)
+		hash = _hash(hash, (network >> (idx * 8)) & 0xff);
+
+	now = _now_msec();
+
+	if (clients > 0 && _limited(rrl, _hash(hash, 'C'), now, clients, &bucket))
+		goto over;
+
+	if (responses == 0)
+		return RRL_PASS;
+
+	/*
+	 * The question in wire format, lowercase so mixing the case doesn't
+	 * make a new one
+	 */
+	question_len = dns_question_len(&pkt->dns_data, len);
+	byte = (unsigned char *)pkt->dns_data.buf;
+	hash = _hash(hash, 'Q');
+	for (idx = 0; idx < question_len; idx++)
+		hash = _hash(hash, tolower(byte[idx]));
+
+	if (_limited(rrl, hash, now, responses, &bucket))
+		goto over;
+
+	return RRL_PASS;
+
+over:
+	if (slip > 0 && __sync_fetch_and_add(&bucket->limited, 1) % slip == 0)
+		return RRL_SLIP;
+
+	return RRL_DROP;
+
+}
+
+/**
+ * Turns the query in data, len bytes long, into an empty answer with
+ * the truncated bit set
+ * Returns the length of the answer, 0 if the question is malformed
+ */
+unsigned int rrl_slip_reply(struct dns_data *data, unsigned int len) {
+
+	unsigned int question_len;
+
+	question_len = dns_question_len(data, len);
+	if (question_len == 0)
+		return 0;
+
+	len = dns_reply_init(data, question_len, 0);
+
+	/* Not authoritative, and truncated */
+	data->dns_hdr.dns_flags = htons((ntohs(data->dns_hdr.dns_flags) & ~0x0400) | 0x0200);
+
+	return len;
+
+}
@@ -0,0 +1,56 @@
+#include <stdint.h>
+#include "dproxy.h"
+
+#ifndef RRL_H
+#define RRL_H
+
+/*
+ * Slots looked at for a key, from the one it hashes to
+ */
+#define RRL_PROBES 4
+
+/*
+ * A bucket untouched this long is full again, and its slot can be
+ * taken by another key
+ */
+#define RRL_AGE_MSEC 1000
+
+/*
+ * Tokens are counted in thousandths, a response takes RRL_TOKEN
+ */
+#define RRL_TOKEN 1000
+
+/*
+ * Highest rate accepted, so a full bucket fits in 32 bits
+ */
+#define RRL_MAX_RATE 1000000
+
+enum rrl_action {
+	RRL_PASS = 0,
+	RRL_DROP,
+	RRL_SLIP
+};
+
+/*
+ * Key and state change with compare and swap, never under a lock. The
+ * state holds the millisecond of the last refill in the upper half and
+ * the tokens left in the lower one, so both change together.
+ */
+struct rrl_bucket {
+	volatile uint32_t key;
+	volatile uint32_t limited;
+	volatile uint64_t state;
+};
+
+struct rrl {
+	struct rrl_bucket *buckets;
+	unsigned int mask;
+	uint32_t seed;
+};
+
+struct rrl *rrl_new(unsigned int);
+void rrl_destroy(struct rrl *);
+enum rrl_action rrl_check(struct rrl *, struct udp_packet *, unsigned int);
+unsigned int rrl_slip_reply(struct dns_data *, unsigned int);
+
+#endif
@@ -0,0 +1,137 @@
+/*
+  **
+  ** stats.c
+  **
+  ** Counters and latency histograms. Every thread counts into a block of
+  ** its own, registered the first time it counts, so the hot path is a
+  ** plain increment with no atomics and no shared cache lines. The
+  ** blocks are only added up when somebody reads the numbers. A thread
+  ** going away folds its numbers into a block kept for the retired
+  ** threads, so nothing is lost when the worker pool shrinks.
+  **
+*/
+
+#include <pthread.h>
+#include <time.h>
+#include "dproxy.h"
+#include "stats.h"
+
+__thread struct stats_thread *stats_local = NULL;
+
+const unsigned long stats_bucket_bounds[STATS_BUCKETS - 1] = STATS_BUCKET_BOUNDS;
+
+/*
+ * Blocks of the live threads, and the numbers of the retired ones
+ */
+static struct stats_thread *stats_threads = NULL;
+static struct stats_thread stats_retired;
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+unsigned long long stats_now_usec(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+
+}
+
+/**
+ * Allocates the block of the calling thread. If there is no memory the
+ * thread counts into the retired block, racing with the other threads
+ * in the same situation.
+ */
+struct stats_thread *stats_register(void) {
+
+	struct stats_thread *block;
+
+	if (posix_memalign((void **)&block, 64, sizeof(struct stats_thread)) != 0) {
+		stats_local = &stats_retired;
+		return stats_local;
+	}
+
+	memset(block, 0, sizeof(struct stats_thread));
+
+	pthread_mutex_lock(&stats_mutex);
+	block->next = stats_threads;
+	stats_threads = block;
+	pthread_mutex_unlock(&stats_mutex);
+
+	stats_local = block;
+
+	return block;
+
+}
+
+static void _add(struct stats_thread *total, struct stats_thread *block) {
+
+	unsigned int idx;
+	unsigned int bucket;
+
+	for (idx = 0; idx < STATS_COUNTERS; idx++)
+		total->counters[idx] += block->counters[idx];
+
+	for (idx = 0; idx < STATS_QTYPES; idx++)
+		total->qtypes[idx] += block->qtypes[idx];
+
+	for (idx = 0; idx < STATS_HISTOGRAMS; idx++) {
+		for (bucket = 0; bucket < STATS_BUCKETS; bucket++)
+			total->histograms[idx].buckets[bucket] += block->histograms[idx].buckets[bucket];
+		total->histograms[idx].sum += block->histograms[idx].sum;
+		total->histograms[idx].count += block->histograms[idx].count;
+	}
+
+}
+
+/**
+ * Folds the numbers of the calling thread into the retired block and
+ * frees its own. To be called by threads about to exit.
+ */
+void stats_thread_exit(void) {
+
+	struct stats_thread **ptr;
+	struct stats_thread *block = stats_local;
+
+	if (block == NULL || block == &stats_retired)
+		return;
+
+	pthread_mutex_lock(&stats_mutex);
+
+	for (ptr = &stats_threads; *ptr != NULL; ptr = &(*ptr)->next) {
+		if (*ptr == block) {
+			*ptr = block->next;
+			break;
+		}
+	}
+
+	_add(&stats_retired, block);
+
+	pthread_mutex_unlock(&stats_mutex);
+
+	stats_local = NULL;
+	free(block);
+
+}
+
+/**
+ * Adds up the numbers of all the threads, live and retired, into total.
+ * The live threads keep counting meanwhile, so the result is a close
+ * snapshot rather than an exact one.
+ */
+void stats_read(struct stats_thread *total) {
+
+	struct stats_thread *block;
+
+	memset(total, 0, sizeof(struct stats_thread));
+
+	pthread_mutex_lock(&stats_mutex);
+
+	_add(total, &stats_retired);
+
+	for (block = stats_threads; block != NULL; block = block->next)
+		_add(total, block);
+
+	pthread_mutex_unlock(&stats_mutex);
+
+}
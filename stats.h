@@ -0,0 +1,105 @@
+#include <pthread.h>
+
+#ifndef STATS_H
+#define STATS_H
+
+enum stats_counter {
+	STATS_QUERIES = 0,
+	STATS_UDP_QUERIES,
+	STATS_TCP_QUERIES,
+	STATS_CACHE_HITS,
+	STATS_CACHE_MISSES,
+	STATS_LOCAL_ANSWERS,
+	STATS_BLOCKED,
+	STATS_UPSTREAM_QUERIES,
+	STATS_UPSTREAM_ANSWERS,
+	STATS_UPSTREAM_TIMEOUTS,
+	STATS_UPSTREAM_UNMATCHED,
+	STATS_TRUNCATED,
+	STATS_DROPPED,
+	STATS_RRL_DROPPED,
+	STATS_RRL_SLIPPED,
+	STATS_ACL_REFUSED,
+	STATS_COUNTERS
+};
+
+enum stats_histogram {
+	STATS_UPSTREAM_RTT = 0,
+	STATS_RESOLVE_TIME,
+	STATS_HISTOGRAMS
+};
+
+/*
+ * Upper bounds of the histogram buckets, in microseconds. The last
+ * bucket takes everything above.
+ */
+#define STATS_BUCKETS 16
+#define STATS_BUCKET_BOUNDS { 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000 }
+
+/*
+ * Query types above STATS_QTYPES - 1 are counted as type 0
+ */
+#define STATS_QTYPES 256
+
+struct stats_histogram_data {
+	unsigned long buckets[STATS_BUCKETS];
+	unsigned long long sum;
+	unsigned long count;
+};
+
+/*
+ * The numbers of a thread. Only the owning thread writes them, with
+ * plain increments; readers add up the blocks of all the threads. The
+ * blocks are cache line aligned so threads never share a line.
+ */
+struct stats_thread {
+	unsigned long counters[STATS_COUNTERS];
+	unsigned long qtypes[STATS_QTYPES];
+	struct stats_histogram_data histograms[STATS_HISTOGRAMS];
+	struct stats_thread *next;
+} __attribute__((aligned(64)));
+
+extern __thread struct stats_thread *stats_local;
+extern const unsigned long stats_bucket_bounds[STATS_BUCKETS - 1];
+
+struct stats_thread *stats_register(void);
+void stats_thread_exit(void);
+void stats_read(struct stats_thread *);
+unsigned long long stats_now_usec(void);
+
+static inline struct stats_thread *stats_get(void) {
+
+	return (stats_local != NULL) ? stats_local : stats_register();
+
+}
+
+static inline void stats_count(enum stats_counter counter) {
+
+	stats_get()->counters[counter]++;
+
+}
+
+static inline void stats_count_qtype(unsigned short int type) {
+
+	stats_get()->qtypes[(type < STATS_QTYPES) ? type : 0]++;
+
+}
+
+/**
+ * Adds a time in microseconds to a histogram
+ */
+static inline void stats_time(enum stats_histogram histogram, unsigned long usec) {
+
+	struct stats_histogram_data *data = &stats_get()->histograms[histogram];
+	unsigned int idx;
+
+	for (idx = 0; idx < STATS_BUCKETS - 1 && usec > stats_bucket_bounds[idx]; idx++)
+		;
+
+	data->buckets[idx]++;
+	data->sum += usec;
+	data->count++;
+
+}
+
+#endif
@@ -0,0 +1,370 @@
+/*
+  **
+  ** stub_server.c
+  **
+  ** dproxy-stub: an authoritative DNS server for benchmarks, standing in
+  ** for the upstream servers on localhost. It answers from a zone in the
+  ** hosts file format, read by hosts.c, and makes up an A record for the
+  ** names it doesn't know, or answers NXDOMAIN. Answers may be delayed,
+  ** lost or truncated on purpose, to see how dproxy copes with a slow or
+  ** unreliable upstream.
+  **
+  ** Each thread has its own socket on the port. Delayed answers wait in a
+  ** queue of the thread, in the order they are due since the delay is
+  ** the same for all of them.
+  **
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include "dproxy.h"
+#include "hosts.h"
+
+/*
+ * Answers a thread may hold back at once, more are dropped
+ */
+#define STUB_QUEUE_SIZE 8192
+#define STUB_TTL 300
+#define STUB_POLL_MSEC 100
+
+struct stub_answer {
+	unsigned long long due;
+	struct sockaddr_in addr;
+	unsigned int len;
+	struct dns_data data;
+};
+
+struct stub_thread {
+	pthread_t tid;
+	int sockfd;
+	unsigned long long seed;
+	struct stub_answer *queue;
+	unsigned int head;
+	unsigned int tail;
+	unsigned long queries;
+	unsigned long answered;
+	unsigned long lost;
+	unsigned long truncated;
+	unsigned long overflows;
+};
+
+static struct hosts *stub_zone = NULL;
+static struct in_addr stub_address;
+static unsigned long long stub_delay = 0;
+static unsigned int stub_loss = 0;
+static unsigned int stub_truncate = 0;
+static int stub_nxdomain = 0;
+static volatile int stub_run = 1;
+
+static unsigned long long stub_now_nsec(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+}
+
+/**
+ * Returns a random number below 100, from the generator of a thread
+ */
+static unsigned int stub_percent(struct stub_thread *thread) {
+
+	thread->seed ^= thread->seed >> 12;
+	thread->seed ^= thread->seed << 25;
+	thread->seed ^= thread->seed >> 27;
+
+	return ((thread->seed * 2685821657736338717ULL) >> 32) % 100;
+
+}
+
+/**
+ * Turns the query in data into its answer
+ * Returns the length of the answer, 0 if the query is not valid
+ */
+static unsigned int stub_answer(struct dns_data *data, unsigned int len) {
+
+	char name[DNS_NAME_SIZE];
+	unsigned short int type;
+	unsigned short int class;
+	unsigned int question_len;
+	unsigned int res;
+
+	question_len = dns_question_len(data, len);
+	if (question_len == 0 || (ntohs(data->dns_hdr.dns_flags) & 0x8000))
+		return 0;
+
+	if (extract_request(data->buf, name, &type, &class) != 0)
+		return 0;
+
+	if (stub_zone != NULL) {
+		res = hosts_answer(stub_zone, name, type, data, len);
+		if (res > 0)
+			return res;
+	}
+
+	if (stub_nxdomain)
+		return dns_reply_init(data, question_len, 3);
+
+	len = dns_reply_init(data, question_len, 0);
+	if (type == DNS_TYPE_A)
+		len = dns_reply_add_rr(data, len, type, STUB_TTL, &stub_address, 4);
+
+	return len;
+
+}
+
+/**
+ * Sends the answers of the queue that are due
+ * Returns the milliseconds to wait for the next one, or STUB_POLL_MSEC
+ */
+static int stub_flush(struct stub_thread *thread) {
+
+	struct stub_answer *answer;
+	unsigned long long now = stub_now_nsec();
+
+	while (thread->head != thread->tail) {
+
+		answer = &thread->queue[thread->head % STUB_QUEUE_SIZE];
+		if (answer->due > now)
+			return (answer->due - now) / 1000000 + 1;
+
+		sendto(thread->sockfd, &answer->data, answer->len, 0, (struct sockaddr *)&answer->addr, sizeof(answer->addr));
+		thread->answered++;
+		thread->head++;
+
+	}
+
+	return STUB_POLL_MSEC;
+
+}
+
+static void *stub_thread_run(void *args) {
+
+	struct stub_thread *thread = (struct stub_thread *)args;
+	struct stub_answer *answer;
+	struct stub_answer overflow;
+	struct pollfd pfd;
+	socklen_t addr_len;
+	int timeout = STUB_POLL_MSEC;
+	int res;
+
+	pfd.fd = thread->sockfd;
+	pfd.events = POLLIN;
+
+	while (stub_run) {
+
+		if (poll(&pfd, 1, timeout) > 0) {
+
+			for (;;) {
+
+				/* Queue full, the query is read and dropped */
+				if (thread->tail - thread->head == STUB_QUEUE_SIZE)
+					answer = &overflow;
+				else
+					answer = &thread->queue[thread->tail % STUB_QUEUE_SIZE];
+
+				addr_len = sizeof(answer->addr);
+				res = recvfrom(thread->sockfd, &answer->data, sizeof(struct dns_data), MSG_DONTWAIT, (struct sockaddr *)&answer->addr, &addr_len);
+				if (res <= 0)
+					break;
+
+				thread->queries++;
+
+				if (answer == &overflow) {
+					thread->overflows++;
+					continue;
+				}
+
+				answer->len = stub_answer(&answer->data, res);
+				if (answer->len == 0)
+					continue;
+
+				if (stub_loss && stub_percent(thread) < stub_loss) {
+					thread->lost++;
+					continue;
+				}
+
+				/* Truncated answers keep the question only */
+				if (stub_truncate && stub_percent(thread) < stub_truncate) {
+					answer->len = dns_reply_init(&answer->data, dns_question_len(&answer->data, answer->len), 0);
+					answer->data.dns_hdr.dns_flags |= htons(0x0200);
+					thread->truncated++;
+				}
+
+				answer->due = stub_now_nsec() + stub_delay;
+				thread->tail++;
+
+			}
+
+		}
+
+		timeout = stub_flush(thread);
+
+	}
+
+	return NULL;
+
+}
+
+static int stub_sock_open(struct in_addr ip, int port) {
+
+	struct sockaddr_in sa;
+	int on = 1;
+	int fd;
+
+	fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (fd < 0)
+		return -1;
+
+	setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr = ip;
+	sa.sin_port = htons(port);
+
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+
+}
+
+static void stub_stop(int signo) {
+
+	stub_run = 0;
+
+}
+
+static void stub_usage(char *program) {
+
+	fprintf(stderr, "usage: %s [-a address] [-p port] [-z zone] [-d msec] [-l percent] [-t percent] [-j threads] [-N]\n", program);
+	fprintf(stderr, "\t-a\taddress to listen on, default 127.0.0.1\n");
+	fprintf(stderr, "\t-p\tport, default 5353\n");
+	fprintf(stderr, "\t-z\tzone, in the hosts file format\n");
+	fprintf(stderr, "\t-d\tdelay of the answers in milliseconds, default 0\n");
+	fprintf(stderr, "\t-l\tpercentage of the answers lost\n");
+	fprintf(stderr, "\t-t\tpercentage of the answers truncated\n");
+	fprintf(stderr, "\t-j\tthreads, default 1\n");
+	fprintf(stderr, "\t-N\tanswer NXDOMAIN for the names out of the zone,\n");
+	fprintf(stderr, "\t\tinstead of an A record with address 192.0.2.1\n");
+
+}
+
+int main(int argc, char *argv[]) {
+
+	struct stub_thread *threads;
+	struct stub_thread total;
+	struct in_addr ip;
+	char *zone = NULL;
+	unsigned int threads_count = 1;
+	unsigned int idx;
+	int port = 5353;
+	int opt;
+
+	ip.s_addr = htonl(INADDR_LOOPBACK);
+	inet_pton(AF_INET, "192.0.2.1", &stub_address);
+
+	while ((opt = getopt(argc, argv, "a:p:z:d:l:t:j:Nh")) != -1) {
+		switch (opt) {
+		case 'a':
+			if (inet_pton(AF_INET, optarg, &ip) != 1) {
+				fprintf(stderr, "Invalid address %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'z':
+			zone = optarg;
+			break;
+		case 'd':
+			stub_delay = strtoull(optarg, NULL, 10) * 1000000ULL;
+			break;
+		case 'l':
+			stub_loss = atoi(optarg);
+			break;
+		case 't':
+			stub_truncate = atoi(optarg);
+			break;
+		case 'j':
+			threads_count = atoi(optarg);
+			break;
+		case 'N':
+			stub_nxdomain = 1;
+			break;
+		default:
+			stub_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (port <= 0 || threads_count == 0) {
+		stub_usage(argv[0]);
+		return 1;
+	}
+
+	if (zone != NULL) {
+		stub_zone = hosts_new(zone);
+		if (stub_zone == NULL) {
+			fprintf(stderr, "Could not load the zone %s\n", zone);
+			return 1;
+		}
+	}
+
+	threads = calloc(threads_count, sizeof(struct stub_thread));
+	if (threads == NULL)
+		return 1;
+
+	signal(SIGINT, stub_stop);
+	signal(SIGTERM, stub_stop);
+
+	for (idx = 0; idx < threads_count; idx++) {
+
+		threads[idx].seed = 0x9e3779b97f4a7c15ULL * (idx + 1);
+		threads[idx].queue = malloc(sizeof(struct stub_answer) * STUB_QUEUE_SIZE);
+		threads[idx].sockfd = stub_sock_open(ip, port);
+
+		if (threads[idx].queue == NULL || threads[idx].sockfd < 0) {
+			perror("Could not open the socket");
+			return 1;
+		}
+
+		pthread_create(&threads[idx].tid, NULL, stub_thread_run, &threads[idx]);
+
+	}
+
+	memset(&total, 0, sizeof(total));
+
+	for (idx = 0; idx < threads_count; idx++) {
+		pthread_join(threads[idx].tid, NULL);
+		total.queries += threads[idx].queries;
+		total.answered += threads[idx].answered;
+		total.lost += threads[idx].lost;
+		total.truncated += threads[idx].truncated;
+		total.overflows += threads[idx].overflows;
+		close(threads[idx].sockfd);
+		free(threads[idx].queue);
+	}
+
+	printf("stub queries=%lu answered=%lu lost=%lu truncated=%lu overflows=%lu\n",
+		total.queries, total.answered, total.lost, total.truncated, total.overflows);
+
+	hosts_destroy(stub_zone);
+	free(threads);
+
+	return 0;
+
+}
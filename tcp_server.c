@@ -0,0 +1,791 @@
+/*
+  **
+  ** tcp_server.c
+  **
+  ** DNS over TCP listener. A single thread waits with epoll on the
+  ** listening socket and on all the client connections, splitting the
+  ** incoming byte stream in DNS messages. Each message is queued to a
+  ** small set of resolver threads which share the cache and the upstream
+  ** server with the UDP workers. Names not cached are asked upstream over
+  ** TCP as well, so answers too long for UDP come back whole. Answers are
+  ** written back as soon as they are ready, so pipelined queries on the
+  ** same connection may be answered out of order.
+  **
+*/
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <netinet/tcp.h>
+#include "dproxy.h"
+#include "tcp_server.h"
+#include "stats.h"
+#include "topk.h"
+#include "reload.h"
+#include "acl.h"
+
+#define TCP_MAX_EVENTS 64
+#define TCP_LISTEN_BACKLOG 128
+
+static void *tcp_listener(void *);
+static void *tcp_worker(void *);
+
+/**
+ * Opens a non blocking TCP socket listening on the given address
+ * Returns the socket, or -1 on failure
+ */
+static int tcp_sock_open(struct in_addr ip, int port) {
+
+	int fd;
+	int on = 1;
+	struct sockaddr_in sa;
+
+	memset((void *)&sa, 0, sizeof(sa));
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+	if (fd < 0) {
+		debug_perror("Could not create TCP socket");
+		return -1;
+	}
+
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	sa.sin_family = AF_INET;
+	memcpy((void *)&sa.sin_addr, (void *)&ip, sizeof(struct in_addr));
+	sa.sin_port = htons(port);
+
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+		debug_perror("Could not bind to TCP port");
+		close(fd);
+		return -1;
+	}
+
+	if (listen(fd, TCP_LISTEN_BACKLOG) < 0) {
+		debug_perror("Could not listen on TCP port");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+
+}
+
+/**
+ * Creates the TCP listener and its resolver threads. The listening
+ * socket is fd, if not -1, or a new one bound to ip and port.
+ * Returns NULL if the listening socket could not be opened
+ */
+struct tcp_server *tcp_server_new(struct in_addr ip, int port, int fd, unsigned int threads, unsigned int max_conns, unsigned int idle_timeout) {
+
+	struct tcp_server *srv;
+	struct epoll_event ev;
+	unsigned int idx;
+
+	srv = (struct tcp_server *)malloc(sizeof(struct tcp_server));
+	if (srv == NULL)
+		return NULL;
+
+	memset(srv, 0, sizeof(struct tcp_server));
+
+	srv->listen_fd = (fd >= 0) ? fd : tcp_sock_open(ip, port);
+	if (srv->listen_fd < 0) {
+		free(srv);
+		return NULL;
+	}
+
+	srv->epoll_fd = epoll_create1(0);
+	if (srv->epoll_fd < 0) {
+		debug_perror("epoll_create1");
+		close(srv->listen_fd);
+		free(srv);
+		return NULL;
+	}
+
+	/*
+	 * The listening socket is recognized by a NULL pointer in the event
+	 */
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	epoll_ctl(srv->epoll_fd, EPOLL_CTL_ADD, srv->listen_fd, &ev);
+
+	if (threads == 0)
+		threads = 1;
+
+	srv->max_conns = max_conns;
+	srv->idle_timeout = idle_timeout;
+	srv->run = 1;
+
+	pthread_mutex_init(&srv->queue_mutex, NULL);
+	pthread_cond_init(&srv->queue_cond, NULL);
+
+	srv->workers = (pthread_t *)malloc(sizeof(pthread_t) * threads);
+	srv->workers_count = threads;
+	for (idx = 0; idx < threads; idx++)
+		pthread_create(&srv->workers[idx], NULL, tcp_worker, srv);
+
+	pthread_create(&srv->tid, NULL, tcp_listener, srv);
+
+	log_info("TCP listener started on port %d with %d resolver threads\n", port, threads);
+
+	return srv;
+
+}
+
+/**
+ * Drops a reference to a connection. The last one closes the socket and
+ * frees the memory, so a connection closed by the listener stays valid
+ * until all its queries have been answered (or discarded).
+ */
+static void tcp_conn_put(struct tcp_conn *conn) {
+
+	int last;
+
+	pthread_mutex_lock(&conn->mutex);
+	conn->refcount--;
+	last = (conn->refcount == 0);
+	pthread_mutex_unlock(&conn->mutex);
+
+	if (last) {
+		close(conn->fd);
+		pthread_mutex_destroy(&conn->mutex);
+		free(conn->out_buf);
+		free(conn);
+	}
+
+}
+
+/**
+ * Updates the epoll events of a connection after a change of its
+ * reading state or of its output buffer. Must be called holding
+ * conn->mutex.
+ */
+static void tcp_conn_rearm(struct tcp_server *srv, struct tcp_conn *conn) {
+
+	struct epoll_event ev;
+
+	if (conn->closed)
+		return;
+
+	ev.events = 0;
+	if (conn->reading)
+		ev.events |= EPOLLIN;
+	if (conn->out_len > 0)
+		ev.events |= EPOLLOUT;
+	ev.data.ptr = conn;
+
+	epoll_ctl(srv->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+
+}
+
+/**
+ * Once the client has closed its side, the connection is shut down as
+ * soon as the last answer has left. The listener then gets EPOLLHUP and
+ * releases it. Must be called holding conn->mutex.
+ */
+static void tcp_conn_check_eof(struct tcp_conn *conn) {
+
+	if (conn->eof && conn->inflight == 0 && conn->out_len == 0)
+		shutdown(conn->fd, SHUT_WR);
+
+}
+
+/**
+ * Closes a connection on the listener side. Only called by the listener
+ * thread, which is the only one walking the connection list.
+ */
+static void tcp_conn_close(struct tcp_server *srv, struct tcp_conn *conn) {
+
+	pthread_mutex_lock(&conn->mutex);
+	conn->closed = 1;
+	epoll_ctl(srv->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+	shutdown(conn->fd, SHUT_RDWR);
+	pthread_mutex_unlock(&conn->mutex);
+
+	if (conn->prev != NULL)
+		conn->prev->next = conn->next;
+	else
+		srv->conns = conn->next;
+	if (conn->next != NULL)
+		conn->next->prev = conn->prev;
+
+	srv->conns_count--;
+
+	debug("TCP connection from %s closed\n", inet_ntoa(conn->src_ip));
+
+	tcp_conn_put(conn);
+
+}
+
+/**
+ * Accepts all the pending connections, refusing the ones above the
+ * configured limit.
+ */
+static void tcp_accept(struct tcp_server *srv) {
+
+	int fd;
+	int on = 1;
+	struct sockaddr_in sa;
+	socklen_t salen;
+	struct tcp_conn *conn;
+	struct epoll_event ev;
+	unsigned int token;
+	int allowed;
+
+	while (1) {
+
+		salen = sizeof(sa);
+		fd = accept4(srv->listen_fd, (struct sockaddr *)&sa, &salen, SOCK_NONBLOCK);
+		if (fd < 0) {
+			/*
+			 * The pending connection keeps the socket readable, epoll
+			 * would wake the listener again right away
+			 */
+			if (errno == EMFILE || errno == ENFILE) {
+				epoll_ctl(srv->epoll_fd, EPOLL_CTL_DEL, srv->listen_fd, NULL);
+				srv->accept_paused = 1;
+				if (!srv->accept_failing)
+					log_error("Out of file descriptors, not accepting TCP connections for now\n");
+				srv->accept_failing = 1;
+			}
+			return;
+		}
+
+		if (srv->accept_failing) {
+			log_info("Accepting TCP connections again\n");
+			srv->accept_failing = 0;
+		}
+
+		if (acl != NULL) {
+			token = reload_read_lock();
+			allowed = (acl == NULL || acl_check(acl, sa.sin_addr));
+			reload_read_unlock(token);
+			if (!allowed) {
+				stats_count(STATS_ACL_REFUSED);
+				close(fd);
+				continue;
+			}
+		}
+
+		if (srv->conns_count >= srv->max_conns) {
+			log_warning("Too many TCP connections, refusing %s\n", inet_ntoa(sa.sin_addr));
+			close(fd);
+			continue;
+		}
+
+		conn = (struct tcp_conn *)malloc(sizeof(struct tcp_conn));
+		if (conn == NULL) {
+			close(fd);
+			continue;
+		}
+
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+		conn->fd = fd;
+		pthread_mutex_init(&conn->mutex, NULL);
+		conn->refcount = 1;
+		conn->inflight = 0;
+		conn->closed = 0;
+		conn->reading = 1;
+		conn->eof = 0;
+		conn->last_active = time(NULL);
+		conn->src_ip = sa.sin_addr;
+		conn->src_port = ntohs(sa.sin_port);
+		conn->in_len = 0;
+		conn->out_len = 0;
+		conn->out_size = 0;
+		conn->out_buf = NULL;
+
+		conn->prev = NULL;
+		conn->next = srv->conns;
+		if (srv->conns != NULL)
+			srv->conns->prev = conn;
+		srv->conns = conn;
+		srv->conns_count++;
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = conn;
+		epoll_ctl(srv->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+
+		debug("TCP connection from %s port %d\n", inet_ntoa(conn->src_ip), conn->src_port);
+
+	}
+
+}
+
+/**
+ * Queues a complete DNS message read from a connection to the resolver
+ * threads. Must be called holding conn->mutex.
+ */
+static void tcp_dispatch(struct tcp_server *srv, struct tcp_conn *conn, unsigned char *msg, unsigned int len) {
+
+	struct tcp_query *query;
+
+	query = (struct tcp_query *)malloc(sizeof(struct tcp_query));
+	if (query == NULL)
+		return;
+
+	memcpy(&query->pkt.dns_data, msg, len);
+	query->pkt.dns_data_len = len;
+	dns_cook_header(&query->pkt.dns_data.dns_hdr, &query->pkt.dns_chdr);
+	query->pkt.src_ip = conn->src_ip;
+	query->pkt.src_port = conn->src_port;
+	query->pkt.tcp = 1;
+	query->pkt.long_answer = NULL;
+	query->conn = conn;
+	query->next = NULL;
+
+	conn->refcount++;
+	conn->inflight++;
+
+	pthread_mutex_lock(&srv->queue_mutex);
+	if (srv->queue_tail != NULL)
+		srv->queue_tail->next = query;
+	else
+		srv->queue_head = query;
+	srv->queue_tail = query;
+	pthread_cond_signal(&srv->queue_cond);
+	pthread_mutex_unlock(&srv->queue_mutex);
+
+}
+
+/**
+ * Dispatches all the complete messages waiting in the input buffer of a
+ * connection, pausing the reads if the client has too many queries
+ * waiting for an answer. Must be called holding conn->mutex.
+ * Returns 1 if the client sent garbage and the connection must be closed.
+ */
+static int tcp_conn_parse(struct tcp_server *srv, struct tcp_conn *conn) {
+
+	unsigned int msg_len;
+	unsigned int consumed = 0;
+	int ret = 0;
+
+	while (conn->in_len - consumed >= 2) {
+
+		if (conn->inflight >= TCP_MAX_PIPELINE) {
+			if (conn->reading) {
+				conn->reading = 0;
+				tcp_conn_rearm(srv, conn);
+			}
+			break;
+		}
+
+		msg_len = (conn->in_buf[consumed] << 8) | conn->in_buf[consumed + 1];
+
+		if (msg_len < sizeof(struct dns_header) + 1 || msg_len > sizeof(struct dns_data)) {
+			debug("TCP message with invalid size %d from %s\n", msg_len, inet_ntoa(conn->src_ip));
+			ret = 1;
+			break;
+		}
+
+		if (conn->in_len - consumed < 2 + msg_len)
+			break;
+
+		tcp_dispatch(srv, conn, conn->in_buf + consumed + 2, msg_len);
+		consumed += 2 + msg_len;
+
+	}
+
+	if (consumed > 0) {
+		memmove(conn->in_buf, conn->in_buf + consumed, conn->in_len - consumed);
+		conn->in_len -= consumed;
+	}
+
+	return ret;
+
+}
+
+/**
+ * Reads whatever is available on a connection and dispatches all the
+ * complete messages found. Returns 1 if the connection must be closed.
+ */
+static int tcp_conn_read(struct tcp_server *srv, struct tcp_conn *conn) {
+
+	ssize_t numread;
+
+	pthread_mutex_lock(&conn->mutex);
+
+	while (conn->reading) {
+
+		numread = read(conn->fd, conn->in_buf + conn->in_len, sizeof(conn->in_buf) - conn->in_len);
+
+		if (numread == 0) {
+			/*
+			 * The client has nothing more to ask. Keep the connection
+			 * until the pending answers have been sent.
+			 */
+			if (conn->inflight == 0 && conn->out_len == 0) {
+				pthread_mutex_unlock(&conn->mutex);
+				return 1;
+			}
+			conn->reading = 0;
+			conn->eof = 1;
+			tcp_conn_rearm(srv, conn);
+			break;
+		}
+
+		if (numread < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			pthread_mutex_unlock(&conn->mutex);
+			return 1;
+		}
+
+		conn->in_len += numread;
+		conn->last_active = time(NULL);
+
+		if (tcp_conn_parse(srv, conn)) {
+			pthread_mutex_unlock(&conn->mutex);
+			return 1;
+		}
+
+	}
+
+	pthread_mutex_unlock(&conn->mutex);
+
+	return 0;
+
+}
+
+/**
+ * Tries to write the buffered answers of a connection. Must be called
+ * holding conn->mutex. Returns 1 if the connection is broken.
+ */
+static int tcp_conn_flush(struct tcp_server *srv, struct tcp_conn *conn) {
+
+	ssize_t numwritten;
+
+	if (conn->out_len == 0)
+		return 0;
+
+	numwritten = send(conn->fd, conn->out_buf, conn->out_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (numwritten < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+		return 1;
+	}
+
+	memmove(conn->out_buf, conn->out_buf + numwritten, conn->out_len - numwritten);
+	conn->out_len -= numwritten;
+
+	if (conn->out_len == 0)
+		tcp_conn_rearm(srv, conn);
+
+	return 0;
+
+}
+
+/**
+ * Sends an answer back to the client, buffering what can't be written
+ * immediately. Called by the resolver threads.
+ */
+static void tcp_conn_send(struct tcp_server *srv, struct tcp_conn *conn, void *data, unsigned int len) {
+
+	unsigned char prefix[2];
+	struct iovec iov[2];
+	struct msghdr msg;
+	unsigned char *buf;
+	unsigned int size;
+	unsigned int left;
+	ssize_t numwritten = 0;
+
+	if (conn->closed)
+		return;
+
+	prefix[0] = (len >> 8) & 0xff;
+	prefix[1] = len & 0xff;
+
+	/*
+	 * Answers must not be interleaved, so write directly only if
+	 * nothing is waiting in the output buffer
+	 */
+	if (conn->out_len == 0) {
+		iov[0].iov_base = prefix;
+		iov[0].iov_len = 2;
+		iov[1].iov_base = data;
+		iov[1].iov_len = len;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = 2;
+		numwritten = sendmsg(conn->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (numwritten < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				shutdown(conn->fd, SHUT_RDWR);
+				return;
+			}
+			numwritten = 0;
+		}
+		if (numwritten == 2 + len)
+			return;
+	}
+
+	left = 2 + len - numwritten;
+
+	if (conn->out_len + left > TCP_OUT_BUF_SIZE) {
+		log_warning("TCP client %s is not reading its answers, dropping it\n", inet_ntoa(conn->src_ip));
+		shutdown(conn->fd, SHUT_RDWR);
+		return;
+	}
+
+	if (conn->out_len + left > conn->out_size) {
+		for (size = (conn->out_size > 0) ? conn->out_size : 4096; size < conn->out_len + left; size *= 2)
+			;
+		if (size > TCP_OUT_BUF_SIZE)
+			size = TCP_OUT_BUF_SIZE;
+		buf = (unsigned char *)realloc(conn->out_buf, size);
+		if (buf == NULL) {
+			shutdown(conn->fd, SHUT_RDWR);
+			return;
+		}
+		conn->out_buf = buf;
+		conn->out_size = size;
+	}
+
+	/* What is left of the length, then of the answer */
+	if (numwritten < 2) {
+		memcpy(conn->out_buf + conn->out_len, prefix + numwritten, 2 - numwritten);
+		conn->out_len += 2 - numwritten;
+		numwritten = 2;
+	}
+
+	memcpy(conn->out_buf + conn->out_len, (unsigned char *)data + numwritten - 2, len - (numwritten - 2));
+	conn->out_len += len - (numwritten - 2);
+	tcp_conn_rearm(srv, conn);
+
+}
+
+/**
+ * Closes the connections without any activity for longer than the idle
+ * timeout. Connections with queries still waiting for an answer are kept.
+ */
+static void tcp_close_idle(struct tcp_server *srv, time_t now) {
+
+	struct tcp_conn *conn;
+	struct tcp_conn *next;
+	int idle;
+
+	for (conn = srv->conns; conn != NULL; conn = next) {
+
+		next = conn->next;
+
+		pthread_mutex_lock(&conn->mutex);
+		idle = conn->inflight == 0 && conn->out_len == 0 && now > conn->last_active + srv->idle_timeout;
+		pthread_mutex_unlock(&conn->mutex);
+
+		if (idle)
+			tcp_conn_close(srv, conn);
+
+	}
+
+}
+
+/**
+ * Watches the listening socket again after tcp_accept() ran out of file
+ * descriptors, unless the socket went to a new process meanwhile
+ */
+static void tcp_accept_resume(struct tcp_server *srv) {
+
+	struct epoll_event ev;
+
+	if (!srv->accept_paused)
+		return;
+
+	srv->accept_paused = 0;
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	epoll_ctl(srv->epoll_fd, EPOLL_CTL_ADD, srv->listen_fd, &ev);
+
+	/* Pairs with tcp_server_handover() */
+	__sync_synchronize();
+	if (srv->handed_over)
+		epoll_ctl(srv->epoll_fd, EPOLL_CTL_DEL, srv->listen_fd, NULL);
+
+}
+
+static void *tcp_listener(void *args) {
+
+	struct tcp_server *srv = (struct tcp_server *)args;
+	struct epoll_event events[TCP_MAX_EVENTS];
+	struct tcp_conn *conn;
+	time_t last_sweep = time(NULL);
+	time_t now;
+	int count;
+	int idx;
+	int broken;
+
+	while (srv->run) {
+
+		count = epoll_wait(srv->epoll_fd, events, TCP_MAX_EVENTS, 1000);
+
+		for (idx = 0; idx < count; idx++) {
+
+			conn = (struct tcp_conn *)events[idx].data.ptr;
+
+			if (conn == NULL) {
+				tcp_accept(srv);
+				continue;
+			}
+
+			broken = 0;
+
+			if (events[idx].events & (EPOLLERR | EPOLLHUP))
+				broken = 1;
+
+			if (!broken && (events[idx].events & EPOLLOUT)) {
+				pthread_mutex_lock(&conn->mutex);
+				broken = tcp_conn_flush(srv, conn);
+				tcp_conn_check_eof(conn);
+				pthread_mutex_unlock(&conn->mutex);
+			}
+
+			if (!broken && (events[idx].events & EPOLLIN))
+				broken = tcp_conn_read(srv, conn);
+
+			if (broken)
+				tcp_conn_close(srv, conn);
+
+		}
+
+		now = time(NULL);
+		if (now != last_sweep) {
+			tcp_close_idle(srv, now);
+			tcp_accept_resume(srv);
+			last_sweep = now;
+		}
+
+	}
+
+	return NULL;
+
+}
+
+static void *tcp_worker(void *args) {
+
+	struct tcp_server *srv = (struct tcp_server *)args;
+	struct tcp_query *query;
+	struct tcp_conn *conn;
+	int data_len;
+
+	while (1) {
+
+		pthread_mutex_lock(&srv->queue_mutex);
+		while (srv->queue_head == NULL && srv->run)
+			pthread_cond_wait(&srv->queue_cond, &srv->queue_mutex);
+
+		if (!srv->run) {
+			pthread_mutex_unlock(&srv->queue_mutex);
+			break;
+		}
+
+		query = srv->queue_head;
+		srv->queue_head = query->next;
+		if (srv->queue_head == NULL)
+			srv->queue_tail = NULL;
+		pthread_mutex_unlock(&srv->queue_mutex);
+
+		conn = query->conn;
+
+		stats_count(STATS_TCP_QUERIES);
+		data_len = resolve_packet(&query->pkt);
+
+		pthread_mutex_lock(&conn->mutex);
+
+		if (data_len > 0) {
+			if (query->pkt.long_answer != NULL)
+				tcp_conn_send(srv, conn, query->pkt.long_answer, data_len);
+			else
+				tcp_conn_send(srv, conn, &query->pkt.dns_data, data_len);
+			conn->last_active = time(NULL);
+		}
+
+		conn->inflight--;
+
+		/*
+		 * Resume a connection paused by too many pipelined queries,
+		 * starting from the messages already buffered
+		 */
+		if (!conn->reading && !conn->eof && !conn->closed && conn->inflight < TCP_MAX_PIPELINE) {
+			conn->reading = 1;
+			tcp_conn_rearm(srv, conn);
+			if (tcp_conn_parse(srv, conn))
+				shutdown(conn->fd, SHUT_RDWR);
+		}
+
+		tcp_conn_check_eof(conn);
+
+		pthread_mutex_unlock(&conn->mutex);
+
+		tcp_conn_put(conn);
+		free(query->pkt.long_answer);
+		free(query);
+
+	}
+
+	stats_thread_exit();
+	topk_thread_exit();
+	log_thread_exit();
+
+	return NULL;
+
+}
+
+/**
+ * Stops accepting connections, the listening socket now belongs to
+ * another process. Those already open are still served.
+ */
+void tcp_server_handover(struct tcp_server *srv) {
+
+	if (srv == NULL)
+		return;
+
+	srv->handed_over = 1;
+	__sync_synchronize();
+	epoll_ctl(srv->epoll_fd, EPOLL_CTL_DEL, srv->listen_fd, NULL);
+
+}
+
+/**
+ * Stops the listener and the resolver threads and closes all the
+ * connections
+ */
+void tcp_server_destroy(struct tcp_server *srv) {
+
+	unsigned int idx;
+	struct tcp_query *query;
+
+	if (srv == NULL)
+		return;
+
+	srv->run = 0;
+	pthread_join(srv->tid, NULL);
+
+	pthread_mutex_lock(&srv->queue_mutex);
+	pthread_cond_broadcast(&srv->queue_cond);
+	pthread_mutex_unlock(&srv->queue_mutex);
+
+	for (idx = 0; idx < srv->workers_count; idx++)
+		pthread_join(srv->workers[idx], NULL);
+
+	while (srv->queue_head != NULL) {
+		query = srv->queue_head;
+		srv->queue_head = query->next;
+		tcp_conn_put(query->conn);
+		free(query);
+	}
+
+	while (srv->conns != NULL)
+		tcp_conn_close(srv, srv->conns);
+
+	close(srv->epoll_fd);
+	close(srv->listen_fd);
+
+	pthread_mutex_destroy(&srv->queue_mutex);
+	pthread_cond_destroy(&srv->queue_cond);
+
+	free(srv->workers);
+	free(srv);
+
+}
@@ -0,0 +1,90 @@
+#include <pthread.h>
+#include <time.h>
+#include "dproxy.h"
+
+#ifndef TCP_SERVER_H
+#define TCP_SERVER_H
+
+/*
+ * Maximum number of queries of a single connection that may be waiting
+ * for an answer. When reached, the connection is not read anymore until
+ * some answer has been sent back.
+ */
+#define TCP_MAX_PIPELINE 32
+
+/*
+ * Most a connection may hold of the answers that could not be written
+ * to the client at once, two of the longest. The buffer grows up to it
+ * as needed. If a client doesn't read its answers and the buffer
+ * overflows, the connection is dropped.
+ */
+#define TCP_OUT_BUF_SIZE (2 * (2 + DNS_TCP_SIZE))
+
+struct tcp_conn {
+	int fd;
+	pthread_mutex_t mutex;
+	unsigned int refcount;
+	unsigned int inflight;
+	int closed;
+	int reading;
+	int eof;
+	time_t last_active;
+	struct in_addr src_ip;
+	int src_port;
+	/*
+	 * Incoming data: a two bytes length followed by the DNS message
+	 */
+	unsigned int in_len;
+	unsigned char in_buf[2 + sizeof(struct dns_data)];
+	/*
+	 * Answers waiting for the socket to become writable, allocated
+	 * the first time one has to wait
+	 */
+	unsigned int out_len;
+	unsigned int out_size;
+	unsigned char *out_buf;
+	struct tcp_conn *prev;
+	struct tcp_conn *next;
+};
+
+struct tcp_query {
+	struct tcp_conn *conn;
+	struct udp_packet pkt;
+	struct tcp_query *next;
+};
+
+struct tcp_server {
+	int listen_fd;
+	int epoll_fd;
+	int run;
+	pthread_t tid;
+	pthread_t *workers;
+	unsigned int workers_count;
+	/*
+	 * Queries ready to be resolved by the worker threads
+	 */
+	pthread_mutex_t queue_mutex;
+	pthread_cond_t queue_cond;
+	struct tcp_query *queue_head;
+	struct tcp_query *queue_tail;
+	/*
+	 * Open client connections, only touched by the listener thread
+	 */
+	struct tcp_conn *conns;
+	unsigned int conns_count;
+	unsigned int max_conns;
+	unsigned int idle_timeout;
+	/*
+	 * Out of file descriptors the listening socket is left out of epoll
+	 * until the next sweep, see tcp_accept()
+	 */
+	int accept_paused;
+	int accept_failing;
+	volatile int handed_over;
+};
+
+struct tcp_server *tcp_server_new(struct in_addr, int, int, unsigned int, unsigned int, unsigned int);
+void tcp_server_handover(struct tcp_server *);
+void tcp_server_destroy(struct tcp_server *);
+
+#endif
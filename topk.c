@@ -0,0 +1,359 @@
+/*
+  **
+  ** topk.c
+  **
+  ** Finds the names queried most, the clients asking most and the names
+  ** answered most with NXDOMAIN. Each thread keeps a Space-Saving summary
+  ** of its own for each list, updated without locks, and the summaries
+  ** are merged only when somebody reads the lists. Counts are halved
+  ** every TOPK_DECAY_SECONDS so the lists show what is going on now.
+  **
+*/
+
+#include <pthread.h>
+#include "dproxy.h"
+#include "topk.h"
+
+static __thread struct topk_thread *topk_local = NULL;
+
+static struct topk_thread *topk_threads = NULL;
+static struct topk_thread topk_retired;
+static pthread_mutex_t topk_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int _hash(unsigned char *key, unsigned int len) {
+
+	unsigned int hash = 2166136261u;
+
+	while (len-- > 0) {
+		hash ^= *key++;
+		hash *= 16777619;
+	}
+
+	return hash;
+
+}
+
+/**
+ * Halves the counts once for each decay period gone by since the summary
+ * was last updated
+ */
+static void _decay(struct topk_summary *summary, unsigned int epoch) {
+
+	unsigned int shift;
+	unsigned int idx;
+
+	if (summary->epoch >= epoch)
+		return;
+
+	shift = epoch - summary->epoch;
+	summary->epoch = epoch;
+
+	for (idx = 0; idx < summary->used; idx++) {
+		summary->counts[idx] = (shift < 64) ? summary->counts[idx] >> shift : 0;
+		summary->errors[idx] = (shift < 64) ? summary->errors[idx] >> shift : 0;
+	}
+
+}
+
+/**
+ * Takes the slot out of the index, moving back the keys probed past it
+ */
+static void _index_remove(struct topk_summary *summary, unsigned int slot) {
+
+	unsigned int mask = TOPK_INDEX_SIZE - 1;
+	unsigned int pos;
+	unsigned int next;
+	unsigned int home;
+
+	for (pos = summary->hashes[slot] & mask; summary->index[pos] != slot + 1; pos = (pos + 1) & mask)
+		;
+
+	for (next = (pos + 1) & mask; summary->index[next] != 0; next = (next + 1) & mask) {
+		home = summary->hashes[summary->index[next] - 1] & mask;
+		/* Left where it is if its home is between the hole and it */
+		if (((next - home) & mask) >= ((next - pos) & mask)) {
+			summary->index[pos] = summary->index[next];
+			pos = next;
+		}
+	}
+
+	summary->index[pos] = 0;
+
+}
+
+/**
+ * Adds count to key, taking the place of the least counted key if the
+ * summary is full
+ */
+static void _add(struct topk_summary *summary, unsigned char *key, unsigned int len, unsigned int hash, unsigned long count, unsigned long error) {
+
+	unsigned int mask = TOPK_INDEX_SIZE - 1;
+	unsigned int pos;
+	unsigned int slot;
+	unsigned int idx;
+
+	for (pos = hash & mask; summary->index[pos] != 0; pos = (pos + 1) & mask) {
+		slot = summary->index[pos] - 1;
+		if (summary->hashes[slot] == hash && summary->key_lens[slot] == len && memcmp(summary->keys[slot], key, len) == 0) {
+			summary->counts[slot] += count;
+			summary->errors[slot] += error;
+			return;
+		}
+	}
+
+	if (summary->used < TOPK_SIZE) {
+		slot = summary->used++;
+		summary->counts[slot] = count;
+		summary->errors[slot] = error;
+	} else {
+		slot = 0;
+		for (idx = 1; idx < TOPK_SIZE; idx++)
+			if (summary->counts[idx] < summary->counts[slot])
+				slot = idx;
+		_index_remove(summary, slot);
+		summary->errors[slot] = summary->counts[slot] + error;
+		summary->counts[slot] += count;
+		for (pos = hash & mask; summary->index[pos] != 0; pos = (pos + 1) & mask)
+			;
+	}
+
+	summary->index[pos] = slot + 1;
+	summary->hashes[slot] = hash;
+	summary->key_lens[slot] = len;
+	memcpy(summary->keys[slot], key, len);
+
+}
+
+static struct topk_thread *topk_register(void) {
+
+	struct topk_thread *block;
+
+	if (posix_memalign((void **)&block, 64, sizeof(struct topk_thread)) != 0)
+		return NULL;
+
+	memset(block, 0, sizeof(struct topk_thread));
+
+	pthread_mutex_lock(&topk_mutex);
+	block->next = topk_threads;
+	topk_threads = block;
+	pthread_mutex_unlock(&topk_mutex);
+
+	topk_local = block;
+
+	return block;
+
+}
+
+/**
+ * Counts a key, a name or an address, len bytes long, seen at the given
+ * time in microseconds of stats_now_usec(). Names are counted regardless
+ * of their case.
+ */
+void topk_count(enum topk_list list, void *key, unsigned int len, unsigned long long usec) {
+
+	struct topk_thread *block;
+	struct topk_summary *summary;
+	unsigned char lkey[DNS_NAME_SIZE];
+	unsigned int idx;
+
+	block = (topk_local != NULL) ? topk_local : topk_register();
+	if (block == NULL)
+		return;
+
+	if (len > sizeof(lkey))
+		len = sizeof(lkey);
+
+	for (idx = 0; idx < len; idx++)
+		lkey[idx] = (list == TOPK_CLIENTS) ? ((unsigned char *)key)[idx] : tolower(((unsigned char *)key)[idx]);
+
+	summary = &block->lists[list];
+
+	summary->seq++;
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	_decay(summary, usec / 1000000 / TOPK_DECAY_SECONDS);
+	_add(summary, lkey, len, _hash(lkey, len), 1, 0);
+
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	summary->seq++;
+
+}
+
+/**
+ * Copies a summary another thread may be updating
+ */
+static void _copy(struct topk_summary *dst, struct topk_summary *src) {
+
+	unsigned int seq;
+
+	do {
+		while ((seq = __atomic_load_n(&src->seq, __ATOMIC_ACQUIRE)) & 1)
+			;
+		memcpy(dst, src, sizeof(struct topk_summary));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&src->seq, __ATOMIC_RELAXED) != seq);
+
+}
+
+/**
+ * Adds the summaries of the calling thread into the retired one and
+ * frees them. To be called by threads about to exit.
+ */
+void topk_thread_exit(void) {
+
+	struct topk_thread **ptr;
+	struct topk_thread *block = topk_local;
+	struct topk_summary *summary;
+	unsigned int list;
+	unsigned int idx;
+
+	if (block == NULL)
+		return;
+
+	pthread_mutex_lock(&topk_mutex);
+
+	for (ptr = &topk_threads; *ptr != NULL; ptr = &(*ptr)->next) {
+		if (*ptr == block) {
+			*ptr = block->next;
+			break;
+		}
+	}
+
+	for (list = 0; list < TOPK_LISTS; list++) {
+		summary = &block->lists[list];
+		if (summary->epoch > topk_retired.lists[list].epoch)
+			_decay(&topk_retired.lists[list], summary->epoch);
+		else
+			_decay(summary, topk_retired.lists[list].epoch);
+		for (idx = 0; idx < summary->used; idx++)
+			_add(&topk_retired.lists[list], summary->keys[idx], summary->key_lens[idx],
+				summary->hashes[idx], summary->counts[idx], summary->errors[idx]);
+	}
+
+	pthread_mutex_unlock(&topk_mutex);
+
+	topk_local = NULL;
+	free(block);
+
+}
+
+static int _compare_key(const void *a, const void *b) {
+
+	const struct topk_entry *ea = a;
+	const struct topk_entry *eb = b;
+
+	if (ea->hash != eb->hash)
+		return (ea->hash < eb->hash) ? -1 : 1;
+
+	if (ea->key_len != eb->key_len)
+		return (ea->key_len < eb->key_len) ? -1 : 1;
+
+	return memcmp(ea->key, eb->key, ea->key_len);
+
+}
+
+static int _compare_count(const void *a, const void *b) {
+
+	const struct topk_entry *ea = a;
+	const struct topk_entry *eb = b;
+
+	if (ea->count != eb->count)
+		return (ea->count > eb->count) ? -1 : 1;
+
+	return 0;
+
+}
+
+/**
+ * Merges the summaries of all the threads into one, at the given time in
+ * microseconds, and copies the size most counted keys of a list into
+ * items, most counted first. Counts may be overestimated by up to the
+ * error of each entry.
+ * Returns the number of keys copied
+ */
+unsigned int topk_read(enum topk_list list, struct topk_entry *items, unsigned int size, unsigned long long usec) {
+
+	struct topk_thread *block;
+	struct topk_summary *copy;
+	struct topk_entry *merged;
+	unsigned int merged_size;
+	unsigned int merged_used = 0;
+	unsigned int epoch;
+	unsigned int idx;
+	unsigned int pos;
+
+	epoch = usec / 1000000 / TOPK_DECAY_SECONDS;
+
+	copy = malloc(sizeof(struct topk_summary));
+	if (copy == NULL)
+		return 0;
+
+	pthread_mutex_lock(&topk_mutex);
+
+	merged_size = TOPK_SIZE;
+	for (block = topk_threads; block != NULL; block = block->next)
+		merged_size += TOPK_SIZE;
+
+	merged = malloc(sizeof(struct topk_entry) * merged_size);
+	if (merged == NULL) {
+		pthread_mutex_unlock(&topk_mutex);
+		free(copy);
+		return 0;
+	}
+
+	/*
+	 * The retired summary first, then the one of each live thread
+	 */
+	block = &topk_retired;
+
+	while (block != NULL) {
+
+		_copy(copy, &block->lists[list]);
+		_decay(copy, epoch);
+
+		for (idx = 0; idx < copy->used; idx++) {
+			if (copy->counts[idx] == 0)
+				continue;
+			merged[merged_used].hash = copy->hashes[idx];
+			merged[merged_used].key_len = copy->key_lens[idx];
+			merged[merged_used].count = copy->counts[idx];
+			merged[merged_used].error = copy->errors[idx];
+			memcpy(merged[merged_used].key, copy->keys[idx], copy->key_lens[idx]);
+			merged_used++;
+		}
+
+		block = (block == &topk_retired) ? topk_threads : block->next;
+
+	}
+
+	pthread_mutex_unlock(&topk_mutex);
+
+	/*
+	 * Sort by key to add up the counts of the same key
+	 */
+	qsort(merged, merged_used, sizeof(struct topk_entry), _compare_key);
+
+	for (idx = 0, pos = 0; idx < merged_used; idx++) {
+		if (pos > 0 && _compare_key(&merged[pos - 1], &merged[idx]) == 0) {
+			merged[pos - 1].count += merged[idx].count;
+			merged[pos - 1].error += merged[idx].error;
+		} else if (pos++ != idx) {
+			memcpy(&merged[pos - 1], &merged[idx], sizeof(struct topk_entry));
+		}
+	}
+
+	merged_used = pos;
+
+	qsort(merged, merged_used, sizeof(struct topk_entry), _compare_count);
+
+	if (size > merged_used)
+		size = merged_used;
+
+	memcpy(items, merged, sizeof(struct topk_entry) * size);
+
+	free(merged);
+	free(copy);
+
+	return size;
+
+}
@@ -0,0 +1,76 @@
+#include <pthread.h>
+#include "dns.h"
+
+#ifndef TOPK_H
+#define TOPK_H
+
+/*
+ * Counters kept by each thread for each list. Keys seen less often than
+ * the least counted one of the list replace it, as in the Space-Saving
+ * algorithm, so the memory used doesn't depend on the traffic.
+ */
+#define TOPK_SIZE 64
+
+/*
+ * Slots of the hash index of a summary, at least twice TOPK_SIZE and a
+ * power of two
+ */
+#define TOPK_INDEX_SIZE 128
+
+/*
+ * Counts are halved every TOPK_DECAY_SECONDS, so the lists follow the
+ * traffic of the last few minutes
+ */
+#define TOPK_DECAY_SECONDS 60
+
+enum topk_list {
+	TOPK_NAMES = 0,
+	TOPK_CLIENTS,
+	TOPK_NXDOMAIN,
+	TOPK_LISTS
+};
+
+struct topk_entry {
+	unsigned int hash;
+	unsigned int key_len;
+	unsigned long count;
+	/*
+	 * Count inherited from the key replaced, the most the count may be
+	 * overestimated by
+	 */
+	unsigned long error;
+	unsigned char key[DNS_NAME_SIZE];
+};
+
+/*
+ * Written by its thread only. seq is odd while an update is in progress,
+ * readers copy the summary again if seq changed while they copied it.
+ * The entries are split in arrays so counting a key touches a few cache
+ * lines: the index finds its slot by hash, and the key itself is only
+ * compared on a hash match.
+ */
+struct topk_summary {
+	volatile unsigned int seq;
+	unsigned int used;
+	unsigned int epoch;
+	/*
+	 * Slot + 1 of the keys by hash, linear probing, 0 is empty
+	 */
+	unsigned char index[TOPK_INDEX_SIZE];
+	unsigned int hashes[TOPK_SIZE];
+	unsigned int key_lens[TOPK_SIZE];
+	unsigned long counts[TOPK_SIZE];
+	unsigned long errors[TOPK_SIZE];
+	unsigned char keys[TOPK_SIZE][DNS_NAME_SIZE];
+};
+
+struct topk_thread {
+	struct topk_summary lists[TOPK_LISTS];
+	struct topk_thread *next;
+} __attribute__((aligned(64)));
+
+void topk_count(enum topk_list, void *, unsigned int, unsigned long long);
+unsigned int topk_read(enum topk_list, struct topk_entry *, unsigned int, unsigned long long);
+void topk_thread_exit(void);
+
+#endif
@@ -0,0 +1,431 @@
+/*
+  **
+  ** upgrade.c
+  **
+  ** Replaces a running dproxy with a new binary without closing its
+  ** sockets. The old process writes its cache in a snapshot, an anonymous
+  ** memory file, and starts the new binary with the same arguments and
+  ** one end of a unix socket pair in UPGRADE_FD_ENV. Over the pair it
+  ** hands the listening sockets and the snapshot with SCM_RIGHTS. The new
+  ** process serves on the same sockets, so the kernel keeps queueing the
+  ** packets, and tells when it is ready. Only then the old one stops
+  ** reading, answers what it has already taken and leaves.
+  **
+  ** If the new process doesn't get ready in UPGRADE_TIMEOUT seconds, or
+  ** dies, the old one goes on as if nothing happened.
+  **
+*/
+
+#define _GNU_SOURCE
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include "dproxy.h"
+#include "cache.h"
+#include "numa.h"
+#include "upgrade.h"
+
+extern char **environ;
+
+struct upgrade_snapshot {
+	FILE *fp;
+	unsigned int now;
+	unsigned int count;
+	unsigned int shard;
+};
+
+static int _snapshot_visit(struct payload *payload, void *arg) {
+
+	struct upgrade_snapshot *snapshot = (struct upgrade_snapshot *)arg;
+	struct upgrade_record record;
+
+	if (payload->expires <= snapshot->now)
+		return 0;
+
+	memset(&record, 0, sizeof(record));
+	record.expires = payload->expires;
+	record.type = payload->type;
+	record.len = payload->buf_len;
+	record.shard = snapshot->shard;
+	strcpy(record.host, payload->host);
+
+	if (fwrite(&record, sizeof(record), 1, snapshot->fp) != 1 || fwrite(&payload->buffer, payload->buf_len, 1, snapshot->fp) != 1)
+		return 1;
+
+	snapshot->count++;
+
+	return 0;
+
+}
+
+/**
+ * Writes the live entries of the cache in an anonymous memory file
+ * Returns its descriptor, or -1 on failure
+ */
+static int _snapshot_write(struct cache *cache, unsigned int *count) {
+
+	struct upgrade_snapshot snapshot;
+	struct cache_cursor cursor;
+	struct payload *payload;
+	int fd;
+	int failed = 0;
+
+	fd = memfd_create("dproxy-cache", MFD_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	snapshot.fp = fdopen(dup(fd), "w");
+	if (snapshot.fp == NULL) {
+		close(fd);
+		return -1;
+	}
+
+	snapshot.now = time(NULL);
+	snapshot.count = 0;
+
+	/*
+	 * The cursor tells the shard of each entry, to load it back there.
+	 * A shared cache stays where it is for the new process.
+	 */
+	if (cache->shm == NULL && cache_cursor_open(&cursor, cache) == 0) {
+		while (!failed && (payload = cache_cursor_next(&cursor)) != NULL) {
+			snapshot.shard = cursor.shard;
+			failed = _snapshot_visit(payload, &snapshot);
+		}
+		cache_cursor_close(&cursor);
+	}
+
+	if (fclose(snapshot.fp) != 0 || failed) {
+		close(fd);
+		return -1;
+	}
+
+	*count = snapshot.count;
+
+	return fd;
+
+}
+
+/**
+ * Sends the hello and the descriptors fds over channel
+ * Returns 1 on failure
+ */
+static int _send_fds(int channel, struct upgrade_hello *hello, int *fds, unsigned int count) {
+
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	char control[CMSG_SPACE(sizeof(int) * (UPGRADE_MAX_UDP + 3))];
+
+	memset(&msg, 0, sizeof(msg));
+	memset(control, 0, sizeof(control));
+
+	iov.iov_base = hello;
+	iov.iov_len = sizeof(struct upgrade_hello);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+
+	return sendmsg(channel, &msg, MSG_NOSIGNAL) != sizeof(struct upgrade_hello);
+
+}
+
+/**
+ * Starts binary with argv, hands it the UDP sockets, the TCP and metrics
+ * listeners (-1 if none) and a snapshot of cache, then waits for it to
+ * be ready. The caller stops serving after a success, the sockets are
+ * shared with the new process from then on. What happens is reported
+ * on out, unless NULL.
+ * Returns 1 if the new process is not serving, nothing changed then
+ */
+int upgrade_exec(char *binary, char **argv, int *udp_fds, unsigned int udp_count, int tcp_fd, int metrics_fd, struct cache *cache, FILE *out) {
+
+	struct upgrade_hello hello;
+	struct upgrade_ready ready;
+	struct pollfd pfd;
+	struct rlimit limit;
+	char variable[64];
+	char **envp;
+	int fds[UPGRADE_MAX_UDP + 3];
+	int pair[2];
+	int channel;
+	int snapshot;
+	unsigned int count = 0;
+	unsigned int idx;
+	unsigned int env_count;
+	pid_t pid;
+	int fd;
+	int res;
+
+	if (udp_count > UPGRADE_MAX_UDP)
+		return 1;
+
+	if (access(binary, X_OK) != 0) {
+		log_error("Can't upgrade to %s: %s\n", binary, strerror(errno));
+		if (out != NULL)
+			fprintf(out, "%s: %s\n", binary, strerror(errno));
+		return 1;
+	}
+
+	snapshot = _snapshot_write(cache, &hello.entries);
+	if (snapshot < 0) {
+		log_error("Could not write the cache snapshot: %s\n", strerror(errno));
+		return 1;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) < 0) {
+		close(snapshot);
+		return 1;
+	}
+
+	/*
+	 * The end of the child must survive the closing of the standard
+	 * descriptors by a daemon
+	 */
+	channel = fcntl(pair[1], F_DUPFD_CLOEXEC, 3);
+	close(pair[1]);
+
+	for (env_count = 0; environ[env_count] != NULL; env_count++)
+		;
+
+	envp = malloc(sizeof(char *) * (env_count + 2));
+	if (channel < 0 || envp == NULL) {
+		free(envp);
+		close(pair[0]);
+		if (channel >= 0)
+			close(channel);
+		close(snapshot);
+		return 1;
+	}
+
+	snprintf(variable, sizeof(variable), "%s=%d", UPGRADE_FD_ENV, channel);
+	memcpy(envp, environ, sizeof(char *) * env_count);
+	envp[env_count] = variable;
+	envp[env_count + 1] = NULL;
+
+	if (getrlimit(RLIMIT_NOFILE, &limit) < 0 || limit.rlim_cur > 65536)
+		limit.rlim_cur = 65536;
+
+	pid = fork();
+
+	if (pid == 0) {
+		/* Only async-signal-safe calls until exec */
+		for (fd = 3; fd < limit.rlim_cur; fd++)
+			if (fd != channel)
+				close(fd);
+		fcntl(channel, F_SETFD, 0);
+		execve(binary, argv, envp);
+		_exit(127);
+	}
+
+	free(envp);
+	close(channel);
+
+	if (pid < 0) {
+		close(pair[0]);
+		close(snapshot);
+		return 1;
+	}
+
+	log_info("Upgrading to %s, pid %d, with %u cache entries\n", binary, (int)pid, hello.entries);
+
+	hello.magic = UPGRADE_MAGIC;
+	hello.udp_count = udp_count;
+	hello.tcp = (tcp_fd >= 0);
+	hello.metrics = (metrics_fd >= 0);
+
+	for (idx = 0; idx < udp_count; idx++)
+		fds[count++] = udp_fds[idx];
+	if (tcp_fd >= 0)
+		fds[count++] = tcp_fd;
+	if (metrics_fd >= 0)
+		fds[count++] = metrics_fd;
+	fds[count++] = snapshot;
+
+	res = _send_fds(pair[0], &hello, fds, count);
+	close(snapshot);
+
+	if (res == 0) {
+		pfd.fd = pair[0];
+		pfd.events = POLLIN;
+		res = (poll(&pfd, 1, UPGRADE_TIMEOUT * 1000) <= 0 || recv(pair[0], &ready, sizeof(ready), 0) != sizeof(ready) || ready.magic != UPGRADE_MAGIC);
+	}
+
+	/* Closing the channel makes a late new process give up */
+	close(pair[0]);
+
+	/* Reap it, or the parent it left behind becoming a daemon */
+	waitpid(pid, NULL, WNOHANG);
+
+	if (res) {
+		log_error("The new process did not get ready, keeping on\n");
+		if (out != NULL)
+			fprintf(out, "the new process did not get ready\n");
+		return 1;
+	}
+
+	log_info("Process %d is serving, leaving\n", (int)ready.pid);
+	if (out != NULL)
+		fprintf(out, "pid %d\n", (int)ready.pid);
+
+	return 0;
+
+}
+
+/**
+ * Takes what the old process hands over, if this process was started
+ * by an upgrade
+ * Returns NULL otherwise, or if the hand over failed
+ */
+struct upgrade *upgrade_receive(void) {
+
+	struct upgrade *up;
+	struct upgrade_hello hello;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	char control[CMSG_SPACE(sizeof(int) * (UPGRADE_MAX_UDP + 3))];
+	int fds[UPGRADE_MAX_UDP + 3];
+	unsigned int count = 0;
+	unsigned int expected;
+	unsigned int idx;
+	char *value;
+	int channel;
+
+	value = getenv(UPGRADE_FD_ENV);
+	if (value == NULL)
+		return NULL;
+
+	channel = atoi(value);
+	unsetenv(UPGRADE_FD_ENV);
+	fcntl(channel, F_SETFD, FD_CLOEXEC);
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &hello;
+	iov.iov_len = sizeof(hello);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	if (recvmsg(channel, &msg, MSG_CMSG_CLOEXEC) != sizeof(hello) || hello.magic != UPGRADE_MAGIC || hello.udp_count > UPGRADE_MAX_UDP) {
+		fprintf(stderr, "Invalid upgrade hand over\n");
+		close(channel);
+		return NULL;
+	}
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * count);
+		}
+	}
+
+	expected = hello.udp_count + (hello.tcp != 0) + (hello.metrics != 0) + 1;
+
+	up = malloc(sizeof(struct upgrade));
+	if (up == NULL || count != expected || (msg.msg_flags & MSG_CTRUNC)) {
+		fprintf(stderr, "Invalid upgrade hand over\n");
+		for (idx = 0; idx < count; idx++)
+			close(fds[idx]);
+		free(up);
+		close(channel);
+		return NULL;
+	}
+
+	up->channel = channel;
+	up->udp_count = hello.udp_count;
+	up->entries = hello.entries;
+
+	count = 0;
+	for (idx = 0; idx < hello.udp_count; idx++)
+		up->udp_fds[idx] = fds[count++];
+	up->tcp_fd = hello.tcp ? fds[count++] : -1;
+	up->metrics_fd = hello.metrics ? fds[count++] : -1;
+	up->snapshot_fd = fds[count++];
+
+	return up;
+
+}
+
+/**
+ * Fills cache with the entries of the snapshot not expired meanwhile,
+ * each in the shard it came from
+ * Returns the number of entries loaded
+ */
+unsigned int upgrade_load_cache(struct upgrade *up, struct cache *cache) {
+
+	struct upgrade_record record;
+	struct stat st;
+	unsigned char *snapshot;
+	unsigned int now = time(NULL);
+	unsigned int loaded = 0;
+	unsigned int idx;
+	size_t offset = 0;
+	int node = numa_local_node();
+
+	if (fstat(up->snapshot_fd, &st) < 0 || st.st_size == 0)
+		return 0;
+
+	snapshot = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, up->snapshot_fd, 0);
+	if (snapshot == MAP_FAILED)
+		return 0;
+
+	for (idx = 0; idx < up->entries && offset + sizeof(struct upgrade_record) <= st.st_size; idx++) {
+
+		/* Records follow answers of any length, they may be unaligned */
+		memcpy(&record, snapshot + offset, sizeof(struct upgrade_record));
+		offset += sizeof(struct upgrade_record);
+
+		if (record.len > sizeof(struct dns_data) || offset + record.len > st.st_size)
+			break;
+
+		if (record.expires > now) {
+			record.host[DNS_NAME_SIZE - 1] = 0;
+			numa_set_local_node(record.shard);
+			cache_insert(cache, record.host, record.type, record.expires, snapshot + offset, record.len);
+			loaded++;
+		}
+
+		offset += record.len;
+
+	}
+
+	numa_set_local_node(node);
+	munmap(snapshot, st.st_size);
+
+	return loaded;
+
+}
+
+/**
+ * Tells the old process this one serves, and drops the channel
+ * Returns 1 if the old process gave up waiting, this one must leave
+ * then
+ */
+int upgrade_ready(struct upgrade *up) {
+
+	struct upgrade_ready ready;
+	int res;
+
+	ready.magic = UPGRADE_MAGIC;
+	ready.pid = getpid();
+
+	res = (send(up->channel, &ready, sizeof(ready), MSG_NOSIGNAL) != sizeof(ready));
+
+	close(up->channel);
+	close(up->snapshot_fd);
+	free(up);
+
+	return res;
+
+}
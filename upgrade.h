@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include "dns.h"
+
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+struct cache;
+
+/*
+ * The new process finds its end of the channel in this variable
+ */
+#define UPGRADE_FD_ENV "DPROXY_UPGRADE_FD"
+#define UPGRADE_MAGIC 0x44505855
+
+/*
+ * Seconds the new process has to get ready, the old one keeps serving
+ * if it doesn't make it
+ */
+#define UPGRADE_TIMEOUT 30
+
+/*
+ * UDP sockets handed over at most, one per NUMA node
+ */
+#define UPGRADE_MAX_UDP 32
+
+/*
+ * First message, from the old process. The descriptors travel with it:
+ * the UDP sockets, the TCP and metrics listeners if any, the snapshot.
+ */
+struct upgrade_hello {
+	unsigned int magic;
+	unsigned int udp_count;
+	int tcp;
+	int metrics;
+	unsigned int entries;
+};
+
+/*
+ * Answer of the new process once it serves
+ */
+struct upgrade_ready {
+	unsigned int magic;
+	pid_t pid;
+};
+
+/*
+ * An entry of the cache snapshot, its answer follows
+ */
+struct upgrade_record {
+	unsigned int expires;
+	unsigned short int type;
+	unsigned short int len;
+	unsigned int shard;
+	char host[DNS_NAME_SIZE];
+};
+
+/*
+ * What the new process received. Descriptors not received are -1.
+ */
+struct upgrade {
+	int channel;
+	int udp_fds[UPGRADE_MAX_UDP];
+	unsigned int udp_count;
+	int tcp_fd;
+	int metrics_fd;
+	int snapshot_fd;
+	unsigned int entries;
+};
+
+int upgrade_exec(char *, char **, int *, unsigned int, int, int, struct cache *, FILE *);
+struct upgrade *upgrade_receive(void);
+unsigned int upgrade_load_cache(struct upgrade *, struct cache *);
+int upgrade_ready(struct upgrade *);
+
+#endif
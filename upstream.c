@@ -0,0 +1,516 @@
+/*
+  **
+  ** upstream.c
+  **
+  ** Shared engine sending the queries to the upstream servers. A few
+  ** sockets, each bound to a random port, carry the queries of all the
+  ** threads. Every query leaves with a random message id and is recorded
+  ** in a table of outstanding queries keyed by socket and id. A reader
+  ** thread matches the answers against the table, checking the source
+  ** address and the question too, and hands them to the waiting thread.
+  ** Late answers to queries that already timed out, and forged ones,
+  ** find no entry and are dropped.
+  **
+  ** Queries of TCP clients go over TCP instead, one connection each, so
+  ** their answers are not cut to what fits in a UDP message.
+  **
+*/
+
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/random.h>
+#include "dproxy.h"
+#include "upstream.h"
+#include "stats.h"
+
+#define UPSTREAM_PORT_TRIES 32
+
+static void *upstream_reader(void *);
+
+/*
+ * Random bytes are fetched from the kernel a block at a time, each
+ * thread with its own block
+ */
+static __thread unsigned char random_buf[256];
+static __thread unsigned int random_pos = sizeof(random_buf);
+
+static unsigned short int _random16(void) {
+
+	unsigned short int value;
+
+	if (random_pos + 2 > sizeof(random_buf)) {
+		if (getrandom(random_buf, sizeof(random_buf), 0) != sizeof(random_buf)) {
+			for (random_pos = 0; random_pos < sizeof(random_buf); random_pos++)
+				random_buf[random_pos] = rand();
+		}
+		random_pos = 0;
+	}
+
+	value = (random_buf[random_pos] << 8) | random_buf[random_pos + 1];
+	random_pos += 2;
+
+	return value;
+
+}
+
+/**
+ * Opens a socket bound to a random unprivileged port
+ * Returns the socket or -1 on failure
+ */
+static int _sock_open_random(unsigned short int *port) {
+
+	int fd;
+	int tries;
+	struct sockaddr_in sa;
+	socklen_t salen;
+
+	fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (fd < 0) {
+		debug_perror("Could not create upstream socket");
+		return -1;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = INADDR_ANY;
+
+	for (tries = 0; tries < UPSTREAM_PORT_TRIES; tries++) {
+		sa.sin_port = htons(1024 + _random16() % (65536 - 1024));
+		if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) == 0)
+			break;
+	}
+
+	/*
+	 * Unlucky, let the kernel choose
+	 */
+	if (tries == UPSTREAM_PORT_TRIES) {
+		sa.sin_port = 0;
+		if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+			debug_perror("Could not bind upstream socket");
+			close(fd);
+			return -1;
+		}
+	}
+
+	salen = sizeof(sa);
+	getsockname(fd, (struct sockaddr *)&sa, &salen);
+	*port = ntohs(sa.sin_port);
+
+	return fd;
+
+}
+
+/**
+ * Creates the engine with socks_count sockets. Queries not answered
+ * within timeout milliseconds are given up.
+ */
+struct upstream *upstream_new(unsigned int socks_count, unsigned int timeout) {
+
+	struct upstream *up;
+	unsigned int idx;
+
+	if (socks_count == 0)
+		socks_count = 1;
+	if (socks_count > UPSTREAM_MAX_SOCKETS)
+		socks_count = UPSTREAM_MAX_SOCKETS;
+
+	up = (struct upstream *)malloc(sizeof(struct upstream));
+	if (up == NULL)
+		return NULL;
+
+	memset(up, 0, sizeof(struct upstream));
+
+	for (idx = 0; idx < socks_count; idx++) {
+		up->socks[idx] = _sock_open_random(&up->ports[idx]);
+		if (up->socks[idx] < 0) {
+			while (idx-- > 0)
+				close(up->socks[idx]);
+			free(up);
+			return NULL;
+		}
+		debug("Upstream socket %d bound to port %d\n", idx, up->ports[idx]);
+	}
+
+	for (idx = 0; idx < UPSTREAM_LOCKS; idx++)
+		pthread_mutex_init(&up->locks[idx], NULL);
+
+	up->socks_count = socks_count;
+	up->timeout = timeout;
+	up->run = 1;
+
+	pthread_create(&up->tid, NULL, upstream_reader, up);
+
+	return up;
+
+}
+
+void upstream_destroy(struct upstream *up) {
+
+	unsigned int idx;
+
+	if (up == NULL)
+		return;
+
+	up->run = 0;
+	pthread_join(up->tid, NULL);
+
+	for (idx = 0; idx < up->socks_count; idx++)
+		close(up->socks[idx]);
+
+	for (idx = 0; idx < UPSTREAM_LOCKS; idx++)
+		pthread_mutex_destroy(&up->locks[idx]);
+
+	free(up);
+
+}
+
+static inline unsigned int _bucket(unsigned int sock, unsigned short int id) {
+
+	return ((sock << 16) ^ id) % UPSTREAM_BUCKETS;
+
+}
+
+static inline pthread_mutex_t *_lock(struct upstream *up, unsigned int bucket) {
+
+	return &up->locks[bucket % UPSTREAM_LOCKS];
+
+}
+
+/**
+ * Removes a query from its bucket. Must be called holding the bucket lock.
+ */
+static void _unlink(struct upstream *up, unsigned int bucket, struct upstream_query *query) {
+
+	struct upstream_query **ptr;
+
+	for (ptr = &up->buckets[bucket]; *ptr != NULL; ptr = &(*ptr)->next) {
+		if (*ptr == query) {
+			*ptr = query->next;
+			return;
+		}
+	}
+
+}
+
+/**
+ * Looks for an outstanding query. Must be called holding the bucket lock.
+ */
+static struct upstream_query *_lookup(struct upstream *up, unsigned int bucket, unsigned int sock, unsigned short int id) {
+
+	struct upstream_query *query;
+
+	for (query = up->buckets[bucket]; query != NULL; query = query->next)
+		if (query->sock == sock && query->id == id)
+			return query;
+
+	return NULL;
+
+}
+
+/**
+ * Compares the question of an answer with the one of the query, ignoring
+ * the case of the name
+ */
+static int _same_question(struct dns_data *query, struct dns_data *answer, unsigned int answer_len, unsigned int question_len) {
+
+	unsigned int idx;
+
+	if (question_len == 0)
+		return 1;
+
+	if (answer->dns_hdr.dns_no_questions != query->dns_hdr.dns_no_questions)
+		return 0;
+
+	if (answer_len < sizeof(struct dns_header) + question_len)
+		return 0;
+
+	for (idx = 0; idx < question_len; idx++)
+		if (tolower((unsigned char)query->buf[idx]) != tolower((unsigned char)answer->buf[idx]))
+			return 0;
+
+	return 1;
+
+}
+
+/**
+ * Sends a query to a server and waits for its answer, which is written
+ * back into data with the message id of the query.
+ * Returns the length of the answer, 0 if there is no answer
+ */
+int upstream_resolve(struct upstream *up, struct dns_server *srv, struct dns_data *data, unsigned int data_len) {
+
+	struct upstream_query query;
+	struct timespec deadline;
+	unsigned long long start;
+	unsigned int bucket;
+	pthread_mutex_t *lock;
+	int res;
+
+	query.orig_id = data->dns_hdr.dns_id;
+	query.address = &srv->inet_address;
+	query.data = data;
+	query.question_len = dns_question_len(data, data_len);
+	query.answer_len = -1;
+	query.sock = _random16() % up->socks_count;
+	pthread_cond_init(&query.cond, NULL);
+
+	/*
+	 * Pick a random id not already in flight on the chosen socket
+	 */
+	while (1) {
+		query.id = _random16();
+		bucket = _bucket(query.sock, query.id);
+		lock = _lock(up, bucket);
+		pthread_mutex_lock(lock);
+		if (_lookup(up, bucket, query.sock, query.id) == NULL)
+			break;
+		pthread_mutex_unlock(lock);
+	}
+
+	query.next = up->buckets[bucket];
+	up->buckets[bucket] = &query;
+
+	data->dns_hdr.dns_id = query.id;
+
+	start = stats_now_usec();
+	res = sendto(up->socks[query.sock], data, data_len, 0, (struct sockaddr *)&srv->inet_address, sizeof(srv->inet_address));
+	if (res < 0) {
+		debug_perror("Could not send data upstream");
+		_unlink(up, bucket, &query);
+		pthread_mutex_unlock(lock);
+		data->dns_hdr.dns_id = query.orig_id;
+		pthread_cond_destroy(&query.cond);
+		return 0;
+	}
+
+	stats_count(STATS_UPSTREAM_QUERIES);
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += up->timeout / 1000;
+	deadline.tv_nsec += (up->timeout % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	while (query.answer_len < 0)
+		if (pthread_cond_timedwait(&query.cond, lock, &deadline) != 0)
+			break;
+
+	/*
+	 * Timed out: forget the query, so a late answer won't be taken
+	 */
+	if (query.answer_len < 0) {
+		_unlink(up, bucket, &query);
+		data->dns_hdr.dns_id = query.orig_id;
+		query.answer_len = 0;
+		stats_count(STATS_UPSTREAM_TIMEOUTS);
+		debug("Upstream query timed out\n");
+	} else {
+		stats_count(STATS_UPSTREAM_ANSWERS);
+		stats_time(STATS_UPSTREAM_RTT, stats_now_usec() - start);
+		if (ntohs(data->dns_hdr.dns_flags) & 0x0200)
+			stats_count(STATS_TRUNCATED);
+	}
+
+	pthread_mutex_unlock(lock);
+	pthread_cond_destroy(&query.cond);
+
+	return query.answer_len;
+
+}
+
+/**
+ * Sends or receives len bytes on a TCP socket, waiting for it up to
+ * deadline, in microseconds of stats_now_usec()
+ * Returns 1 if the connection failed or timed out
+ */
+static int _tcp_transfer(int fd, unsigned char *buf, unsigned int len, int writing, unsigned long long deadline) {
+
+	struct pollfd pfd;
+	unsigned long long now;
+	ssize_t res;
+	unsigned int done = 0;
+
+	pfd.fd = fd;
+	pfd.events = writing ? POLLOUT : POLLIN;
+
+	while (done < len) {
+
+		now = stats_now_usec();
+		if (now >= deadline)
+			return 1;
+
+		if (poll(&pfd, 1, (deadline - now + 999) / 1000) <= 0)
+			continue;
+
+		if (writing)
+			res = send(fd, buf + done, len - done, MSG_DONTWAIT | MSG_NOSIGNAL);
+		else
+			res = recv(fd, buf + done, len - done, MSG_DONTWAIT);
+
+		if (res == 0)
+			return 1;
+
+		if (res < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				continue;
+			return 1;
+		}
+
+		done += res;
+
+	}
+
+	return 0;
+
+}
+
+/**
+ * Sends a query to a server over a TCP connection of its own and waits
+ * for the answer, written in answer, size bytes at most. The connection
+ * is private, so the query keeps its message id.
+ * Returns the length of the answer, 0 if there is no answer
+ */
+int upstream_resolve_tcp(struct upstream *up, struct dns_server *srv, struct dns_data *data, unsigned int data_len, unsigned char *answer, unsigned int size) {
+
+	unsigned char frame[2 + sizeof(struct dns_data)];
+	unsigned long long start;
+	unsigned long long deadline;
+	unsigned int len = 0;
+	int fd;
+
+	if (data_len > sizeof(struct dns_data))
+		return 0;
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+	if (fd < 0) {
+		debug_perror("Could not create an upstream TCP socket");
+		return 0;
+	}
+
+	start = stats_now_usec();
+	deadline = start + (unsigned long long)up->timeout * 1000;
+
+	frame[0] = (data_len >> 8) & 0xff;
+	frame[1] = data_len & 0xff;
+	memcpy(frame + 2, data, data_len);
+
+	if (connect(fd, (struct sockaddr *)&srv->inet_address, sizeof(srv->inet_address)) < 0 && errno != EINPROGRESS) {
+		debug_perror("Could not connect upstream");
+		close(fd);
+		return 0;
+	}
+
+	stats_count(STATS_UPSTREAM_QUERIES);
+
+	if (_tcp_transfer(fd, frame, 2 + data_len, 1, deadline) || _tcp_transfer(fd, frame, 2, 0, deadline))
+		goto failed;
+
+	len = (frame[0] << 8) | frame[1];
+	if (len < sizeof(struct dns_header) || len > size || _tcp_transfer(fd, answer, len, 0, deadline))
+		goto failed;
+
+	if (((struct dns_header *)answer)->dns_id != data->dns_hdr.dns_id || !(ntohs(((struct dns_header *)answer)->dns_flags) & 0x8000))
+		goto failed;
+
+	close(fd);
+
+	stats_count(STATS_UPSTREAM_ANSWERS);
+	stats_time(STATS_UPSTREAM_RTT, stats_now_usec() - start);
+
+	return len;
+
+failed:
+	if (stats_now_usec() >= deadline)
+		stats_count(STATS_UPSTREAM_TIMEOUTS);
+	debug("Upstream TCP query failed\n");
+	close(fd);
+
+	return 0;
+
+}
+
+/**
+ * Hands an answer read from socket sock to the query waiting for it
+ */
+static void upstream_deliver(struct upstream *up, unsigned int sock, struct dns_data *answer, unsigned int len, struct sockaddr_in *from) {
+
+	struct upstream_query *query;
+	unsigned int bucket;
+	pthread_mutex_t *lock;
+
+	if (len < sizeof(struct dns_header) || !(ntohs(answer->dns_hdr.dns_flags) & 0x8000)) {
+		stats_count(STATS_UPSTREAM_UNMATCHED);
+		return;
+	}
+
+	bucket = _bucket(sock, answer->dns_hdr.dns_id);
+	lock = _lock(up, bucket);
+
+	pthread_mutex_lock(lock);
+
+	query = _lookup(up, bucket, sock, answer->dns_hdr.dns_id);
+
+	if (query == NULL ||
+		query->address->sin_addr.s_addr != from->sin_addr.s_addr ||
+		query->address->sin_port != from->sin_port ||
+		!_same_question(query->data, answer, len, query->question_len)) {
+		pthread_mutex_unlock(lock);
+		stats_count(STATS_UPSTREAM_UNMATCHED);
+		debug("Dropped unexpected answer from %s\n", inet_ntoa(from->sin_addr));
+		return;
+	}
+
+	_unlink(up, bucket, query);
+
+	answer->dns_hdr.dns_id = query->orig_id;
+	memcpy(query->data, answer, len);
+	query->answer_len = len;
+
+	pthread_cond_signal(&query->cond);
+	pthread_mutex_unlock(lock);
+
+}
+
+static void *upstream_reader(void *args) {
+
+	struct upstream *up = (struct upstream *)args;
+	struct pollfd fds[UPSTREAM_MAX_SOCKETS];
+	struct dns_data answer;
+	struct sockaddr_in from;
+	socklen_t fromlen;
+	unsigned int idx;
+	int numread;
+
+	for (idx = 0; idx < up->socks_count; idx++) {
+		fds[idx].fd = up->socks[idx];
+		fds[idx].events = POLLIN;
+	}
+
+	while (up->run) {
+
+		if (poll(fds, up->socks_count, 1000) <= 0)
+			continue;
+
+		for (idx = 0; idx < up->socks_count; idx++) {
+
+			if (!(fds[idx].revents & POLLIN))
+				continue;
+
+			while (1) {
+				fromlen = sizeof(from);
+				numread = recvfrom(up->socks[idx], &answer, sizeof(answer), MSG_DONTWAIT, (struct sockaddr *)&from, &fromlen);
+				if (numread < 0)
+					break;
+				upstream_deliver(up, idx, &answer, numread, &from);
+			}
+
+		}
+
+	}
+
+	return NULL;
+
+}
@@ -0,0 +1,45 @@
+#include <pthread.h>
+#include "dns.h"
+#include "dns_server.h"
+
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+
+/*
+ * Outstanding queries are kept in a hash table keyed by socket and
+ * message id. Buckets are protected by UPSTREAM_LOCKS mutexes, so
+ * threads sending on different buckets don't contend.
+ */
+#define UPSTREAM_BUCKETS 4096
+#define UPSTREAM_LOCKS 16
+#define UPSTREAM_MAX_SOCKETS 64
+
+struct upstream_query {
+	unsigned short int id;
+	unsigned short int orig_id;
+	unsigned int sock;
+	struct sockaddr_in *address;
+	struct dns_data *data;
+	unsigned int question_len;
+	int answer_len;
+	pthread_cond_t cond;
+	struct upstream_query *next;
+};
+
+struct upstream {
+	int socks[UPSTREAM_MAX_SOCKETS];
+	unsigned short int ports[UPSTREAM_MAX_SOCKETS];
+	unsigned int socks_count;
+	unsigned int timeout;
+	struct upstream_query *buckets[UPSTREAM_BUCKETS];
+	pthread_mutex_t locks[UPSTREAM_LOCKS];
+	pthread_t tid;
+	int run;
+};
+
+struct upstream *upstream_new(unsigned int, unsigned int);
+void upstream_destroy(struct upstream *);
+int upstream_resolve(struct upstream *, struct dns_server *, struct dns_data *, unsigned int);
+int upstream_resolve_tcp(struct upstream *, struct dns_server *, struct dns_data *, unsigned int, unsigned char *, unsigned int);
+
+#endif
@@ -0,0 +1,123 @@
+/*
+  **
+  ** watch.c
+  **
+  ** Watches a file with inotify from a thread of its own and calls back
+  ** when it changes. The directory of the file is watched rather than
+  ** the file, so a file replaced by renaming another one over it, as
+  ** editors and package managers do, is noticed too. Changes are
+  ** reported once the file stays untouched for WATCH_SETTLE_MSEC, so a
+  ** file being written is not read halfway.
+  **
+*/
+
+#include <pthread.h>
+#include <poll.h>
+#include <libgen.h>
+#include <sys/inotify.h>
+#include "dproxy.h"
+#include "conf.h"
+#include "watch.h"
+
+static void *file_watch_loop(void *);
+
+/**
+ * Starts watching path. changed(arg) is called from the watching thread.
+ * Returns NULL if the file can't be watched
+ */
+struct file_watch *file_watch_new(char *path, void (*changed)(void *), void *arg) {
+
+	struct file_watch *watch;
+
+	watch = malloc(sizeof(struct file_watch));
+	if (watch == NULL)
+		return NULL;
+
+	watch->path = strdup(path);
+	if (watch->path == NULL) {
+		free(watch);
+		return NULL;
+	}
+
+	watch->changed = changed;
+	watch->arg = arg;
+	watch->run = 1;
+
+	if (pthread_create(&watch->tid, NULL, file_watch_loop, watch) != 0) {
+		free(watch->path);
+		free(watch);
+		return NULL;
+	}
+
+	return watch;
+
+}
+
+void file_watch_destroy(struct file_watch *watch) {
+
+	if (watch == NULL)
+		return;
+
+	watch->run = 0;
+	pthread_join(watch->tid, NULL);
+
+	free(watch->path);
+	free(watch);
+
+}
+
+static void *file_watch_loop(void *args) {
+
+	struct file_watch *watch = (struct file_watch *)args;
+	struct inotify_event *event;
+	struct pollfd pfd;
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	char dir[CONF_PATH_LEN];
+	char base[CONF_PATH_LEN];
+	char *name;
+	int changed = 0;
+	int numread;
+	int res;
+
+	strncpy(dir, watch->path, sizeof(dir) - 1);
+	dir[sizeof(dir) - 1] = 0;
+	strncpy(base, watch->path, sizeof(base) - 1);
+	base[sizeof(base) - 1] = 0;
+
+	pfd.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	pfd.events = POLLIN;
+	if (pfd.fd < 0 || inotify_add_watch(pfd.fd, dirname(dir), IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE | IN_MOVED_FROM) < 0) {
+		fprintf(stderr, "Could not watch %s for changes: %s\n", watch->path, strerror(errno));
+		if (pfd.fd >= 0)
+			close(pfd.fd);
+		return NULL;
+	}
+
+	name = basename(base);
+
+	while (watch->run) {
+
+		res = poll(&pfd, 1, changed ? WATCH_SETTLE_MSEC : 1000);
+
+		if (res > 0) {
+			while ((numread = read(pfd.fd, buf, sizeof(buf))) > 0) {
+				for (event = (struct inotify_event *)buf; (char *)event < buf + numread; event = (struct inotify_event *)((char *)event + sizeof(struct inotify_event) + event->len)) {
+					if (event->len > 0 && strcmp(event->name, name) == 0)
+						changed = 1;
+				}
+			}
+			continue;
+		}
+
+		if (res == 0 && changed) {
+			watch->changed(watch->arg);
+			changed = 0;
+		}
+
+	}
+
+	close(pfd.fd);
+
+	return NULL;
+
+}
@@ -0,0 +1,22 @@
+#include <pthread.h>
+
+#ifndef WATCH_H
+#define WATCH_H
+
+/*
+ * Time a file must stay untouched after a change before it is reported
+ */
+#define WATCH_SETTLE_MSEC 250
+
+struct file_watch {
+	char *path;
+	void (*changed)(void *);
+	void *arg;
+	pthread_t tid;
+	int run;
+};
+
+struct file_watch *file_watch_new(char *, void (*)(void *), void *);
+void file_watch_destroy(struct file_watch *);
+
+#endif
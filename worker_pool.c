@@ -0,0 +1,360 @@
+/*
+  **
+  ** worker_pool.c
+  **
+  ** Pool of UDP worker threads. Workers take the packets queued by the
+  ** receiver from a packet pool. The pool starts with the configured
+  ** number of threads and a manager thread grows or shrinks it between
+  ** the min and max bounds, looking at how long packets wait in the
+  ** queue and at how many workers are stuck waiting for the upstream
+  ** server.
+  **
+  ** Workers may be pinned to a set of CPUs, usually the ones of a NUMA
+  ** node.
+  **
+*/
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include "dproxy.h"
+#include "worker_pool.h"
+
+volatile int upstream_waiting = 0;
+
+static void *worker_pool_manager(void *);
+
+/**
+ * Starts a new worker in the first free slot of the pool.
+ * Must be called holding pool->resize_mutex.
+ */
+static int worker_pool_grow(struct worker_pool *pool) {
+
+	struct thread_info *t_info;
+	unsigned int idx = pool->count;
+	pthread_attr_t attr;
+	int ret;
+
+	if (idx >= pool->max)
+		return 1;
+
+	/*
+	 * Slots are allocated the first time they are used and never freed
+	 * until the pool is destroyed
+	 */
+	if (pool->t_info[idx] == NULL) {
+		t_info = (struct thread_info *)malloc(sizeof(struct thread_info));
+		if (t_info == NULL)
+			return 1;
+		pool->t_info[idx] = t_info;
+	}
+
+	t_info = pool->t_info[idx];
+	t_info->tid = 0;
+	t_info->idx = idx;
+	t_info->node = pool->node;
+	t_info->sockfd = pool->sockfd;
+	t_info->packets = pool->packets;
+	t_info->cache.head = NULL;
+	t_info->cache.count = 0;
+	t_info->upstream_waiting = &pool->upstream_waiting;
+	t_info->busy = 0;
+	t_info->run = 1;
+
+	pthread_attr_init(&attr);
+	numa_pin_attr(&attr, &pool->cpus);
+	ret = pthread_create(&t_info->tid, &attr, pool->routine, t_info);
+	pthread_attr_destroy(&attr);
+
+	if (ret != 0) {
+		debug_perror("pthread_create");
+		return 1;
+	}
+
+	pool->count = idx + 1;
+
+	debug("Created thread %d with tid %lx\n", idx, (unsigned long)t_info->tid);
+
+	return 0;
+
+}
+
+/**
+ * Stops the last worker of the pool. A worker busy with a packet
+ * completes it before leaving through its run flag.
+ * Must be called holding pool->resize_mutex.
+ */
+static int worker_pool_retire(struct worker_pool *pool) {
+
+	struct thread_info *t_info;
+
+	if (pool->count == 0)
+		return 1;
+
+	t_info = pool->t_info[pool->count - 1];
+
+	t_info->run = 0;
+	pool->count--;
+	packet_queue_wakeup(pool->packets);
+
+	pthread_join(t_info->tid, NULL);
+
+	return 0;
+
+}
+
+/**
+ * Creates a pool of workers running routine. The pool starts with count
+ * threads and will be kept between min and max threads, trying to keep
+ * the receiver waiting less than latency_target microseconds per packet.
+ * Workers run on the given NUMA node, pinned to cpus (if not NULL nor
+ * empty), take their packets from packets and send their answers
+ * through sockfd.
+ */
+struct worker_pool *worker_pool_new(unsigned int count, unsigned int min, unsigned int max, unsigned int latency_target, void *(*routine)(void *), int node, cpu_set_t *cpus, int sockfd, struct packet_pool *packets) {
+
+	struct worker_pool *pool;
+	unsigned int idx;
+
+	if (min == 0)
+		min = 1;
+	if (max < min)
+		max = min;
+	if (count < min)
+		count = min;
+	if (count > max)
+		count = max;
+
+	pool = (struct worker_pool *)malloc(sizeof(struct worker_pool));
+	if (pool == NULL)
+		return NULL;
+
+	memset(pool, 0, sizeof(struct worker_pool));
+
+	pool->t_info = (struct thread_info **)malloc(sizeof(struct thread_info *) * max);
+	if (pool->t_info == NULL) {
+		free(pool);
+		return NULL;
+	}
+
+	for (idx = 0; idx < max; idx++)
+		pool->t_info[idx] = NULL;
+
+	pool->slots = max;
+	pool->min = min;
+	pool->max = max;
+	pool->latency_target = latency_target;
+	pool->routine = routine;
+	pool->node = node;
+	pool->sockfd = sockfd;
+	pool->packets = packets;
+	if (cpus != NULL)
+		memcpy(&pool->cpus, cpus, sizeof(cpu_set_t));
+	else
+		CPU_ZERO(&pool->cpus);
+	pool->run = 1;
+	pthread_mutex_init(&pool->resize_mutex, NULL);
+
+	debug("Creating %d worker threads on node %d\n", count, node);
+
+	pthread_mutex_lock(&pool->resize_mutex);
+	while (pool->count < count)
+		if (worker_pool_grow(pool))
+			break;
+	pthread_mutex_unlock(&pool->resize_mutex);
+
+	/*
+	 * A fixed size pool doesn't need anybody looking after it
+	 */
+	if (min != max)
+		pool->managed = (pthread_create(&pool->manager_tid, NULL, worker_pool_manager, pool) == 0);
+
+	return pool;
+
+}
+
+/**
+ * Stops all the workers and waits for their termination
+ */
+void worker_pool_destroy(struct worker_pool *pool) {
+
+	unsigned int idx;
+
+	if (pool == NULL)
+		return;
+
+	if (pool->managed) {
+		pool->run = 0;
+		pthread_join(pool->manager_tid, NULL);
+	}
+
+	pthread_mutex_lock(&pool->resize_mutex);
+
+	/*
+	 * Busy workers complete their packet before leaving
+	 */
+	for (idx = 0; idx < pool->count; idx++)
+		pool->t_info[idx]->run = 0;
+
+	packet_queue_wakeup(pool->packets);
+
+	while (pool->count > 0) {
+		pthread_join(pool->t_info[pool->count - 1]->tid, NULL);
+		pool->count--;
+	}
+
+	pthread_mutex_unlock(&pool->resize_mutex);
+
+	for (idx = 0; idx < pool->slots; idx++)
+		free(pool->t_info[idx]);
+
+	pthread_mutex_destroy(&pool->resize_mutex);
+	free(pool->t_info);
+	free(pool);
+
+}
+
+/**
+ * Changes the number of running workers, within the pool bounds.
+ * Returns the number of workers actually running.
+ */
+unsigned int worker_pool_resize(struct worker_pool *pool, unsigned int count) {
+
+	unsigned int old_count;
+
+	if (count < pool->min)
+		count = pool->min;
+	if (count > pool->max)
+		count = pool->max;
+
+	pthread_mutex_lock(&pool->resize_mutex);
+
+	old_count = pool->count;
+
+	while (pool->count < count)
+		if (worker_pool_grow(pool))
+			break;
+
+	while (pool->count > count)
+		if (worker_pool_retire(pool))
+			break;
+
+	if (pool->count > old_count) {
+		pool->grown++;
+		log_info("Worker pool grown from %d to %d threads\n", old_count, pool->count);
+	} else if (pool->count < old_count) {
+		pool->shrunk++;
+		log_info("Worker pool shrunk from %d to %d threads\n", old_count, pool->count);
+	}
+
+	count = pool->count;
+
+	pthread_mutex_unlock(&pool->resize_mutex);
+
+	return count;
+
+}
+
+/**
+ * Changes the bounds of the pool and its latency target, then brings the
+ * number of workers within the new bounds. The receiver walks the slots
+ * without locks, so max can't go beyond those allocated at creation.
+ * Returns 1 if it would
+ */
+int worker_pool_limits(struct worker_pool *pool, unsigned int min, unsigned int max, unsigned int latency_target) {
+
+	if (min == 0)
+		min = 1;
+	if (max < min)
+		max = min;
+
+	if (max > pool->slots)
+		return 1;
+
+	pthread_mutex_lock(&pool->resize_mutex);
+	pool->min = min;
+	pool->max = max;
+	pool->latency_target = latency_target;
+	pthread_mutex_unlock(&pool->resize_mutex);
+
+	/* A pool that was of fixed size may need looking after now */
+	if (min != max && !pool->managed)
+		pool->managed = (pthread_create(&pool->manager_tid, NULL, worker_pool_manager, pool) == 0);
+
+	worker_pool_resize(pool, pool->count);
+
+	return 0;
+
+}
+
+/**
+ * Periodically compares the average time spent by packets in the queue
+ * with the target. The pool grows as soon as packets wait too much or
+ * all the workers are stuck on the upstream server, and shrinks slowly
+ * when the workers are mostly idle.
+ */
+static void *worker_pool_manager(void *args) {
+
+	struct worker_pool *pool = (struct worker_pool *)args;
+	struct packet_pool *packets = pool->packets;
+	unsigned long wait_usec;
+	unsigned long dequeued;
+	unsigned long delay;
+	unsigned int queued;
+	unsigned int count;
+	unsigned int busy;
+	unsigned int idx;
+	int blocked;
+
+	while (pool->run) {
+
+		usleep(POOL_CHECK_INTERVAL);
+
+		pthread_mutex_lock(&packets->queue_mutex);
+		wait_usec = packets->queue_wait_usec;
+		dequeued = packets->dequeued;
+		queued = packets->queue_len;
+		packets->queue_wait_usec = 0;
+		packets->dequeued = 0;
+		pthread_mutex_unlock(&packets->queue_mutex);
+
+		delay = wait_usec / (dequeued ? dequeued : 1);
+
+		count = pool->count;
+		busy = 0;
+		for (idx = 0; idx < count; idx++)
+			if (pool->t_info[idx]->busy)
+				busy++;
+
+		/* Waits of other pools and of TCP workers are no concern here */
+		blocked = pool->upstream_waiting;
+
+		if (count < pool->max && (delay > pool->latency_target || (busy == count && (queued > 0 || blocked >= count)))) {
+
+			/*
+			 * Far off the target, grow faster
+			 */
+			if (delay > 4 * pool->latency_target)
+				worker_pool_resize(pool, count + count / 2 + 1);
+			else
+				worker_pool_resize(pool, count + 1);
+
+			pool->oversized_checks = 0;
+
+		} else if (count > pool->min && queued == 0 && delay < pool->latency_target / 4 && busy + 1 < count && blocked < count / 2) {
+
+			if (++pool->oversized_checks >= POOL_SHRINK_CHECKS) {
+				worker_pool_resize(pool, count - 1);
+				pool->oversized_checks = 0;
+			}
+
+		} else {
+
+			pool->oversized_checks = 0;
+
+		}
+
+	}
+
+	return NULL;
+
+}
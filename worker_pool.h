@@ -0,0 +1,81 @@
+#include <pthread.h>
+#include "dproxy.h"
+#include "numa.h"
+#include "packet_pool.h"
+
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+/*
+ * The pool manager checks the load every POOL_CHECK_INTERVAL microseconds.
+ * The pool shrinks only after POOL_SHRINK_CHECKS consecutive checks found
+ * it oversized, so short pauses in the traffic don't kill threads.
+ */
+#define POOL_CHECK_INTERVAL 250000
+#define POOL_SHRINK_CHECKS 40
+
+struct thread_info {
+	pthread_t tid;
+	unsigned int idx;
+	int node;
+	int sockfd;
+	struct packet_pool *packets;
+	struct packet_cache cache;
+	/*
+	 * Counter of the pool, raised while the worker waits for upstream
+	 */
+	volatile int *upstream_waiting;
+	volatile int busy;
+	volatile int run;
+};
+
+struct worker_pool {
+	/*
+	 * Slots for max threads. Slots of retired threads are kept, so the
+	 * receiver never sees a thread_info going away under its feet.
+	 */
+	struct thread_info **t_info;
+	unsigned int slots;
+	volatile unsigned int count;
+	volatile unsigned int min;
+	volatile unsigned int max;
+	volatile unsigned int latency_target;
+	unsigned int cursor;
+	void *(*routine)(void *);
+	/*
+	 * NUMA node and CPUs of the workers, the socket they answer on and
+	 * the pool of packets they take their jobs from
+	 */
+	int node;
+	cpu_set_t cpus;
+	int sockfd;
+	struct packet_pool *packets;
+	unsigned int oversized_checks;
+	/*
+	 * Workers of this pool waiting for an answer from upstream, the
+	 * manager's measure of how stuck the pool is
+	 */
+	volatile int upstream_waiting;
+	/*
+	 * Number of pool size changes since start
+	 */
+	unsigned long grown;
+	unsigned long shrunk;
+	pthread_mutex_t resize_mutex;
+	pthread_t manager_tid;
+	int managed;
+	int run;
+};
+
+/*
+ * Number of threads currently waiting for an answer from upstream, in
+ * all the pools and the TCP workers, for the statistics
+ */
+extern volatile int upstream_waiting;
+
+struct worker_pool *worker_pool_new(unsigned int, unsigned int, unsigned int, unsigned int, void *(*)(void *), int, cpu_set_t *, int, struct packet_pool *);
+void worker_pool_destroy(struct worker_pool *);
+unsigned int worker_pool_resize(struct worker_pool *, unsigned int);
+int worker_pool_limits(struct worker_pool *, unsigned int, unsigned int, unsigned int);
+
+#endif